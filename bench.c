@@ -0,0 +1,313 @@
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "interface.h"
+#include "model.h"
+
+// Largest number of timed edits per workload
+#define MAX_EDITS 2000
+
+// Number of cells listed by display callbacks
+static size_t displayed_cells = 0;
+
+// Stub display: the benchmark only counts what would be drawn.
+void update_cell_displays(const CellDisplayUpdate *updates, size_t count) {
+    (void)updates;
+    displayed_cells += count;
+}
+
+// Function to produce deterministic pseudo-random numbers (xorshift64).
+static uint64_t next_random(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+// Function to read a monotonic clock in nanoseconds.
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// Function to write the name of a cell, such as "AB12", into a buffer.
+static void cell_name(size_t row, size_t col, char *buffer, size_t size) {
+    char letters[8];
+    size_t length = 0;
+
+    // Columns are numbered A to Z, then AA, AB, and so on.
+    for (size_t n = col + 1; n > 0; n = (n - 1) / 26)
+        letters[length++] = (char)('A' + (n - 1) % 26);
+    size_t k = 0;
+    while (length > 0 && k + 1 < size)
+        buffer[k++] = letters[--length];
+    snprintf(buffer + k, size - k, "%zu", row + 1);
+}
+
+// Function to set a cell to text built from a format string.
+static void set_text(size_t row, size_t col, const char *format, ...) {
+    char text[128];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    set_cell_value_at(row, col, strdup(text));
+}
+
+// Function to set a cell to a number.
+static void set_number(size_t row, size_t col, double value) {
+    char text[32];
+    snprintf(text, sizeof(text), "%g", value);
+    set_cell_value_at(row, col, strdup(text));
+}
+
+// Function to compare two durations for sorting.
+static int compare_durations(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// A synthetic workload.
+typedef struct {
+    // Name printed in the report
+    const char *name;
+    // Builds the sheet, returning the number of formula cells
+    size_t (*build)(size_t scale, uint64_t *random);
+    // Applies the i-th timed edit
+    void (*edit)(size_t i, size_t scale, uint64_t *random);
+    // Applies an edit that recalculates every formula of the sheet
+    void (*edit_all)(size_t scale);
+    // Number of timed edits, at most MAX_EDITS
+    size_t num_edits;
+} Workload;
+
+// Wide fan-in: one formula summing a long column of literals.
+static size_t build_fan_in(size_t scale, uint64_t *random) {
+    char last[16], text[64];
+    (void)random;
+    model_init_sized(10000 * scale + 1, 2);
+    for (size_t row = 0; row < 10000 * scale; ++row)
+        set_number(row, 1, (double)row);
+    cell_name(10000 * scale - 1, 1, last, sizeof(last));
+    snprintf(text, sizeof(text), "=SUM(B1:%s)+B1", last);
+    set_cell_value_at(0, 0, strdup(text));
+    return 1;
+}
+
+static void edit_fan_in(size_t i, size_t scale, uint64_t *random) {
+    set_number(next_random(random) % (10000 * scale), 1, (double)i);
+}
+
+static void edit_all_fan_in(size_t scale) {
+    (void)scale;
+    set_number(0, 1, 42);
+}
+
+// Deep chain: every cell adds one to the cell above it.
+static size_t build_chain(size_t scale, uint64_t *random) {
+    char above[16];
+    (void)random;
+    model_init_sized(10000 * scale, 1);
+    set_number(0, 0, 1);
+    for (size_t row = 1; row < 10000 * scale; ++row) {
+        cell_name(row - 1, 0, above, sizeof(above));
+        set_text(row, 0, "=%s+1", above);
+    }
+    return 10000 * scale - 1;
+}
+
+static void edit_chain(size_t i, size_t scale, uint64_t *random) {
+    // Edit somewhere along the chain, recalculating the rest of it.
+    size_t row = 1 + next_random(random) % (10000 * scale - 1);
+    char above[16];
+    (void)i;
+    cell_name(row - 1, 0, above, sizeof(above));
+    set_text(row, 0, "=%s+1", above);
+}
+
+static void edit_all_chain(size_t scale) {
+    (void)scale;
+    set_number(0, 0, 2);
+}
+
+// Random DAG: each formula reads two random cells of the rows above it.
+static size_t build_dag(size_t scale, uint64_t *random) {
+    size_t rows = 2000 * scale;
+    char left[16], right[16];
+    model_init_sized(rows, 10);
+    for (size_t col = 0; col < 10; ++col)
+        set_number(0, col, (double)col);
+    for (size_t row = 1; row < rows; ++row) {
+        for (size_t col = 0; col < 10; ++col) {
+            cell_name(next_random(random) % row, next_random(random) % 10, left, sizeof(left));
+            cell_name(next_random(random) % row, next_random(random) % 10, right, sizeof(right));
+            set_text(row, col, "=%s+%s", left, right);
+        }
+    }
+    return (rows - 1) * 10;
+}
+
+static void edit_dag(size_t i, size_t scale, uint64_t *random) {
+    (void)scale;
+    set_number(0, next_random(random) % 10, (double)i);
+}
+
+static void edit_all_dag(size_t scale) {
+    // Change every input so that all formulas are recalculated.
+    (void)scale;
+    model_begin_batch();
+    for (size_t col = 0; col < 10; ++col)
+        set_number(0, col, (double)col + 0.5);
+    model_commit_batch();
+}
+
+// Mostly literals: a large block of numbers with a formula every 100 rows.
+static size_t build_literals(size_t scale, uint64_t *random) {
+    size_t rows = 10000 * scale;
+    char name[16];
+    (void)random;
+    model_init_sized(rows, 10);
+    model_begin_batch();
+    for (size_t row = 0; row < rows; ++row) {
+        for (size_t col = 0; col < 9; ++col)
+            set_number(row, col, (double)(row * col));
+        if (row % 100 == 0) {
+            cell_name(row, 0, name, sizeof(name));
+            set_text(row, 9, "=%s+1", name);
+        }
+    }
+    model_commit_batch();
+    return rows / 100;
+}
+
+static void edit_literals(size_t i, size_t scale, uint64_t *random) {
+    set_number(next_random(random) % (10000 * scale), next_random(random) % 9, (double)i);
+}
+
+static void edit_all_literals(size_t scale) {
+    model_begin_batch();
+    for (size_t row = 0; row < 10000 * scale; row += 100)
+        set_number(row, 0, 7);
+    model_commit_batch();
+}
+
+// Filled down: a column of the same formula, each reading the literal next to it.
+static size_t build_fill(size_t scale, uint64_t *random) {
+    size_t rows = 10000 * scale;
+    (void)random;
+    model_init_sized(rows, 2);
+    model_begin_batch();
+    for (size_t row = 0; row < rows; ++row)
+        set_number(row, 0, (double)row);
+    model_commit_batch();
+    model_begin_batch();
+    for (size_t row = 0; row < rows; ++row)
+        set_text(row, 1, "=A%zu*A%zu/4+1", row + 1, row + 1);
+    model_commit_batch();
+    return rows;
+}
+
+static void edit_fill(size_t i, size_t scale, uint64_t *random) {
+    set_number(next_random(random) % (10000 * scale), 0, (double)i);
+}
+
+static void edit_all_fill(size_t scale) {
+    model_begin_batch();
+    for (size_t row = 0; row < 10000 * scale; ++row)
+        set_number(row, 0, (double)row + 0.5);
+    model_commit_batch();
+}
+
+// String heavy: mostly text cells, overwritten with other text.
+static size_t build_strings(size_t scale, uint64_t *random) {
+    size_t rows = 10000 * scale;
+    char text[32];
+    model_init_sized(rows, 4);
+    model_begin_batch();
+    for (size_t row = 0; row < rows; ++row) {
+        for (size_t col = 0; col < 4; ++col) {
+            snprintf(text, sizeof(text), "item-%llu", (unsigned long long)(next_random(random) % 100000));
+            set_cell_value_at(row, col, strdup(text));
+        }
+    }
+    model_commit_batch();
+    return 0;
+}
+
+static void edit_strings(size_t i, size_t scale, uint64_t *random) {
+    char text[32];
+    snprintf(text, sizeof(text), "edit-%zu", i);
+    set_cell_value_at(next_random(random) % (10000 * scale), next_random(random) % 4, strdup(text));
+}
+
+static void edit_all_strings(size_t scale) {
+    (void)scale;
+    set_cell_value_at(0, 0, strdup("first"));
+}
+
+// Function to run one workload and print its line of the report.
+static void run_workload(const Workload *workload, size_t scale) {
+    static uint64_t durations[MAX_EDITS];
+    size_t num_edits = workload->num_edits;
+    uint64_t random = 0x9e3779b97f4a7c15u;
+
+    uint64_t start = now_ns();
+    size_t formulas = workload->build(scale, &random);
+    double build_ms = (double)(now_ns() - start) / 1e6;
+
+    // Time single edits, counting the allocations they make.
+    size_t allocations = model_allocation_count();
+    size_t cells = displayed_cells;
+    for (size_t i = 0; i < num_edits; ++i) {
+        start = now_ns();
+        workload->edit(i, scale, &random);
+        durations[i] = now_ns() - start;
+    }
+    double allocations_per_edit = (double)(model_allocation_count() - allocations) / num_edits;
+    double cells_per_edit = (double)(displayed_cells - cells) / num_edits;
+    qsort(durations, num_edits, sizeof(uint64_t), compare_durations);
+
+    // Time an edit recalculating all formulas.
+    start = now_ns();
+    workload->edit_all(scale);
+    double full_s = (double)(now_ns() - start) / 1e9;
+    double throughput = formulas > 0 && full_s > 0 ? (double)formulas / full_s : 0;
+
+    printf("%-10s %10.1f %9.2f %9.2f %9.2f %9.2f %10.2f %9.1f %12.0f\n", workload->name, build_ms,
+           (double)durations[num_edits / 2] / 1e3, (double)durations[num_edits * 9 / 10] / 1e3,
+           (double)durations[num_edits * 99 / 100] / 1e3, (double)durations[num_edits - 1] / 1e3,
+           allocations_per_edit, cells_per_edit, throughput);
+}
+
+int main(int argc, char **argv) {
+    // The optional argument multiplies the size of every workload.
+    size_t scale = argc > 1 ? strtoul(argv[1], NULL, 10) : 1;
+    if (scale == 0)
+        scale = 1;
+
+    // The optional second argument sets the number of recalculation threads.
+    if (argc > 2)
+        model_set_threads(strtoul(argv[2], NULL, 10));
+
+    static const Workload workloads[] = {
+        {"fan-in", build_fan_in, edit_fan_in, edit_all_fan_in, 2000},
+        {"chain", build_chain, edit_chain, edit_all_chain, 2000},
+        {"dag", build_dag, edit_dag, edit_all_dag, 200},
+        {"literals", build_literals, edit_literals, edit_all_literals, 2000},
+        {"fill", build_fill, edit_fill, edit_all_fill, 2000},
+        {"strings", build_strings, edit_strings, edit_all_strings, 2000},
+    };
+
+    printf("Latencies in microseconds per edit, throughput in formulas per second.\n");
+    printf("%-10s %10s %9s %9s %9s %9s %10s %9s %12s\n", "workload", "build ms", "p50", "p90", "p99", "max",
+           "allocs", "redrawn", "full recalc");
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); ++i)
+        run_workload(&workloads[i], scale);
+    return 0;
+}
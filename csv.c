@@ -0,0 +1,156 @@
+#include "csv.h"
+#include "memory.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Number of bytes read from the stream at a time.
+#define CHUNK_SIZE (1 << 20)
+
+// State of the reader between two chunks.
+typedef struct {
+    // Field being read, which may span chunks
+    char *text;
+    size_t length;
+    size_t capacity;
+    // Position of the field
+    size_t row;
+    size_t col;
+    // Whether the field started with a quote, and whether the quote is open
+    bool quoted;
+    bool in_quotes;
+    // Whether the last character was the quote closing a quoted part
+    bool after_quote;
+    // Whether the line ended with CR, which is dropped if LF follows
+    bool pending_cr;
+} CsvReader;
+
+// Function to append characters to the current field.
+static void append(CsvReader *reader, const char *text, size_t length) {
+    if (reader->length + length + 1 > reader->capacity) {
+        while (reader->length + length + 1 > reader->capacity)
+            reader->capacity = reader->capacity ? 2 * reader->capacity : 256;
+        reader->text = checked_realloc(reader->text, reader->capacity);
+    }
+    memcpy(reader->text + reader->length, text, length);
+    reader->length += length;
+}
+
+// Function to hand the current field to the callback and start the next one.
+static void finish_field(CsvReader *reader, CsvField field, void *data) {
+    append(reader, "", 0);
+    reader->text[reader->length] = '\0';
+    field(reader->row, reader->col, reader->text, reader->length, data);
+    reader->length = 0;
+    reader->quoted = reader->in_quotes = reader->after_quote = false;
+    ++reader->col;
+}
+
+bool csv_read(FILE *stream, char delimiter, CsvField field, void *data) {
+    char *chunk = checked_malloc(CHUNK_SIZE);
+    CsvReader reader = {0};
+    bool line_started = false;
+    size_t count;
+
+    while ((count = fread(chunk, 1, CHUNK_SIZE, stream)) > 0) {
+        const char *p = chunk, *end = chunk + count;
+
+        while (p < end) {
+            // Inside quotes, everything up to the next quote is plain text.
+            if (reader.in_quotes) {
+                const char *quote = memchr(p, '"', (size_t)(end - p));
+                if (quote == NULL) {
+                    append(&reader, p, (size_t)(end - p));
+                    break;
+                }
+                append(&reader, p, (size_t)(quote - p));
+                reader.in_quotes = false;
+                reader.after_quote = true;
+                p = quote + 1;
+                continue;
+            }
+
+            // Copy the run of plain characters up to the next special one.
+            const char *start = p;
+            while (p < end && *p != delimiter && *p != '\n' && *p != '\r' && *p != '"')
+                ++p;
+            if (p > start) {
+                // A CR not followed by LF is kept as part of the field.
+                if (reader.pending_cr)
+                    append(&reader, "\r", 1);
+                reader.pending_cr = false;
+                reader.after_quote = false;
+                append(&reader, start, (size_t)(p - start));
+                line_started = true;
+            }
+            if (p == end)
+                break;
+
+            char c = *p++;
+            if (c == '\r') {
+                if (reader.pending_cr)
+                    append(&reader, "\r", 1);
+                reader.pending_cr = true;
+                continue;
+            }
+            if (c == '\n') {
+                // Lines end the last field; empty lines hold no fields.
+                reader.pending_cr = false;
+                if (line_started || reader.quoted)
+                    finish_field(&reader, field, data);
+                ++reader.row;
+                reader.col = 0;
+                line_started = false;
+                continue;
+            }
+            if (reader.pending_cr) {
+                append(&reader, "\r", 1);
+                reader.pending_cr = false;
+            }
+            line_started = true;
+            if (c == delimiter) {
+                finish_field(&reader, field, data);
+            } else if (reader.after_quote) {
+                // A doubled quote inside a quoted field stands for one quote.
+                append(&reader, "\"", 1);
+                reader.after_quote = false;
+                reader.in_quotes = true;
+            } else if (reader.length == 0 && !reader.quoted) {
+                reader.quoted = reader.in_quotes = true;
+            } else {
+                // Quotes within an unquoted field are kept as they are.
+                append(&reader, "\"", 1);
+            }
+        }
+    }
+
+    // The last line need not end with a line break.
+    if (reader.pending_cr)
+        append(&reader, "\r", 1);
+    if (line_started || reader.quoted || reader.length > 0)
+        finish_field(&reader, field, data);
+
+    bool ok = !ferror(stream);
+    free(reader.text);
+    free(chunk);
+    return ok;
+}
+
+void csv_write_field(FILE *stream, const char *text, char delimiter) {
+    // Fields containing special characters, or starting with a quote, are quoted.
+    bool quote = false;
+    for (const char *p = text; *p != '\0' && !quote; ++p)
+        quote = *p == delimiter || *p == '\n' || *p == '\r' || *p == '"';
+    if (!quote) {
+        fputs(text, stream);
+        return;
+    }
+
+    fputc('"', stream);
+    for (const char *p = text; *p != '\0'; ++p) {
+        if (*p == '"')
+            fputc('"', stream);
+        fputc(*p, stream);
+    }
+    fputc('"', stream);
+}
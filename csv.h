@@ -0,0 +1,26 @@
+#ifndef ASSIGNMENT_CSV_H
+#define ASSIGNMENT_CSV_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// Reading and writing of delimiter-separated values, such as CSV and TSV.
+//
+// Fields may be quoted with double quotes, in which case they can contain the
+// delimiter, line breaks and doubled quotes standing for a single one. Lines
+// end with LF or CRLF.
+
+// Called for every field read, with the 0-based row and column of the field.
+// 'text' holds 'length' characters followed by a terminating NUL; it may be
+// modified, but is only valid during the call.
+typedef void (*CsvField)(size_t row, size_t col, char *text, size_t length, void *data);
+
+// Reads a whole stream in large chunks, calling 'field' for each field.
+// Returns false if reading failed.
+bool csv_read(FILE *stream, char delimiter, CsvField field, void *data);
+
+// Writes one field, quoting it if necessary.
+void csv_write_field(FILE *stream, const char *text, char delimiter);
+
+#endif //ASSIGNMENT_CSV_H
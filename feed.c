@@ -0,0 +1,131 @@
+#include "feed.h"
+#include "memory.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Size of a cache line; the fields written by each side are padded apart, so
+// that the producer and consumer do not keep stealing each other's lines.
+#define CACHE_LINE 64
+
+// Positions in both rings count records and bytes from the creation of the
+// feed, and only wrap around when indexing the arrays.
+struct ChangeFeed {
+    // Records and texts, and their sizes, which are powers of two
+    ChangeRecord *records;
+    size_t capacity;
+    char *texts;
+    size_t text_capacity;
+
+    // Written by the producer: records pushed, records published, end of the
+    // texts pushed and records dropped
+    char producer_padding[CACHE_LINE];
+    uint64_t pushed;
+    uint64_t head;
+    uint64_t text_head;
+    uint64_t dropped;
+
+    // Written by the consumer: records and end of the texts released
+    char consumer_padding[CACHE_LINE];
+    uint64_t tail;
+    uint64_t text_tail;
+    char end_padding[CACHE_LINE];
+};
+
+// Function to round a capacity up to a power of two, of at least 'minimum'.
+static size_t ring_capacity(size_t requested, size_t minimum) {
+    size_t capacity = minimum;
+    while (capacity < requested)
+        capacity *= 2;
+    return capacity;
+}
+
+ChangeFeed *change_feed_create(size_t capacity, size_t text_capacity) {
+    ChangeFeed *feed = checked_calloc(1, sizeof(ChangeFeed));
+    feed->capacity = ring_capacity(capacity, 16);
+    feed->records = checked_malloc(feed->capacity * sizeof(ChangeRecord));
+    feed->text_capacity = ring_capacity(text_capacity, 64);
+    feed->texts = checked_malloc(feed->text_capacity);
+    return feed;
+}
+
+void change_feed_free(ChangeFeed *feed) {
+    if (feed == NULL)
+        return;
+    free(feed->records);
+    free(feed->texts);
+    free(feed);
+}
+
+void change_feed_push(ChangeFeed *feed, const ChangeRecord *record, const char *text, size_t text_length) {
+    // Records are released in order, so the consumer's progress tells how much
+    // room there is; reading it late only ever makes the room look smaller.
+    uint64_t tail = __atomic_load_n(&feed->tail, __ATOMIC_ACQUIRE);
+    if (feed->pushed - tail == feed->capacity) {
+        __atomic_store_n(&feed->dropped, feed->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    // A text never wraps around the end of the ring, so that it can be read in
+    // place; the bytes up to the end are skipped instead. Texts are released
+    // along with the records following them.
+    ChangeRecord *slot = &feed->records[feed->pushed & (feed->capacity - 1)];
+    uint64_t position = feed->text_head;
+    if (text_length > 0) {
+        size_t size = text_length + 1;
+        size_t offset = position & (feed->text_capacity - 1);
+        if (offset + size > feed->text_capacity)
+            position += feed->text_capacity - offset;
+        uint64_t text_tail = __atomic_load_n(&feed->text_tail, __ATOMIC_ACQUIRE);
+        if (text_length >= UINT32_MAX || size > feed->text_capacity ||
+            position + size - text_tail > feed->text_capacity) {
+            __atomic_store_n(&feed->dropped, feed->dropped + 1, __ATOMIC_RELAXED);
+            return;
+        }
+        memcpy(feed->texts + (position & (feed->text_capacity - 1)), text, text_length);
+        feed->texts[(position & (feed->text_capacity - 1)) + text_length] = '\0';
+        feed->text_head = position + size;
+    }
+    *slot = *record;
+    slot->text = position;
+    slot->text_length = (uint32_t)text_length;
+    ++feed->pushed;
+}
+
+void change_feed_publish(ChangeFeed *feed) {
+    // Releasing the count makes the records and texts visible along with it.
+    if (feed->head != feed->pushed)
+        __atomic_store_n(&feed->head, feed->pushed, __ATOMIC_RELEASE);
+}
+
+size_t change_feed_peek(ChangeFeed *feed, const ChangeRecord **records) {
+    uint64_t head = __atomic_load_n(&feed->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = feed->tail;
+    size_t offset = tail & (feed->capacity - 1);
+    size_t count = head - tail;
+    *records = &feed->records[offset];
+    return count < feed->capacity - offset ? count : feed->capacity - offset;
+}
+
+void change_feed_release(ChangeFeed *feed, size_t count) {
+    if (count == 0)
+        return;
+
+    // The texts end where the last record's text ends, or where the texts
+    // ended when it was pushed if it has none.
+    uint64_t tail = feed->tail;
+    const ChangeRecord *last = &feed->records[(tail + count - 1) & (feed->capacity - 1)];
+    uint64_t text_tail = last->text + (last->text_length > 0 ? (uint64_t)last->text_length + 1 : 0);
+    __atomic_store_n(&feed->text_tail, text_tail, __ATOMIC_RELEASE);
+    __atomic_store_n(&feed->tail, tail + count, __ATOMIC_RELEASE);
+}
+
+const char *change_feed_text(const ChangeFeed *feed, const ChangeRecord *record) {
+    if (record->text_length == 0)
+        return "";
+    return feed->texts + (record->text & (feed->text_capacity - 1));
+}
+
+uint64_t change_feed_dropped(const ChangeFeed *feed) {
+    return __atomic_load_n(&feed->dropped, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,93 @@
+#ifndef ASSIGNMENT_FEED_H
+#define ASSIGNMENT_FEED_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Feeds of the changes of cell values, for consumers outside the model.
+//
+// A feed is a ring buffer with a single producer, the thread that edits the
+// model, and a single consumer, which may run on any other thread. Records
+// are binary and of fixed size; the texts of string cells are copied into a
+// second ring of the feed, where consumers read them in place. The producer
+// never waits: it publishes the records of a recalculation together, and
+// drops the records that do not fit, counting them. Neither side takes locks
+// or allocates once the feed is created.
+
+// What a change record reports about its cell.
+typedef enum {
+    // The cell was cleared
+    CHANGE_EMPTY,
+    // The cell holds a number, or a formula whose value is 'number'
+    CHANGE_NUMBER,
+    // The cell holds the string 'text'
+    CHANGE_TEXT,
+    // The cell holds a formula that failed, or lies on a cycle
+    CHANGE_ERROR,
+    CHANGE_CYCLE,
+    // The whole workbook was replaced; the position of the record is 0 and
+    // consumers must read every cell again
+    CHANGE_RESET,
+} ChangeType;
+
+// The new value of a cell.
+typedef struct {
+    // Recalculation the change belongs to; epochs increase by one with every
+    // recalculation that changed any cells, and all records of one of them
+    // are published together
+    uint64_t epoch;
+    // Value of the cell, set for CHANGE_NUMBER
+    double number;
+    // Position of the text of the cell in the texts of the feed, see
+    // 'change_feed_text', and its length; the length is 0 unless the type is
+    // CHANGE_TEXT
+    uint64_t text;
+    uint32_t text_length;
+    // 0-based position of the cell, on the sheet with index 'sheet'
+    uint32_t row;
+    uint32_t col;
+    uint16_t sheet;
+    // A ChangeType
+    uint8_t type;
+} ChangeRecord;
+
+// A feed of changes.
+typedef struct ChangeFeed ChangeFeed;
+
+// Creates a feed holding up to 'capacity' records and 'text_capacity' bytes
+// of texts that were not consumed yet, both rounded up to powers of two.
+ChangeFeed *change_feed_create(size_t capacity, size_t text_capacity);
+
+// Frees a feed. Neither side may use it any more.
+void change_feed_free(ChangeFeed *feed);
+
+// Adds a record to the feed on the producer side, with its text if it has
+// one; the 'text' and 'text_length' fields of the record are set by the
+// feed. Consumers do not see the record before 'change_feed_publish'. The
+// record is dropped if it does not fit, as is a text longer than the texts of
+// the feed.
+void change_feed_push(ChangeFeed *feed, const ChangeRecord *record, const char *text, size_t text_length);
+
+// Makes the records pushed so far visible to the consumer.
+void change_feed_publish(ChangeFeed *feed);
+
+// Returns the number of records published but not released yet that follow
+// each other in the ring, which may be fewer than all of them, and points
+// '*records' to the first one. The records stay valid until they are
+// released. Called by the consumer.
+size_t change_feed_peek(ChangeFeed *feed, const ChangeRecord **records);
+
+// Hands the first 'count' records of the last 'change_feed_peek' back to the
+// producer, along with their texts. Called by the consumer.
+void change_feed_release(ChangeFeed *feed, size_t count);
+
+// Returns the text of a record that was not released yet, terminated by a
+// NUL character; the feed owns it.
+const char *change_feed_text(const ChangeFeed *feed, const ChangeRecord *record);
+
+// Returns the number of records dropped so far because the feed was full.
+// Consumers seeing it grow have missed changes, and must read the cells
+// again to catch up.
+uint64_t change_feed_dropped(const ChangeFeed *feed);
+
+#endif //ASSIGNMENT_FEED_H
@@ -0,0 +1,811 @@
+#include "formula.h"
+#include "memory.h"
+#include "number.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <math.h>
+
+#define EQUALS_CHAR '='
+
+// State of a formula being compiled.
+typedef struct {
+    // Remaining formula text, and its end
+    const char *pos;
+    const char *end;
+    // Sheets references may lie on, used to validate them, and the
+    // dimensions of the sheet of the last reference parsed
+    const FormulaScope *scope;
+    size_t sheet_rows;
+    size_t sheet_cols;
+    // Formula under construction along with the capacities of its arrays
+    Formula *formula;
+    size_t code_capacity;
+    size_t constants_capacity;
+    size_t refs_capacity;
+    size_t ranges_capacity;
+    // Current stack depth while emitting code
+    size_t depth;
+} Compiler;
+
+// Function to make sure an array can hold at least one more element.
+static void *reserve(void *array, size_t *capacity, size_t length, size_t element_size) {
+    if (length < *capacity)
+        return array;
+    *capacity = *capacity ? 2 * *capacity : 4;
+    return checked_realloc(array, *capacity * element_size);
+}
+
+// Function to append an instruction and track the resulting stack depth.
+static void emit(Compiler *compiler, OPCODE op, uint32_t operand) {
+    Formula *formula = compiler->formula;
+
+    formula->code = reserve(formula->code, &compiler->code_capacity, formula->length, sizeof(Instruction));
+    formula->code[formula->length++] = (Instruction){op, operand};
+
+    // Track how each instruction changes the number of values on the stack.
+    switch (op) {
+        case OP_CONST:
+        case OP_REF:
+            ++compiler->depth;
+            break;
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_POW:
+        case OP_AGG_VALUE:
+            --compiler->depth;
+            break;
+        case OP_AGG_BEGIN:
+            compiler->depth += 4;
+            break;
+        case OP_AGG_RANGE:
+        case OP_AGG_RANGE_EXTREMA:
+        case OP_NEG:
+        case OP_ADD_REF:
+        case OP_ADD_CONST:
+            break;
+        case OP_AGG_END:
+            compiler->depth -= 3;
+            break;
+    }
+    if (compiler->depth > formula->max_stack)
+        formula->max_stack = compiler->depth;
+}
+
+// Function to emit code pushing a numeric literal.
+static void emit_constant(Compiler *compiler, double value) {
+    Formula *formula = compiler->formula;
+
+    formula->constants = reserve(formula->constants, &compiler->constants_capacity, formula->num_constants,
+                                 sizeof(double));
+    formula->constants[formula->num_constants] = value;
+    emit(compiler, OP_CONST, (uint32_t)formula->num_constants++);
+}
+
+// Function to remove the last instruction, which pushed a constant or the value of a cell.
+static Instruction drop_operand(Compiler *compiler) {
+    --compiler->depth;
+    return compiler->formula->code[--compiler->formula->length];
+}
+
+// Function to emit a binary operator, calculating it right away if both
+// operands are constants.
+static void emit_operator(Compiler *compiler, OPCODE op) {
+    Formula *formula = compiler->formula;
+    const Instruction *code = formula->code;
+    size_t length = formula->length;
+
+    // The right operand ends with the last instruction. If that pushes a
+    // constant, the operand is just the constant, and so is the left operand
+    // if the instruction before pushes a constant too; these are then the
+    // last two constants of the table.
+    if (length >= 2 && code[length - 1].op == OP_CONST && code[length - 2].op == OP_CONST) {
+        double result;
+        if (formula_operate(op, formula->constants[code[length - 2].operand],
+                            formula->constants[code[length - 1].operand], &result)) {
+            drop_operand(compiler);
+            drop_operand(compiler);
+            formula->num_constants -= 2;
+            emit_constant(compiler, result);
+            return;
+        }
+    }
+
+    // Adding a cell or a constant takes a single instruction, and so does
+    // subtracting a constant, which is the same as adding its negation.
+    if (op == OP_SUB && code[length - 1].op == OP_CONST) {
+        formula->constants[code[length - 1].operand] = -formula->constants[code[length - 1].operand];
+        op = OP_ADD;
+    }
+    if (op == OP_ADD && (code[length - 1].op == OP_REF || code[length - 1].op == OP_CONST)) {
+        Instruction right = drop_operand(compiler);
+        emit(compiler, right.op == OP_REF ? OP_ADD_REF : OP_ADD_CONST, right.operand);
+        return;
+    }
+
+    emit(compiler, op, 0);
+}
+
+// Function to emit a negation, applying it right away to a constant.
+static void emit_negation(Compiler *compiler) {
+    Formula *formula = compiler->formula;
+    const Instruction *last = &formula->code[formula->length - 1];
+
+    // Like the operands of operators, a constant on top is not used by anything else.
+    if (last->op == OP_CONST) {
+        formula->constants[last->operand] = -formula->constants[last->operand];
+        return;
+    }
+    emit(compiler, OP_NEG, 0);
+}
+
+// Function to make the position of a cell relative to the cell of the formula.
+static CellRef relative_ref(const Compiler *compiler, CellRef ref) {
+    return (CellRef){ref.row - (uint32_t)compiler->scope->row, ref.col - (uint32_t)compiler->scope->col, ref.sheet};
+}
+
+// Function to emit code pushing the value of a cell.
+static void emit_reference(Compiler *compiler, CellRef ref) {
+    Formula *formula = compiler->formula;
+    size_t index;
+    ref = relative_ref(compiler, ref);
+
+    // Each distinct cell is stored once, so 'refs' doubles as the list of
+    // precedents recorded in the dependency graph.
+    for (index = 0; index < formula->num_refs; ++index) {
+        if (formula->refs[index].row == ref.row && formula->refs[index].col == ref.col &&
+            formula->refs[index].sheet == ref.sheet)
+            break;
+    }
+    if (index == formula->num_refs) {
+        formula->refs = reserve(formula->refs, &compiler->refs_capacity, formula->num_refs, sizeof(CellRef));
+        formula->refs[formula->num_refs++] = ref;
+    }
+    emit(compiler, OP_REF, (uint32_t)index);
+}
+
+// Function to emit code adding the cells of a range to the totals of a range function.
+static void emit_range(Compiler *compiler, FUNCTION function, CellRef first, CellRef last) {
+    Formula *formula = compiler->formula;
+
+    // Store the corners so that 'first' is the top-left one.
+    CellRef top_left = {first.row < last.row ? first.row : last.row, first.col < last.col ? first.col : last.col,
+                        first.sheet};
+    CellRef bottom_right = {first.row > last.row ? first.row : last.row, first.col > last.col ? first.col : last.col,
+                            first.sheet};
+    CellRange range = {relative_ref(compiler, top_left), relative_ref(compiler, bottom_right)};
+
+    formula->ranges = reserve(formula->ranges, &compiler->ranges_capacity, formula->num_ranges,
+                              sizeof(CellRange));
+    formula->ranges[formula->num_ranges] = range;
+
+    // Only MIN and MAX need the kernels to track the extreme values.
+    OPCODE op = function == FN_MIN || function == FN_MAX ? OP_AGG_RANGE_EXTREMA : OP_AGG_RANGE;
+    emit(compiler, op, (uint32_t)formula->num_ranges++);
+}
+
+// Function to skip whitespace characters in the remaining text.
+static void skip_spaces(Compiler *compiler) {
+    while (*compiler->pos && isspace((unsigned char)*compiler->pos))
+        ++compiler->pos;
+}
+
+// Function to check whether a character may be part of the name of a sheet.
+static bool is_name_char(char c) {
+    return isalnum((unsigned char)c) || c == '_';
+}
+
+// Function to parse a cell reference without emitting any code.
+//
+// The second corner of a range passes its first corner as 'corner': it lies on
+// the same sheet, which it may name again.
+static bool parse_reference(Compiler *compiler, CellRef *ref, const CellRef *corner) {
+    const FormulaScope *scope = compiler->scope;
+    const char *pos = compiler->pos;
+
+    // Without a name, the cell lies on the sheet of the formula, or of the
+    // first corner, whose dimensions are still known.
+    size_t sheet = scope->sheet, num_rows = scope->num_rows, num_cols = scope->num_cols;
+    if (corner != NULL) {
+        sheet = corner->sheet;
+        num_rows = compiler->sheet_rows;
+        num_cols = compiler->sheet_cols;
+    }
+
+    // A name followed by '!' selects the sheet holding the cell.
+    const char *name = pos;
+    while (is_name_char(*pos))
+        ++pos;
+    if (*pos == '!') {
+        if (scope->find_sheet == NULL ||
+            !scope->find_sheet(name, (size_t)(pos - name), &sheet, &num_rows, &num_cols, scope->data) ||
+            (corner != NULL && sheet != corner->sheet))
+            return false;
+        ++pos;
+    } else {
+        pos = name;
+    }
+
+    // A reference is one or more column letters (A-Z, then AA, AB, ...)
+    // followed by a 1-based row number.
+    size_t col = 0;
+    while (isupper((unsigned char)*pos)) {
+        col = col * 26 + (size_t)(*pos++ - 'A' + 1);
+        // Stop accumulating once the column is out of range anyway.
+        if (col > num_cols)
+            col = num_cols + 1;
+    }
+    if (col == 0 || !isdigit((unsigned char)*pos))
+        return false;
+
+    size_t row = 0;
+    while (isdigit((unsigned char)*pos)) {
+        row = row * 10 + (size_t)(*pos++ - '0');
+        // Stop accumulating once the row is out of range anyway.
+        if (row > num_rows)
+            row = num_rows + 1;
+    }
+    if (row < 1 || row > num_rows || col > num_cols)
+        return false;
+
+    *ref = (CellRef){(uint32_t)(row - 1), (uint32_t)(col - 1), (uint32_t)sheet};
+    compiler->pos = pos;
+    compiler->sheet_rows = num_rows;
+    compiler->sheet_cols = num_cols;
+    return true;
+}
+
+// Function to look up a range function by name.
+static bool find_function(const char *name, size_t length, FUNCTION *function) {
+    static const struct {
+        const char *name;
+        FUNCTION function;
+    } functions[] = {
+            {"SUM", FN_SUM},
+            {"MIN", FN_MIN},
+            {"MAX", FN_MAX},
+            {"AVERAGE", FN_AVERAGE},
+            {"COUNT", FN_COUNT},
+    };
+
+    for (size_t i = 0; i < sizeof(functions) / sizeof(functions[0]); ++i) {
+        if (strlen(functions[i].name) == length && strncmp(functions[i].name, name, length) == 0) {
+            *function = functions[i].function;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool compile_sum(Compiler *compiler);
+
+// Function to compile one argument of a range function.
+static bool compile_argument(Compiler *compiler, FUNCTION function) {
+    const char *start = compiler->pos;
+    CellRef first, last;
+
+    // A range, or a lone reference, adds the numeric cells it covers.
+    if (parse_reference(compiler, &first, NULL)) {
+        skip_spaces(compiler);
+        if (*compiler->pos == ':') {
+            ++compiler->pos;
+            skip_spaces(compiler);
+            if (!parse_reference(compiler, &last, &first))
+                return false;
+            emit_range(compiler, function, first, last);
+            return true;
+        }
+        if (*compiler->pos == ',' || *compiler->pos == ')') {
+            emit_range(compiler, function, first, first);
+            return true;
+        }
+
+        // The reference starts a longer expression; compile it as such.
+        compiler->pos = start;
+    }
+
+    // Any other argument is an expression contributing its value.
+    if (!compile_sum(compiler))
+        return false;
+    emit(compiler, OP_AGG_VALUE, 0);
+    return true;
+}
+
+// Function to compile the parenthesized argument list of a range function.
+static bool compile_call(Compiler *compiler, FUNCTION function) {
+    // The opening parenthesis has already been checked.
+    ++compiler->pos;
+    emit(compiler, OP_AGG_BEGIN, 0);
+
+    while (true) {
+        skip_spaces(compiler);
+        if (!compile_argument(compiler, function))
+            return false;
+        skip_spaces(compiler);
+
+        // Arguments are separated by commas.
+        if (*compiler->pos != ',')
+            break;
+        ++compiler->pos;
+    }
+
+    if (*compiler->pos != ')')
+        return false;
+    ++compiler->pos;
+
+    emit(compiler, OP_AGG_END, (uint32_t)function);
+    return true;
+}
+
+// Function to compile a single operand: a cell reference, a number, a function
+// call or a parenthesized expression.
+static bool compile_operand(Compiler *compiler) {
+    const char *pos = compiler->pos;
+
+    if (*pos == '(') {
+        compiler->pos = pos + 1;
+        if (!compile_sum(compiler) || *compiler->pos != ')')
+            return false;
+        ++compiler->pos;
+        return true;
+    }
+
+    if (isalpha((unsigned char)*pos) || *pos == '_') {
+        // Letters followed by a parenthesis name a function.
+        const char *name = pos;
+        while (isupper((unsigned char)*pos))
+            ++pos;
+        if (*pos == '(') {
+            FUNCTION function;
+            if (!find_function(name, (size_t)(pos - name), &function))
+                return false;
+            compiler->pos = pos;
+            return compile_call(compiler, function);
+        }
+
+        // Otherwise the name is a reference, or the sheet of one.
+        CellRef ref;
+        if (!parse_reference(compiler, &ref, NULL))
+            return false;
+        emit_reference(compiler, ref);
+        return true;
+    }
+
+    if (isdigit((unsigned char)*pos) || *pos == '.') {
+        // A number consists of digits with at most one decimal point.
+        double value;
+        size_t length = number_parse(pos, (size_t)(compiler->end - pos), &value);
+        if (length == 0)
+            return false;
+        pos += length;
+        emit_constant(compiler, value);
+        compiler->pos = pos;
+        return true;
+    }
+
+    return false;
+}
+
+static bool compile_unary(Compiler *compiler);
+
+// Function to compile an operand, raised to a power if a '^' follows.
+static bool compile_power(Compiler *compiler) {
+    if (!compile_operand(compiler))
+        return false;
+    skip_spaces(compiler);
+    if (*compiler->pos != '^')
+        return true;
+    ++compiler->pos;
+
+    // The exponent may be a power itself, which makes powers group to the
+    // right, or be negated.
+    if (!compile_unary(compiler))
+        return false;
+    emit_operator(compiler, OP_POW);
+    return true;
+}
+
+// Function to compile a power preceded by any number of minus signs.
+static bool compile_unary(Compiler *compiler) {
+    skip_spaces(compiler);
+    if (*compiler->pos != '-')
+        return compile_power(compiler);
+    ++compiler->pos;
+
+    if (!compile_unary(compiler))
+        return false;
+    emit_negation(compiler);
+    return true;
+}
+
+// Function to compile a sequence of factors separated by '*' or '/'.
+static bool compile_product(Compiler *compiler) {
+    if (!compile_unary(compiler))
+        return false;
+    skip_spaces(compiler);
+
+    while (*compiler->pos == '*' || *compiler->pos == '/') {
+        OPCODE op = *compiler->pos++ == '*' ? OP_MUL : OP_DIV;
+        if (!compile_unary(compiler))
+            return false;
+        emit_operator(compiler, op);
+        skip_spaces(compiler);
+    }
+    return true;
+}
+
+// Function to compile a sequence of terms separated by '+' or '-'.
+static bool compile_sum(Compiler *compiler) {
+    if (!compile_product(compiler))
+        return false;
+
+    while (*compiler->pos == '+' || *compiler->pos == '-') {
+        OPCODE op = *compiler->pos++ == '+' ? OP_ADD : OP_SUB;
+        if (!compile_product(compiler))
+            return false;
+        emit_operator(compiler, op);
+    }
+    return true;
+}
+
+// Function to compile the text following the equals sign.
+static bool compile_expression(Compiler *compiler) {
+    if (!compile_sum(compiler))
+        return false;
+
+    // Anything left over is not part of the grammar.
+    return *compiler->pos == '\0';
+}
+
+bool formula_operate(OPCODE op, double left, double right, double *result) {
+    switch (op) {
+        case OP_ADD:
+            *result = left + right;
+            return true;
+        case OP_SUB:
+            *result = left - right;
+            return true;
+        case OP_MUL:
+            *result = left * right;
+            return true;
+        case OP_DIV:
+            if (right == 0)
+                return false;
+            *result = left / right;
+            return true;
+        case OP_POW:
+            // Results that are not finite come from exponents the base has no
+            // power for, such as negative numbers to fractional exponents,
+            // unless the operands were not finite to start with.
+            *result = pow(left, right);
+            return isfinite(*result) || !isfinite(left) || !isfinite(right);
+        default:
+            return false;
+    }
+}
+
+/* SHARED FORMULAS */
+
+// A formula of a table, along with the hash it is filed under.
+typedef struct {
+    uint64_t hash;
+    // NULL for a free slot
+    Formula *formula;
+} TableEntry;
+
+// Formulas hashed with open addressing and linear probing; the capacity is a
+// power of two, or 0.
+typedef struct {
+    TableEntry *entries;
+    size_t capacity;
+    size_t count;
+} FormulaTable;
+
+// Formulas in use, by their contents.
+static FormulaTable formulas_in_use = {0};
+
+// Formulas in use that have a shape, by their shape.
+static FormulaTable formula_shapes = {0};
+
+// Starts a shape with a reference; the offsets of its row and column from the
+// cell of the formula follow, as two int64_t.
+#define SHAPE_REFERENCE '\x01'
+
+// Shape of the text compiled last, reused by every compilation.
+static char *shape_buffer = NULL;
+static size_t shape_capacity = 0;
+
+// Function to continue a hash with some bytes, eight at a time like FNV-1a
+// does one at a time; folding the high half back in makes up for the low
+// bits, which the tables use, only depending on the low bytes.
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t size) {
+    const unsigned char *bytes = data;
+    for (; size >= 8; bytes += 8, size -= 8) {
+        uint64_t word;
+        memcpy(&word, bytes, sizeof(word));
+        hash = (hash ^ word) * 0x9E3779B97F4A7C15ull;
+        hash ^= hash >> 32;
+    }
+    for (; size > 0; ++bytes, --size)
+        hash = (hash ^ *bytes) * 0x100000001B3ull;
+    return hash;
+}
+
+// Initial value of the hashes.
+#define HASH_START 0xCBF29CE484222325ull
+
+// Function to hash the contents of a formula, which leave no padding bytes.
+static uint64_t contents_hash(const Formula *formula) {
+    size_t sizes[5] = {formula->length, formula->num_constants, formula->num_refs, formula->num_ranges,
+                       formula->max_stack};
+    uint64_t hash = hash_bytes(HASH_START, sizes, sizeof(sizes));
+    hash = hash_bytes(hash, formula->code, formula->length * sizeof(Instruction));
+    hash = hash_bytes(hash, formula->constants, formula->num_constants * sizeof(double));
+    hash = hash_bytes(hash, formula->refs, formula->num_refs * sizeof(CellRef));
+    return hash_bytes(hash, formula->ranges, formula->num_ranges * sizeof(CellRange));
+}
+
+// Function to compare two arrays, either of which is NULL if it is empty.
+static bool same_bytes(const void *a, const void *b, size_t size) {
+    return size == 0 || memcmp(a, b, size) == 0;
+}
+
+// Function to check whether two formulas compute the same, from the same cells.
+static bool same_contents(const Formula *a, const Formula *b) {
+    // Constants are compared bit for bit, which tells 0 and -0 apart.
+    return a->length == b->length && a->num_constants == b->num_constants && a->num_refs == b->num_refs &&
+           a->num_ranges == b->num_ranges && a->max_stack == b->max_stack &&
+           same_bytes(a->code, b->code, a->length * sizeof(Instruction)) &&
+           same_bytes(a->constants, b->constants, a->num_constants * sizeof(double)) &&
+           same_bytes(a->refs, b->refs, a->num_refs * sizeof(CellRef)) &&
+           same_bytes(a->ranges, b->ranges, a->num_ranges * sizeof(CellRange));
+}
+
+// Function to add a formula to a table.
+static void table_add(FormulaTable *table, uint64_t hash, Formula *formula) {
+    // Keep the table at most half full, moving the entries to a larger one.
+    if (2 * (table->count + 1) > table->capacity) {
+        TableEntry *old = table->entries;
+        size_t old_capacity = table->capacity;
+        table->capacity = table->capacity ? 2 * table->capacity : 64;
+        table->entries = checked_calloc(table->capacity, sizeof(TableEntry));
+        table->count = 0;
+        for (size_t k = 0; k < old_capacity; ++k) {
+            if (old[k].formula != NULL)
+                table_add(table, old[k].hash, old[k].formula);
+        }
+        free(old);
+    }
+
+    size_t mask = table->capacity - 1;
+    size_t slot = (size_t)hash & mask;
+    while (table->entries[slot].formula != NULL)
+        slot = (slot + 1) & mask;
+    table->entries[slot] = (TableEntry){hash, formula};
+    ++table->count;
+}
+
+// Function to remove a formula from a table.
+static void table_remove(FormulaTable *table, uint64_t hash, const Formula *formula) {
+    size_t mask = table->capacity - 1;
+    size_t slot = (size_t)hash & mask;
+    while (table->entries[slot].formula != formula)
+        slot = (slot + 1) & mask;
+
+    // Move later entries of the same run back into the gap if their probes
+    // pass it, so that lookups never stop at it.
+    size_t gap = slot;
+    for (size_t next = (gap + 1) & mask; table->entries[next].formula != NULL; next = (next + 1) & mask) {
+        size_t home = (size_t)table->entries[next].hash & mask;
+        if (((next - home) & mask) >= ((next - gap) & mask)) {
+            table->entries[gap] = table->entries[next];
+            gap = next;
+        }
+    }
+    table->entries[gap].formula = NULL;
+    --table->count;
+}
+
+// Function to append bytes to the shape being made.
+static void append_shape(size_t *length, const void *data, size_t size) {
+    if (*length + size > shape_capacity) {
+        while (*length + size > shape_capacity)
+            shape_capacity = shape_capacity ? 2 * shape_capacity : 256;
+        shape_buffer = checked_realloc(shape_buffer, shape_capacity);
+    }
+    memcpy(shape_buffer + *length, data, size);
+    *length += size;
+}
+
+// Function to make the shape of a formula text in 'shape_buffer'.
+//
+// The shape starts with the sheet of the formula and its dimensions, followed
+// by the text in which every word of capital letters and digits stands for
+// the offsets of the cell it references, which distinguishes it from the
+// texts of formulas compiling differently. Returns false for texts naming
+// sheets, whose formulas are not found by shape.
+static bool make_shape(const char *text, const FormulaScope *scope, size_t *length) {
+    // Positions relative to the cell must not be mistaken for positions on
+    // the sheet once they wrap around.
+    if (scope->num_rows > INT32_MAX || scope->num_cols > INT32_MAX)
+        return false;
+
+    size_t header[3] = {scope->sheet, scope->num_rows, scope->num_cols};
+    *length = 0;
+    append_shape(length, header, sizeof(header));
+
+    const char *pos = text;
+    while (*pos != '\0') {
+        if (*pos == '!' || *pos == SHAPE_REFERENCE)
+            return false;
+
+        // Words may read as numbers as well as references, such as 1E5, and
+        // only those starting with a letter are taken apart.
+        if (!is_name_char(*pos) && *pos != '.') {
+            const char *other = pos;
+            while (*pos != '\0' && *pos != '!' && *pos != SHAPE_REFERENCE && !is_name_char(*pos) && *pos != '.')
+                ++pos;
+            append_shape(length, other, (size_t)(pos - other));
+            continue;
+        }
+        const char *word = pos;
+        while (is_name_char(*pos) || *pos == '.')
+            ++pos;
+
+        // Columns and rows stop accumulating once they are out of range, as
+        // they do when compiling.
+        const char *end = word;
+        size_t col = 0, row = 0;
+        while (end < pos && isupper((unsigned char)*end)) {
+            col = col * 26 + (size_t)(*end++ - 'A' + 1);
+            if (col > scope->num_cols)
+                col = scope->num_cols + 1;
+        }
+        const char *digits = end;
+        while (end < pos && isdigit((unsigned char)*end)) {
+            row = row * 10 + (size_t)(*end++ - '0');
+            if (row > scope->num_rows)
+                row = scope->num_rows + 1;
+        }
+        if (col == 0 || end == digits || end != pos) {
+            append_shape(length, word, (size_t)(pos - word));
+            continue;
+        }
+
+        char marker = SHAPE_REFERENCE;
+        int64_t offsets[2] = {(int64_t)row - 1 - (int64_t)scope->row, (int64_t)col - 1 - (int64_t)scope->col};
+        append_shape(length, &marker, 1);
+        append_shape(length, offsets, sizeof(offsets));
+    }
+    return true;
+}
+
+// Function to find the formula in use having the shape in 'shape_buffer'.
+static Formula *find_shape(uint64_t hash, size_t length) {
+    if (formula_shapes.count == 0)
+        return NULL;
+    size_t mask = formula_shapes.capacity - 1;
+    for (size_t slot = (size_t)hash & mask; formula_shapes.entries[slot].formula != NULL; slot = (slot + 1) & mask) {
+        Formula *formula = formula_shapes.entries[slot].formula;
+        if (formula_shapes.entries[slot].hash == hash && formula->shape_length == length &&
+            memcmp(formula->shape, shape_buffer, length) == 0)
+            return formula;
+    }
+    return NULL;
+}
+
+// Function to check whether a cell relative to the cell of a formula lies on its sheet.
+static bool ref_fits(CellRef ref, const FormulaScope *scope) {
+    return (uint32_t)(ref.row + (uint32_t)scope->row) < scope->num_rows &&
+           (uint32_t)(ref.col + (uint32_t)scope->col) < scope->num_cols;
+}
+
+// Function to check whether the cells read by a formula of a shape lie on its sheet.
+static bool shape_fits(const Formula *formula, const FormulaScope *scope) {
+    for (size_t k = 0; k < formula->num_refs; ++k) {
+        if (!ref_fits(formula->refs[k], scope))
+            return false;
+    }
+    for (size_t k = 0; k < formula->num_ranges; ++k) {
+        if (!ref_fits(formula->ranges[k].first, scope) || !ref_fits(formula->ranges[k].last, scope))
+            return false;
+    }
+    return true;
+}
+
+Formula *formula_share(Formula *formula) {
+    uint64_t hash = contents_hash(formula);
+
+    if (formulas_in_use.count > 0) {
+        size_t mask = formulas_in_use.capacity - 1;
+        for (size_t slot = (size_t)hash & mask; formulas_in_use.entries[slot].formula != NULL;
+             slot = (slot + 1) & mask) {
+            Formula *found = formulas_in_use.entries[slot].formula;
+            if (formulas_in_use.entries[slot].hash == hash && same_contents(found, formula)) {
+                ++found->shares;
+                formula_free(formula);
+                return found;
+            }
+        }
+    }
+
+    formula->shares = 1;
+    table_add(&formulas_in_use, hash, formula);
+    return formula;
+}
+
+size_t formula_count(void) {
+    return formulas_in_use.count;
+}
+
+Formula *formula_compile(const char *text, const FormulaScope *scope) {
+    // Skip leading whitespace and check for the equals sign.
+    while (*text && isspace((unsigned char)*text))
+        ++text;
+    if (*text != EQUALS_CHAR)
+        return NULL;
+
+    // A formula of the same shape compiles the same, provided that the cells
+    // it reads lie on the sheet.
+    size_t shape_length;
+    uint64_t shape_hash = 0;
+    bool shaped = make_shape(text, scope, &shape_length);
+    if (shaped) {
+        shape_hash = hash_bytes(HASH_START, shape_buffer, shape_length);
+        Formula *formula = find_shape(shape_hash, shape_length);
+        if (formula != NULL) {
+            if (!shape_fits(formula, scope))
+                return NULL;
+            ++formula->shares;
+            return formula;
+        }
+    }
+
+    Compiler compiler = {
+            .pos = text + 1,
+            .end = text + strlen(text),
+            .scope = scope,
+            .formula = checked_calloc(1, sizeof(Formula)),
+    };
+
+    if (!compile_expression(&compiler)) {
+        formula_free(compiler.formula);
+        return NULL;
+    }
+
+    // Formulas only keep the first shape they are compiled from.
+    Formula *formula = formula_share(compiler.formula);
+    if (shaped && formula->shape == NULL) {
+        formula->shape = checked_malloc(shape_length);
+        memcpy(formula->shape, shape_buffer, shape_length);
+        formula->shape_length = shape_length;
+        table_add(&formula_shapes, shape_hash, formula);
+    }
+    return formula;
+}
+
+void formula_free(Formula *formula) {
+    if (formula == NULL)
+        return;
+    if (formula->shares > 1) {
+        --formula->shares;
+        return;
+    }
+
+    // The last holder takes the formula out of use.
+    if (formula->shares == 1) {
+        table_remove(&formulas_in_use, contents_hash(formula), formula);
+        if (formula->shape != NULL)
+            table_remove(&formula_shapes, hash_bytes(HASH_START, formula->shape, formula->shape_length), formula);
+    }
+    free(formula->shape);
+    free(formula->code);
+    free(formula->constants);
+    free(formula->refs);
+    free(formula->ranges);
+    free(formula);
+}
@@ -0,0 +1,178 @@
+#ifndef ASSIGNMENT_FORMULA_H
+#define ASSIGNMENT_FORMULA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Operations understood by the formula evaluator.
+//
+// Formulas are compiled to postfix code for a stack machine: operands are
+// pushed onto a stack and operators replace the topmost values with their
+// result. A successful evaluation leaves exactly one value on the stack.
+//
+// Opcodes are stored in snapshot files, so new ones must be added at the end.
+typedef enum {
+    // Pushes constants[operand]
+    OP_CONST,
+    // Pushes the value of the cell refs[operand]
+    OP_REF,
+    // Pops two values and pushes their sum
+    OP_ADD,
+    // Starts the arguments of a range function by pushing four running
+    // totals: sum, count, minimum and maximum
+    OP_AGG_BEGIN,
+    // Pops a value and adds it to the totals below it
+    OP_AGG_VALUE,
+    // Adds the numeric cells of ranges[operand] to the totals on top,
+    // ignoring the minimum and maximum
+    OP_AGG_RANGE,
+    // Like OP_AGG_RANGE, but also updates the minimum and maximum
+    OP_AGG_RANGE_EXTREMA,
+    // Replaces the totals on top by the result of the FUNCTION 'operand'
+    OP_AGG_END,
+    // Pops two values and pushes their difference, product, quotient or power
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_POW,
+    // Replaces the value on top by its negation
+    OP_NEG,
+    // Adds the value of the cell refs[operand] to the value on top, standing
+    // for an OP_REF followed by an OP_ADD
+    OP_ADD_REF,
+    // Adds constants[operand] to the value on top, standing for an OP_CONST
+    // followed by an OP_ADD
+    OP_ADD_CONST,
+} OPCODE;
+
+// Range functions.
+typedef enum {
+    FN_SUM,
+    FN_MIN,
+    FN_MAX,
+    FN_AVERAGE,
+    FN_COUNT,
+} FUNCTION;
+
+// A single instruction of a compiled formula.
+typedef struct {
+    // Operation to perform
+    OPCODE op;
+    // Index into the constant or reference table, if the operation takes one
+    uint32_t operand;
+} Instruction;
+
+// Position of a cell referenced by a formula.
+//
+// Within a compiled formula, rows and columns are relative to the cell
+// holding it: adding the cell's row and column, modulo 2^32, gives the
+// position of the cell read. Sheet indices are absolute.
+typedef struct {
+    uint32_t row;
+    uint32_t col;
+    // Index of the sheet of the cell within the workbook
+    uint32_t sheet;
+} CellRef;
+
+// Rectangular block of cells, such as A1:B10, including both corners, which
+// lie on the same sheet.
+typedef struct {
+    // Top-left corner
+    CellRef first;
+    // Bottom-right corner
+    CellRef last;
+} CellRange;
+
+// A formula compiled from its text.
+//
+// As references are relative, formulas filled down a column or across a row,
+// such as =A1+B1, =A2+B2 and so on, compile to the same formula, whose single
+// copy is shared by all the cells holding it.
+typedef struct {
+    // Instructions, in execution order
+    Instruction *code;
+    // Number of instructions
+    size_t length;
+    // Numeric literals used by OP_CONST
+    double *constants;
+    // Number of entries in 'constants'
+    size_t num_constants;
+    // Distinct cells read by OP_REF; these are the formula's precedents
+    CellRef *refs;
+    // Number of entries in 'refs'
+    size_t num_refs;
+    // Ranges read by OP_AGG_RANGE; their cells are precedents too
+    CellRange *ranges;
+    // Number of entries in 'ranges'
+    size_t num_ranges;
+    // Largest number of values on the stack at any point of the evaluation
+    size_t max_stack;
+    // Number of holders of the formula, see 'formula_share'
+    size_t shares;
+    // Text of the formula with its references made relative, under which
+    // 'formula_compile' finds it again without compiling; NULL if it has none
+    char *shape;
+    size_t shape_length;
+} Formula;
+
+// Sheets of the workbook a formula is compiled for.
+typedef struct {
+    // Index of the sheet holding the formula, the position of its cell on the
+    // sheet, and the dimensions of the sheet
+    size_t sheet;
+    size_t row;
+    size_t col;
+    size_t num_rows;
+    size_t num_cols;
+    // Looks up the sheet named by the 'length' characters at 'name', setting
+    // its index and dimensions; returns false if there is none. NULL if the
+    // formula can only read its own sheet.
+    bool (*find_sheet)(const char *name, size_t length, size_t *sheet, size_t *num_rows, size_t *num_cols,
+                       void *data);
+    void *data;
+} FormulaScope;
+
+// Compiles formula text such as "=A1+B2+0.5" or "=SUM(A1:A10, C1)*(2-A3)".
+//
+// Expressions combine numbers, cell references and function calls with the
+// operators '+', '-', '*', '/' and '^', parentheses and unary minus, with the
+// usual precedence: '^' binds tightest and to the right, so that -2^2 is -4
+// and 2^3^2 is 512. Operations on constants only are calculated right away.
+// The functions SUM, MIN, MAX, AVERAGE and COUNT take any number of
+// arguments, each being a range, a single cell or an expression. They only
+// consider numeric cells: empty cells and strings in ranges are skipped.
+// References lie on the sheet of the formula unless they are prefixed by the
+// name of another sheet of 'scope' and '!', as in Sheet2!A1; a range names
+// the sheet before its first corner, as in SUM(Sheet2!A1:B5). References must
+// lie within the dimensions of their sheet; columns after Z are named AA, AB,
+// and so on.
+// Returns NULL if the text is not a well-formed formula, in which case the
+// cell displays an error. The result is shared as by 'formula_share', and must
+// be released with 'formula_free'.
+//
+// Formulas whose text only differs from one compiled before by references at
+// the same offsets from their cells, and which do not name sheets, are found
+// in a table instead of being compiled again, so that filling a formula into
+// many cells costs a single compilation.
+Formula *formula_compile(const char *text, const FormulaScope *scope);
+
+// Adds a holder to a formula identical to 'formula' among the formulas in
+// use, and returns it, freeing 'formula'. If there is none, 'formula' is
+// returned with one holder, and is in use from now on; it must not be
+// modified any more.
+Formula *formula_share(Formula *formula);
+
+// Returns the number of distinct formulas in use.
+size_t formula_count(void);
+
+// Calculates the result of the binary operator 'op', one of OP_ADD, OP_SUB,
+// OP_MUL, OP_DIV and OP_POW. Returns false if there is none: for divisions by
+// zero, and for powers that are not finite, as 0^-1 or (-8)^(1/3).
+bool formula_operate(OPCODE op, double left, double right, double *result);
+
+// Releases a holder of a compiled formula, freeing it along with its last
+// holder. Accepts NULL.
+void formula_free(Formula *formula);
+
+#endif //ASSIGNMENT_FORMULA_H
@@ -0,0 +1,1255 @@
+#include <ctype.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "interface.h"
+#include "model.h"
+#include "number.h"
+
+// Differential fuzzing of the model.
+//
+// Each input is decoded into a sequence of operations: edits with generated
+// or random text, batches, undo and redo, and round trips through CSV files
+// and snapshots. The sequence is applied to the model once in each engine
+// mode, and after every operation the text each cell displays and edits is
+// compared with what a slow reference evaluator derives from the texts of
+// the cells alone, without compiled code, dependency graphs or incremental
+// updates. The modes must also agree with each other exactly, on the texts
+// displayed and, through a change feed, on the values of the cells down to
+// the last bit. Any difference aborts with a log of the operations.
+//
+// Configured with MODEL_FUZZ, this is a libFuzzer target; otherwise it runs
+// a number of random inputs, given on the command line along with a seed.
+
+// Size of the sheet. Edits go to the first EDIT_ROWS rows, and fills to
+// column FILL_COL of the rows below them, making changes large enough to be
+// recalculated in parallel.
+#define SHEET_ROWS 1200
+#define SHEET_COLS 6
+#define EDIT_ROWS 8
+#define FILL_COL 4
+
+// Rows shown in lazy mode, which only keeps these up to date after edits.
+#define VIEWPORT_ROWS 4
+
+// Largest number of operations decoded from an input, which keeps the undo
+// journal well within its default limit.
+#define MAX_OPERATIONS 128
+
+// File the input is written to when a check fails.
+#define FAILURE_PATH "fuzz_failure.bin"
+
+// Files written by the round trips.
+#define CSV_PATH "fuzz_roundtrip.csv"
+#define SNAPSHOT_PATH "fuzz_roundtrip.snapshot"
+
+// Engine modes every input is run in.
+typedef enum {
+    MODE_SEQUENTIAL,
+    MODE_LAZY,
+    MODE_THREADED,
+    NUM_MODES,
+} Mode;
+
+static const char *mode_names[NUM_MODES] = {"sequential", "lazy", "threaded"};
+
+// Texts displayed by the model for each cell.
+typedef char Displays[SHEET_ROWS][SHEET_COLS][CELL_DISPLAY_WIDTH + 1];
+static Displays display;
+
+// Largest number of checks of an input in one mode: two per operation, and
+// one at the end.
+#define MAX_CHECKS (2 * MAX_OPERATIONS + 1)
+
+// Values of the cells as last reported by the change feed: a ChangeType, or
+// VALUE_UNKNOWN before any report since the workbook was created, and the
+// number reported along with CHANGE_NUMBER.
+#define VALUE_UNKNOWN 0xFF
+typedef struct {
+    uint8_t types[SHEET_ROWS][SHEET_COLS];
+    double numbers[SHEET_ROWS][SHEET_COLS];
+} Values;
+static Values values;
+
+// Feed the values are read from, which is large enough never to drop any.
+static ChangeFeed *feed = NULL;
+
+// What each check saw in sequential mode, which the other modes must see
+// exactly; allocated with the first input.
+typedef struct {
+    Displays displays;
+    Values values;
+} Seen;
+static Seen *sequential_seen = NULL;
+static size_t num_checks = 0;
+
+void update_cell_displays(const CellDisplayUpdate *updates, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        if (updates[i].row < SHEET_ROWS && updates[i].col < SHEET_COLS)
+            snprintf(display[updates[i].row][updates[i].col], CELL_DISPLAY_WIDTH + 1, "%s", updates[i].text);
+    }
+}
+
+// Function to forget the values of all cells.
+static void forget_values(void) {
+    memset(values.types, VALUE_UNKNOWN, sizeof(values.types));
+}
+
+/* OPERATION LOG */
+
+// Operations applied in the current mode, printed when a check fails.
+static char *log_text = NULL;
+static size_t log_length = 0;
+static size_t log_capacity = 0;
+
+// Function to append a line to the operation log.
+static void log_operation(const char *format, ...) {
+    char line[512];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (length < 0)
+        return;
+    if ((size_t)length >= sizeof(line))
+        length = sizeof(line) - 1;
+
+    if (log_length + (size_t)length + 2 > log_capacity) {
+        log_capacity = 2 * (log_length + (size_t)length + 2);
+        log_text = realloc(log_text, log_capacity);
+        if (log_text == NULL)
+            abort();
+    }
+    memcpy(log_text + log_length, line, (size_t)length);
+    log_length += (size_t)length;
+    log_text[log_length++] = '\n';
+    log_text[log_length] = '\0';
+}
+
+// Input being run, saved when a check fails.
+static const uint8_t *input_data = NULL;
+static size_t input_size = 0;
+
+// Function to report a difference between the model and the reference, and abort.
+static void fail(Mode mode, const char *format, ...) {
+    fprintf(stderr, "fuzz: mismatch in %s mode after these operations:\n%s", mode_names[mode],
+            log_text != NULL ? log_text : "");
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fputc('\n', stderr);
+
+    // The input can be run again by passing the file on the command line.
+    FILE *stream = fopen(FAILURE_PATH, "wb");
+    if (stream != NULL) {
+        fwrite(input_data, 1, input_size, stream);
+        fclose(stream);
+        fprintf(stderr, "fuzz: input written to " FAILURE_PATH "\n");
+    }
+    abort();
+}
+
+/* REFERENCE SHEET */
+
+// Texts of the cells of the reference sheet, NULL for empty cells. Numbers
+// are kept in the form the model gives them when editing.
+typedef char *Texts[SHEET_ROWS][SHEET_COLS];
+
+// Current texts, and the texts before each step that can be undone or redone.
+static Texts texts;
+static Texts *undo_steps[MAX_OPERATIONS];
+static Texts *redo_steps[MAX_OPERATIONS];
+static size_t num_undo_steps = 0;
+static size_t num_redo_steps = 0;
+
+// Number of open batches, the texts before the outermost one, and whether
+// any of its edits changed a cell.
+static size_t batch_depth = 0;
+static Texts *batch_start = NULL;
+static bool batch_changed = false;
+
+// Whether any cells below the edited rows were filled.
+static bool filled = false;
+
+// Function to copy the current texts.
+static Texts *copy_texts(void) {
+    Texts *copy = malloc(sizeof(Texts));
+    if (copy == NULL)
+        abort();
+    for (size_t row = 0; row < SHEET_ROWS; ++row) {
+        for (size_t col = 0; col < SHEET_COLS; ++col)
+            (*copy)[row][col] = texts[row][col] != NULL ? strdup(texts[row][col]) : NULL;
+    }
+    return copy;
+}
+
+// Function to release copied texts.
+static void free_texts(Texts *copy) {
+    if (copy == NULL)
+        return;
+    for (size_t row = 0; row < SHEET_ROWS; ++row) {
+        for (size_t col = 0; col < SHEET_COLS; ++col)
+            free((*copy)[row][col]);
+    }
+    free(copy);
+}
+
+// Function to make copied texts the current ones, releasing the copy.
+static void restore_texts(Texts *copy) {
+    for (size_t row = 0; row < SHEET_ROWS; ++row) {
+        for (size_t col = 0; col < SHEET_COLS; ++col) {
+            free(texts[row][col]);
+            texts[row][col] = (*copy)[row][col];
+        }
+    }
+    free(copy);
+}
+
+// Function to forget all steps that can be undone or redone.
+static void clear_history(void) {
+    while (num_undo_steps > 0)
+        free_texts(undo_steps[--num_undo_steps]);
+    while (num_redo_steps > 0)
+        free_texts(redo_steps[--num_redo_steps]);
+}
+
+// Function to empty the reference sheet.
+static void clear_reference(void) {
+    clear_history();
+    for (size_t row = 0; row < SHEET_ROWS; ++row) {
+        for (size_t col = 0; col < SHEET_COLS; ++col) {
+            free(texts[row][col]);
+            texts[row][col] = NULL;
+        }
+    }
+    free_texts(batch_start);
+    batch_start = NULL;
+    batch_depth = 0;
+    filled = false;
+}
+
+// Kinds of cells, as classified from their text.
+typedef enum {
+    KIND_EMPTY,
+    KIND_NUMBER,
+    KIND_STRING,
+    KIND_FORMULA,
+} Kind;
+
+// Function to classify the text of a cell: numbers are digits with at most
+// one decimal point after any whitespace, formulas start with '='.
+static Kind classify(const char *text) {
+    if (text == NULL)
+        return KIND_EMPTY;
+    while (isspace((unsigned char)*text))
+        ++text;
+
+    bool digit = false, point = false;
+    const char *p = text;
+    for (; *p != '\0'; ++p) {
+        if (isdigit((unsigned char)*p))
+            digit = true;
+        else if (*p == '.' && !point)
+            point = true;
+        else
+            break;
+    }
+    if (*p == '\0' && digit)
+        return KIND_NUMBER;
+    return *text == '=' ? KIND_FORMULA : KIND_STRING;
+}
+
+// Function to record a change about to be made to the reference sheet, as a
+// step that can be undone.
+static void begin_change(void) {
+    if (batch_depth > 0) {
+        batch_changed = true;
+        return;
+    }
+    undo_steps[num_undo_steps++] = copy_texts();
+    while (num_redo_steps > 0)
+        free_texts(redo_steps[--num_redo_steps]);
+}
+
+// Function to set the text of a cell of the reference sheet, as the model
+// does: empty texts are ignored.
+static void reference_set(size_t row, size_t col, const char *text) {
+    if (*text == '\0')
+        return;
+    begin_change();
+
+    char formatted[NUMBER_TEXT_MAX];
+    if (classify(text) == KIND_NUMBER) {
+        number_format(strtod(text, NULL), formatted);
+        text = formatted;
+    }
+    free(texts[row][col]);
+    texts[row][col] = strdup(text);
+}
+
+// Function to clear a cell of the reference sheet; clearing an empty cell
+// changes nothing.
+static void reference_clear(size_t row, size_t col) {
+    if (texts[row][col] == NULL)
+        return;
+    begin_change();
+    free(texts[row][col]);
+    texts[row][col] = NULL;
+}
+
+/* REFERENCE EVALUATOR */
+
+// Results of formulas.
+typedef enum {
+    RESULT_UNKNOWN,
+    RESULT_PENDING,
+    RESULT_VALUE,
+    RESULT_ERROR,
+    RESULT_CYCLE,
+} ResultKind;
+
+// Result of each formula of the reference sheet.
+static ResultKind result_kinds[SHEET_ROWS][SHEET_COLS];
+static double result_values[SHEET_ROWS][SHEET_COLS];
+
+// Whether each formula is well formed, and the cells it reads, listed per
+// cell in row-major order.
+static bool well_formed[SHEET_ROWS][SHEET_COLS];
+static size_t edge_start[SHEET_ROWS * SHEET_COLS + 1];
+static size_t *edges = NULL;
+static size_t num_edges = 0;
+static size_t edges_capacity = 0;
+
+// State of the reference parser.
+typedef struct {
+    // Remaining text
+    const char *pos;
+    // Whether values are calculated, or the cells read only recorded as edges
+    bool evaluate;
+} Parser;
+
+static bool cell_value(size_t row, size_t col, double *value);
+
+// Function to record that the formula being parsed reads a cell.
+static void add_edge(size_t row, size_t col) {
+    if (num_edges == edges_capacity) {
+        edges_capacity = edges_capacity ? 2 * edges_capacity : 1024;
+        edges = realloc(edges, edges_capacity * sizeof(size_t));
+        if (edges == NULL)
+            abort();
+    }
+    edges[num_edges++] = row * SHEET_COLS + col;
+}
+
+static void skip_spaces(Parser *parser) {
+    while (isspace((unsigned char)*parser->pos))
+        ++parser->pos;
+}
+
+// Function to parse a cell name such as "B7" within the sheet into a 0-based position.
+static bool parse_cell(Parser *parser, size_t *row, size_t *col) {
+    const char *p = parser->pos;
+    size_t c = 0, r = 0;
+    while (isupper((unsigned char)*p)) {
+        c = c * 26 + (size_t)(*p++ - 'A' + 1);
+        if (c > SHEET_COLS)
+            c = SHEET_COLS + 1;
+    }
+    if (c == 0 || !isdigit((unsigned char)*p))
+        return false;
+    while (isdigit((unsigned char)*p)) {
+        r = r * 10 + (size_t)(*p++ - '0');
+        if (r > SHEET_ROWS)
+            r = SHEET_ROWS + 1;
+    }
+    if (r < 1 || r > SHEET_ROWS || c > SHEET_COLS)
+        return false;
+    *row = r - 1;
+    *col = c - 1;
+    parser->pos = p;
+    return true;
+}
+
+// Function to apply a binary operator; divisions by zero and powers without
+// a finite value fail.
+static bool apply(char op, double left, double right, double *result) {
+    switch (op) {
+        case '+':
+            *result = left + right;
+            return true;
+        case '-':
+            *result = left - right;
+            return true;
+        case '*':
+            *result = left * right;
+            return true;
+        case '/':
+            *result = left / right;
+            return right != 0;
+        default:
+            *result = pow(left, right);
+            return isfinite(*result) || !isfinite(left) || !isfinite(right);
+    }
+}
+
+// Running totals of a function call.
+typedef struct {
+    double sum;
+    double count;
+    double min;
+    double max;
+} Totals;
+
+// Function to add a value to the totals of a function call.
+static void add_total(Totals *totals, double value) {
+    totals->sum += value;
+    totals->count += 1;
+    if (value < totals->min)
+        totals->min = value;
+    if (value > totals->max)
+        totals->max = value;
+}
+
+static bool parse_sum(Parser *parser, double *value);
+
+// Function to parse one argument of a function call: a range, a single cell
+// standing for a range, or an expression.
+static bool parse_argument(Parser *parser, Totals *totals) {
+    const char *start = parser->pos;
+    size_t first_row, first_col, last_row, last_col;
+
+    if (parse_cell(parser, &first_row, &first_col)) {
+        skip_spaces(parser);
+        bool range = true;
+        if (*parser->pos == ':') {
+            ++parser->pos;
+            skip_spaces(parser);
+            if (!parse_cell(parser, &last_row, &last_col))
+                return false;
+        } else if (*parser->pos == ',' || *parser->pos == ')') {
+            last_row = first_row;
+            last_col = first_col;
+        } else {
+            range = false;
+            parser->pos = start;
+        }
+
+        // Ranges only count the cells holding numbers and formulas.
+        if (range) {
+            size_t top = first_row < last_row ? first_row : last_row;
+            size_t bottom = first_row < last_row ? last_row : first_row;
+            size_t left = first_col < last_col ? first_col : last_col;
+            size_t right = first_col < last_col ? last_col : first_col;
+            for (size_t col = left; col <= right; ++col) {
+                for (size_t row = top; row <= bottom; ++row) {
+                    if (!parser->evaluate) {
+                        add_edge(row, col);
+                        continue;
+                    }
+                    Kind kind = classify(texts[row][col]);
+                    double value;
+                    if (kind == KIND_NUMBER || kind == KIND_FORMULA) {
+                        if (!cell_value(row, col, &value))
+                            return false;
+                        add_total(totals, value);
+                    }
+                }
+            }
+            return true;
+        }
+    }
+
+    // Any other argument counts, whatever its value.
+    double value;
+    if (!parse_sum(parser, &value))
+        return false;
+    add_total(totals, value);
+    return true;
+}
+
+// Function to parse a function call after its name, starting at the parenthesis.
+static bool parse_call(Parser *parser, const char *name, size_t length, double *value) {
+    static const char *names[] = {"SUM", "MIN", "MAX", "AVERAGE", "COUNT"};
+    size_t function = 0;
+    while (function < 5 && (strlen(names[function]) != length || strncmp(names[function], name, length) != 0))
+        ++function;
+    if (function == 5)
+        return false;
+
+    ++parser->pos;
+    Totals totals = {0, 0, INFINITY, -INFINITY};
+    while (true) {
+        skip_spaces(parser);
+        if (!parse_argument(parser, &totals))
+            return false;
+        skip_spaces(parser);
+        if (*parser->pos != ',')
+            break;
+        ++parser->pos;
+    }
+    if (*parser->pos != ')')
+        return false;
+    ++parser->pos;
+
+    switch (function) {
+        case 0:
+            *value = totals.sum;
+            return true;
+        case 1:
+            *value = totals.count > 0 ? totals.min + 0.0 : 0;
+            return true;
+        case 2:
+            *value = totals.count > 0 ? totals.max + 0.0 : 0;
+            return true;
+        case 3:
+            *value = totals.count > 0 ? totals.sum / totals.count : 0;
+            return totals.count > 0 || !parser->evaluate;
+        default:
+            *value = totals.count;
+            return true;
+    }
+}
+
+// Function to parse a number, a cell, a function call or a parenthesized expression.
+static bool parse_operand(Parser *parser, double *value) {
+    const char *p = parser->pos;
+    *value = 0;
+
+    if (*p == '(') {
+        parser->pos = p + 1;
+        if (!parse_sum(parser, value) || *parser->pos != ')')
+            return false;
+        ++parser->pos;
+        return true;
+    }
+
+    if (isupper((unsigned char)*p)) {
+        while (isupper((unsigned char)*p))
+            ++p;
+        if (*p == '(') {
+            const char *name = parser->pos;
+            parser->pos = p;
+            return parse_call(parser, name, (size_t)(p - name), value);
+        }
+
+        size_t row, col;
+        if (!parse_cell(parser, &row, &col))
+            return false;
+        if (!parser->evaluate) {
+            add_edge(row, col);
+            return true;
+        }
+        return cell_value(row, col, value);
+    }
+
+    // Numbers are digits with at most one decimal point, read with strtod.
+    bool digit = false, point = false;
+    while (isdigit((unsigned char)*p) || (*p == '.' && !point)) {
+        if (*p == '.')
+            point = true;
+        else
+            digit = true;
+        ++p;
+    }
+    char *end;
+    if (!digit)
+        return false;
+    *value = strtod(parser->pos, &end);
+    if (end != p)
+        return false;
+    parser->pos = p;
+    return true;
+}
+
+static bool parse_unary(Parser *parser, double *value);
+
+// Function to parse an operand, raised to a power if a '^' follows.
+static bool parse_power(Parser *parser, double *value) {
+    if (!parse_operand(parser, value))
+        return false;
+    skip_spaces(parser);
+    if (*parser->pos != '^')
+        return true;
+    ++parser->pos;
+
+    double exponent;
+    if (!parse_unary(parser, &exponent))
+        return false;
+    return apply('^', *value, exponent, value) || !parser->evaluate;
+}
+
+// Function to parse a power preceded by minus signs.
+static bool parse_unary(Parser *parser, double *value) {
+    skip_spaces(parser);
+    if (*parser->pos != '-')
+        return parse_power(parser, value);
+    ++parser->pos;
+    if (!parse_unary(parser, value))
+        return false;
+    *value = -*value;
+    return true;
+}
+
+// Function to parse factors separated by '*' and '/'.
+static bool parse_product(Parser *parser, double *value) {
+    if (!parse_unary(parser, value))
+        return false;
+    skip_spaces(parser);
+    while (*parser->pos == '*' || *parser->pos == '/') {
+        char op = *parser->pos++;
+        double right;
+        if (!parse_unary(parser, &right))
+            return false;
+        if (!apply(op, *value, right, value) && parser->evaluate)
+            return false;
+        skip_spaces(parser);
+    }
+    return true;
+}
+
+// Function to parse terms separated by '+' and '-'.
+static bool parse_sum(Parser *parser, double *value) {
+    if (!parse_product(parser, value))
+        return false;
+    while (*parser->pos == '+' || *parser->pos == '-') {
+        char op = *parser->pos++;
+        double right;
+        if (!parse_product(parser, &right))
+            return false;
+        apply(op, *value, right, value);
+    }
+    return true;
+}
+
+// Function to parse the text of a formula, from its equals sign to the end.
+static bool parse_formula(const char *text, bool evaluate, double *value) {
+    while (isspace((unsigned char)*text))
+        ++text;
+    Parser parser = {text + 1, evaluate};
+    return parse_sum(&parser, value) && *parser.pos == '\0';
+}
+
+// Function to get the value of a cell read by a formula. Empty cells and
+// strings read as 0, and formulas that failed make the reader fail.
+static bool cell_value(size_t row, size_t col, double *value) {
+    const char *text = texts[row][col];
+    *value = 0;
+    switch (classify(text)) {
+        case KIND_NUMBER:
+            *value = strtod(text, NULL);
+            return true;
+        case KIND_FORMULA:
+            break;
+        default:
+            return true;
+    }
+
+    if (result_kinds[row][col] == RESULT_UNKNOWN) {
+        result_kinds[row][col] = RESULT_PENDING;
+        double result;
+        bool ok = well_formed[row][col] && parse_formula(text, true, &result);
+        result_kinds[row][col] = ok ? RESULT_VALUE : RESULT_ERROR;
+        result_values[row][col] = ok ? result : 0;
+    }
+    if (result_kinds[row][col] == RESULT_PENDING) {
+        fprintf(stderr, "fuzz: the reference evaluator reached a cycle\n");
+        abort();
+    }
+    *value = result_values[row][col];
+    return result_kinds[row][col] == RESULT_VALUE;
+}
+
+// State of Tarjan's algorithm finding the formulas on cycles.
+static size_t visit_index[SHEET_ROWS * SHEET_COLS];
+static size_t visit_low[SHEET_ROWS * SHEET_COLS];
+static bool visit_on_stack[SHEET_ROWS * SHEET_COLS];
+static size_t visit_stack[SHEET_ROWS * SHEET_COLS];
+static size_t visit_depth = 0;
+static size_t next_visit = 0;
+
+// Function to find the strongly connected component of a cell, marking the
+// cells of components with a cycle.
+static void find_component(size_t cell) {
+    visit_index[cell] = visit_low[cell] = ++next_visit;
+    visit_stack[visit_depth++] = cell;
+    visit_on_stack[cell] = true;
+
+    bool self_loop = false;
+    for (size_t e = edge_start[cell]; e < edge_start[cell + 1]; ++e) {
+        size_t other = edges[e];
+        self_loop |= other == cell;
+        if (visit_index[other] == 0) {
+            find_component(other);
+            if (visit_low[other] < visit_low[cell])
+                visit_low[cell] = visit_low[other];
+        } else if (visit_on_stack[other] && visit_index[other] < visit_low[cell]) {
+            visit_low[cell] = visit_index[other];
+        }
+    }
+
+    if (visit_low[cell] != visit_index[cell])
+        return;
+    size_t size = 0, member;
+    size_t top = visit_depth;
+    do {
+        member = visit_stack[--visit_depth];
+        visit_on_stack[member] = false;
+        ++size;
+    } while (member != cell);
+    if (size > 1 || self_loop) {
+        for (size_t k = visit_depth; k < top; ++k)
+            result_kinds[visit_stack[k] / SHEET_COLS][visit_stack[k] % SHEET_COLS] = RESULT_CYCLE;
+    }
+}
+
+// Function to work out the results of all formulas of the reference sheet.
+static void evaluate_reference(size_t num_rows) {
+    // Record the cells each well-formed formula reads.
+    num_edges = 0;
+    for (size_t row = 0; row < SHEET_ROWS; ++row) {
+        for (size_t col = 0; col < SHEET_COLS; ++col) {
+            size_t cell = row * SHEET_COLS + col;
+            edge_start[cell] = num_edges;
+            result_kinds[row][col] = RESULT_UNKNOWN;
+            visit_index[cell] = 0;
+            double unused;
+            well_formed[row][col] = row < num_rows && classify(texts[row][col]) == KIND_FORMULA &&
+                                    parse_formula(texts[row][col], false, &unused);
+            if (!well_formed[row][col])
+                num_edges = edge_start[cell];
+        }
+    }
+    edge_start[SHEET_ROWS * SHEET_COLS] = num_edges;
+
+    // Formulas on cycles are not evaluated at all.
+    next_visit = 0;
+    for (size_t cell = 0; cell < num_rows * SHEET_COLS; ++cell) {
+        if (visit_index[cell] == 0 && edge_start[cell + 1] > edge_start[cell])
+            find_component(cell);
+    }
+}
+
+// Function to format what the reference expects a cell to display.
+static Kind expected_display(size_t row, size_t col, char *text) {
+    const char *cell = texts[row][col];
+    char formatted[NUMBER_TEXT_MAX];
+    const char *shown = formatted;
+    Kind kind = classify(cell);
+    double value;
+
+    switch (kind) {
+        case KIND_EMPTY:
+            shown = "";
+            break;
+        case KIND_NUMBER:
+            number_format(strtod(cell, NULL), formatted);
+            break;
+        case KIND_STRING:
+            shown = cell;
+            break;
+        case KIND_FORMULA:
+            if (result_kinds[row][col] == RESULT_CYCLE)
+                shown = "#CYCLE";
+            else if (!cell_value(row, col, &value))
+                shown = "ERROR";
+            else
+                number_format_general(value, 6, formatted);
+            break;
+    }
+    snprintf(text, CELL_DISPLAY_WIDTH + 1, "%.*s", CELL_DISPLAY_WIDTH, shown);
+    return kind;
+}
+
+// Function to check whether a formula displays what the reference expects.
+//
+// Values may differ from the reference in their last bits, as the model adds
+// up large ranges in its own order, which can also change the last digit
+// displayed, or leave a tiny value where the reference has 0.
+static bool same_result(const char *expected, const char *actual) {
+    if (strcmp(expected, actual) == 0)
+        return true;
+    char *expected_end, *actual_end;
+    double a = strtod(expected, &expected_end), b = strtod(actual, &actual_end);
+    if (expected_end == expected || actual_end == actual || *expected_end != '\0' || *actual_end != '\0')
+        return false;
+    if (isnan(a) || isnan(b))
+        return isnan(a) && isnan(b);
+    double magnitude = fabs(a) > fabs(b) ? fabs(a) : fabs(b);
+    return fabs(a - b) <= 1e-9 + 1e-5 * magnitude;
+}
+
+// Function to bring the values of the cells up to date with the change feed.
+static void read_feed(Mode mode) {
+    const ChangeRecord *records;
+    size_t count;
+    while ((count = change_feed_peek(feed, &records)) > 0) {
+        for (size_t k = 0; k < count; ++k) {
+            const ChangeRecord *record = &records[k];
+            if (record->type == CHANGE_RESET) {
+                forget_values();
+            } else if (record->sheet == 0 && record->row < SHEET_ROWS && record->col < SHEET_COLS) {
+                values.types[record->row][record->col] = record->type;
+                values.numbers[record->row][record->col] = record->number;
+            }
+        }
+        change_feed_release(feed, count);
+    }
+    if (change_feed_dropped(feed) != 0)
+        fail(mode, "the change feed dropped %llu records", (unsigned long long)change_feed_dropped(feed));
+}
+
+// Function to compare the model with the reference, for the given rows or all.
+static void check(Mode mode, size_t num_rows) {
+    size_t used_rows = filled ? SHEET_ROWS : EDIT_ROWS;
+    evaluate_reference(used_rows);
+    if (num_rows > used_rows)
+        num_rows = used_rows;
+
+    for (size_t row = 0; row < used_rows; ++row) {
+        for (size_t col = 0; col < SHEET_COLS; ++col) {
+            // Cells keep the text they were given, except for numbers.
+            const char *expected_text = texts[row][col] != NULL ? texts[row][col] : "";
+            const char *text;
+            size_t length;
+            get_textual_value_view_at(row, col, &text, &length);
+            if (length != strlen(expected_text) || memcmp(text, expected_text, length) != 0)
+                fail(mode, "cell (%zu, %zu) has text \"%.*s\", expected \"%s\"", row, col, (int)length, text,
+                     expected_text);
+
+            if (row >= num_rows)
+                continue;
+            char expected[CELL_DISPLAY_WIDTH + 1];
+            Kind kind = expected_display(row, col, expected);
+            if (kind == KIND_FORMULA ? !same_result(expected, display[row][col])
+                                     : strcmp(expected, display[row][col]) != 0)
+                fail(mode, "cell (%zu, %zu) displays \"%s\", expected \"%s\"", row, col, display[row][col], expected);
+        }
+    }
+
+    // Every mode evaluates the same formulas in the same way, so their results
+    // are compared without any tolerance. Values reported in one mode only
+    // cannot be compared, as lazy mode reports fewer cells.
+    read_feed(mode);
+    if (num_checks == MAX_CHECKS)
+        return;
+    Seen *sequential = &sequential_seen[num_checks++];
+    if (mode == MODE_SEQUENTIAL) {
+        memcpy(sequential->displays, display, sizeof(Displays));
+        sequential->values = values;
+        return;
+    }
+    for (size_t row = 0; row < num_rows; ++row) {
+        for (size_t col = 0; col < SHEET_COLS; ++col) {
+            if (strcmp(sequential->displays[row][col], display[row][col]) != 0)
+                fail(mode, "cell (%zu, %zu) displays \"%s\", but \"%s\" in sequential mode", row, col,
+                     display[row][col], sequential->displays[row][col]);
+            uint8_t type = values.types[row][col], expected_type = sequential->values.types[row][col];
+            if (type == VALUE_UNKNOWN || expected_type == VALUE_UNKNOWN)
+                continue;
+            double number = values.numbers[row][col], expected_number = sequential->values.numbers[row][col];
+            if (type != expected_type ||
+                (type == CHANGE_NUMBER && memcmp(&number, &expected_number, sizeof(double)) != 0))
+                fail(mode, "cell (%zu, %zu) has value %.17g of type %u, but %.17g of type %u in sequential mode", row,
+                     col, number, type, expected_number, expected_type);
+        }
+    }
+}
+
+/* INPUT DECODING */
+
+// Bytes of the input not decoded yet; bytes past its end read as 0.
+typedef struct {
+    const uint8_t *data;
+    size_t size;
+} Input;
+
+static unsigned take(Input *input) {
+    if (input->size == 0)
+        return 0;
+    --input->size;
+    return *input->data++;
+}
+
+// Function to append to generated text, if there is room left.
+static void append(char *text, size_t size, const char *format, ...) {
+    size_t length = strlen(text);
+    va_list args;
+    va_start(args, format);
+    vsnprintf(text + length, size - length, format, args);
+    va_end(args);
+}
+
+// Function to generate the name of a cell, mostly one of the edited rows.
+static void generate_cell(Input *input, char *text, size_t size) {
+    unsigned choice = take(input);
+    if (choice % 16 == 0) {
+        // Cells outside the sheet make the formula malformed.
+        append(text, size, choice & 16 ? "G1" : "A1201");
+        return;
+    }
+    unsigned rows = choice % 16 == 1 ? SHEET_ROWS : EDIT_ROWS;
+    append(text, size, "%c%u", 'A' + take(input) % SHEET_COLS, 1 + take(input) % rows);
+}
+
+// Function to generate an expression of the formula grammar.
+static void generate_expression(Input *input, char *text, size_t size, int depth) {
+    static const char *operators[] = {"+", "-", "*", "/", "^", " + ", " - ", " * "};
+    static const char *functions[] = {"SUM", "MIN", "MAX", "AVERAGE", "COUNT"};
+    unsigned choice = take(input) % (depth > 3 ? 3 : 8);
+
+    switch (choice) {
+        case 0: {
+            // Tenths have no exact binary form, so results round like 0.1 + 0.2.
+            unsigned form = take(input) % 4;
+            if (form == 0)
+                append(text, size, "%u", take(input) % 10);
+            else if (form == 1)
+                append(text, size, "%u.5", take(input) % 10);
+            else
+                append(text, size, "%u.%u", form == 2 ? 0 : take(input) % 10, 1 + take(input) % 9);
+            break;
+        }
+        case 1:
+        case 2:
+            generate_cell(input, text, size);
+            break;
+        case 3:
+        case 4:
+            generate_expression(input, text, size, depth + 1);
+            append(text, size, "%s", operators[take(input) % 8]);
+            generate_expression(input, text, size, depth + 1);
+            break;
+        case 5:
+            append(text, size, "-");
+            generate_expression(input, text, size, depth + 1);
+            break;
+        case 6:
+            append(text, size, "(");
+            generate_expression(input, text, size, depth + 1);
+            append(text, size, ")");
+            break;
+        default: {
+            append(text, size, "%s(", functions[take(input) % 5]);
+            unsigned count = 1 + take(input) % 3;
+            for (unsigned k = 0; k < count; ++k) {
+                if (k > 0)
+                    append(text, size, take(input) & 1 ? ", " : ",");
+                if (take(input) & 1) {
+                    generate_cell(input, text, size);
+                    append(text, size, ":");
+                    generate_cell(input, text, size);
+                } else {
+                    generate_expression(input, text, size, depth + 1);
+                }
+            }
+            append(text, size, ")");
+            break;
+        }
+    }
+}
+
+// Function to generate the text of a cell: a number, a string or a formula.
+static void generate_text(Input *input, char *text, size_t size) {
+    text[0] = '\0';
+    unsigned choice = take(input) % 8;
+    if (choice == 0) {
+        unsigned whole = take(input) % 100;
+        if (take(input) & 1)
+            append(text, size, "%u.%u", whole, take(input) % 4 * 25);
+        else
+            append(text, size, "%u.%u", whole, take(input) % 10);
+    } else if (choice == 1) {
+        append(text, size, take(input) & 1 ? "label" : " x");
+    } else {
+        append(text, size, take(input) & 1 ? "=" : " = ");
+        generate_expression(input, text, size, 0);
+    }
+}
+
+// Function to generate text from random pieces of formulas, which is mostly malformed.
+static void generate_raw_text(Input *input, char *text, size_t size) {
+    static const char *pieces[] = {
+            "=", "+", "-", "*", "/", "^", "(", ")", ",", ":", " ", ".", "0", "1", "2", "7", "A1", "B2",
+            "C3", "F8", "A", "G1", "E9", "SUM(", "MIN(", "MAX(", "AVERAGE(", "COUNT(", "SUMX(", "x", "e", "\"",
+    };
+    size_t num_pieces = sizeof(pieces) / sizeof(pieces[0]);
+
+    text[0] = '\0';
+    if (take(input) % 4 != 0)
+        append(text, size, "=");
+    unsigned count = take(input) % 16;
+    for (unsigned k = 0; k < count; ++k)
+        append(text, size, "%s", pieces[take(input) % num_pieces]);
+}
+
+// Function to fill the cells below the edited rows with one of a few kinds of
+// formulas, as a single batch.
+static void fill(Input *input) {
+    unsigned kind = take(input) % 4;
+    log_operation("fill %u", kind);
+    for (size_t row = EDIT_ROWS; row < SHEET_ROWS; ++row) {
+        char text[64];
+        if (kind == 0)
+            snprintf(text, sizeof(text), "=A%zu*2+B1", 1 + row % EDIT_ROWS);
+        else if (kind == 1)
+            snprintf(text, sizeof(text), "=SUM(A1:C%zu)-C1/4", 1 + row % EDIT_ROWS);
+        else if (kind == 3)
+            snprintf(text, sizeof(text), "=SUM(A%zu:C%zu)+(B%zu+2)^0.5*3", row + 1, row + 1, row + 1);
+        else if (row % 16 == 0)
+            snprintf(text, sizeof(text), "=A1");
+        else
+            snprintf(text, sizeof(text), "=E%zu+1", row);
+        set_cell_value_at(row, FILL_COL, strdup(text));
+        reference_set(row, FILL_COL, text);
+    }
+    filled = true;
+}
+
+/* DRIVER */
+
+// Function to open a batch in the model and in the reference.
+static void begin_batch(void) {
+    model_begin_batch();
+    if (batch_depth++ == 0) {
+        batch_start = copy_texts();
+        batch_changed = false;
+    }
+}
+
+// Function to close a batch in the model and in the reference.
+static void commit_batch(void) {
+    model_commit_batch();
+    if (--batch_depth > 0)
+        return;
+    if (batch_changed) {
+        undo_steps[num_undo_steps++] = batch_start;
+        while (num_redo_steps > 0)
+            free_texts(redo_steps[--num_redo_steps]);
+    } else {
+        free_texts(batch_start);
+    }
+    batch_start = NULL;
+}
+
+// Function to start the model over with an empty sheet in a mode.
+static void start_mode(Mode mode) {
+    model_init_sized(SHEET_ROWS, SHEET_COLS);
+    read_feed(mode);
+    memset(display, 0, sizeof(display));
+    clear_reference();
+    log_length = 0;
+    num_checks = 0;
+
+    model_set_lazy(mode == MODE_LAZY);
+    model_set_viewport(0, 0, VIEWPORT_ROWS, SHEET_COLS);
+    model_set_threads(mode == MODE_THREADED ? 4 : 1);
+}
+
+// Function to bring every displayed cell up to date, as lazy mode only
+// displays the viewport after edits.
+static void redisplay(void) {
+    model_redisplay(0, 0, SHEET_ROWS, SHEET_COLS);
+}
+
+// Function to apply the operations of an input in a mode, checking the model after each.
+static void run_mode(const uint8_t *data, size_t size, Mode mode) {
+    Input input = {data, size};
+    start_mode(mode);
+    size_t shown_rows = mode == MODE_LAZY ? VIEWPORT_ROWS : SHEET_ROWS;
+
+    for (size_t step = 0; step < MAX_OPERATIONS && input.size > 0; ++step) {
+        unsigned op = take(&input) % 16;
+        size_t row = take(&input) % EDIT_ROWS, col = take(&input) % SHEET_COLS;
+        char text[256];
+
+        switch (op) {
+            case 0:
+            case 1:
+            case 2:
+            case 3:
+            case 4:
+            case 5:
+                generate_text(&input, text, sizeof(text));
+                log_operation("set (%zu, %zu) to \"%s\"", row, col, text);
+                set_cell_value_at(row, col, strdup(text));
+                reference_set(row, col, text);
+                break;
+            case 6:
+                generate_raw_text(&input, text, sizeof(text));
+                log_operation("set (%zu, %zu) to \"%s\"", row, col, text);
+                set_cell_value_at(row, col, strdup(text));
+                reference_set(row, col, text);
+                break;
+            case 7:
+                log_operation("clear (%zu, %zu)", row, col);
+                clear_cell_at(row, col);
+                reference_clear(row, col);
+                break;
+            case 8:
+                log_operation("begin batch");
+                begin_batch();
+                break;
+            case 9:
+                if (batch_depth == 0)
+                    break;
+                log_operation("commit batch");
+                commit_batch();
+                break;
+            case 10: {
+                log_operation("undo");
+                bool expected = batch_depth == 0 && num_undo_steps > 0;
+                if (model_undo() != expected)
+                    fail(mode, "undo gave %s", expected ? "false" : "true");
+                if (expected) {
+                    redo_steps[num_redo_steps++] = copy_texts();
+                    restore_texts(undo_steps[--num_undo_steps]);
+                }
+                break;
+            }
+            case 11: {
+                log_operation("redo");
+                bool expected = batch_depth == 0 && num_redo_steps > 0;
+                if (model_redo() != expected)
+                    fail(mode, "redo gave %s", expected ? "false" : "true");
+                if (expected) {
+                    undo_steps[num_undo_steps++] = copy_texts();
+                    restore_texts(redo_steps[--num_redo_steps]);
+                }
+                break;
+            }
+            case 12:
+                if (batch_depth > 0)
+                    break;
+                begin_batch();
+                fill(&input);
+                commit_batch();
+                break;
+            case 13:
+                // Files are loaded into a new sheet, which cannot undo what came before.
+                if (batch_depth > 0)
+                    break;
+                log_operation("CSV round trip");
+                if (!model_save_csv(CSV_PATH, ','))
+                    fail(mode, "could not save " CSV_PATH);
+                model_init_sized(SHEET_ROWS, SHEET_COLS);
+                memset(display, 0, sizeof(display));
+                if (!model_load_csv(CSV_PATH, ','))
+                    fail(mode, "could not load " CSV_PATH);
+                clear_history();
+                break;
+            case 14:
+                if (batch_depth > 0)
+                    break;
+                log_operation("snapshot round trip");
+                if (!model_save_snapshot(SNAPSHOT_PATH))
+                    fail(mode, "could not save " SNAPSHOT_PATH);
+                if (!model_open_snapshot(SNAPSHOT_PATH))
+                    fail(mode, "could not open " SNAPSHOT_PATH);
+                memset(display, 0, sizeof(display));
+                redisplay();
+                clear_history();
+                break;
+            default:
+                // Values are only settled outside batches.
+                log_operation("redisplay");
+                redisplay();
+                if (batch_depth == 0)
+                    check(mode, SHEET_ROWS);
+                break;
+        }
+
+        if (batch_depth == 0)
+            check(mode, shown_rows);
+    }
+
+    // Close what the input left open, and check every cell.
+    while (batch_depth > 0)
+        commit_batch();
+    redisplay();
+    check(mode, SHEET_ROWS);
+}
+
+// Function to run an input in every engine mode.
+static void run_input(const uint8_t *data, size_t size) {
+    input_data = data;
+    input_size = size;
+    if (sequential_seen == NULL) {
+        sequential_seen = malloc(MAX_CHECKS * sizeof(Seen));
+        if (sequential_seen == NULL)
+            abort();
+        feed = model_subscribe(1 << 16, 1 << 16);
+    }
+    for (Mode mode = 0; mode < NUM_MODES; ++mode)
+        run_mode(data, size, mode);
+    model_set_lazy(false);
+    model_set_threads(1);
+    remove(CSV_PATH);
+    remove(SNAPSHOT_PATH);
+}
+
+#ifdef FUZZ_LIBFUZZER
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    run_input(data, size);
+    return 0;
+}
+
+#else
+
+// Function to produce deterministic pseudo-random numbers (xorshift64).
+static uint64_t next_random(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+// Function to run an input saved in a file.
+static bool run_file(const char *path) {
+    FILE *stream = fopen(path, "rb");
+    if (stream == NULL)
+        return false;
+    static uint8_t data[1 << 16];
+    size_t size = fread(data, 1, sizeof(data), stream);
+    fclose(stream);
+    run_input(data, size);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    // Arguments are files with inputs to run again...
+    if (argc > 1 && !isdigit((unsigned char)argv[1][0])) {
+        for (int k = 1; k < argc; ++k) {
+            if (!run_file(argv[k])) {
+                fprintf(stderr, "fuzz: cannot read %s\n", argv[k]);
+                return 1;
+            }
+        }
+        printf("fuzz: %d inputs matched the reference in every mode\n", argc - 1);
+        return 0;
+    }
+
+    // ...or the number of random inputs and the seed generating them.
+    size_t count = argc > 1 ? strtoul(argv[1], NULL, 10) : 50;
+    uint64_t state = argc > 2 ? strtoull(argv[2], NULL, 10) : 1;
+    if (state == 0)
+        state = 1;
+
+    uint8_t data[1024];
+    for (size_t k = 0; k < count; ++k) {
+        size_t size = next_random(&state) % sizeof(data);
+        for (size_t i = 0; i < size; ++i)
+            data[i] = (uint8_t)(next_random(&state) >> 24);
+        run_input(data, size);
+    }
+    printf("fuzz: %zu inputs matched the reference in every mode\n", count);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,1118 @@
+#include "graph.h"
+#include "memory.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+// Marks an unused slot in the node hash table.
+#define EMPTY_SLOT UINT32_MAX
+
+// A cell taking part in at least one dependency edge.
+typedef struct {
+    // Key of the cell this node represents
+    CellKey key;
+    // Indices of the nodes this cell's formula reads
+    uint32_t *precedents;
+    // Number of entries in 'precedents'
+    size_t num_precedents;
+    // Indices of the nodes whose formulas read this cell
+    uint32_t *dependents;
+    // Number of entries in 'dependents'
+    size_t num_dependents;
+    // Allocated capacity of 'dependents'
+    size_t dependents_capacity;
+    // Traversal in which this node was last visited
+    uint32_t mark;
+    // Traversal in which 'level' was last computed
+    uint32_t level_mark;
+    // Recalculation level of the node in that traversal
+    uint32_t level;
+    // Whether the value of the cell is out of date, see graph_mark_dirty
+    bool dirty;
+    // Traversal in which the node was last visited by Tarjan's algorithm, and
+    // its visit number and lowest reachable visit number in that traversal
+    uint32_t scc_mark;
+    uint32_t scc_index;
+    uint32_t scc_low;
+    // Whether the node is on Tarjan's stack of unfinished components
+    bool on_stack;
+    // Whether the cell lies on a cycle, see graph_update_cycles
+    bool cyclic;
+    // Whether the precedents changed since the last graph_update_cycles
+    bool pending;
+    // Ranges of cells this cell's formula reads, kept out of 'precedents'
+    GraphRange *ranges;
+    // Number of entries in 'ranges'
+    size_t num_ranges;
+    // Gathering of neighbours in which this node was last listed
+    uint32_t gather_mark;
+    // Whether the node is on the list of free nodes, see release_node
+    bool unused;
+} DepNode;
+
+// Frame of the explicit stack used by the depth-first traversal.
+//
+// The neighbours of the node are gathered onto the neighbour stack when the
+// frame is pushed, after those of the frames below it.
+typedef struct {
+    // Index of the node being expanded
+    uint32_t node;
+    // Positions in the neighbour stack of the next neighbour to visit, and
+    // of the end of the node's neighbours
+    size_t next;
+    size_t end;
+} DfsFrame;
+
+// Marks the absence of a tree entry.
+#define NO_ENTRY UINT32_MAX
+
+// Entry of a range in the interval tree of one of the columns it covers.
+//
+// Each tree is a treap ordered by first row, with random priorities keeping
+// it balanced, where every entry also knows the last row of all ranges below
+// it. Ranges covering a row are then found without visiting subtrees ending
+// above it, or starting below it.
+typedef struct {
+    // Rows of the range, and the largest last row in this entry's subtree
+    uint32_t first_row;
+    uint32_t last_row;
+    uint32_t max_row;
+    // Index of the node reading the range
+    uint32_t dependent;
+    // Heap priority of the entry; parents have higher ones than children
+    uint32_t priority;
+    // Children of the entry; the next free entry for entries not in use
+    uint32_t left;
+    uint32_t right;
+} RangeEntry;
+
+// Node storage. Nodes are referred to by index so that growing the array does
+// not invalidate any edges.
+static DepNode *nodes = NULL;
+static size_t num_nodes = 0;
+static size_t nodes_capacity = 0;
+
+// Indices of the nodes released since they took part in no edges any more,
+// reused before the array grows.
+static uint32_t *free_nodes = NULL;
+static size_t num_free_nodes = 0;
+static size_t free_nodes_capacity = 0;
+
+// Open-addressing hash table mapping cell keys to node indices.
+static uint32_t *slots = NULL;
+static size_t slots_capacity = 0;
+
+// Counter used to tell apart visits of different traversals.
+static uint32_t current_mark = 0;
+
+// Scratch buffers reused by every traversal.
+static DfsFrame *dfs_stack = NULL;
+static size_t dfs_stack_capacity = 0;
+static CellKey *order_buffer = NULL;
+static size_t order_capacity = 0;
+// Number of cells in 'order_buffer' after the last traversal
+static size_t order_length = 0;
+static CellKey *level_order_buffer = NULL;
+static size_t level_order_capacity = 0;
+static uint32_t *position_levels = NULL;
+static size_t position_levels_capacity = 0;
+static size_t *level_starts = NULL;
+static size_t level_starts_capacity = 0;
+static uint32_t *dirty_stack = NULL;
+static size_t dirty_stack_capacity = 0;
+static CellKey *dependents_buffer = NULL;
+static size_t dependents_capacity = 0;
+static uint32_t *scc_stack = NULL;
+static size_t scc_stack_capacity = 0;
+
+// Nodes whose precedents changed since the last call to graph_update_cycles.
+static uint32_t *pending_cycles = NULL;
+static size_t num_pending_cycles = 0;
+static size_t pending_cycles_capacity = 0;
+
+// Cells that entered or left a cycle in the last call to graph_update_cycles.
+static CellKey *cycle_changes = NULL;
+static size_t num_cycle_changes = 0;
+static size_t cycle_changes_capacity = 0;
+
+// Neighbours gathered by traversals, see DfsFrame, and the counter telling
+// the gatherings apart.
+static uint32_t *neighbours = NULL;
+static size_t num_neighbours = 0;
+static size_t neighbours_capacity = 0;
+static uint32_t current_gather = 0;
+
+// Root entries of the range trees of the columns of a sheet.
+typedef struct {
+    uint32_t *roots;
+    size_t count;
+} ColumnTrees;
+
+// Storage of the range tree entries, with a list of free ones, and the trees
+// of the columns of each sheet.
+static RangeEntry *entries = NULL;
+static size_t num_entries = 0;
+static size_t entries_capacity = 0;
+static uint32_t free_entries = NO_ENTRY;
+static ColumnTrees *sheet_trees = NULL;
+static size_t num_sheet_trees = 0;
+
+// State of the generator of entry priorities (xorshift32).
+static uint32_t priority_state = 2463534242u;
+
+// Function to make sure a buffer can hold at least 'needed' elements.
+static void ensure_capacity(void **buffer, size_t *capacity, size_t needed, size_t element_size) {
+    if (needed <= *capacity)
+        return;
+
+    // Grow geometrically so that repeated calls stay amortized constant time.
+    size_t new_capacity = *capacity ? *capacity : 16;
+    while (new_capacity < needed)
+        new_capacity *= 2;
+
+    *buffer = checked_realloc(*buffer, new_capacity * element_size);
+    *capacity = new_capacity;
+}
+
+CellKey cell_key(size_t sheet, size_t row, size_t col) {
+    return ((CellKey)sheet << 48) | ((CellKey)row << 16) | (CellKey)col;
+}
+
+size_t key_sheet(CellKey key) {
+    return (size_t)(key >> 48);
+}
+
+size_t key_row(CellKey key) {
+    return (size_t)((key >> 16) & 0xffffffff);
+}
+
+size_t key_col(CellKey key) {
+    return (size_t)(key & 0xffff);
+}
+
+// Function to scramble a key so that neighbouring cells spread over the table.
+static size_t hash_key(CellKey key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return (size_t)key;
+}
+
+// Function to find the slot holding a key, or the empty slot where it belongs.
+static size_t find_slot(CellKey key) {
+    size_t mask = slots_capacity - 1;
+    size_t slot = hash_key(key) & mask;
+    while (slots[slot] != EMPTY_SLOT && nodes[slots[slot]].key != key)
+        slot = (slot + 1) & mask;
+    return slot;
+}
+
+// Function to double the hash table and reinsert all nodes.
+static void grow_slots(void) {
+    size_t new_capacity = slots_capacity ? 2 * slots_capacity : 64;
+
+    free(slots);
+    slots = checked_malloc(new_capacity * sizeof(uint32_t));
+    memset(slots, 0xff, new_capacity * sizeof(uint32_t));
+    slots_capacity = new_capacity;
+
+    for (uint32_t i = 0; i < num_nodes; ++i) {
+        if (!nodes[i].unused)
+            slots[find_slot(nodes[i].key)] = i;
+    }
+}
+
+// Function to look up the node of a cell without creating it.
+static bool lookup_node(CellKey key, uint32_t *index) {
+    if (slots_capacity == 0)
+        return false;
+
+    size_t slot = find_slot(key);
+    if (slots[slot] == EMPTY_SLOT)
+        return false;
+
+    *index = slots[slot];
+    return true;
+}
+
+// Function to look up the node of a cell, creating it if necessary.
+static uint32_t get_node(CellKey key) {
+    uint32_t index;
+    if (lookup_node(key, &index))
+        return index;
+
+    // Keep the load factor below one half.
+    if (2 * (num_nodes - num_free_nodes + 1) > slots_capacity)
+        grow_slots();
+
+    if (num_free_nodes > 0) {
+        index = free_nodes[--num_free_nodes];
+    } else {
+        ensure_capacity((void **)&nodes, &nodes_capacity, num_nodes + 1, sizeof(DepNode));
+        index = (uint32_t)num_nodes++;
+    }
+    nodes[index] = (DepNode){.key = key};
+    slots[find_slot(key)] = index;
+    return index;
+}
+
+// Function to release the node of a cell once it takes part in no edges, so
+// that cleared cells give back their memory and their slot.
+//
+// Nodes that are dirty, or whose cycles are yet to be updated, are kept until
+// they are cleaned or updated. The callers must not hold on to the index.
+static void release_node(uint32_t index) {
+    DepNode *node = &nodes[index];
+    if (node->unused || node->num_precedents > 0 || node->num_dependents > 0 || node->num_ranges > 0 ||
+        node->dirty || node->pending)
+        return;
+
+    // Linear probing finds keys by scanning from their hash up to an empty
+    // slot, so the keys after the hole that would no longer be found are
+    // shifted back into it.
+    size_t mask = slots_capacity - 1;
+    size_t hole = find_slot(node->key);
+    for (size_t slot = (hole + 1) & mask; slots[slot] != EMPTY_SLOT; slot = (slot + 1) & mask) {
+        size_t home = hash_key(nodes[slots[slot]].key) & mask;
+        if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+            slots[hole] = slots[slot];
+            hole = slot;
+        }
+    }
+    slots[hole] = EMPTY_SLOT;
+
+    free(node->precedents);
+    free(node->dependents);
+    free(node->ranges);
+    *node = (DepNode){.unused = true};
+    ensure_capacity((void **)&free_nodes, &free_nodes_capacity, num_free_nodes + 1, sizeof(uint32_t));
+    free_nodes[num_free_nodes++] = index;
+}
+
+// Function to record that 'dependent' reads 'precedent'.
+static void add_dependent(uint32_t precedent, uint32_t dependent) {
+    DepNode *node = &nodes[precedent];
+    ensure_capacity((void **)&node->dependents, &node->dependents_capacity, node->num_dependents + 1,
+                    sizeof(uint32_t));
+    node->dependents[node->num_dependents++] = dependent;
+}
+
+// Function to forget that 'dependent' reads 'precedent'.
+static void remove_dependent(uint32_t precedent, uint32_t dependent) {
+    DepNode *node = &nodes[precedent];
+    for (size_t i = 0; i < node->num_dependents; ++i) {
+        if (node->dependents[i] == dependent) {
+            // Order of dependents is irrelevant, so swap in the last one.
+            node->dependents[i] = node->dependents[--node->num_dependents];
+            return;
+        }
+    }
+}
+
+/* RANGE TREES */
+
+// Function to recompute the largest last row of an entry's subtree.
+static void update_max_row(uint32_t entry) {
+    RangeEntry *e = &entries[entry];
+    e->max_row = e->last_row;
+    if (e->left != NO_ENTRY && entries[e->left].max_row > e->max_row)
+        e->max_row = entries[e->left].max_row;
+    if (e->right != NO_ENTRY && entries[e->right].max_row > e->max_row)
+        e->max_row = entries[e->right].max_row;
+}
+
+// Function to order entries by first row, then by any other field, so that
+// every entry has a unique place in its tree.
+static bool entry_before(const RangeEntry *a, const RangeEntry *b) {
+    if (a->first_row != b->first_row)
+        return a->first_row < b->first_row;
+    if (a->dependent != b->dependent)
+        return a->dependent < b->dependent;
+    return a->last_row < b->last_row;
+}
+
+// Function to insert an entry into a tree, returning the new root.
+static uint32_t tree_insert(uint32_t root, uint32_t entry) {
+    if (root == NO_ENTRY)
+        return entry;
+
+    // Children with a higher priority are rotated above their parent.
+    RangeEntry *r = &entries[root];
+    if (entry_before(&entries[entry], r)) {
+        r->left = tree_insert(r->left, entry);
+        if (entries[r->left].priority > r->priority) {
+            uint32_t top = r->left;
+            r->left = entries[top].right;
+            entries[top].right = root;
+            update_max_row(root);
+            root = top;
+        }
+    } else {
+        r->right = tree_insert(r->right, entry);
+        if (entries[r->right].priority > r->priority) {
+            uint32_t top = r->right;
+            r->right = entries[top].left;
+            entries[top].left = root;
+            update_max_row(root);
+            root = top;
+        }
+    }
+    update_max_row(root);
+    return root;
+}
+
+// Function to join two trees, all of whose entries in 'left' come before
+// those in 'right', returning the new root.
+static uint32_t tree_merge(uint32_t left, uint32_t right) {
+    if (left == NO_ENTRY)
+        return right;
+    if (right == NO_ENTRY)
+        return left;
+    if (entries[left].priority > entries[right].priority) {
+        entries[left].right = tree_merge(entries[left].right, right);
+        update_max_row(left);
+        return left;
+    }
+    entries[right].left = tree_merge(left, entries[right].left);
+    update_max_row(right);
+    return right;
+}
+
+// Function to remove the entry equal to 'key' from a tree, returning the new
+// root. The entry is put on the free list.
+static uint32_t tree_remove(uint32_t root, const RangeEntry *key) {
+    if (root == NO_ENTRY)
+        return NO_ENTRY;
+    RangeEntry *r = &entries[root];
+    if (entry_before(key, r)) {
+        r->left = tree_remove(r->left, key);
+    } else if (entry_before(r, key)) {
+        r->right = tree_remove(r->right, key);
+    } else {
+        uint32_t merged = tree_merge(r->left, r->right);
+        r->left = free_entries;
+        free_entries = root;
+        return merged;
+    }
+    update_max_row(root);
+    return root;
+}
+
+// Function to add the nodes reading a row of a tree to the neighbour stack.
+static void tree_stab(uint32_t root, uint32_t row) {
+    while (root != NO_ENTRY) {
+        const RangeEntry *r = &entries[root];
+        if (r->max_row < row)
+            return;
+        tree_stab(r->left, row);
+
+        // Entries further right start at the same row or below.
+        if (r->first_row > row)
+            return;
+        if (r->last_row >= row && nodes[r->dependent].gather_mark != current_gather) {
+            nodes[r->dependent].gather_mark = current_gather;
+            ensure_capacity((void **)&neighbours, &neighbours_capacity, num_neighbours + 1, sizeof(uint32_t));
+            neighbours[num_neighbours++] = r->dependent;
+        }
+        root = r->right;
+    }
+}
+
+// Function to add a range read by a node to the trees of its columns.
+static void insert_range(const GraphRange *range, uint32_t dependent) {
+    if (range->sheet >= num_sheet_trees) {
+        size_t count = range->sheet + 1;
+        sheet_trees = checked_realloc(sheet_trees, count * sizeof(ColumnTrees));
+        for (size_t s = num_sheet_trees; s < count; ++s)
+            sheet_trees[s] = (ColumnTrees){NULL, 0};
+        num_sheet_trees = count;
+    }
+    ColumnTrees *trees = &sheet_trees[range->sheet];
+    if (range->last_col >= trees->count) {
+        size_t count = range->last_col + 1;
+        trees->roots = checked_realloc(trees->roots, count * sizeof(uint32_t));
+        for (size_t col = trees->count; col < count; ++col)
+            trees->roots[col] = NO_ENTRY;
+        trees->count = count;
+    }
+
+    for (size_t col = range->first_col; col <= range->last_col; ++col) {
+        uint32_t entry;
+        if (free_entries != NO_ENTRY) {
+            entry = free_entries;
+            free_entries = entries[entry].left;
+        } else {
+            ensure_capacity((void **)&entries, &entries_capacity, num_entries + 1, sizeof(RangeEntry));
+            entry = (uint32_t)num_entries++;
+        }
+        priority_state ^= priority_state << 13;
+        priority_state ^= priority_state >> 17;
+        priority_state ^= priority_state << 5;
+        entries[entry] = (RangeEntry){(uint32_t)range->first_row, (uint32_t)range->last_row,
+                                      (uint32_t)range->last_row, dependent, priority_state, NO_ENTRY, NO_ENTRY};
+        trees->roots[col] = tree_insert(trees->roots[col], entry);
+    }
+}
+
+// Function to remove a range read by a node from the trees of its columns.
+static void remove_range(const GraphRange *range, uint32_t dependent) {
+    RangeEntry key = {(uint32_t)range->first_row, (uint32_t)range->last_row, 0, dependent, 0, 0, 0};
+    ColumnTrees *trees = &sheet_trees[range->sheet];
+    for (size_t col = range->first_col; col <= range->last_col; ++col)
+        trees->roots[col] = tree_remove(trees->roots[col], &key);
+}
+
+// Function to compare two ranges, used to remove duplicate ones.
+static int compare_ranges(const void *a, const void *b) {
+    return memcmp(a, b, sizeof(GraphRange));
+}
+
+/* EDGES */
+
+// Function to compare two node indices, used to remove duplicate precedents.
+static int compare_indices(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+void graph_set_precedents(CellKey cell, const CellKey *precedents, size_t count, const GraphRange *ranges,
+                          size_t num_ranges) {
+    uint32_t index;
+
+    // A cell without a node has no precedents, so there is nothing to remove.
+    if (!lookup_node(cell, &index)) {
+        if (count == 0 && num_ranges == 0)
+            return;
+        index = get_node(cell);
+    }
+
+    // Cycles through the cell may appear or disappear.
+    if (!nodes[index].pending) {
+        nodes[index].pending = true;
+        ensure_capacity((void **)&pending_cycles, &pending_cycles_capacity, num_pending_cycles + 1,
+                        sizeof(uint32_t));
+        pending_cycles[num_pending_cycles++] = index;
+    }
+
+    // Detach the cell from its old precedents, which are released at the end
+    // if nothing else keeps them.
+    uint32_t *old_precedents = nodes[index].precedents;
+    size_t num_old_precedents = nodes[index].num_precedents;
+    for (size_t i = 0; i < num_old_precedents; ++i)
+        remove_dependent(old_precedents[i], index);
+    nodes[index].precedents = NULL;
+    nodes[index].num_precedents = 0;
+    for (size_t i = 0; i < nodes[index].num_ranges; ++i)
+        remove_range(&nodes[index].ranges[i], index);
+    free(nodes[index].ranges);
+    nodes[index].ranges = NULL;
+    nodes[index].num_ranges = 0;
+
+    // Ranges are stored as they are, however many cells they cover, each once.
+    if (num_ranges > 0) {
+        GraphRange *copy = checked_malloc(num_ranges * sizeof(GraphRange));
+        memcpy(copy, ranges, num_ranges * sizeof(GraphRange));
+        qsort(copy, num_ranges, sizeof(GraphRange), compare_ranges);
+        size_t unique = 0;
+        for (size_t i = 0; i < num_ranges; ++i) {
+            if (unique == 0 || memcmp(&copy[unique - 1], &copy[i], sizeof(GraphRange)) != 0)
+                copy[unique++] = copy[i];
+        }
+        for (size_t i = 0; i < unique; ++i)
+            insert_range(&copy[i], index);
+        nodes[index].ranges = copy;
+        nodes[index].num_ranges = unique;
+    }
+
+    if (count > 0) {
+        // Resolve the new precedents to node indices. Creating nodes may move
+        // the node array, so the cell's node is only accessed through its index.
+        uint32_t *resolved = checked_malloc(count * sizeof(uint32_t));
+        for (size_t i = 0; i < count; ++i)
+            resolved[i] = get_node(precedents[i]);
+
+        // Drop duplicates so every edge is recorded exactly once.
+        qsort(resolved, count, sizeof(uint32_t), compare_indices);
+        size_t unique = 0;
+        for (size_t i = 0; i < count; ++i) {
+            if (unique == 0 || resolved[unique - 1] != resolved[i])
+                resolved[unique++] = resolved[i];
+        }
+
+        // Attach the cell to its new precedents.
+        for (size_t i = 0; i < unique; ++i)
+            add_dependent(resolved[i], index);
+        nodes[index].precedents = resolved;
+        nodes[index].num_precedents = unique;
+    }
+
+    // The cell itself is pending, so it is only released by the update of
+    // the cycles.
+    for (size_t i = 0; i < num_old_precedents; ++i)
+        release_node(old_precedents[i]);
+    free(old_precedents);
+}
+
+/* TRAVERSALS */
+
+// Function to append a key to the output order.
+static void emit(size_t *length, CellKey key) {
+    ensure_capacity((void **)&order_buffer, &order_capacity, *length + 1, sizeof(CellKey));
+    order_buffer[(*length)++] = key;
+}
+
+// Function to start a new traversal; on wrap-around, stale marks are cleared.
+static void start_traversal(void) {
+    if (++current_mark == 0) {
+        for (size_t i = 0; i < num_nodes; ++i)
+            nodes[i].mark = nodes[i].level_mark = nodes[i].scc_mark = 0;
+        current_mark = 1;
+    }
+    num_neighbours = 0;
+}
+
+// Function to start listing neighbours; on wrap-around, stale marks are cleared.
+static void start_gather(void) {
+    if (++current_gather == 0) {
+        for (size_t i = 0; i < num_nodes; ++i)
+            nodes[i].gather_mark = 0;
+        current_gather = 1;
+    }
+}
+
+// Function to add a node to the neighbour stack, unless it is listed already.
+static void gather(uint32_t index) {
+    if (nodes[index].gather_mark == current_gather)
+        return;
+    nodes[index].gather_mark = current_gather;
+    ensure_capacity((void **)&neighbours, &neighbours_capacity, num_neighbours + 1, sizeof(uint32_t));
+    neighbours[num_neighbours++] = index;
+}
+
+// Function to add the nodes reading a cell to the neighbour stack, each once:
+// those reading it directly, if the cell has node 'index', and those reading
+// a range covering it, found in the tree of its column of its sheet.
+static void gather_dependents(CellKey key, uint32_t index) {
+    start_gather();
+    if (index != EMPTY_SLOT) {
+        const DepNode *node = &nodes[index];
+        for (size_t i = 0; i < node->num_dependents; ++i)
+            gather(node->dependents[i]);
+    }
+
+    size_t sheet = key_sheet(key), col = key_col(key);
+    if (sheet < num_sheet_trees && col < sheet_trees[sheet].count)
+        tree_stab(sheet_trees[sheet].roots[col], (uint32_t)key_row(key));
+}
+
+// Function to add the nodes a node reads to the neighbour stack, each once.
+//
+// Only cells with nodes can be of interest to a traversal, so the cells of a
+// range are looked up one by one, or, for ranges covering more cells than
+// there are nodes, all nodes are checked for lying in the range instead.
+static void gather_precedents(uint32_t index) {
+    start_gather();
+    const DepNode *node = &nodes[index];
+    for (size_t i = 0; i < node->num_precedents; ++i)
+        gather(node->precedents[i]);
+
+    for (size_t r = 0; r < node->num_ranges; ++r) {
+        const GraphRange *range = &node->ranges[r];
+        size_t area = (size_t)(range->last_row - range->first_row + 1) * (range->last_col - range->first_col + 1);
+        if (area > num_nodes) {
+            for (uint32_t i = 0; i < num_nodes; ++i) {
+                size_t row = key_row(nodes[i].key), col = key_col(nodes[i].key);
+                if (!nodes[i].unused && key_sheet(nodes[i].key) == range->sheet && row >= range->first_row && row <= range->last_row &&
+                    col >= range->first_col && col <= range->last_col)
+                    gather(i);
+            }
+            continue;
+        }
+        for (size_t col = range->first_col; col <= range->last_col; ++col) {
+            for (size_t row = range->first_row; row <= range->last_row; ++row) {
+                uint32_t found;
+                if (lookup_node(cell_key(range->sheet, row, col), &found))
+                    gather(found);
+            }
+        }
+    }
+}
+
+// Function to push a frame for a node onto the traversal stack, gathering
+// its dependents, or its precedents.
+static void push_frame(size_t *depth, uint32_t index, bool dependents) {
+    size_t begin = num_neighbours;
+    if (dependents)
+        gather_dependents(nodes[index].key, index);
+    else
+        gather_precedents(index);
+    ensure_capacity((void **)&dfs_stack, &dfs_stack_capacity, *depth + 1, sizeof(DfsFrame));
+    dfs_stack[(*depth)++] = (DfsFrame){index, begin, num_neighbours};
+}
+
+// Function to pop the top frame of the traversal stack along with its neighbours.
+static void pop_frame(size_t *depth) {
+    --*depth;
+    num_neighbours = *depth > 0 ? dfs_stack[*depth - 1].end : 0;
+}
+
+size_t graph_recalc_order(const CellKey *changed, size_t count, const CellKey **order) {
+    size_t length = 0;
+
+    start_traversal();
+
+    // The traversal collects cells in post-order (every cell after all of its
+    // dependents), which is reversed at the end.
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t root;
+
+        if (!lookup_node(changed[i], &root)) {
+            // The cell takes part in no formula, unless a range covers it; it
+            // then gets a node to start the traversal from.
+            gather_dependents(changed[i], EMPTY_SLOT);
+            bool read = num_neighbours > 0;
+            num_neighbours = 0;
+            if (!read) {
+                emit(&length, changed[i]);
+                continue;
+            }
+            root = get_node(changed[i]);
+        }
+        if (nodes[root].mark == current_mark)
+            continue;
+
+        size_t depth = 0;
+        nodes[root].mark = current_mark;
+        push_frame(&depth, root, true);
+
+        while (depth > 0) {
+            DfsFrame *frame = &dfs_stack[depth - 1];
+
+            if (frame->next < frame->end) {
+                uint32_t next = neighbours[frame->next++];
+
+                // Each cell is visited once, which also stops the traversal
+                // from looping forever on circular references.
+                if (nodes[next].mark != current_mark) {
+                    nodes[next].mark = current_mark;
+                    push_frame(&depth, next, true);
+                }
+            } else {
+                // All dependents are done, so the cell itself can be emitted.
+                emit(&length, nodes[frame->node].key);
+                pop_frame(&depth);
+            }
+        }
+
+        // A node made for a cell read through ranges only is no longer needed.
+        release_node(root);
+    }
+
+    // Reverse the post-order to obtain a topological order.
+    for (size_t i = 0; i < length / 2; ++i) {
+        CellKey temp = order_buffer[i];
+        order_buffer[i] = order_buffer[length - 1 - i];
+        order_buffer[length - 1 - i] = temp;
+    }
+
+    order_length = length;
+    *order = order_buffer;
+    return length;
+}
+
+bool graph_has_dependents(CellKey cell) {
+    uint32_t index;
+    if (lookup_node(cell, &index) && nodes[index].num_dependents > 0)
+        return true;
+
+    // Otherwise, only ranges can read the cell.
+    size_t begin = num_neighbours;
+    gather_dependents(cell, EMPTY_SLOT);
+    bool read = num_neighbours > begin;
+    num_neighbours = begin;
+    return read;
+}
+
+// Function to number a node for Tarjan's algorithm and push it onto the
+// traversal stack and the stack of unfinished components.
+static void push_component_frame(size_t *depth, uint32_t index, uint32_t *counter, size_t *scc_depth) {
+    DepNode *node = &nodes[index];
+    node->scc_mark = current_mark;
+    node->scc_index = node->scc_low = (*counter)++;
+    node->on_stack = true;
+    ensure_capacity((void **)&scc_stack, &scc_stack_capacity, *scc_depth + 1, sizeof(uint32_t));
+    scc_stack[(*scc_depth)++] = index;
+    push_frame(depth, index, true);
+}
+
+// Function to run Tarjan's algorithm from a node, over the dependent edges
+// between nodes visited by the current traversal.
+//
+// Every strongly connected component found this way is a set of cells all
+// reading each other; those of more than one cell, or of a cell reading
+// itself, are cycles. Following dependents rather than precedents finds the
+// same components, and ranges are much cheaper to follow that way.
+static void find_components(uint32_t root, uint32_t *counter, size_t *scc_depth) {
+    size_t depth = 0;
+    push_component_frame(&depth, root, counter, scc_depth);
+
+    while (depth > 0) {
+        DfsFrame *frame = &dfs_stack[depth - 1];
+        DepNode *node = &nodes[frame->node];
+
+        if (frame->next < frame->end) {
+            uint32_t next = neighbours[frame->next++];
+            DepNode *target = &nodes[next];
+
+            // Nodes outside the traversal cannot lie on a cycle through it.
+            if (target->mark != current_mark)
+                continue;
+            if (target->scc_mark != current_mark)
+                push_component_frame(&depth, next, counter, scc_depth);
+            else if (target->on_stack && target->scc_index < node->scc_low)
+                node->scc_low = target->scc_index;
+            continue;
+        }
+
+        // The node is the root of a component: pop the component off the stack.
+        if (node->scc_low == node->scc_index) {
+            size_t first = *scc_depth;
+            do
+                --first;
+            while (scc_stack[first] != frame->node);
+
+            // The node's dependents are still on top of the neighbour stack.
+            bool cycle = *scc_depth - first > 1;
+            size_t begin = depth > 1 ? dfs_stack[depth - 2].end : 0;
+            for (size_t i = begin; i < frame->end && !cycle; ++i)
+                cycle = neighbours[i] == frame->node;
+            for (size_t i = first; i < *scc_depth; ++i) {
+                DepNode *member = &nodes[scc_stack[i]];
+                member->on_stack = false;
+                if (member->cyclic != cycle) {
+                    ensure_capacity((void **)&cycle_changes, &cycle_changes_capacity, num_cycle_changes + 1,
+                                    sizeof(CellKey));
+                    cycle_changes[num_cycle_changes++] = member->key;
+                }
+                member->cyclic = cycle;
+            }
+            *scc_depth = first;
+        }
+
+        // Hand the lowest visit number on to the node that reached this one.
+        uint32_t low = node->scc_low;
+        pop_frame(&depth);
+        if (depth > 0 && low < nodes[dfs_stack[depth - 1].node].scc_low)
+            nodes[dfs_stack[depth - 1].node].scc_low = low;
+    }
+}
+
+size_t graph_update_cycles(const CellKey **changed) {
+    *changed = cycle_changes;
+    num_cycle_changes = 0;
+    if (num_pending_cycles == 0)
+        return 0;
+
+    // A cycle through a node consists of nodes depending on it, so only the
+    // dependents of the changed nodes can change whether they are on cycles.
+    start_traversal();
+    size_t count = 0;
+    for (size_t i = 0; i < num_pending_cycles; ++i) {
+        uint32_t root = pending_cycles[i];
+        nodes[root].pending = false;
+        if (nodes[root].mark == current_mark)
+            continue;
+        nodes[root].mark = current_mark;
+        ensure_capacity((void **)&dirty_stack, &dirty_stack_capacity, count + 1, sizeof(uint32_t));
+        dirty_stack[count++] = root;
+    }
+    num_pending_cycles = 0;
+
+    // Collect all of them, keeping them in the buffer.
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t index = dirty_stack[i];
+        gather_dependents(nodes[index].key, index);
+        for (size_t j = 0; j < num_neighbours; ++j) {
+            uint32_t next = neighbours[j];
+            if (nodes[next].mark == current_mark)
+                continue;
+            nodes[next].mark = current_mark;
+            ensure_capacity((void **)&dirty_stack, &dirty_stack_capacity, count + 1, sizeof(uint32_t));
+            dirty_stack[count++] = next;
+        }
+        num_neighbours = 0;
+    }
+
+    // Their components are the same as in the whole graph.
+    uint32_t counter = 0;
+    size_t scc_depth = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (nodes[dirty_stack[i]].scc_mark != current_mark)
+            find_components(dirty_stack[i], &counter, &scc_depth);
+    }
+
+    // Cells that were cleared only kept their nodes until now.
+    for (size_t i = 0; i < count; ++i)
+        release_node(dirty_stack[i]);
+    *changed = cycle_changes;
+    return num_cycle_changes;
+}
+
+bool graph_in_cycle(CellKey cell) {
+    uint32_t index;
+    return lookup_node(cell, &index) && nodes[index].cyclic;
+}
+
+size_t graph_dependents(CellKey cell, const CellKey **dependents) {
+    uint32_t index;
+    size_t begin = num_neighbours;
+    gather_dependents(cell, lookup_node(cell, &index) ? index : EMPTY_SLOT);
+
+    size_t count = num_neighbours - begin;
+    ensure_capacity((void **)&dependents_buffer, &dependents_capacity, count, sizeof(CellKey));
+    for (size_t i = 0; i < count; ++i)
+        dependents_buffer[i] = nodes[neighbours[begin + i]].key;
+    num_neighbours = begin;
+
+    *dependents = dependents_buffer;
+    return count;
+}
+
+// Function to mark the dependents gathered on the neighbour stack dirty,
+// pushing the ones that were not onto the dirty stack.
+static void mark_gathered_dirty(size_t begin, size_t *depth) {
+    for (size_t j = begin; j < num_neighbours; ++j) {
+        uint32_t next = neighbours[j];
+        if (nodes[next].dirty)
+            continue;
+        nodes[next].dirty = true;
+        ensure_capacity((void **)&dirty_stack, &dirty_stack_capacity, *depth + 1, sizeof(uint32_t));
+        dirty_stack[(*depth)++] = next;
+    }
+    num_neighbours = begin;
+}
+
+void graph_mark_dirty(const CellKey *cells, size_t count) {
+    size_t depth = 0;
+    size_t begin = num_neighbours;
+
+    // Cells that are dirty already have dirty dependents, so the marking
+    // stops at them; repeated edits of the same region cost next to nothing.
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t index;
+        if (!lookup_node(cells[i], &index)) {
+            // Cells without a node may still be read through ranges.
+            gather_dependents(cells[i], EMPTY_SLOT);
+            mark_gathered_dirty(begin, &depth);
+        } else if (!nodes[index].dirty) {
+            nodes[index].dirty = true;
+            ensure_capacity((void **)&dirty_stack, &dirty_stack_capacity, depth + 1, sizeof(uint32_t));
+            dirty_stack[depth++] = index;
+        }
+
+        while (depth > 0) {
+            uint32_t next = dirty_stack[--depth];
+            gather_dependents(nodes[next].key, next);
+            mark_gathered_dirty(begin, &depth);
+        }
+    }
+}
+
+bool graph_is_dirty(CellKey cell) {
+    uint32_t index;
+    return lookup_node(cell, &index) && nodes[index].dirty;
+}
+
+// Function to emit a dirty node after its dirty precedents, marking them all clean.
+static void clean_from(uint32_t root, size_t *length) {
+    if (!nodes[root].dirty || nodes[root].mark == current_mark)
+        return;
+
+    // Clean cells only read clean cells, so only dirty precedents are
+    // followed. The post-order puts every cell after the cells it reads.
+    size_t depth = 0;
+    nodes[root].mark = current_mark;
+    push_frame(&depth, root, false);
+
+    while (depth > 0) {
+        DfsFrame *frame = &dfs_stack[depth - 1];
+
+        if (frame->next < frame->end) {
+            uint32_t next = neighbours[frame->next++];
+            if (nodes[next].dirty && nodes[next].mark != current_mark) {
+                nodes[next].mark = current_mark;
+                push_frame(&depth, next, false);
+            }
+        } else {
+            // Nodes only kept for being dirty are released once they are not.
+            uint32_t index = frame->node;
+            nodes[index].dirty = false;
+            emit(length, nodes[index].key);
+            pop_frame(&depth);
+            release_node(index);
+        }
+    }
+}
+
+size_t graph_clean_order(const CellKey *cells, size_t count, const CellKey **order) {
+    size_t length = 0;
+
+    start_traversal();
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t root;
+        if (lookup_node(cells[i], &root))
+            clean_from(root, &length);
+    }
+
+    order_length = length;
+    *order = order_buffer;
+    return length;
+}
+
+size_t graph_clean_all(const CellKey **order) {
+    size_t length = 0;
+
+    start_traversal();
+    for (uint32_t i = 0; i < num_nodes; ++i)
+        clean_from(i, &length);
+
+    order_length = length;
+    *order = order_buffer;
+    return length;
+}
+
+size_t graph_recalc_levels(const CellKey **order, const size_t **starts) {
+    const CellKey *topological = order_buffer;
+    size_t length = order_length;
+    uint32_t max_level = 0;
+
+    ensure_capacity((void **)&position_levels, &position_levels_capacity, length, sizeof(uint32_t));
+    ensure_capacity((void **)&level_order_buffer, &level_order_capacity, length, sizeof(CellKey));
+
+    // The cells of the order were all visited by its traversal.
+    for (size_t i = 0; i < length; ++i) {
+        uint32_t index;
+        if (lookup_node(topological[i], &index))
+            nodes[index].level = 0;
+    }
+
+    // Walking the cells in topological order, each cell's level is final once
+    // it is reached, and is one more than the highest level of the precedents
+    // it has to wait for; every cell raises the levels of its dependents to
+    // above its own. Dependents reached already are only possible on circular
+    // references, which are ignored, so every cell still gets a level.
+    for (size_t i = 0; i < length; ++i) {
+        uint32_t index = EMPTY_SLOT, level = 0;
+
+        // Cells without nodes read nothing, but may still be read through
+        // ranges, as their nodes are released after the traversal.
+        if (lookup_node(topological[i], &index)) {
+            level = nodes[index].level;
+            nodes[index].level_mark = current_mark;
+        }
+        gather_dependents(topological[i], index);
+        for (size_t j = 0; j < num_neighbours; ++j) {
+            DepNode *dependent = &nodes[neighbours[j]];
+            if (dependent->mark == current_mark && dependent->level_mark != current_mark &&
+                dependent->level < level + 1)
+                dependent->level = level + 1;
+        }
+        num_neighbours = 0;
+
+        position_levels[i] = level;
+        if (level > max_level)
+            max_level = level;
+    }
+
+    // Group the cells by level with a counting sort, which keeps the
+    // topological order within each level.
+    size_t levels = length > 0 ? (size_t)max_level + 1 : 0;
+    ensure_capacity((void **)&level_starts, &level_starts_capacity, levels + 1, sizeof(size_t));
+    memset(level_starts, 0, (levels + 1) * sizeof(size_t));
+    for (size_t i = 0; i < length; ++i)
+        ++level_starts[position_levels[i] + 1];
+    for (size_t level = 0; level < levels; ++level)
+        level_starts[level + 1] += level_starts[level];
+    for (size_t i = 0; i < length; ++i)
+        level_order_buffer[level_starts[position_levels[i]]++] = topological[i];
+
+    // Placing the cells advanced each start to the next level's; shift back.
+    for (size_t level = levels; level > 0; --level)
+        level_starts[level] = level_starts[level - 1];
+    level_starts[0] = 0;
+
+    *order = level_order_buffer;
+    *starts = level_starts;
+    return levels;
+}
+
+size_t graph_num_nodes(void) {
+    return num_nodes - num_free_nodes;
+}
+
+void graph_reset(void) {
+    for (size_t i = 0; i < num_nodes; ++i) {
+        free(nodes[i].precedents);
+        free(nodes[i].dependents);
+        free(nodes[i].ranges);
+    }
+    free(nodes);
+    free(free_nodes);
+    free(slots);
+    free(dfs_stack);
+    free(order_buffer);
+    free(level_order_buffer);
+    free(position_levels);
+    free(level_starts);
+    free(dirty_stack);
+    free(dependents_buffer);
+    free(scc_stack);
+    free(pending_cycles);
+    free(cycle_changes);
+    free(neighbours);
+    free(entries);
+    for (size_t s = 0; s < num_sheet_trees; ++s)
+        free(sheet_trees[s].roots);
+    free(sheet_trees);
+
+    nodes = NULL;
+    num_nodes = nodes_capacity = 0;
+    free_nodes = NULL;
+    num_free_nodes = free_nodes_capacity = 0;
+    slots = NULL;
+    slots_capacity = 0;
+    dfs_stack = NULL;
+    dfs_stack_capacity = 0;
+    order_buffer = NULL;
+    order_capacity = 0;
+    order_length = 0;
+    level_order_buffer = NULL;
+    level_order_capacity = 0;
+    position_levels = NULL;
+    position_levels_capacity = 0;
+    level_starts = NULL;
+    level_starts_capacity = 0;
+    dirty_stack = NULL;
+    dirty_stack_capacity = 0;
+    dependents_buffer = NULL;
+    dependents_capacity = 0;
+    scc_stack = NULL;
+    scc_stack_capacity = 0;
+    pending_cycles = NULL;
+    num_pending_cycles = pending_cycles_capacity = 0;
+    cycle_changes = NULL;
+    num_cycle_changes = cycle_changes_capacity = 0;
+    neighbours = NULL;
+    num_neighbours = neighbours_capacity = 0;
+    current_gather = 0;
+    entries = NULL;
+    num_entries = entries_capacity = 0;
+    free_entries = NO_ENTRY;
+    sheet_trees = NULL;
+    num_sheet_trees = 0;
+    current_mark = 0;
+}
@@ -0,0 +1,125 @@
+#ifndef ASSIGNMENT_GRAPH_H
+#define ASSIGNMENT_GRAPH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Identifies a cell within the dependency graph.
+//
+// Keys are made from the position of a cell by 'cell_key', which the graph
+// relies on to find the ranges covering a cell.
+typedef uint64_t CellKey;
+
+// Encodes the position of a cell as a key: the index of its sheet, below
+// 65536, its row and its column.
+CellKey cell_key(size_t sheet, size_t row, size_t col);
+
+// Decodes the sheet, the row and the column of a cell from its key.
+size_t key_sheet(CellKey key);
+size_t key_row(CellKey key);
+size_t key_col(CellKey key);
+
+// Rectangular block of cells of one sheet read by a formula, including both
+// corners.
+typedef struct {
+    uint32_t sheet;
+    uint32_t first_row;
+    uint32_t first_col;
+    uint32_t last_row;
+    uint32_t last_col;
+} GraphRange;
+
+// Replaces the precedents of a cell, i.e. the cells its formula reads: the
+// cells 'precedents', and all cells covered by 'ranges'.
+//
+// The matching dependent edges are updated as well. Passing counts of zero
+// removes all precedents, which is what happens when a formula is overwritten
+// by a literal or cleared. Duplicate keys and ranges are allowed and are only
+// recorded once.
+//
+// Ranges are not broken up into cells: each is kept in an interval tree of
+// every column it spans on its sheet, so that it takes the same memory however
+// many rows it covers, and the formulas reading a cell through ranges are
+// found in time logarithmic in the number of ranges of its column, plus the
+// time to list them.
+void graph_set_precedents(CellKey cell, const CellKey *precedents, size_t count, const GraphRange *ranges,
+                          size_t num_ranges);
+
+// Returns whether any formula reads a cell.
+bool graph_has_dependents(CellKey cell);
+
+// Finds out again which cells lie on cycles of formulas reading each other,
+// after precedents were set.
+//
+// Only the cells depending on cells whose precedents changed since the last
+// call are visited, as no other cells can enter or leave a cycle; Tarjan's
+// algorithm then finds their strongly connected components in time linear in
+// their number and the number of edges between them.
+//
+// Returns the number of cells that entered or left a cycle, and points
+// 'changed' at them; the array is owned by the graph and is only valid until
+// the next call.
+size_t graph_update_cycles(const CellKey **changed);
+
+// Returns whether a cell lies on a cycle, as of the last 'graph_update_cycles'.
+bool graph_in_cycle(CellKey cell);
+
+// Lists the cells whose formulas read a cell, each once.
+//
+// The returned array is owned by the graph and is only valid until the next
+// call to this function or to a function changing the graph. Unlike the other
+// queries, it leaves the arrays returned by the functions below intact.
+size_t graph_dependents(CellKey cell, const CellKey **dependents);
+
+// Computes the order in which cells must be recalculated after the cells in
+// 'changed' were modified.
+//
+// The result contains the changed cells and all of their transitive
+// dependents, each exactly once, ordered so that every cell appears after all
+// of the cells it depends on. The returned array is owned by the graph and is
+// only valid until the next call to a graph function.
+size_t graph_recalc_order(const CellKey *changed, size_t count, const CellKey **order);
+
+// Groups the cells returned by the last call to 'graph_recalc_order' by level,
+// returning the number of levels.
+//
+// Cells of level 0 depend on none of the other cells, and every other cell
+// depends on at least one cell of the level just below its own; cells of the
+// same level never depend on each other, so they can be recalculated in any
+// order, or at the same time. Level 'k' consists of the entries 'starts[k]' to
+// 'starts[k + 1] - 1' of 'order'. The arrays are owned by the graph and are
+// only valid until the next call to a graph function.
+size_t graph_recalc_levels(const CellKey **order, const size_t **starts);
+
+// Marks the given cells and all of their transitive dependents as dirty, i.e.
+// as having out-of-date values. Cells without edges are not marked.
+//
+// The dependents of a dirty cell are always dirty, so the marking stops at
+// cells that are dirty already.
+void graph_mark_dirty(const CellKey *cells, size_t count);
+
+// Returns whether a cell is dirty.
+bool graph_is_dirty(CellKey cell);
+
+// Computes the order in which the dirty cells among 'cells', and the dirty
+// cells they transitively depend on, must be recalculated, and marks them
+// clean.
+//
+// Every cell appears after all of the cells it depends on. The returned array
+// is owned by the graph and is only valid until the next call to a graph
+// function.
+size_t graph_clean_order(const CellKey *cells, size_t count, const CellKey **order);
+
+// Like 'graph_clean_order' for all of the dirty cells of the graph.
+size_t graph_clean_all(const CellKey **order);
+
+// Returns the number of nodes of the graph, i.e. of cells taking part in
+// edges. The nodes of cells are released once they take part in no edges, and
+// are neither dirty nor waiting for 'graph_update_cycles'.
+size_t graph_num_nodes(void);
+
+// Removes all nodes and edges from the graph and releases its memory.
+void graph_reset(void);
+
+#endif //ASSIGNMENT_GRAPH_H
@@ -4,20 +4,26 @@
 #include <ctype.h>
 #include <errno.h>
 #include <ncurses.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 
+#ifdef MODEL_THREADS
+#include <pthread.h>
+#include <time.h>
+#endif
+
 #define MAX_LEN 256
 
 #define DEFAULT_EDIT_SIZE 256
 
 // Current cur_row and column.
-static ROW cur_row = ROW_1;
-static COL cur_col = COL_A;
+static size_t cur_row = 0;
+static size_t cur_col = 0;
 
 // Column to return to when pressing <enter>.
-static COL return_col = COL_A;
+static size_t return_col = 0;
 
 // Current editable text.
 static char *edit_text = NULL;
@@ -26,9 +32,792 @@ static size_t edit_text_length = 0;
 static size_t edit_position = 0;
 static size_t edit_display_offset = 0;
 
+// Screen line of the first row of cells, below the edit field and the
+// column headers.
+#define FIRST_CELL_LINE 5
+
+// Viewport: the first row and column shown, and how many rows and columns
+// fit on the terminal. Only the cells of the viewport are drawn.
+static size_t top_row = 0;
+static size_t left_col = 0;
+static size_t visible_rows = 1;
+static size_t visible_cols = 1;
+
+// Width of the grid on the screen, including its borders.
+static size_t total_width = 0;
+
+// Text a cell of the viewport shows on the screen.
+typedef struct {
+    // Whether the screen is known to show 'text' there
+    bool valid;
+    char text[CELL_DISPLAY_WIDTH + 1];
+} ShownCell;
+
+// What the cells of the viewport show, row by row by their position on the
+// screen, so that only the cells whose text changed are written again.
+static ShownCell *shown_cells = NULL;
+
+// Size of the sheet, which never changes while the interface runs.
+static size_t sheet_rows = 0;
+static size_t sheet_cols = 0;
+
+// Text at the bottom of the screen.
+static const char *footer = "";
+
+// Shown after the footer while the sheet on the screen is out of date.
+#define CALCULATING "Calculating..."
+
+// Snapshot given on the command line, or NULL.
+static const char *snapshot_path = NULL;
+
+#ifdef MODEL_STATS
+
+// Number of lines below the footer, holding the cost of the last edit.
+#define STATUS_LINES 1
+
+#else
+
+#define STATUS_LINES 0
+
+#endif
+
+/* BACKGROUND RECALCULATION */
+
+// In builds with MODEL_THREADS, a worker thread owns the model: the input loop
+// only queues commands for it and draws the cells it last published, so that
+// typing and moving around never wait for a recalculation. Without threads,
+// the commands run as soon as they are queued.
+
+// Time between checks for a newly published view, in milliseconds. Keys are
+// handled within this time however large the sheet is.
+#define FRAME_MS 16
+
+#ifdef MODEL_THREADS
+#define LOCK(lock) pthread_mutex_lock(&(lock))
+#define UNLOCK(lock) pthread_mutex_unlock(&(lock))
+#else
+#define LOCK(lock) ((void)0)
+#define UNLOCK(lock) ((void)0)
+#endif
+
+// What a view holds of a cell.
+typedef struct {
+    // Display text of the cell
+    char display[CELL_DISPLAY_WIDTH + 1];
+    // Text the cell was given, cut short like 'get_textual_value_at' does;
+    // empty if the cell is
+    char text[MAX_LEN];
+    // Whether the cell changed since the view was last published
+    bool changed;
+} ViewCell;
+
+// The cells of a region of the sheet, as calculated by the model.
+typedef struct {
+    // Region of the sheet held by the view
+    size_t row, col, num_rows, num_cols;
+    // Cells of the region, row by row, and the number of them allocated
+    ViewCell *cells;
+    size_t capacity;
+    // Positions of the cells that changed since the view was last published,
+    // unless it moved meanwhile, in which case all cells are published
+    size_t *changed;
+    size_t num_changed;
+    size_t changed_capacity;
+    bool moved;
+    // Version of the last command applied to the sheet
+    size_t version;
+#ifdef MODEL_STATS
+    // Cost of the last edit
+    char status[256];
+#endif
+} View;
+
+// Cells the model displays while applying commands; only used by the worker.
+static View back_view;
+
+// Cells of the worker's view while it moves; only used by the worker.
+static ViewCell *moved_cells = NULL;
+static size_t moved_capacity = 0;
+
+// The last view the worker published, in which every cell is up to date.
+static View published_view;
+
+#ifdef MODEL_THREADS
+// Protects 'published_view'.
+static pthread_mutex_t view_lock = PTHREAD_MUTEX_INITIALIZER;
+// Signalled when a view is published
+static pthread_cond_t view_cond = PTHREAD_COND_INITIALIZER;
+#endif
+
+// Version of the published view the screen shows.
+static size_t drawn_version = 0;
+
+typedef enum {
+    EDIT_CELL,
+    UNDO,
+    REDO,
+    SAVE,
+    MOVE_VIEWPORT,
+} CommandKind;
+
+// Something for the worker to do to the model.
+typedef struct {
+    CommandKind kind;
+    // Cell of an edit, or first row and column of the viewport
+    size_t row, col;
+    // Size of the viewport
+    size_t num_rows, num_cols;
+    // Text of an edit, or NULL to clear the cell
+    char *text;
+    // Number of commands queued up to and including this one
+    size_t version;
+} Command;
+
+// Commands queued and not taken by the worker yet.
+static Command *commands = NULL;
+static size_t num_commands = 0;
+static size_t commands_capacity = 0;
+
+// Number of commands queued so far.
+static size_t submitted = 0;
+
+// Number of queued edits, undos and redos not applied yet; an evaluation is
+// cut short while there are any, as they would make its results stale.
+static size_t pending_changes = 0;
+
+#ifdef MODEL_THREADS
+// Protects the queue, 'pending_changes' and 'stopping'.
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+// Signalled when commands are queued or the worker should stop
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+// Set to make the worker finish the queued commands and exit
+static bool stopping = false;
+
+static pthread_t worker;
+
+// Commands the worker took from the queue.
+static Command *taken = NULL;
+static size_t taken_capacity = 0;
+
+// Whether an evaluation was cut short since the worker last checked.
+static bool evaluation_interrupted = false;
+#endif
+
+// An edit queued but not shown by the published view yet.
+typedef struct {
+    size_t row, col;
+    // Copy of the text of the edit, or NULL if it clears the cell
+    char *text;
+    size_t version;
+} PendingEdit;
+
+// Queued edits, oldest first; only used by the input loop.
+static PendingEdit *pending_edits = NULL;
+static size_t num_pending_edits = 0;
+static size_t pending_edits_capacity = 0;
+
+// Function to resize an allocation, exiting if memory runs out.
+static void *reallocate(void *pointer, size_t size) {
+    pointer = realloc(pointer, size);
+    if (pointer == NULL && size > 0) {
+        endwin();
+        exit(ENOMEM);
+    }
+    return pointer;
+}
+
+// Function to make room for at least one more element in an array.
+static void *reserve_one(void *array, size_t count, size_t *capacity, size_t size) {
+    if (count < *capacity)
+        return array;
+    *capacity = *capacity ? 2 * *capacity : 16;
+    return reallocate(array, *capacity * size);
+}
+
+// Function to find the position of a cell in a view, returning false if it is outside.
+static bool view_index(const View *view, size_t row, size_t col, size_t *index) {
+    if (row < view->row || row >= view->row + view->num_rows || col < view->col || col >= view->col + view->num_cols)
+        return false;
+    *index = (row - view->row) * view->num_cols + (col - view->col);
+    return true;
+}
+
+// Function to ask the model for the cells of a region of the worker's view.
+//
+// They arrive through 'update_cell_displays'; empty regions are skipped.
+static void fetch_region(size_t row, size_t col, size_t end_row, size_t end_col) {
+    if (row < end_row && col < end_col)
+        model_redisplay(row, col, end_row - row, end_col - col);
+}
+
+// Function to point the worker's view at a region of the sheet.
+//
+// The cells it held already are kept, and only the newly exposed ones are
+// fetched from the model, so scrolling costs as much as the rows and columns
+// it brings into view.
+static void move_view(size_t row, size_t col, size_t num_rows, size_t num_cols) {
+    View *view = &back_view;
+    if (row == view->row && col == view->col && num_rows == view->num_rows && num_cols == view->num_cols)
+        return;
+
+    // The cells move to their new positions in the spare array, which is then
+    // swapped in; the others start out blank.
+    size_t count = num_rows * num_cols;
+    if (count > moved_capacity) {
+        moved_capacity = count;
+        moved_cells = reallocate(moved_cells, count * sizeof(ViewCell));
+    }
+    size_t first_row = row > view->row ? row : view->row;
+    size_t first_col = col > view->col ? col : view->col;
+    size_t end_row = row + num_rows < view->row + view->num_rows ? row + num_rows : view->row + view->num_rows;
+    size_t end_col = col + num_cols < view->col + view->num_cols ? col + num_cols : view->col + view->num_cols;
+    for (size_t r = row; r < row + num_rows; r++) {
+        for (size_t c = col; c < col + num_cols; c++) {
+            ViewCell *cell = &moved_cells[(r - row) * num_cols + (c - col)];
+            size_t index;
+            if (view_index(view, r, c, &index))
+                *cell = view->cells[index];
+            else
+                cell->display[0] = cell->text[0] = '\0';
+            cell->changed = false;
+        }
+    }
+    ViewCell *cells = view->cells;
+    size_t capacity = view->capacity;
+    view->cells = moved_cells;
+    view->capacity = moved_capacity;
+    moved_cells = cells;
+    moved_capacity = capacity;
+    view->row = row;
+    view->col = col;
+    view->num_rows = num_rows;
+    view->num_cols = num_cols;
+    view->num_changed = 0;
+    view->moved = true;
+
+    // Without overlap, everything is new. Otherwise, the rows above and below
+    // the kept cells are new, and so are the columns left and right of them.
+    if (first_row >= end_row || first_col >= end_col) {
+        fetch_region(row, col, row + num_rows, col + num_cols);
+        return;
+    }
+    fetch_region(row, col, first_row, col + num_cols);
+    fetch_region(end_row, col, row + num_rows, col + num_cols);
+    fetch_region(first_row, col, end_row, first_col);
+    fetch_region(first_row, end_col, end_row, col + num_cols);
+}
+
+// Function to copy the cells of the worker's view into the published one.
+//
+// Only the cells that changed since the last time are copied, unless the
+// worker's view moved meanwhile.
+static void publish_view(size_t version) {
+    LOCK(view_lock);
+    size_t count = back_view.num_rows * back_view.num_cols;
+    if (back_view.moved) {
+        if (count > published_view.capacity) {
+            published_view.capacity = count;
+            published_view.cells = reallocate(published_view.cells, count * sizeof(ViewCell));
+        }
+        published_view.row = back_view.row;
+        published_view.col = back_view.col;
+        published_view.num_rows = back_view.num_rows;
+        published_view.num_cols = back_view.num_cols;
+        memcpy(published_view.cells, back_view.cells, count * sizeof(ViewCell));
+    } else {
+        for (size_t k = 0; k < back_view.num_changed; k++) {
+            size_t index = back_view.changed[k];
+            published_view.cells[index] = back_view.cells[index];
+        }
+    }
+    published_view.version = version;
+#ifdef MODEL_STATS
+    memcpy(published_view.status, back_view.status, sizeof(back_view.status));
+#endif
+#ifdef MODEL_THREADS
+    pthread_cond_broadcast(&view_cond);
+#endif
+    UNLOCK(view_lock);
+
+    for (size_t k = 0; k < back_view.num_changed; k++)
+        back_view.cells[back_view.changed[k]].changed = false;
+    back_view.num_changed = 0;
+    back_view.moved = false;
+}
+
+#ifdef MODEL_STATS
+
+// Function to describe what the last edit cost, given the model's counters from before it.
+static void record_edit_stats(const ModelStats *before) {
+    ModelStats after = model_get_stats();
+    snprintf(back_view.status, sizeof(back_view.status),
+             "Edit: %.3f ms, %zu cells visited, %zu evaluated, %zu by delta, %zu displayed, %zu allocations; "
+             "strings: %zu bytes",
+             (after.edit_seconds - before->edit_seconds) * 1e3, after.cells_visited - before->cells_visited,
+             after.formulas_evaluated - before->formulas_evaluated, after.delta_updates - before->delta_updates,
+             after.cells_displayed - before->cells_displayed, after.allocations - before->allocations,
+             after.text_bytes);
+}
+
+#endif
+
+// Function to apply a command to the model.
+static void apply_command(Command *command) {
+    switch (command->kind) {
+        case EDIT_CELL: {
+#ifdef MODEL_STATS
+            ModelStats before = model_get_stats();
+#endif
+            if (command->text != NULL)
+                set_cell_value_at(command->row, command->col, command->text);
+            else
+                clear_cell_at(command->row, command->col);
+#ifdef MODEL_STATS
+            record_edit_stats(&before);
+#endif
+            break;
+        }
+        case UNDO:
+            model_undo();
+            break;
+        case REDO:
+            model_redo();
+            break;
+        case SAVE:
+            model_save_snapshot(snapshot_path);
+            break;
+        case MOVE_VIEWPORT:
+            model_set_viewport(command->row, command->col, command->num_rows, command->num_cols);
+            move_view(command->row, command->col, command->num_rows, command->num_cols);
+            break;
+    }
+}
+
+// Function to apply commands taken from the queue, and publish the result.
+static void run_commands(Command *list, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        // A change no longer makes the evaluations before it stale once it runs.
+        if (list[i].kind != SAVE && list[i].kind != MOVE_VIEWPORT) {
+            LOCK(queue_lock);
+            pending_changes--;
+            UNLOCK(queue_lock);
+        }
+        apply_command(&list[i]);
+    }
+
+    // Cells left out of date by interrupted evaluations are calculated now;
+    // the view already holds all others. If that is interrupted as well,
+    // newer commands are waiting, and the view is published once they have run.
+#ifdef MODEL_THREADS
+    evaluation_interrupted = false;
+#endif
+    model_update_region(back_view.row, back_view.col, back_view.num_rows, back_view.num_cols);
+#ifdef MODEL_THREADS
+    if (evaluation_interrupted)
+        return;
+#endif
+    publish_view(list[count - 1].version);
+}
+
+#ifdef MODEL_THREADS
+
+// Function asked by the model whether to cut an evaluation short.
+static bool should_interrupt(void *data) {
+    (void)data;
+    LOCK(queue_lock);
+    bool interrupt = pending_changes > 0 || stopping;
+    UNLOCK(queue_lock);
+    if (interrupt)
+        evaluation_interrupted = true;
+    return interrupt;
+}
+
+// Function run by the worker thread, applying commands until it is stopped.
+static void *run_worker(void *data) {
+    (void)data;
+    LOCK(queue_lock);
+    while (true) {
+        while (num_commands == 0 && !stopping)
+            pthread_cond_wait(&queue_cond, &queue_lock);
+        if (num_commands == 0)
+            break;
+
+        // Take all queued commands, so the input loop can queue new ones meanwhile.
+        if (num_commands > taken_capacity) {
+            taken_capacity = commands_capacity;
+            taken = reallocate(taken, taken_capacity * sizeof(Command));
+        }
+        memcpy(taken, commands, num_commands * sizeof(Command));
+        size_t count = num_commands;
+        num_commands = 0;
+
+        UNLOCK(queue_lock);
+        run_commands(taken, count);
+        LOCK(queue_lock);
+    }
+    UNLOCK(queue_lock);
+    return NULL;
+}
+
+#endif
+
+// Function to hand the model over to the worker.
+static void start_worker(void) {
+#ifdef MODEL_THREADS
+    model_set_interrupt(should_interrupt, NULL);
+    if (pthread_create(&worker, NULL, run_worker, NULL) != 0) {
+        endwin();
+        exit(EAGAIN);
+    }
+#endif
+}
+
+// Function to let the worker apply the commands still queued, and wait for it to exit.
+static void stop_worker(void) {
+#ifdef MODEL_THREADS
+    LOCK(queue_lock);
+    stopping = true;
+    pthread_cond_signal(&queue_cond);
+    UNLOCK(queue_lock);
+    pthread_join(worker, NULL);
+#endif
+}
+
+// Function to queue a command for the worker.
+//
+// A queued edit of the same cell, or a queued move of the viewport, that
+// nothing else was queued after is superseded by the new command.
+static void submit_command(Command command) {
+    LOCK(queue_lock);
+    command.version = ++submitted;
+    Command *last = num_commands > 0 ? &commands[num_commands - 1] : NULL;
+    if (last != NULL && last->kind == MOVE_VIEWPORT && command.kind == MOVE_VIEWPORT) {
+        *last = command;
+        UNLOCK(queue_lock);
+        return;
+    }
+    if (command.kind == EDIT_CELL) {
+        for (size_t i = num_commands; i > 0 && commands[i - 1].kind == EDIT_CELL; i--) {
+            if (commands[i - 1].row == command.row && commands[i - 1].col == command.col) {
+                free(commands[i - 1].text);
+                commands[i - 1].text = command.text;
+                commands[i - 1].version = command.version;
+                // Later commands do not touch the cell, so they may run first.
+                commands[num_commands - 1].version = command.version;
+                UNLOCK(queue_lock);
+                return;
+            }
+        }
+    }
+
+    commands = reserve_one(commands, num_commands, &commands_capacity, sizeof(Command));
+    commands[num_commands++] = command;
+    if (command.kind != SAVE && command.kind != MOVE_VIEWPORT)
+        pending_changes++;
+#ifdef MODEL_THREADS
+    pthread_cond_signal(&queue_cond);
+    UNLOCK(queue_lock);
+#else
+    // Without a worker, the command runs right away.
+    num_commands = 0;
+    run_commands(commands, 1);
+#endif
+}
+
+// Function to wait a little for the worker to catch up with the queued
+// commands, so that quick changes are drawn without flickering.
+static void await_view(void) {
+#ifdef MODEL_THREADS
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += FRAME_MS * 1000000L / 2;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    LOCK(view_lock);
+    while (published_view.version < submitted &&
+           pthread_cond_timedwait(&view_cond, &view_lock, &deadline) == 0)
+        continue;
+    UNLOCK(view_lock);
+#endif
+}
+
+// Function to get a copy of the text of the current cell, or NULL if it is empty.
+//
+// Queued edits are taken into account before the published view shows them.
+static char *current_cell_text(void) {
+    LOCK(view_lock);
+    size_t version = published_view.version;
+    char *text = NULL;
+    size_t index;
+    if (view_index(&published_view, cur_row, cur_col, &index))
+        text = strdup(published_view.cells[index].text);
+    UNLOCK(view_lock);
+
+    // Forget the edits the view shows.
+    size_t kept = 0;
+    for (size_t i = 0; i < num_pending_edits; i++) {
+        if (pending_edits[i].version > version)
+            pending_edits[kept++] = pending_edits[i];
+        else
+            free(pending_edits[i].text);
+    }
+    num_pending_edits = kept;
+
+    for (size_t i = num_pending_edits; i > 0; i--) {
+        if (pending_edits[i - 1].row == cur_row && pending_edits[i - 1].col == cur_col) {
+            free(text);
+            text = pending_edits[i - 1].text != NULL ? strdup(pending_edits[i - 1].text) : NULL;
+            break;
+        }
+    }
+    return text;
+}
+
+// Function to get the screen line of a visible row.
+static int screen_row(size_t row) {
+    return FIRST_CELL_LINE + 2 * (int) (row - top_row);
+}
+
+// Function to get the screen column of a visible column.
+static int screen_col(size_t col) {
+    return (CELL_DISPLAY_WIDTH + 1) * ((int) (col - left_col) + 1) + 1;
+}
+
 static void set_cell_attr(attr_t attr) {
-    mvchgat(2 * ((int) cur_row + 2) + 1, (CELL_DISPLAY_WIDTH + 1) * (cur_col + 1) + 1, CELL_DISPLAY_WIDTH, attr, 0,
-            NULL);
+    mvchgat(screen_row(cur_row), screen_col(cur_col), CELL_DISPLAY_WIDTH, attr, 0, NULL);
+}
+
+// Function to write the name of a column, such as "AB", into a buffer.
+static void column_name(size_t col, char *buffer) {
+    char letters[8];
+    size_t length = 0;
+
+    // Columns are numbered A to Z, then AA, AB, and so on.
+    for (size_t n = col + 1; n > 0; n = (n - 1) / 26)
+        letters[length++] = (char) ('A' + (n - 1) % 26);
+    for (size_t k = 0; k < length; k++)
+        buffer[k] = letters[length - 1 - k];
+    buffer[length] = 0;
+}
+
+// Function to fit the viewport to the terminal and keep the current cell in it.
+static void fit_viewport(void) {
+    // Two lines per row, plus the lines above the cells, the bottom border,
+    // the footer and the status line.
+    visible_rows = LINES > FIRST_CELL_LINE + 3 + STATUS_LINES
+                   ? (size_t) (LINES - FIRST_CELL_LINE - 1 - STATUS_LINES) / 2
+                   : 1;
+    if (visible_rows > sheet_rows)
+        visible_rows = sheet_rows;
+
+    // Include extra column to the left for row numbers.
+    visible_cols = COLS > 2 * (CELL_DISPLAY_WIDTH + 1) ? (size_t) (COLS - 1) / (CELL_DISPLAY_WIDTH + 1) - 1 : 1;
+    if (visible_cols > sheet_cols)
+        visible_cols = sheet_cols;
+    total_width = (visible_cols + 1) * (CELL_DISPLAY_WIDTH + 1) + 1;
+    shown_cells = reallocate(shown_cells, visible_rows * visible_cols * sizeof(ShownCell));
+
+    if (top_row + visible_rows > sheet_rows)
+        top_row = sheet_rows - visible_rows;
+    if (cur_row < top_row)
+        top_row = cur_row;
+    if (cur_row >= top_row + visible_rows)
+        top_row = cur_row - visible_rows + 1;
+    if (left_col + visible_cols > sheet_cols)
+        left_col = sheet_cols - visible_cols;
+    if (cur_col < left_col)
+        left_col = cur_col;
+    if (cur_col >= left_col + visible_cols)
+        left_col = cur_col - visible_cols + 1;
+}
+
+// Function to draw a horizontal line of the grid.
+static void draw_separator(int line, chtype left, chtype middle, chtype right) {
+    mvaddch(line, 0, left);
+    for (size_t j = 0; j < visible_cols + 1; j++) {
+        if (j > 0)
+            addch(middle);
+        for (size_t k = 0; k < CELL_DISPLAY_WIDTH; k++)
+            addch(ACS_HLINE);
+    }
+    addch(right);
+}
+
+// Function to draw the vertical lines of a line of cells.
+static void draw_cell_borders(int line) {
+    for (size_t j = 0; j < visible_cols + 2; j++)
+        mvaddch(line, j < visible_cols + 1 ? (int) ((CELL_DISPLAY_WIDTH + 1) * j) : (int) total_width - 1, ACS_VLINE);
+}
+
+// Function to draw the cells of some rows of the viewport from the published view.
+//
+// 'first' is the index of the first row within the viewport. Cells the view
+// does not hold yet are left blank, and cells already showing their text are
+// skipped, so a recalculation only writes the cells whose values changed.
+static void draw_cells(size_t first, size_t count) {
+    LOCK(view_lock);
+    for (size_t row = top_row + first; row < top_row + first + count; row++) {
+        for (size_t col = left_col; col < left_col + visible_cols; col++) {
+            size_t index;
+            const char *text = view_index(&published_view, row, col, &index) ? published_view.cells[index].display : "";
+            ShownCell *shown = &shown_cells[(row - top_row) * visible_cols + (col - left_col)];
+            if (shown->valid && strcmp(shown->text, text) == 0)
+                continue;
+            shown->valid = true;
+            snprintf(shown->text, sizeof(shown->text), "%s", text);
+
+            // Pad the text with blanks, so that each cell is written only once.
+            mvprintw(screen_row(row), screen_col(col), "%-*.*s", CELL_DISPLAY_WIDTH, CELL_DISPLAY_WIDTH, text);
+        }
+    }
+    UNLOCK(view_lock);
+}
+
+// Function to forget what some rows of the viewport show, after the screen
+// was cleared there.
+static void invalidate_shown(size_t first, size_t count) {
+    for (size_t k = first * visible_cols; k < (first + count) * visible_cols; k++)
+        shown_cells[k].valid = false;
+}
+
+// Function to draw some rows of the viewport and ask the model for their cells.
+//
+// 'first' is the index of the first row within the viewport.
+static void draw_rows(size_t first, size_t count) {
+    for (size_t k = first; k < first + count; k++) {
+        int line = FIRST_CELL_LINE + 2 * (int) k;
+        draw_cell_borders(line);
+        mvprintw(line, 1, "%*zu", CELL_DISPLAY_WIDTH, top_row + k + 1);
+
+        // The lines between rows, which scrolling may have cleared.
+        if (k > 0)
+            draw_separator(line - 1, ACS_LTEE, ACS_PLUS, ACS_RTEE);
+        if (k + 1 < visible_rows)
+            draw_separator(line + 1, ACS_LTEE, ACS_PLUS, ACS_RTEE);
+    }
+    draw_cells(first, count);
+
+    // Lazy mode keeps whatever the viewport shows up to date.
+    submit_command((Command) {MOVE_VIEWPORT, top_row, left_col, visible_rows, visible_cols, NULL, 0});
+}
+
+// Function to show whether the screen is behind the commands queued for the
+// worker, and the cost of the last edit.
+static void draw_progress(void) {
+    int line = FIRST_CELL_LINE + 2 * (int) visible_rows;
+    mvprintw(line, (int) strlen(footer) + 1, "%-*s", (int) strlen(CALCULATING),
+             drawn_version < submitted ? CALCULATING : "");
+#ifdef MODEL_STATS
+    move(line + 1, 0);
+    clrtoeol();
+    LOCK(view_lock);
+    mvaddnstr(line + 1, 0, published_view.status, COLS);
+    UNLOCK(view_lock);
+#endif
+}
+
+// Function to draw the cells again once the worker has published a newer view.
+static void refresh_view(void) {
+    LOCK(view_lock);
+    size_t version = published_view.version;
+    UNLOCK(view_lock);
+    if (version != drawn_version) {
+        drawn_version = version;
+        draw_cells(0, visible_rows);
+    }
+    draw_progress();
+}
+
+// Function to draw the whole screen.
+static void draw_screen(void) {
+    erase();
+    invalidate_shown(0, visible_rows);
+
+    // Draw the top line, and the borders of the edit field.
+    mvaddch(0, 0, ACS_ULCORNER);
+    for (size_t i = 0; i < total_width - 2; i++)
+        addch(ACS_HLINE);
+    addch(ACS_URCORNER);
+    mvaddch(1, 0, ACS_VLINE);
+    mvaddch(1, (int) total_width - 1, ACS_VLINE);
+
+    // Print the column headers.
+    draw_separator(2, ACS_LTEE, ACS_TTEE, ACS_RTEE);
+    draw_cell_borders(3);
+    for (size_t col = left_col; col < left_col + visible_cols; col++) {
+        char name[8];
+        column_name(col, name);
+        mvaddstr(3, screen_col(col) + (CELL_DISPLAY_WIDTH - (int) strlen(name)) / 2, name);
+    }
+    draw_separator(4, ACS_LTEE, ACS_PLUS, ACS_RTEE);
+
+    // Draw the rows and the bottom line.
+    draw_rows(0, visible_rows);
+    draw_separator(FIRST_CELL_LINE + 2 * (int) visible_rows - 1, ACS_LLCORNER, ACS_BTEE, ACS_LRCORNER);
+
+    // Draw exit instructions.
+    mvaddstr(FIRST_CELL_LINE + 2 * (int) visible_rows, 0, footer);
+    draw_progress();
+}
+
+// Function to scroll the viewport so that its first row is 'row'.
+//
+// Rows that stay visible are shifted on the screen with a scroll region, so
+// only the newly exposed rows are drawn and fetched from the model.
+static void scroll_rows(size_t row) {
+    size_t distance = row > top_row ? row - top_row : top_row - row;
+    if (distance == 0)
+        return;
+    if (distance >= visible_rows) {
+        top_row = row;
+        draw_rows(0, visible_rows);
+        return;
+    }
+
+    // The region holds the rows and the lines between them, but not the
+    // bottom line.
+    setscrreg(FIRST_CELL_LINE, FIRST_CELL_LINE + 2 * (int) visible_rows - 2);
+    scrollok(stdscr, true);
+    scrl(row > top_row ? 2 * (int) distance : -2 * (int) distance);
+    scrollok(stdscr, false);
+    setscrreg(0, LINES - 1);
+
+    // The cells that stay visible move along with their text.
+    bool down = row > top_row;
+    size_t kept = (visible_rows - distance) * visible_cols;
+    if (down)
+        memmove(shown_cells, shown_cells + distance * visible_cols, kept * sizeof(ShownCell));
+    else
+        memmove(shown_cells + distance * visible_cols, shown_cells, kept * sizeof(ShownCell));
+    invalidate_shown(down ? visible_rows - distance : 0, distance);
+    top_row = row;
+    draw_rows(down ? visible_rows - distance : 0, distance);
+}
+
+// Function to move the viewport so that the current cell is visible.
+static void show_current_cell(void) {
+    if (cur_row < top_row)
+        scroll_rows(cur_row);
+    else if (cur_row >= top_row + visible_rows)
+        scroll_rows(cur_row - visible_rows + 1);
+
+    // Columns cannot be shifted on the screen, so all cells are drawn again.
+    if (cur_col < left_col || cur_col >= left_col + visible_cols) {
+        left_col = cur_col < left_col ? cur_col : cur_col - visible_cols + 1;
+        draw_screen();
+    }
+}
+
+// Function to set the current cell to 'text', or to clear it if 'text' is NULL.
+static void edit_current_cell(char *text) {
+    // Until the worker publishes the edit, the edit field shows it from here.
+    // The model owns the text once the command is queued.
+    pending_edits = reserve_one(pending_edits, num_pending_edits, &pending_edits_capacity, sizeof(PendingEdit));
+    pending_edits[num_pending_edits++] = (PendingEdit) {cur_row, cur_col, text != NULL ? strdup(text) : NULL,
+                                                        submitted + 1};
+    submit_command((Command) {EDIT_CELL, cur_row, cur_col, 0, 0, text, 0});
 }
 
 static void ensure_edit_text_capacity(size_t capacity) {
@@ -50,9 +839,20 @@ static void ensure_edit_text_capacity(size_t capacity) {
     edit_text_capacity = capacity;
 }
 
-int main() {
+int main(int argc, char **argv) {
     /* INITIALIZATION */
 
+    // Initialize the cell contents data structure, from a snapshot if one was given.
+    snapshot_path = argc > 1 ? argv[1] : NULL;
+    bool from_snapshot = snapshot_path != NULL && model_open_snapshot(snapshot_path);
+    if (!from_snapshot)
+        model_init();
+
+    // Only the cells on the screen need to be calculated after an edit.
+    model_set_lazy(true);
+    sheet_rows = model_num_rows();
+    sheet_cols = model_num_cols();
+
     // Initialize NCURSES.
     initscr();
 
@@ -65,92 +865,51 @@ int main() {
     // Enable input of function keys.
     keypad(stdscr, true);
 
-    /* DRAW BORDERS */
+#ifdef MODEL_THREADS
+    // Wake up every frame to draw what the worker calculated meanwhile.
+    timeout(FRAME_MS);
+#endif
 
-    // Include extra column to the left for cur_row numbers.
-    const size_t total_width = (NUM_COLS + 1) * (CELL_DISPLAY_WIDTH + 1) + 1;
-    // Include two extra rows on top for edit field and cur_row numbers.
-    const size_t total_height = (NUM_ROWS + 2) * 2 + 1;
+    // From here on, only the worker touches the model.
+    start_worker();
 
-    // Resize window.
-    resizeterm(total_height + 1, total_width);
+    /* DRAW THE VIEWPORT */
 
-    // Draw the top line.
-    addch(ACS_ULCORNER);
-    for (size_t i = 0; i < total_width - 2; i++)
-        addch(ACS_HLINE);
-    addch(ACS_URCORNER);
-
-    // Draw the left/right and interior lines.
-    for (size_t i = 0; i < NUM_ROWS + 2; i++) {
-        if (i > 0) {
-            mvaddch(2 * i, 0, ACS_LTEE);
-            for (size_t j = 0; j < NUM_COLS + 1; j++) {
-                if (j > 0)
-                    addch(i == 1 ? ACS_TTEE : ACS_PLUS);
-                for (size_t k = 0; k < CELL_DISPLAY_WIDTH; k++)
-                    addch(ACS_HLINE);
-            }
-            addch(ACS_RTEE);
-        }
-        mvaddch(2 * i + 1, 0, ACS_VLINE);
-        if (i > 0)
-            for (size_t j = 1; j < NUM_COLS + 1; j++)
-                mvaddch(2 * i + 1, (CELL_DISPLAY_WIDTH + 1) * j, ACS_VLINE);
-        mvaddch(2 * i + 1, total_width - 1, ACS_VLINE);
-    }
-
-    // Draw the bottom line.
-    mvaddch(total_height - 1, 0, ACS_LLCORNER);
-    for (size_t i = 0; i < NUM_COLS + 1; i++) {
-        if (i > 0)
-            addch(ACS_BTEE);
-        for (size_t j = 0; j < CELL_DISPLAY_WIDTH; j++)
-            addch(ACS_HLINE);
-    }
-    addch(ACS_LRCORNER);
-
-    // Draw exit instructions.
-    mvaddstr(total_height, 0, "Press Ctrl+C to exit.");
-
-    /* HEADERS */
-
-    // Print the column headers.
-    for (COL col = COL_A; col < NUM_COLS; col++)
-        mvaddch(3, (CELL_DISPLAY_WIDTH + 1) * (col + 1) + CELL_DISPLAY_WIDTH / 2 + 1, col + 'A');
-
-    // Generate the format specifier for the cur_row headers.
-    char format_buffer[8];
-    snprintf(format_buffer, sizeof(format_buffer), "%%%dd", CELL_DISPLAY_WIDTH);
-
-    // Print the cur_row headers.
-    for (ROW row = ROW_1; row < NUM_ROWS; row++)
-        mvprintw(2 * ((int) row + 2) + 1, 1, format_buffer, row + 1);
+    // Only the part of the sheet that fits on the terminal is drawn,
+    // starting with its top-left corner.
+    footer = snapshot_path != NULL ? "Press Ctrl+Z to undo, Ctrl+Y to redo, Ctrl+S to save, Ctrl+C to exit."
+                                   : "Press Ctrl+Z to undo, Ctrl+Y to redo, Ctrl+C to exit.";
+    fit_viewport();
+    draw_screen();
 
     /* MAIN LOOP */
 
-    // String of blanks used by main loop.
-    char blanks[total_width + 1];
-    for (size_t i = 0; i < total_width; i++)
-        blanks[i] = ' ';
-    blanks[total_width] = 0;
-
     while (true) {
-        // Print the current cell coordinates in top-left corner.
-        mvaddnstr(3, 1, blanks, CELL_DISPLAY_WIDTH);
-        mvprintw(3, CELL_DISPLAY_WIDTH / 2, "%c%d", cur_col + 'A', cur_row + 1);
+        // Scroll to the current cell if it moved out of the viewport.
+        show_current_cell();
+
+        // Draw the cells the worker calculated since the last key.
+        await_view();
+        refresh_view();
 
+        // Print the current cell coordinates in top-left corner.
+        char name[32];
+        column_name(cur_col, name);
+        snprintf(name + strlen(name), sizeof(name) - strlen(name), "%zu", cur_row + 1);
+        mvhline(3, 1, ' ', CELL_DISPLAY_WIDTH);
+        mvaddnstr(3, 1 + (strlen(name) < CELL_DISPLAY_WIDTH ? (CELL_DISPLAY_WIDTH - (int) strlen(name)) / 2 : 0), name,
+                  CELL_DISPLAY_WIDTH);
 
         // Show the textual representation of the current cell in the edit field.
         if (edit_text != NULL)
             free(edit_text);
-        edit_text = get_textual_value(cur_row, cur_col);
-        edit_text_capacity = edit_text == NULL ? 0 : MAX_LEN;
-        edit_text_length = strnlen(edit_text,MAX_LEN);
-        mvaddnstr(1, 1, blanks, total_width - 2);
+        edit_text = current_cell_text();
+        edit_text_capacity = edit_text == NULL ? 0 : strlen(edit_text) + 1;
+        edit_text_length = edit_text == NULL ? 0 : strnlen(edit_text, MAX_LEN);
+        mvhline(1, 1, ' ', (int) total_width - 2);
 
         if (edit_text != NULL)
-            mvaddnstr(1, 1, edit_text, total_width - 2);
+            mvaddnstr(1, 1, edit_text, (int) total_width - 2);
 
         // Highlight the current cell.
         set_cell_attr(A_REVERSE);
@@ -159,54 +918,79 @@ int main() {
         // Read next key.
         int c = getch();
         set_cell_attr(A_NORMAL);
+        if (c == ERR)
+            continue;
 
         // Handle key.
         handle_key:
         switch (c) {
             case 3: // Ctrl+C
+                stop_worker();
                 endwin();
                 return 0;
+            case 19: // Ctrl+S
+                // Save to the snapshot given on the command line, if any.
+                if (snapshot_path != NULL)
+                    submit_command((Command) {SAVE, 0, 0, 0, 0, NULL, 0});
+                continue;
+            case 26: // Ctrl+Z
+                submit_command((Command) {UNDO, 0, 0, 0, 0, NULL, 0});
+                continue;
+            case 25: // Ctrl+Y
+                submit_command((Command) {REDO, 0, 0, 0, 0, NULL, 0});
+                continue;
+            case KEY_RESIZE:
+                // Fit the viewport to the new size of the terminal.
+                fit_viewport();
+                draw_screen();
+                continue;
             case KEY_UP:
-                if (cur_row > ROW_1)
+                if (cur_row > 0)
                     cur_row--;
                 continue;
             case KEY_DOWN:
-                if (cur_row < NUM_ROWS - 1)
+                if (cur_row < sheet_rows - 1)
                     cur_row++;
                 continue;
             case KEY_LEFT:
-                if (cur_col > COL_A)
+                if (cur_col > 0)
                     cur_col--;
                 return_col = cur_col;
                 continue;
             case KEY_RIGHT:
-                if (cur_col < NUM_COLS - 1)
+                if (cur_col < sheet_cols - 1)
                     cur_col++;
                 return_col = cur_col;
                 continue;
             case KEY_PPAGE:
-                cur_row = ROW_1;
+                // Move up by one screen of rows.
+                cur_row = cur_row > visible_rows ? cur_row - visible_rows : 0;
+                if (top_row > 0)
+                    scroll_rows(top_row > visible_rows ? top_row - visible_rows : 0);
                 continue;
             case KEY_NPAGE:
-                cur_row = NUM_ROWS - 1;
+                // Move down by one screen of rows.
+                cur_row = cur_row + visible_rows < sheet_rows ? cur_row + visible_rows : sheet_rows - 1;
+                if (top_row + 2 * visible_rows <= sheet_rows)
+                    scroll_rows(top_row + visible_rows);
                 continue;
             case KEY_HOME:
-                cur_col = COL_A;
-                return_col = COL_A;
+                cur_col = 0;
+                return_col = 0;
                 continue;
             case KEY_END:
-                cur_col = NUM_COLS - 1;
-                return_col = NUM_COLS - 1;
+                cur_col = sheet_cols - 1;
+                return_col = cur_col;
                 continue;
             case '\t':
-                if (cur_col < NUM_COLS - 1)
+                if (cur_col < sheet_cols - 1)
                     cur_col++;
                 continue;
             case KEY_DC:
-                clear_cell(cur_row, cur_col);
+                edit_current_cell(NULL);
                 continue;
             case '\n':
-                if (cur_row < NUM_ROWS - 1) {
+                if (cur_row < sheet_rows - 1) {
                     cur_row++;
                     cur_col = return_col;
                 }
@@ -236,7 +1020,7 @@ int main() {
                 edit_display_offset = edit_position - total_width + 2;
 
             // Display edit text.
-            mvaddnstr(1, 1, blanks, total_width - 2);
+            mvhline(1, 1, ' ', (int) total_width - 2);
             size_t display_amount = edit_text_length - edit_display_offset;
             if (display_amount > total_width - 2)
                 display_amount = total_width - 2;
@@ -247,7 +1031,12 @@ int main() {
             c = getch();
 
             switch (c) {
+                case ERR:
+                    // Keep the cells up to date while typing.
+                    refresh_view();
+                    continue;
                 case 3: // Ctrl+C
+                    stop_worker();
                     endwin();
                     return 0;
                 case KEY_LEFT:
@@ -296,7 +1085,7 @@ int main() {
                     // Apply edit and navigate as usual.
                     ensure_edit_text_capacity(edit_text_length + 1);
                     edit_text[edit_text_length] = 0;
-                    set_cell_value(cur_row, cur_col, edit_text);
+                    edit_current_cell(edit_text);
                     edit_text = NULL;
                     edit_text_capacity = 0;
                     edit_text_length = 0;
@@ -315,13 +1104,29 @@ int main() {
     }
 }
 
-void update_cell_display(ROW row, COL col, const char *text) {
-    int console_row = 2 * ((int) row + 2) + 1;
-    int console_col = (CELL_DISPLAY_WIDTH + 1) * (col + 1) + 1;
-    char blanks[CELL_DISPLAY_WIDTH + 1];
-    for (size_t i = 0; i < CELL_DISPLAY_WIDTH; i++)
-        blanks[i] = ' ';
-    blanks[CELL_DISPLAY_WIDTH] = '\0';
-    mvaddstr(console_row, console_col, blanks);
-    mvaddnstr(console_row, console_col, text, CELL_DISPLAY_WIDTH);
+void update_cell_displays(const CellDisplayUpdate *updates, size_t count) {
+    // The model calls this on the worker; the input loop draws the cells
+    // once the worker publishes them. Edited cells are always among the
+    // updates, so their texts are read again here as well.
+    for (size_t i = 0; i < count; i++) {
+        size_t index;
+        if (!view_index(&back_view, updates[i].row, updates[i].col, &index))
+            continue;
+        ViewCell *cell = &back_view.cells[index];
+        snprintf(cell->display, sizeof(cell->display), "%s", updates[i].text);
+        const char *text;
+        size_t length;
+        get_textual_value_view_at(updates[i].row, updates[i].col, &text, &length);
+        if (length > MAX_LEN - 1)
+            length = MAX_LEN - 1;
+        memcpy(cell->text, text, length);
+        cell->text[length] = '\0';
+
+        if (!cell->changed) {
+            cell->changed = true;
+            back_view.changed = reserve_one(back_view.changed, back_view.num_changed, &back_view.changed_capacity,
+                                            sizeof(size_t));
+            back_view.changed[back_view.num_changed++] = index;
+        }
+    }
 }
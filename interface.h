@@ -3,13 +3,26 @@
 
 #include "defs.h"
 
+#include <stddef.h>
+
 #define CELL_DISPLAY_WIDTH 11
 
-// Updates the text which is displayed in a cell.
+// New text to display in a cell.
+typedef struct {
+    // 0-based position of the cell; for sheets created with
+    // 'model_init_sized', it may lie beyond the named ROW and COL constants
+    size_t row;
+    size_t col;
+    // Text to display; only the first CELL_DISPLAY_WIDTH characters are used
+    const char *text;
+} CellDisplayUpdate;
+
+// Updates the text which is displayed in a number of cells.
 //
-// The contents of 'text' are only accessed during the function call, and the
-// function does not modify or deallocate the string. Only the first
-// CELL_DISPLAY_WIDTH characters will be used.
-void update_cell_display(ROW row, COL col, const char *text);
+// The model calls this once per recalculation, listing only the cells whose
+// displayed text may have changed, so the interface can redraw them together.
+// The updates and their texts are only accessed during the function call, and
+// the function does not modify or deallocate them.
+void update_cell_displays(const CellDisplayUpdate *updates, size_t count);
 
 #endif //ASSIGNMENT_INTERFACE_H
@@ -0,0 +1,198 @@
+#include "journal.h"
+#include "memory.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Function to round a size up to a multiple of 8 bytes, which keeps every
+// record in the arena aligned.
+#define ALIGN8(size) (((size) + 7) & ~(size_t)7)
+
+// Header of a step in the arena, followed by the records of its cells.
+typedef struct {
+    // Bytes taken by the step, including this header
+    size_t size;
+    // Offsets of the previous and next steps in the arena, if there are any
+    size_t prev;
+    size_t next;
+} StepHeader;
+
+// Header of the record of a cell, followed by its old and new texts. The
+// record is padded to a multiple of 8 bytes and ends with its own size, so
+// that the records of a step can be walked backwards.
+typedef struct {
+    // Position of the cell
+    size_t sheet;
+    size_t row;
+    size_t col;
+    // Lengths of the texts before and after the change
+    size_t old_length;
+    size_t new_length;
+} CellHeader;
+
+// Arena holding the steps, allocated with the first step, and its size.
+static uint8_t *arena = NULL;
+static size_t limit = JOURNAL_DEFAULT_LIMIT;
+
+// Number of steps in the arena, and how many of the newest were undone.
+static size_t num_steps = 0;
+static size_t num_undone = 0;
+
+// Offsets of the oldest and newest steps, and of the newest step not undone.
+static size_t oldest = 0;
+static size_t newest = 0;
+static size_t current = 0;
+
+// Step being built, starting with room for its header; empty if no cell was
+// recorded yet.
+static uint8_t *pending = NULL;
+static size_t pending_length = 0;
+static size_t pending_capacity = 0;
+
+// Function to get the header of the step at an offset of the arena.
+static StepHeader *step_at(size_t offset) {
+    return (StepHeader *)(arena + offset);
+}
+
+// Function to get the size of the record of a cell.
+static size_t record_size(size_t old_length, size_t new_length) {
+    return ALIGN8(sizeof(CellHeader) + old_length + new_length) + sizeof(size_t);
+}
+
+void journal_record(size_t sheet, size_t row, size_t col, const char *old_text, size_t old_length,
+                    const char *new_text, size_t new_length) {
+    size_t size = record_size(old_length, new_length);
+    if (pending_length == 0)
+        pending_length = sizeof(StepHeader);
+
+    // The buffer grows to the largest step recorded and is then reused.
+    if (pending_length + size > pending_capacity) {
+        while (pending_length + size > pending_capacity)
+            pending_capacity = pending_capacity ? 2 * pending_capacity : 1024;
+        pending = checked_realloc(pending, pending_capacity);
+    }
+
+    uint8_t *record = pending + pending_length;
+    *(CellHeader *)record = (CellHeader){sheet, row, col, old_length, new_length};
+    memcpy(record + sizeof(CellHeader), old_text, old_length);
+    memcpy(record + sizeof(CellHeader) + old_length, new_text, new_length);
+    *(size_t *)(record + size - sizeof(size_t)) = size;
+    pending_length += size;
+}
+
+// Function to find room in the arena for a step, dropping the oldest steps
+// until there is enough. Returns the offset of the room.
+static size_t make_room(size_t size) {
+    while (num_steps > 0) {
+        size_t tail = newest + step_at(newest)->size;
+
+        // The steps either run from 'oldest' to 'tail', leaving room after
+        // them and before them, or wrap around, leaving room between 'tail'
+        // and 'oldest'.
+        if (oldest <= newest) {
+            if (tail + size <= limit)
+                return tail;
+            if (size <= oldest)
+                return 0;
+        } else if (tail + size <= oldest) {
+            return tail;
+        }
+
+        oldest = step_at(oldest)->next;
+        --num_steps;
+    }
+    return 0;
+}
+
+void journal_commit(void) {
+    if (pending_length == 0)
+        return;
+    size_t size = pending_length;
+    pending_length = 0;
+
+    // Steps undone can no longer be redone once something else changed.
+    if (num_undone > 0) {
+        num_steps -= num_undone;
+        num_undone = 0;
+        newest = current;
+    }
+
+    // Earlier steps cannot be undone without this one, so they are dropped
+    // along with it if it does not fit.
+    if (size > limit) {
+        journal_clear();
+        return;
+    }
+
+    if (arena == NULL)
+        arena = checked_malloc(limit);
+    size_t offset = make_room(size);
+    memcpy(arena + offset, pending, size);
+    StepHeader *step = step_at(offset);
+    step->size = size;
+    if (num_steps > 0) {
+        step->prev = newest;
+        step_at(newest)->next = offset;
+    } else {
+        oldest = offset;
+    }
+    newest = current = offset;
+    ++num_steps;
+}
+
+bool journal_undo(JournalVisit visit, void *data) {
+    if (num_undone == num_steps)
+        return false;
+
+    // Walk the records backwards, so that a cell changed several times gets
+    // the text from before its first change.
+    const uint8_t *step = arena + current;
+    size_t end = step_at(current)->size;
+    while (end > sizeof(StepHeader)) {
+        end -= *(const size_t *)(step + end - sizeof(size_t));
+        const CellHeader *cell = (const CellHeader *)(step + end);
+        visit(cell->sheet, cell->row, cell->col, (const char *)(cell + 1), cell->old_length, data);
+    }
+
+    ++num_undone;
+    current = step_at(current)->prev;
+    return true;
+}
+
+bool journal_redo(JournalVisit visit, void *data) {
+    if (num_undone == 0)
+        return false;
+
+    size_t offset = num_undone == num_steps ? oldest : step_at(current)->next;
+    const uint8_t *step = arena + offset;
+    size_t size = step_at(offset)->size;
+    for (size_t at = sizeof(StepHeader); at < size;) {
+        const CellHeader *cell = (const CellHeader *)(step + at);
+        visit(cell->sheet, cell->row, cell->col, (const char *)(cell + 1) + cell->old_length, cell->new_length, data);
+        at += record_size(cell->old_length, cell->new_length);
+    }
+
+    --num_undone;
+    current = offset;
+    return true;
+}
+
+void journal_clear(void) {
+    num_steps = num_undone = 0;
+    pending_length = 0;
+}
+
+void journal_set_limit(size_t bytes) {
+    journal_clear();
+    free(arena);
+    arena = NULL;
+    limit = bytes;
+}
+
+void journal_reset(void) {
+    journal_set_limit(limit);
+    free(pending);
+    pending = NULL;
+    pending_capacity = 0;
+}
@@ -0,0 +1,54 @@
+#ifndef ASSIGNMENT_JOURNAL_H
+#define ASSIGNMENT_JOURNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Journal of edits, for undo and redo.
+//
+// The journal is a sequence of steps, each holding the cells one action
+// changed, with their texts before and after it. Texts are all it takes to
+// restore a cell: its type, value, compiled formula and dependency edges all
+// follow from the text, exactly as when it was entered. Steps are stored one
+// after the other in an arena of fixed size used as a ring buffer; once it is
+// full, the oldest steps are dropped to make room, so the journal never takes
+// more memory than its limit.
+
+// Default size of the arena, in bytes.
+#define JOURNAL_DEFAULT_LIMIT (16u << 20)
+
+// Called for each cell restored by 'journal_undo' or 'journal_redo', with
+// the index of its sheet and the text the cell must get; an empty text means
+// the cell must be cleared. The text is not terminated and only stays valid
+// during the call.
+typedef void (*JournalVisit)(size_t sheet, size_t row, size_t col, const char *text, size_t length, void *data);
+
+// Sets the size of the arena and forgets all steps.
+void journal_set_limit(size_t bytes);
+
+// Adds the change of a cell to the step being built.
+void journal_record(size_t sheet, size_t row, size_t col, const char *old_text, size_t old_length,
+                    const char *new_text, size_t new_length);
+
+// Completes the step being built, if any cells were recorded. Steps undone
+// before are dropped, as they can no longer be redone. A step larger than the
+// arena cannot be kept, and makes the journal forget all steps.
+void journal_commit(void);
+
+// Visits the cells of the last step not undone, from the last change to the
+// first, with their texts before it, and marks the step undone. Returns false
+// if there is no such step.
+bool journal_undo(JournalVisit visit, void *data);
+
+// Visits the cells of the first step undone, in the order of the changes,
+// with their texts after it, and marks the step done again. Returns false if
+// there is no such step.
+bool journal_redo(JournalVisit visit, void *data);
+
+// Forgets all steps, including the one being built.
+void journal_clear(void);
+
+// Forgets all steps and releases the memory of the journal.
+void journal_reset(void);
+
+#endif //ASSIGNMENT_JOURNAL_H
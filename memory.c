@@ -0,0 +1,33 @@
+#include "memory.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+
+// Number of allocations made through this module.
+static size_t allocations = 0;
+
+// Function to abort the program when memory cannot be obtained.
+static void *check_alloc(void *ptr) {
+    if (ptr == NULL) {
+        fprintf(stderr, "ERROR: Memory allocation failure\n");
+        exit(EXIT_FAILURE);
+    }
+    ++allocations;
+    return ptr;
+}
+
+void *checked_malloc(size_t size) {
+    return check_alloc(malloc(size ? size : 1));
+}
+
+void *checked_calloc(size_t count, size_t size) {
+    return check_alloc(calloc(count ? count : 1, size ? size : 1));
+}
+
+void *checked_realloc(void *ptr, size_t size) {
+    return check_alloc(realloc(ptr, size ? size : 1));
+}
+
+size_t allocation_count(void) {
+    return allocations;
+}
@@ -0,0 +1,25 @@
+#ifndef ASSIGNMENT_MEMORY_H
+#define ASSIGNMENT_MEMORY_H
+
+#include <stddef.h>
+
+// Heap allocation helpers used by all parts of the model.
+//
+// They behave like their standard counterparts, except that running out of
+// memory prints an error and exits the program. Every allocation is counted so
+// that tests and benchmarks can check that hot paths stay off the heap.
+
+// Allocates 'size' bytes.
+void *checked_malloc(size_t size);
+
+// Allocates a zeroed array of 'count' elements of 'size' bytes each.
+void *checked_calloc(size_t count, size_t size);
+
+// Resizes an allocation made by one of these functions, or makes a new one if
+// 'ptr' is NULL.
+void *checked_realloc(void *ptr, size_t size);
+
+// Returns the number of allocations made so far.
+size_t allocation_count(void);
+
+#endif //ASSIGNMENT_MEMORY_H
@@ -1,5 +1,23 @@
 #include "model.h"
 #include "interface.h"
+#include "graph.h"
+#include "formula.h"
+#include "memory.h"
+#include "sheet.h"
+#include "rangeops.h"
+#include "csv.h"
+#include "snapshot.h"
+#include "number.h"
+#include "journal.h"
+#include "feed.h"
+
+#ifdef MODEL_THREADS
+#include "pool.h"
+#endif
+
+#ifdef MODEL_STATS
+#include <time.h>
+#endif
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -7,9 +25,9 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include <ctype.h>
+#include <math.h>
 
 #define MAX_LEN 256
-#define EQUALS_CHAR '='
 
 // Define a structure to assist in managing dynamic arrays.
 typedef struct {
@@ -23,33 +41,23 @@ typedef struct {
     size_t capacity;
 } DoubleAssist;
 
-// Function to create and initialize a new dynamic array assist structure.
-DoubleAssist make_double_assist() {
-
-    // Allocate memory for a dynamic array of doubles with an initial capacity of 16.
-    double *temp = malloc(16 * sizeof(double));
+// Function to make sure the dynamic array can hold 'capacity' elements without growing.
+void double_assist_reserve(DoubleAssist *assist, size_t capacity) {
+    // Nothing to do if the array is already large enough.
+    if (capacity <= assist->capacity)
+        return;
 
-    // Create and return a new DoubleAssist structure with initialized properties.
-    return (DoubleAssist){temp, temp, 0, 16};
+    // Reallocate the array and update the base address, stack pointer, and capacity.
+    assist->base = checked_realloc(assist->base, capacity * sizeof(double));
+    assist->sp = assist->base + assist->size;
+    assist->capacity = capacity;
 }
 
 
 // Function to grow the capacity of the dynamic array used in DoubleAssist structure.
 void double_assist_grow(DoubleAssist *assist) {
-    // Attempt to reallocate memory for the dynamic array with double the current capacity.
-    double *temp = realloc(assist->base, 2 * assist->capacity * sizeof(double));
-
-    // Check if the reallocation was successful.
-    if (temp) {
-        // Update the DoubleAssist structure with the new base address, stack pointer, and capacity.
-        assist->base = temp;
-        assist->sp = assist->base + assist->size;
-        assist->capacity *= 2;
-    } else {
-        // If memory allocation fails, print an error message and exit the program.
-        fprintf(stderr, "ERROR: Memory allocation failure\n");
-        exit(EXIT_FAILURE);
-    }
+    // Double the current capacity, starting with room for 16 elements.
+    double_assist_reserve(assist, assist->capacity ? 2 * assist->capacity : 16);
 }
 
 
@@ -79,404 +87,2536 @@ double double_assist_pop(DoubleAssist *assist) {
     return *(assist->sp);
 }
 
+// Function to remove all elements while keeping the allocated memory.
+void double_assist_clear(DoubleAssist *assist) {
+    assist->sp = assist->base;
+    assist->size = 0;
+}
+
 // Function to delete the dynamic array and free associated memory.
 void double_assist_delete(DoubleAssist *assist) {
     // Free the memory allocated for the dynamic array.
     free(assist->base);
 
     // Reset the size and capacity to indicate an empty array.
+    assist->base = assist->sp = NULL;
     assist->size = 0;
     assist->capacity = 0;
 }
 
-// Enumeration to represent different types of cells.
-typedef enum {
-    // Represents an empty or uninitialized cell
-    none,
-    // Represents a cell containing a string value
-    str,
-    // Represents a cell containing a numeric value
-    num,
-    // Represents a cell containing an equation or formula
-    eqn,
-} CELL_TYPE;
-
-// Structure to represent a cell with a type, numeric value, and string value.
-typedef struct cell {
-    // Type of the cell (string, numeric, etc.)
-    CELL_TYPE type;
-    // Numeric value of the cell (valid if type is num)
-    double numVal;
-    // String value of the cell (valid if type is str or eqn)
-    char *strVal;
-} cell;
-
-
-// Definition of a 2D array 'sheet' representing a table of cells with NUM_ROWS rows and NUM_COLS columns.
-cell sheet[NUM_ROWS][NUM_COLS] = {0};
+// Largest number of cells holding the same formula evaluated together.
+#define EVAL_LANES 32
 
-// Function to skip leading whitespace characters in a given text.
-const char *skip_whitespace(const char *text) {
-    while (*text && isspace((unsigned char)*text)) {
-        text++;
+// Evaluation state shared by all formulas evaluated by the model.
+//
+// The operand stack is reused by every evaluation and is grown ahead of time,
+// when a formula needing a deeper stack is compiled, so evaluating formulas
+// never touches the heap.
+typedef struct {
+    // Operand stack of the formula being evaluated
+    DoubleAssist stack;
+    // Operand stacks of the cells evaluated together by 'evaluate_lanes', with
+    // a row of EVAL_LANES values per slot
+    double *lanes;
+    size_t lanes_capacity;
+    // Cells of the recalculation order from the one being evaluated on, which
+    // runs start from, or NULL outside of recalculations; 'evaluated', unless
+    // it is NULL, tells which of them are going to be evaluated in full
+    const CellKey *upcoming;
+    size_t num_upcoming;
+    bool (*evaluated)(const CellKey *cell, void *data);
+    void *evaluated_data;
+    // Upcoming cells evaluated ahead by 'start_run', and their results
+    const CellKey *run;
+    size_t run_length;
+    double run_values[EVAL_LANES];
+    bool run_succeeded[EVAL_LANES];
+} EvalContext;
+
+// Context used for recalculation.
+static EvalContext eval_context = {0};
+
+// Deepest stack needed by any formula compiled so far.
+static size_t max_formula_stack = 0;
+
+// Function to make sure an evaluation context can run every compiled formula.
+void eval_context_prepare(EvalContext *context) {
+    double_assist_reserve(&context->stack, max_formula_stack);
+    if (context->lanes_capacity < max_formula_stack * EVAL_LANES) {
+        context->lanes_capacity = max_formula_stack * EVAL_LANES;
+        context->lanes = checked_realloc(context->lanes, context->lanes_capacity * sizeof(double));
     }
-    return text;
 }
 
-// Function to check if a given string is a valid numeric representation.
-bool is_valid_num(const char *str) {
-    if (!str)
-        return false;
+// Largest number of sheets of a workbook, which cell keys can tell apart.
+#define MAX_SHEETS 65536
+
+// Name of the sheet created by 'model_init_sized', also given to the sheet of
+// snapshots of version 1.
+#define DEFAULT_SHEET_NAME "Sheet1"
 
-    // Skip leading whitespace characters.
-    str = skip_whitespace(str);
+// A sheet of the workbook.
+typedef struct {
+    // Name of the sheet, unique regardless of case
+    char *name;
+    // Dimensions of the sheet
+    size_t num_rows;
+    size_t num_cols;
+    // Cells of the sheet; NULL for a sheet of the opened snapshot which was
+    // not accessed yet
+    Sheet *cells;
+    // Whether the formulas of the sheet are in the dependency graph, or about
+    // to be added, see 'link_queued'
+    bool linked;
+} WorkbookSheet;
+
+// Sheets of the workbook, created by 'model_init_sized', and the index of the
+// active one, which edits and displays apply to.
+static WorkbookSheet *sheets = NULL;
+static size_t num_sheets = 0;
+static size_t sheets_capacity = 0;
+static size_t active_sheet = 0;
+
+// Cells of the active sheet.
+static Sheet *sheet = NULL;
+
+// Snapshot the workbook was opened from, which sheets not accessed yet are
+// loaded from.
+static Snapshot *workbook_snapshot = NULL;
+
+// Whether cells were edited since the workbook was created or opened. From
+// then on, the formulas of every loaded sheet are in the dependency graph.
+static bool workbook_edited = false;
+
+// State of the edit batch opened by 'model_begin_batch'.
+typedef struct {
+    // Number of open batches; edits are deferred while this is not 0
+    size_t depth;
+    // Cells changed since the outermost batch was opened, possibly repeated
+    CellKey *changed;
+    // Number of entries in 'changed' and its allocated capacity
+    size_t num_changed;
+    size_t capacity;
+} EditBatch;
 
-    // Flags to track presence of digits and decimal point.
-    bool hasDigit = false;
-    bool hasDecimalPoint = false;
+// Edit batch of the model.
+static EditBatch batch = {0};
 
-    // Iterate through the characters in the string.
-    while (*str) {
-        if (isdigit((unsigned char)*str)) {
-            hasDigit = true;
-        } else if (*str == '.') {
-            // Check for multiple decimal points.
-            if (hasDecimalPoint) {
-                return false;
-            }
-            hasDecimalPoint = true;
-        } else {
-            // Invalid character encountered.
-            return false;
-        }
-        ++str;
-    }
+// Whether edits are kept out of the journal, as they are while the journal
+// itself is replayed or a file is loaded.
+static bool journal_paused = false;
+
+#ifdef MODEL_STATS
 
-    // Check if at least one digit is present.
-    return hasDigit;
+// Counters of the model's work, see 'model_get_stats'.
+static ModelStats stats = {0};
+
+// Function to read a monotonic clock in seconds.
+double stats_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
 }
 
-// Function to check if a given string is a valid formula.
-bool is_valid_formula(const char *formula) {
-    // Skip leading whitespaces.
-    formula = skip_whitespace(formula);
+// Function to record the wall time of an edit.
+void record_edit(double start) {
+    double seconds = stats_clock() - start;
+    size_t bucket = 0;
+    for (double limit = 1e-6; seconds >= limit && bucket + 1 < MODEL_STATS_BUCKETS; limit *= 2)
+        ++bucket;
 
-    // Check if the formula starts with '='.
-    if (formula[0] != '=')
-        return false;
+    ++stats.edits;
+    stats.edit_seconds += seconds;
+    ++stats.edit_times[bucket];
+}
 
-    // Move to the next character after '='.
-    ++formula;
+// Counting statements, which disappear from builds without MODEL_STATS.
+// Formulas may be evaluated on several threads, so that counter is atomic.
+#define STAT_ADD(field, amount) (stats.field += (amount))
+#define STAT_MAX(field, value) (stats.field = (value) > stats.field ? (value) : stats.field)
+#define STAT_ADD_SHARED(field, amount) __atomic_add_fetch(&stats.field, (amount), __ATOMIC_RELAXED)
+#define STAT_EDIT_BEGIN() double edit_start = stats_clock()
+#define STAT_EDIT_END() record_edit(edit_start)
 
-    // Iterate through the formula characters.
-    while (*formula) {
-        // Skip leading whitespaces.
-        formula = skip_whitespace(formula);
+#else
 
-        // Check for valid formula characters.
-        if (isalpha((unsigned char)*formula)) {
-            // Check for uppercase alphabets.
-            if (islower((unsigned char)*formula)) {
-                return false;
-            }
-        } else if (isdigit((unsigned char)*formula) || *formula == '.' || *formula == '+') {
-            // Valid characters for formula.
-        } else {
-            // Invalid character encountered.
-            return false;
-        }
+#define STAT_ADD(field, amount) ((void)0)
+#define STAT_MAX(field, value) ((void)0)
+#define STAT_ADD_SHARED(field, amount) ((void)0)
+#define STAT_EDIT_BEGIN() ((void)0)
+#define STAT_EDIT_END() ((void)0)
 
-        // Move to the next character.
-        ++formula;
+#endif
+
+// Function to skip leading whitespace characters in a given text.
+const char *skip_whitespace(const char *text) {
+    while (*text && isspace((unsigned char)*text)) {
+        text++;
     }
+    return text;
+}
 
-    // The formula is considered valid if all characters pass the checks.
-    return true;
+// Function to read a text that is a number, after any leading whitespace.
+//
+// Returns false if the text is something else; 'length' is its length.
+bool read_num(const char *text, size_t length, double *value) {
+    const char *start = skip_whitespace(text);
+    size_t remaining = length - (size_t)(start - text);
+    return remaining > 0 && number_parse(start, remaining, value) == remaining;
 }
 
-// Function to set the numeric value in a cell and free existing memory.
-void set_num_value(ROW row, COL col, const char *text) {
-    // Free existing memory for the string value.
-    free(sheet[row][col].strVal);
+// Function to make sure the sheet exists, creating one of the default size if necessary.
+Sheet *current_sheet(void) {
+    if (sheet == NULL)
+        model_init();
+    return sheet;
+}
 
-    // Set the cell type to num.
-    sheet[row][col].type = num;
+// Function to free the string value and compiled formula of a cell.
+void release_cell_contents(Block *block, size_t i) {
+    formula_free(block_formula(block, i));
+    block_set_formula(block, i, NULL);
+    sheet_remove_text(sheet, block->text[i]);
+    block->text[i] = 0;
 
-    // Convert the input text to a double and set the numeric value.
-    sheet[row][col].numVal = strtod(text, NULL);
+    // Whatever the cell holds next displays differently.
+    block->display_valid[i] = false;
+}
+
+// Function to set the numeric value in a cell, read from 'text', and free existing memory.
+void set_num_value(Block *block, size_t i, char *text, double value) {
+    // Free existing memory for the string value and formula.
+    release_cell_contents(block, i);
+
+    // Set the cell type to num.
+    block->type[i] = num;
 
-    // Set the string value to NULL.
-    sheet[row][col].strVal = NULL;
+    // Only the value is kept; its text is generated again when needed.
+    block->num[i] = value;
+    free(text);
 }
 
 // Function to set the string value in a cell and free existing memory.
-void set_string_value(ROW row, COL col, const char *text) {
-    // Free existing memory for the string value.
-    free(sheet[row][col].strVal);
+void set_string_value(Block *block, size_t i, char *text) {
+    // Take over the entered text as the string value, shared with every
+    // other cell holding the same text. It is added before the old value is
+    // released, so that entering the same text again keeps its string.
+    TextId id = sheet_add_text(sheet, text);
+
+    // Free existing memory for the string value and formula.
+    release_cell_contents(block, i);
 
     // Set the cell type to str.
-    sheet[row][col].type = str;
+    block->type[i] = str;
 
     // Set the numeric value to 0.
-    sheet[row][col].numVal = 0;
+    block->num[i] = 0;
+    block->text[i] = id;
+}
 
-    // Duplicate and set the string value.
-    sheet[row][col].strVal = strdup(text);
+// Function to check whether a sheet name equals a text which is not terminated, ignoring case.
+bool same_name(const char *name, const char *text, size_t length) {
+    for (size_t k = 0; k < length; ++k) {
+        if (name[k] == '\0' || tolower((unsigned char)name[k]) != tolower((unsigned char)text[k]))
+            return false;
+    }
+    return name[length] == '\0';
 }
 
-// Function to initialize a cell if its type is none.
+// Function to find a sheet by a name which is not terminated, ignoring case.
+bool find_sheet_named(const char *name, size_t length, size_t *index) {
+    for (size_t k = 0; k < num_sheets; ++k) {
+        if (same_name(sheets[k].name, name, length)) {
+            *index = k;
+            return true;
+        }
+    }
+    return false;
+}
 
-void initialize_cell(ROW row, COL col) {
-    // Check if the cell type is already set.
-    if (sheet[row][col].type != none)
-        return;
+// Function to look up the sheet of a reference for the formula compiler.
+bool find_formula_sheet(const char *name, size_t length, size_t *index, size_t *num_rows, size_t *num_cols,
+                        void *data) {
+    (void)data;
+    if (!find_sheet_named(name, length, index))
+        return false;
+    *num_rows = sheets[*index].num_rows;
+    *num_cols = sheets[*index].num_cols;
+    return true;
+}
+
+// Function to compile the text of a formula cell of the active sheet.
+void compile_cell_formula(Block *block, size_t i) {
+    // Compile the formula once; recalculation only runs the compiled code.
+    size_t row = (size_t)block->index * BLOCK_ROWS + i;
+    FormulaScope scope = {active_sheet, row, block->col, sheet_num_rows(sheet), sheet_num_cols(sheet),
+                          find_formula_sheet, NULL};
+    Formula *formula = formula_compile(sheet_text(sheet, block->text[i]), &scope);
+    block_set_formula(block, i, formula);
+    STAT_ADD(formulas_compiled, 1);
+
+    // Remember the stack depth it needs, so evaluation never has to grow it.
+    if (formula != NULL && formula->max_stack > max_formula_stack)
+        max_formula_stack = formula->max_stack;
+}
+
+// Function to set the formula in a cell and free existing memory.
+void set_formula_value(Block *block, size_t i, char *text) {
+    // Free existing memory for the string value and formula.
+    release_cell_contents(block, i);
+
+    // Set the cell type to eqn; the value is computed during recalculation.
+    block->type[i] = eqn;
+    block->num[i] = 0;
+    block->error[i] = no_error;
+
+    // Keep the formula text, which is shown when editing, and compile it.
+    block->text[i] = sheet_add_text(sheet, text);
+    compile_cell_formula(block, i);
+}
+
+// Function to add the numeric cells of a range read by the formula of a cell
+// to the totals of a range function.
+bool accumulate_range(const CellRange *range, size_t row, size_t col, RangeTotals *totals, bool extrema) {
+    Sheet *cells = sheets[range->first.sheet].cells;
+    uint32_t first_row = range->first.row + (uint32_t)row, last_row = range->last.row + (uint32_t)row;
+    uint32_t first_col = range->first.col + (uint32_t)col, last_col = range->last.col + (uint32_t)col;
+    size_t first_block = first_row / BLOCK_ROWS;
+    size_t last_block = last_row / BLOCK_ROWS;
+
+    // Walk the range column by column, one block of contiguous cells at a time.
+    for (size_t c = first_col; c <= last_col; ++c) {
+        for (size_t index = first_block; index <= last_block; ++index) {
+            const Block *block = sheet_find_block(cells, c, index);
+
+            // Unallocated blocks only hold empty cells, which do not count.
+            if (block == NULL)
+                continue;
+
+            size_t begin = index == first_block ? first_row % BLOCK_ROWS : 0;
+            size_t end = index == last_block ? last_row % BLOCK_ROWS + 1 : BLOCK_ROWS;
+            if (!range_accumulate(totals, block, begin, end - begin, extrema))
+                return false;
+        }
+    }
+    return true;
+}
 
-    // Free existing memory for the string value.
-    free(sheet[row][col].strVal);
+// Function to compute the result of a range function from its totals.
+bool finish_range_function(FUNCTION function, const RangeTotals *totals, double *result) {
+    switch (function) {
+        case FN_SUM:
+            *result = totals->sum;
+            return true;
+        case FN_COUNT:
+            *result = totals->count;
+            return true;
+        case FN_MIN:
+            // Without numeric values the result is 0; adding 0 also turns -0 into 0.
+            *result = totals->count > 0 ? totals->min + 0.0 : 0;
+            return true;
+        case FN_MAX:
+            *result = totals->count > 0 ? totals->max + 0.0 : 0;
+            return true;
+        case FN_AVERAGE:
+            // The average of no values is undefined.
+            if (totals->count == 0)
+                return false;
+            *result = totals->sum / totals->count;
+            return true;
+    }
+    return false;
+}
 
-    // Initialize the cell with type num, numeric value 0, and an empty string.
-    sheet[row][col] = (cell){.type = num, .numVal = 0, .strVal = strdup("")};
+// Function to read the value of a cell referenced by the formula of the cell
+// at 'row' and 'col'. Returns false if the cell holds a formula that failed,
+// which makes the formula fail too.
+//
+// Formulas are only evaluated once they are in the dependency graph, and the
+// sheets of the cells they read are then loaded too, see 'link_queued'.
+static bool read_reference(const CellRef *ref, size_t row, size_t col, double *value) {
+    uint32_t source_row = ref->row + (uint32_t)row;
+    const Block *source = sheet_find(sheets[ref->sheet].cells, source_row, ref->col + (uint32_t)col);
+    size_t index = source_row % BLOCK_ROWS;
+
+    // Cells in unallocated blocks are empty and read as zero.
+    if (source == NULL) {
+        *value = 0;
+        return true;
+    }
+    if (source->type[index] == eqn && source->error[index])
+        return false;
+    *value = source->num[index];
+    return true;
 }
 
-// Function to parse and calculate the result of a formula.
-bool parse_and_calculate_formula(char *formula, double *result) {
+// Function to calculate the result of a compiled formula held by the cell at
+// 'row' and 'col'.
+//
+// The context must have been prepared with 'eval_context_prepare' since the
+// formula was compiled.
+bool evaluate_formula(EvalContext *context, const Formula *formula, size_t row, size_t col, double *result) {
     // Initialize the result to 0.
     *result = 0;
 
-    // Check if the formula is valid.
-    if (!is_valid_formula(formula)) {
+    // Malformed formulas have no code and always fail.
+    if (formula == NULL) {
         return false;
     }
 
-    // Create a dynamic array assist structure for numeric values.
-    DoubleAssist numAssist = make_double_assist();
-
-    // Variable to count the number of operators in the formula.
-    int opcount = 0;
-
-    // Loop through the characters in the formula.
-    while (*formula) {
-        if (*formula == EQUALS_CHAR || *formula == ' ') {
-            // Skip equals sign and spaces.
-            formula++;
-        } else if (*formula == '+') {
-            // Increment the operator count and move to the next character.
-            opcount++;
-            formula++;
-        } else if (isalpha(*formula)) {
-            // Check if the next character is a digit.
-            if (!isdigit(*(formula + 1))) {
-                // Invalid formula if the character after the alphabet is not a digit.
-                double_assist_delete(&numAssist);
-                return false;
+    // Start from an empty operand stack; its memory is kept between evaluations.
+    DoubleAssist *numAssist = &context->stack;
+    double_assist_clear(numAssist);
+
+    // Execute the instructions in order.
+    for (size_t i = 0; i < formula->length; ++i) {
+        const Instruction *instruction = &formula->code[i];
+
+        switch (instruction->op) {
+            case OP_CONST:
+                // Push the literal onto the numeric assist stack.
+                double_assist_push(numAssist, formula->constants[instruction->operand]);
+                break;
+            case OP_REF: {
+                // Push the numeric value from the referenced cell onto the numeric assist stack.
+                double value;
+                if (!read_reference(&formula->refs[instruction->operand], row, col, &value))
+                    return false;
+                double_assist_push(numAssist, value);
+                break;
+            }
+            case OP_ADD: {
+                // Replace the two topmost values by their sum.
+                double right = double_assist_pop(numAssist);
+                double left = double_assist_pop(numAssist);
+                double_assist_push(numAssist, left + right);
+                break;
+            }
+            case OP_SUB:
+            case OP_MUL:
+            case OP_DIV:
+            case OP_POW: {
+                // Replace the two topmost values by the result of the operator.
+                double right = double_assist_pop(numAssist);
+                double *left = numAssist->sp - 1;
+                if (!formula_operate(instruction->op, *left, right, left))
+                    return false;
+                break;
             }
+            case OP_NEG:
+                numAssist->sp[-1] = -numAssist->sp[-1];
+                break;
+            case OP_ADD_REF: {
+                // Add the value of the referenced cell to the value on top.
+                double value;
+                if (!read_reference(&formula->refs[instruction->operand], row, col, &value))
+                    return false;
+                numAssist->sp[-1] += value;
+                break;
+            }
+            case OP_ADD_CONST:
+                numAssist->sp[-1] += formula->constants[instruction->operand];
+                break;
+            case OP_AGG_BEGIN:
+                // Push the running totals: sum, count, minimum and maximum.
+                double_assist_push(numAssist, 0);
+                double_assist_push(numAssist, 0);
+                double_assist_push(numAssist, INFINITY);
+                double_assist_push(numAssist, -INFINITY);
+                break;
+            case OP_AGG_VALUE: {
+                // Add a single argument value to the totals below it.
+                double value = double_assist_pop(numAssist);
+                double *totals = numAssist->sp - 4;
+                totals[0] += value;
+                totals[1] += 1;
+                totals[2] = value < totals[2] ? value : totals[2];
+                totals[3] = value > totals[3] ? value : totals[3];
+                break;
+            }
+            case OP_AGG_RANGE:
+            case OP_AGG_RANGE_EXTREMA: {
+                // Add the numeric cells of a range to the totals on top.
+                double *top = numAssist->sp - 4;
+                RangeTotals totals = {top[0], top[1], top[2], top[3]};
+                if (!accumulate_range(&formula->ranges[instruction->operand], row, col, &totals,
+                                      instruction->op == OP_AGG_RANGE_EXTREMA)) {
+                    return false;
+                }
+                top[0] = totals.sum;
+                top[1] = totals.count;
+                top[2] = totals.min;
+                top[3] = totals.max;
+                break;
+            }
+            case OP_AGG_END: {
+                // Replace the totals by the result of the function.
+                double *top = numAssist->sp - 4;
+                RangeTotals totals = {top[0], top[1], top[2], top[3]};
+                double value;
+                for (int k = 0; k < 4; ++k)
+                    double_assist_pop(numAssist);
+                if (!finish_range_function((FUNCTION)instruction->operand, &totals, &value)) {
+                    return false;
+                }
+                double_assist_push(numAssist, value);
+                break;
+            }
+        }
+    }
 
-            // Calculate the column index from the alphabet character.
-            COL curCol = (COL)(*formula - 'A');
-            formula++;
+    // The compiler guarantees that exactly one value is left.
+    *result = double_assist_pop(numAssist);
 
-            // Calculate the row index from the following digits.
-            ROW curRow = strtol(formula, &formula, 10) - 1;
+    // Formula calculation successful.
+    return true;
+}
 
-            // Check if the row and column indices are within bounds.
-            if (curRow < 0 || curRow >= NUM_ROWS || curCol < 0 || curCol >= NUM_COLS) {
-                double_assist_delete(&numAssist);
-                return false;
-            }
+// Function to calculate the results of a formula held by several cells, as
+// 'evaluate_formula' would one cell after the other.
+//
+// Each instruction is run for all of the cells before the next one, on the
+// stacks of the context, so that the arithmetic turns into loops over rows of
+// values. Cells whose formula fails get 'succeeded' false and a result of 0.
+// The context must have been prepared, and 'count' be at most EVAL_LANES.
+void evaluate_lanes(EvalContext *context, const Formula *formula, const CellKey *cells, size_t count,
+                    double *results, bool *succeeded) {
+    size_t rows[EVAL_LANES], cols[EVAL_LANES];
+    for (size_t k = 0; k < count; ++k) {
+        rows[k] = key_row(cells[k]);
+        cols[k] = key_col(cells[k]);
+        succeeded[k] = true;
+    }
 
-            // Push the numeric value from the referenced cell onto the numeric assist stack.
-            double_assist_push(&numAssist, sheet[curRow][curCol].numVal);
-        } else if (isdigit(*formula) || *formula == '.') {
-            // Push the numeric value onto the numeric assist stack and update the formula pointer.
-            double_assist_push(&numAssist, strtod(formula, &formula));
-        } else {
-            // Invalid character in the formula.
-            double_assist_delete(&numAssist);
-            return false;
+    // Slot 's' of the stack of the cell 'k' is lanes[s * EVAL_LANES + k]. Cells
+    // which failed keep going on values of 0, which are never used.
+    double *lanes = context->lanes;
+    size_t depth = 0;
+    for (size_t i = 0; i < formula->length; ++i) {
+        const Instruction *instruction = &formula->code[i];
+        double *top = lanes + depth * EVAL_LANES;
+        double *right = top - EVAL_LANES;
+        double *left = right - EVAL_LANES;
+
+        switch (instruction->op) {
+            case OP_CONST: {
+                double constant = formula->constants[instruction->operand];
+                for (size_t k = 0; k < count; ++k)
+                    top[k] = constant;
+                ++depth;
+                break;
+            }
+            case OP_REF:
+            case OP_ADD_REF: {
+                const CellRef *ref = &formula->refs[instruction->operand];
+                for (size_t k = 0; k < count; ++k) {
+                    double value;
+                    if (!read_reference(ref, rows[k], cols[k], &value)) {
+                        succeeded[k] = false;
+                        value = 0;
+                    }
+                    if (instruction->op == OP_REF)
+                        top[k] = value;
+                    else
+                        right[k] += value;
+                }
+                if (instruction->op == OP_REF)
+                    ++depth;
+                break;
+            }
+            case OP_ADD:
+                for (size_t k = 0; k < count; ++k)
+                    left[k] = left[k] + right[k];
+                --depth;
+                break;
+            case OP_SUB:
+                for (size_t k = 0; k < count; ++k)
+                    left[k] = left[k] - right[k];
+                --depth;
+                break;
+            case OP_MUL:
+                for (size_t k = 0; k < count; ++k)
+                    left[k] = left[k] * right[k];
+                --depth;
+                break;
+            case OP_DIV:
+            case OP_POW:
+                for (size_t k = 0; k < count; ++k) {
+                    if (!formula_operate(instruction->op, left[k], right[k], &left[k])) {
+                        succeeded[k] = false;
+                        left[k] = 0;
+                    }
+                }
+                --depth;
+                break;
+            case OP_NEG:
+                for (size_t k = 0; k < count; ++k)
+                    right[k] = -right[k];
+                break;
+            case OP_ADD_CONST: {
+                double constant = formula->constants[instruction->operand];
+                for (size_t k = 0; k < count; ++k)
+                    right[k] += constant;
+                break;
+            }
+            case OP_AGG_BEGIN:
+                // Push the running totals: sum, count, minimum and maximum.
+                for (size_t k = 0; k < count; ++k) {
+                    top[k] = 0;
+                    top[EVAL_LANES + k] = 0;
+                    top[2 * EVAL_LANES + k] = INFINITY;
+                    top[3 * EVAL_LANES + k] = -INFINITY;
+                }
+                depth += 4;
+                break;
+            case OP_AGG_VALUE: {
+                // Add a single argument value to the totals below it.
+                double *totals = right - 4 * EVAL_LANES;
+                for (size_t k = 0; k < count; ++k) {
+                    double value = right[k];
+                    totals[k] += value;
+                    totals[EVAL_LANES + k] += 1;
+                    double *min = &totals[2 * EVAL_LANES + k], *max = &totals[3 * EVAL_LANES + k];
+                    *min = value < *min ? value : *min;
+                    *max = value > *max ? value : *max;
+                }
+                --depth;
+                break;
+            }
+            case OP_AGG_RANGE:
+            case OP_AGG_RANGE_EXTREMA: {
+                // Each cell reads a range of its own.
+                double *totals = top - 4 * EVAL_LANES;
+                for (size_t k = 0; k < count; ++k) {
+                    RangeTotals sums = {totals[k], totals[EVAL_LANES + k], totals[2 * EVAL_LANES + k],
+                                        totals[3 * EVAL_LANES + k]};
+                    if (!accumulate_range(&formula->ranges[instruction->operand], rows[k], cols[k], &sums,
+                                          instruction->op == OP_AGG_RANGE_EXTREMA))
+                        succeeded[k] = false;
+                    totals[k] = sums.sum;
+                    totals[EVAL_LANES + k] = sums.count;
+                    totals[2 * EVAL_LANES + k] = sums.min;
+                    totals[3 * EVAL_LANES + k] = sums.max;
+                }
+                break;
+            }
+            case OP_AGG_END: {
+                // Replace the totals by the result of the function.
+                double *totals = top - 4 * EVAL_LANES;
+                for (size_t k = 0; k < count; ++k) {
+                    RangeTotals sums = {totals[k], totals[EVAL_LANES + k], totals[2 * EVAL_LANES + k],
+                                        totals[3 * EVAL_LANES + k]};
+                    if (!finish_range_function((FUNCTION)instruction->operand, &sums, &totals[k])) {
+                        succeeded[k] = false;
+                        totals[k] = 0;
+                    }
+                }
+                depth -= 3;
+                break;
+            }
         }
     }
 
-    // Check if the number of numeric values is one less than the number of operators.
-    if (numAssist.size != opcount + 1) {
-        double_assist_delete(&numAssist);
-        return false;
+    // The compiler guarantees that exactly one value is left.
+    for (size_t k = 0; k < count; ++k)
+        results[k] = succeeded[k] ? lanes[k] : 0;
+}
+
+// Formulas whose values may be out of date; see 'link_sheet_formulas'.
+typedef struct {
+    CellKey *cells;
+    size_t count;
+    size_t capacity;
+} StaleCells;
+
+// Formulas to recalculate along with the next changed cells.
+static StaleCells stale = {0};
+
+// Sheets whose formulas are waiting to be added to the dependency graph.
+typedef struct {
+    size_t *sheets;
+    size_t count;
+    size_t capacity;
+} LinkQueue;
+
+// Sheets to link by 'link_queued'.
+static LinkQueue link_queue = {0};
+
+// Function to make sure the formulas of a sheet get into the dependency graph.
+void queue_link(size_t index) {
+    if (sheets[index].linked)
+        return;
+    sheets[index].linked = true;
+    if (link_queue.count == link_queue.capacity) {
+        link_queue.capacity = link_queue.capacity ? 2 * link_queue.capacity : 16;
+        link_queue.sheets = checked_realloc(link_queue.sheets, link_queue.capacity * sizeof(size_t));
     }
+    link_queue.sheets[link_queue.count++] = index;
+}
 
-    // Sum all numeric values in the stack to calculate the final result.
-    while (numAssist.size > 0) {
-        *result += double_assist_pop(&numAssist);
+// How the formulas of a sheet are linked by 'link_precedents'.
+typedef struct {
+    // Index of the sheet holding the formulas
+    size_t sheet;
+    // Whether formulas reading other sheets may be out of date
+    bool find_stale;
+    // Whether the positions of the cells read are relative to the formula's,
+    // as in compiled formulas, rather than absolute, as in snapshots
+    bool relative;
+} LinkJob;
+
+// Function to record the cells a formula reads in the dependency graph.
+//
+// The sheets of the cells are queued for linking, so that every formula the
+// graph may ask to evaluate reads loaded sheets only.
+void link_precedents(size_t row, size_t col, const CellRef *cells, size_t num_cells, const CellRange *ranges,
+                     size_t num_ranges, void *data) {
+    const LinkJob *job = data;
+    bool reads_other_sheets = false;
+    uint32_t row_offset = job->relative ? (uint32_t)row : 0, col_offset = job->relative ? (uint32_t)col : 0;
+
+    // The compiled formula already lists each referenced cell once; the graph
+    // drops duplicates among the ranges.
+    CellKey *refs = checked_malloc((num_cells + 1) * sizeof(CellKey));
+    for (size_t r = 0; r < num_cells; ++r) {
+        refs[r] = cell_key(cells[r].sheet, cells[r].row + row_offset, cells[r].col + col_offset);
+        reads_other_sheets |= cells[r].sheet != job->sheet;
+        queue_link(cells[r].sheet);
+    }
+    GraphRange *blocks = checked_malloc((num_ranges + 1) * sizeof(GraphRange));
+    for (size_t r = 0; r < num_ranges; ++r) {
+        blocks[r] = (GraphRange){ranges[r].first.sheet, ranges[r].first.row + row_offset,
+                                 ranges[r].first.col + col_offset, ranges[r].last.row + row_offset,
+                                 ranges[r].last.col + col_offset};
+        reads_other_sheets |= ranges[r].first.sheet != job->sheet;
+        queue_link(ranges[r].first.sheet);
     }
 
-    // Free the memory used by the numeric assist stack.
-    double_assist_delete(&numAssist);
+    CellKey key = cell_key(job->sheet, row, col);
+    graph_set_precedents(key, refs, num_cells, blocks, num_ranges);
+    free(refs);
+    free(blocks);
 
-    // Formula parsing and calculation successful.
-    return true;
+    if (job->find_stale && reads_other_sheets) {
+        if (stale.count == stale.capacity) {
+            stale.capacity = stale.capacity ? 2 * stale.capacity : 64;
+            stale.cells = checked_realloc(stale.cells, stale.capacity * sizeof(CellKey));
+        }
+        stale.cells[stale.count++] = key;
+    }
 }
 
-// Function to update the value of a cell based on its type.
-void update_cell_value(ROW row, COL col) {
-    // Check if the cell contains a formula.
-    if (sheet[row][col].type == eqn) {
-        double result;
+// Function to load a sheet of the opened snapshot, unless it is loaded already.
+Sheet *load_sheet(size_t index) {
+    WorkbookSheet *entry = &sheets[index];
+    if (entry->cells == NULL) {
+        // The sheet's blocks and strings are read from the file on demand.
+        entry->cells = sheet_create(entry->num_rows, entry->num_cols);
+        if (snapshot_max_stack(workbook_snapshot, index) > max_formula_stack)
+            max_formula_stack = snapshot_max_stack(workbook_snapshot, index);
+        snapshot_attach(workbook_snapshot, index, entry->cells);
+    }
+    return entry->cells;
+}
 
-        // Parse and calculate the formula.
-        if (parse_and_calculate_formula(sheet[row][col].strVal, &result)) {
-            sheet[row][col].numVal = result;
-            sheet[row][col].type = num;
-            update_cell_display(row, col, sheet[row][col].strVal);
-        } else {
-            // Display "ERROR" if the formula is invalid.
-            update_cell_display(row, col, "ERROR");
-        }
+// Function to add the formulas of the queued sheets to the dependency graph,
+// loading the sheets first, along with the sheets they read in turn.
+//
+// Only sheets of the opened snapshot are ever queued, as the formulas of the
+// other sheets enter the graph as they are entered. Once cells were edited,
+// the values of a sheet's formulas reading other sheets may be out of date,
+// and they are recalculated with the next changed cells; the values of other
+// formulas only depend on cells of their own sheet, which were not edited.
+void link_queued(void) {
+    while (link_queue.count > 0) {
+        size_t index = link_queue.sheets[--link_queue.count];
+        LinkJob job = {index, workbook_edited, false};
+        load_sheet(index);
+        snapshot_for_each_formula(workbook_snapshot, index, link_precedents, &job);
     }
 }
 
-// Function to set the value of a cell in a spreadsheet.
-void set_cell_value(ROW row, COL col, char *text) {
-    // Check if the input text is empty or NULL.
-    if (text == NULL || *text == '\0') {
+// Function to record the cells referenced by a cell's formula of the active
+// sheet in the dependency graph.
+//
+// 'block' may be NULL for a cell which has just been cleared.
+void update_cell_precedents(size_t row, size_t col, const Block *block) {
+    // Only well-formed formulas read other cells.
+    size_t i = row % BLOCK_ROWS;
+    const Formula *formula = block != NULL && block->type[i] == eqn ? block_formula(block, i) : NULL;
+    if (formula == NULL || formula->num_refs + formula->num_ranges == 0) {
+        graph_set_precedents(cell_key(active_sheet, row, col), NULL, 0, NULL, 0);
         return;
     }
 
-    // Check if the cell is uninitialized and initialize it.
-    if (sheet[row][col].type == none) {
-        initialize_cell(row, col);
+    // The formula is evaluated with the edit, and may read sheets not in use yet.
+    LinkJob job = {active_sheet, false, true};
+    link_precedents(row, col, formula->refs, formula->num_refs, formula->ranges, formula->num_ranges, &job);
+    link_queued();
+}
+
+// Function to add the formulas of the loaded sheets to the dependency graph.
+//
+// This is deferred until the first edit, so that opening a snapshot and
+// looking at it never has to read all of its formulas. Sheets loaded later are
+// linked right away, see 'use_sheet'.
+void link_workbook(void) {
+    if (workbook_edited)
+        return;
+    for (size_t k = 0; k < num_sheets; ++k) {
+        if (sheets[k].cells != NULL)
+            queue_link(k);
     }
+    link_queued();
+    workbook_edited = true;
 
-    // Check if the input text represents a numeric value.
-    if (is_valid_num(text)) {
-        set_num_value(row, col, text);
-    } else {
-        // Set the string value and handle formulas.
-        set_string_value(row, col, text);
-        if (is_valid_formula(text)) {
-            double result;
-
-            // Parse and calculate the formula.
-            if (parse_and_calculate_formula(text, &result)) {
-                sheet[row][col].type = eqn;
-                char *formattedResult = calloc(MAX_LEN, sizeof(char));
-                snprintf(formattedResult, MAX_LEN, "%lg", result);
-                free(text);
-                text = formattedResult;
-            } else {
-                // Set the cell value to "ERROR" if the formula is invalid.
-                free(text);
-                text = strdup("ERROR");
-            }
-        }
+    // The snapshot's values already account for its cycles; the graph must
+    // know them too, so that edits can tell which cells enter or leave one.
+    const CellKey *cycle_changes;
+    graph_update_cycles(&cycle_changes);
+}
+
+// Function to make sure a sheet is loaded, and that its formulas are in the
+// dependency graph if cells were edited.
+Sheet *use_sheet(size_t index) {
+    load_sheet(index);
+    if (workbook_edited) {
+        queue_link(index);
+        link_queued();
     }
+    return sheets[index].cells;
+}
 
-    // Update all cells in the spreadsheet.
-    for (ROW i = ROW_1; i < NUM_ROWS; ++i) {
-        for (COL j = COL_A; j < NUM_COLS; ++j) {
-            if (!(i == row && j == col)) {
-                update_cell_value(i, j);
-            }
+// Function to find the block holding the cell of a key, if it is allocated.
+Block *key_block(CellKey key) {
+    return sheet_find(sheets[key_sheet(key)].cells, key_row(key), key_col(key));
+}
+
+// Displayed values produced by one recalculation, delivered to the interface
+// in a single 'update_cell_displays' call.
+typedef struct {
+    // Changed cells, in recalculation order
+    CellDisplayUpdate *updates;
+    // Text of each entry of 'updates', truncated to what a cell can show
+    char (*texts)[CELL_DISPLAY_WIDTH + 1];
+    // Number of entries and allocated capacity of both arrays
+    size_t count;
+    size_t capacity;
+} DisplayBatch;
+
+// Display updates of the current recalculation.
+static DisplayBatch display_batch = {0};
+
+// Largest number of cells handed to the interface in one call; bigger
+// recalculations, such as loading a file, are delivered in several calls.
+#define DISPLAY_BATCH_MAX 65536
+
+void deliver_displays(void);
+
+// Function to queue the new text of a cell for display.
+void queue_display(size_t row, size_t col, const char *text) {
+    DisplayBatch *pending = &display_batch;
+
+    if (pending->count == DISPLAY_BATCH_MAX)
+        deliver_displays();
+
+    // The arrays grow to the largest recalculation seen and are then reused.
+    if (pending->count == pending->capacity) {
+        pending->capacity = pending->capacity ? 2 * pending->capacity : 64;
+        pending->updates = checked_realloc(pending->updates, pending->capacity * sizeof(CellDisplayUpdate));
+        pending->texts = checked_realloc(pending->texts, pending->capacity * sizeof(*pending->texts));
+    }
+
+    size_t length = strnlen(text, CELL_DISPLAY_WIDTH);
+    memcpy(pending->texts[pending->count], text, length);
+    pending->texts[pending->count][length] = '\0';
+    pending->updates[pending->count] = (CellDisplayUpdate){row, col, NULL};
+    ++pending->count;
+}
+
+// Function to deliver the queued display updates to the interface.
+void deliver_displays(void) {
+    DisplayBatch *pending = &display_batch;
+    if (pending->count == 0)
+        return;
+
+    // The texts are only linked now, because growing the arrays moves them.
+    for (size_t i = 0; i < pending->count; ++i)
+        pending->updates[i].text = pending->texts[i];
+    update_cell_displays(pending->updates, pending->count);
+    STAT_ADD(display_calls, 1);
+    STAT_ADD(cells_displayed, pending->count);
+    pending->count = 0;
+}
+
+// Change feeds subscribed with 'model_subscribe'.
+typedef struct {
+    ChangeFeed **feeds;
+    size_t count;
+    size_t capacity;
+    // Epoch of the changes being pushed, and whether any were
+    uint64_t epoch;
+    bool pushed;
+} Subscribers;
+
+static Subscribers subscribers = {NULL, 0, 0, 1, false};
+
+// Function to push a record to every change feed, with its text if it has one.
+void push_change(ChangeRecord *record, const char *text, size_t length) {
+    record->epoch = subscribers.epoch;
+    for (size_t k = 0; k < subscribers.count; ++k)
+        change_feed_push(subscribers.feeds[k], record, text, length);
+    subscribers.pushed = true;
+}
+
+// Function to report the new value of a cell to the change feeds.
+void feed_cell(CellKey key, const Block *block) {
+    if (subscribers.count == 0)
+        return;
+    size_t i = key_row(key) % BLOCK_ROWS;
+    ChangeRecord record = {0};
+    record.sheet = (uint16_t)key_sheet(key);
+    record.row = (uint32_t)key_row(key);
+    record.col = (uint32_t)key_col(key);
+    record.type = CHANGE_EMPTY;
+
+    // Strings are copied into the feeds, so consumers never see them freed.
+    const char *text = NULL;
+    size_t length = 0;
+    if (block != NULL) {
+        switch (block->type[i]) {
+            case eqn:
+                if (block->error[i] == cycle_error) {
+                    record.type = CHANGE_CYCLE;
+                } else if (block->error[i]) {
+                    record.type = CHANGE_ERROR;
+                } else {
+                    record.type = CHANGE_NUMBER;
+                    record.number = block->num[i];
+                }
+                break;
+            case num:
+                record.type = CHANGE_NUMBER;
+                record.number = block->num[i];
+                break;
+            case str:
+                record.type = CHANGE_TEXT;
+                text = sheet_text(sheets[key_sheet(key)].cells, block->text[i]);
+                length = strlen(text);
+                break;
+            default:
+                break;
         }
     }
+    push_change(&record, text, length);
+}
+
+// Function to publish the changes pushed since the last call to the consumers
+// of the change feeds, as one epoch.
+void publish_changes(void) {
+    if (!subscribers.pushed)
+        return;
+    for (size_t k = 0; k < subscribers.count; ++k)
+        change_feed_publish(subscribers.feeds[k]);
+    ++subscribers.epoch;
+    subscribers.pushed = false;
+}
 
-    // Update the cell display with the final value.
-    update_cell_display(row, col, text);
+// Function to deliver the queued display updates, and to publish the changes
+// of their recalculation.
+void flush_displays(void) {
+    deliver_displays();
+    publish_changes();
+}
 
-    // Free memory if the cell type is a formula or string.
-    if (sheet[row][col].type == eqn || sheet[row][col].type == str) {
-        free(text);
+// Function to tell whether the formula of a cell may read another cell of the
+// same sheet holding it, at most 'rows' rows and 'cols' columns away.
+//
+// Offsets are taken as signed, which they are on sheets of at most INT32_MAX
+// rows and columns.
+bool reads_nearby(const Formula *formula, size_t sheet, int64_t rows, int64_t cols) {
+    for (size_t k = 0; k < formula->num_refs; ++k) {
+        const CellRef *ref = &formula->refs[k];
+        int64_t row = (int32_t)ref->row, col = (int32_t)ref->col;
+        if (ref->sheet == sheet && -rows <= row && row <= rows && -cols <= col && col <= cols)
+            return true;
     }
+    for (size_t k = 0; k < formula->num_ranges; ++k) {
+        const CellRange *range = &formula->ranges[k];
+        if (range->first.sheet == sheet && (int32_t)range->first.row <= rows && -rows <= (int32_t)range->last.row &&
+            (int32_t)range->first.col <= cols && -cols <= (int32_t)range->last.col)
+            return true;
+    }
+    return false;
 }
 
-// Function to clear a cell in a 2D array and update its display.
-void clear_cell(ROW row, COL col) {
-    // Check if the cell is already empty.
-    if (sheet[row][col].type == none)
+// Function to evaluate ahead the upcoming cells holding the same formula as
+// the first one, which is being evaluated, and which 'evaluate_cell' then
+// takes the results of.
+//
+// The run stops before the first cell which is not going to be evaluated in
+// full, and before cells which could make the cells of the run read each
+// other: all of them then read cells which were up to date before the first
+// one. Cells on a cycle may be part of it, as they never take their result.
+// Runs of one cell are left to 'evaluate_formula'.
+void start_run(EvalContext *context, const Formula *formula) {
+    const CellKey *cells = context->upcoming;
+    context->run_length = 0;
+    if (context->num_upcoming < 2)
         return;
 
-    // Free memory if the cell contains a string value.
-    free(sheet[row][col].strVal);
+    // Cells of a column filled with a formula mostly share their blocks.
+    size_t sheet = key_sheet(cells[0]);
+    size_t first_row = key_row(cells[0]), last_row = first_row;
+    size_t first_col = key_col(cells[0]), last_col = first_col;
+    const Block *block = key_block(cells[0]);
+    if (sheets[sheet].num_rows > INT32_MAX || sheets[sheet].num_cols > INT32_MAX)
+        return;
+    size_t length = 1;
+    while (length < context->num_upcoming && length < EVAL_LANES && key_sheet(cells[length]) == sheet) {
+        size_t row = key_row(cells[length]), col = key_col(cells[length]);
+        if (block == NULL || block->col != col || block->index != row / BLOCK_ROWS)
+            block = key_block(cells[length]);
+        if (block == NULL || block->type[row % BLOCK_ROWS] != eqn || block_formula(block, row % BLOCK_ROWS) != formula)
+            break;
 
-    // Set the cell to its default state.
-    sheet[row][col] = (cell){.type = none, .numVal = 0.0, .strVal = NULL};
+        // The cells the formula reads must lie outside the box around the
+        // cells of the run, whose cells are at most its size apart.
+        bool grows = row < first_row || row > last_row || col < first_col || col > last_col;
+        size_t grown_first_row = row < first_row ? row : first_row, grown_last_row = row > last_row ? row : last_row;
+        size_t grown_first_col = col < first_col ? col : first_col, grown_last_col = col > last_col ? col : last_col;
+        if ((grows && reads_nearby(formula, sheet, (int64_t)(grown_last_row - grown_first_row),
+                                   (int64_t)(grown_last_col - grown_first_col))) ||
+            (context->evaluated != NULL && !context->evaluated(cells + length, context->evaluated_data)))
+            break;
+        first_row = grown_first_row;
+        last_row = grown_last_row;
+        first_col = grown_first_col;
+        last_col = grown_last_col;
+        ++length;
+    }
+    if (length < 2)
+        return;
 
-    // Update the cell display.
-    update_cell_display(row, col, "");
+    evaluate_lanes(context, formula, cells, length, context->run_values, context->run_succeeded);
+    context->run = cells;
+    context->run_length = length;
 }
 
-// Function to retrieve the textual value of a cell in a 2D array.
-char *get_textual_value(ROW row, COL col) {
-    // Get the cell at the specified position.
-    cell *this = &(sheet[row][col]);
+// Function to calculate the result of the formula of a cell, taking it from
+// the run evaluated ahead if the cell is part of it, or starting a run if the
+// cell is the first of the upcoming cells.
+bool cell_result(EvalContext *context, CellKey key, const Formula *formula, double *result) {
+    const CellKey *upcoming = context->upcoming;
+    if (upcoming != NULL && *upcoming == key && formula != NULL) {
+        if (context->run_length == 0 || upcoming < context->run || upcoming >= context->run + context->run_length)
+            start_run(context, formula);
+        if (context->run_length > 0 && context->run <= upcoming && upcoming < context->run + context->run_length) {
+            size_t k = (size_t)(upcoming - context->run);
+            *result = context->run_values[k];
+            return context->run_succeeded[k];
+        }
+    }
+    return evaluate_formula(context, formula, key_row(key), key_col(key), result);
+}
 
-    // Allocate memory for the result string.
-    char *result = calloc(MAX_LEN, sizeof(char));
+// Function to let 'evaluate_cell' start runs from the upcoming cells of a
+// recalculation order, or to stop it with NULL.
+void set_upcoming(EvalContext *context, const CellKey *cells, size_t count) {
+    context->upcoming = cells;
+    context->num_upcoming = count;
+    if (cells == NULL)
+        context->run_length = 0;
+}
 
-    // Check for memory allocation failure.
-    if (result == NULL) {
-        return NULL;
+// Function to run the formula of a cell, returning whether its value changed.
+bool evaluate_cell(EvalContext *context, CellKey key, Block *block, size_t i) {
+    double previous = block->num[i];
+    uint8_t failed = block->error[i];
+    const Formula *formula = block_formula(block, i);
+    double result;
+    STAT_ADD_SHARED(formulas_evaluated, 1);
+
+    // Formulas on a cycle would read values depending on themselves, so they
+    // are not run. Only formulas reading cells can be on one.
+    if (formula != NULL && formula->num_refs + formula->num_ranges > 0 && graph_in_cycle(key)) {
+        block->num[i] = 0;
+        block->error[i] = cycle_error;
+    } else if (cell_result(context, key, formula, &result)) {
+        // Run the compiled formula.
+        block->num[i] = result;
+        block->error[i] = no_error;
+    } else {
+        block->num[i] = 0;
+        block->error[i] = eval_error;
     }
 
-    // Copy the value based on the cell type.
-    switch (this->type) {
+    // The value is exact again, whatever incremental updates came before.
+    block->delta_updates[i] = 0;
+
+    // Equal values display the same, so there is nothing to redraw, and the
+    // cached display text stays valid.
+    bool changed = failed != block->error[i] || memcmp(&previous, &block->num[i], sizeof(double)) != 0;
+    if (changed)
+        block->display_valid[i] = false;
+    return changed;
+}
+
+// Function to format the display text of a cell of the active sheet based on
+// its type, cut to the width of a cell.
+void format_display(const Block *block, size_t i, char *text) {
+    char formatted[NUMBER_TEXT_MAX];
+    const char *shown = formatted;
+
+    switch (block->type[i]) {
         case eqn:
+            if (block->error[i] == cycle_error) {
+                // Formulas reading themselves have no value at all.
+                shown = "#CYCLE";
+            } else if (block->error[i]) {
+                // Display "ERROR" if the formula is invalid.
+                shown = "ERROR";
+            } else {
+                // Results display like "%lg", with six significant digits.
+                number_format_general(block->num[i], 6, formatted);
+            }
+            break;
         case num:
+            // Numbers display their value in full.
+            number_format(block->num[i], formatted);
+            break;
         case str:
-            strncpy(result, this->strVal, MAX_LEN - 1);
-            result[MAX_LEN - 1] = '\0';
+            // Strings display the text that was entered.
+            shown = sheet_text(sheet, block->text[i]);
             break;
-        case none:
-            *result = '\0';
+        default:
+            shown = "";
             break;
     }
 
-    return result;
+    size_t length = strnlen(shown, CELL_DISPLAY_WIDTH);
+    memcpy(text, shown, length);
+    text[length] = '\0';
 }
 
-// Function to free the memory allocated for the textual value.
-void free_textual_value(char *textual_value) {
-    free(textual_value);
+// Function to queue the display of a cell.
+//
+// Display texts are formatted once and cached in the block until the value
+// of the cell changes, so redrawing a region mostly copies cached texts. Only
+// the cells of the active sheet are shown.
+void display_cell(CellKey key, Block *block) {
+    size_t row = key_row(key), col = key_col(key);
+    size_t i = row % BLOCK_ROWS;
+    if (key_sheet(key) != active_sheet)
+        return;
+
+    // Cells in unallocated blocks are empty.
+    if (block == NULL) {
+        queue_display(row, col, "");
+        return;
+    }
+
+    if (block->display == NULL)
+        block->display = checked_malloc(BLOCK_ROWS * sizeof(*block->display));
+    if (!block->display_valid[i]) {
+        format_display(block, i, block->display[i]);
+        block->display_valid[i] = true;
+    }
+    queue_display(row, col, block->display[i]);
 }
 
-// Attempted Implementation For Dependence
-/*
+// Function to report a cell whose value may have changed to the change feeds,
+// on every sheet, and to queue its display.
+void cell_changed(CellKey key, Block *block) {
+    feed_cell(key, block);
+    display_cell(key, block);
+}
 
-// Function to count the number of cells with type function in the spreadsheet.
-int count_function_cells() {
-    int numForm = 0;
+// Function to update the value of a cell and queue its display.
+//
+// Edited cells are always displayed; other cells only if their value changed.
+void update_cell_value(CellKey key, bool edited) {
+    Block *block = key_block(key);
+    size_t i = key_row(key) % BLOCK_ROWS;
+
+    // Only formulas change value without being edited.
+    bool changed = block != NULL && block->type[i] == eqn && evaluate_cell(&eval_context, key, block, i);
+    if (changed || edited)
+        cell_changed(key, block);
+}
 
-    for (int i = 0; i < NUM_ROWS; i++) {
-        for (int j = 0; j < NUM_COLS; j++) {
-            if (sheet[i][j].type == function) {
-                numForm++;
-            }
-        }
+// Function to compare two cell keys for sorting.
+int compare_keys(const void *a, const void *b) {
+    CellKey left = *(const CellKey *)a;
+    CellKey right = *(const CellKey *)b;
+    return (left > right) - (left < right);
+}
+
+#ifdef MODEL_THREADS
+
+// Smallest recalculation worth spreading over several threads.
+#define PARALLEL_MIN_CELLS 1024
+
+// Smallest level whose cells are evaluated in parallel, and the number of
+// cells a thread takes at a time.
+#define PARALLEL_MIN_LEVEL 64
+#define PARALLEL_GRAIN 16
+
+// Evaluation contexts of the worker threads, indexed by worker.
+static EvalContext *worker_contexts = NULL;
+static size_t num_worker_contexts = 0;
+
+// Whether the value of each cell of a parallel recalculation changed.
+static uint8_t *changed_flags = NULL;
+static size_t changed_flags_capacity = 0;
+
+// A level of cells evaluated by the pool.
+typedef struct {
+    // Cells of the level
+    const CellKey *cells;
+    // Where to record whether each value changed
+    uint8_t *changed;
+} LevelJob;
+
+// Function to evaluate some of the cells of a level on behalf of a worker.
+void evaluate_level(size_t begin, size_t end, size_t worker, void *data) {
+    LevelJob *job = data;
+
+    // Workers only write the values of their own cells, and only read cells
+    // of lower levels, which are complete. Cells of a level do not depend on
+    // each other, so runs of the same formula are evaluated in lanes.
+    EvalContext *context = &worker_contexts[worker];
+    for (size_t k = begin; k < end; ++k) {
+        set_upcoming(context, job->cells + k, end - k);
+        Block *block = key_block(job->cells[k]);
+        size_t i = key_row(job->cells[k]) % BLOCK_ROWS;
+        job->changed[k] = block != NULL && block->type[i] == eqn &&
+                          evaluate_cell(context, job->cells[k], block, i);
+    }
+    set_upcoming(context, NULL, 0);
+}
+
+// Function to recalculate cells level by level, using the thread pool.
+//
+// Each formula reads the same inputs as in a sequential recalculation, so the
+// results are identical; cells are only displayed in a different order.
+void recalculate_parallel(const CellKey *changed, size_t num_changed, size_t count) {
+    const CellKey *order;
+    const size_t *starts;
+    size_t num_levels = graph_recalc_levels(&order, &starts);
+
+    // Looking up a block may load it from a snapshot, which must not happen
+    // on several threads at once. Only the sheets in the graph are read.
+    for (size_t k = 0; k < num_sheets; ++k) {
+        if (sheets[k].linked && sheets[k].cells != NULL)
+            sheet_load_all(sheets[k].cells);
+    }
+
+    for (size_t w = 0; w < num_worker_contexts; ++w)
+        eval_context_prepare(&worker_contexts[w]);
+    if (count > changed_flags_capacity) {
+        changed_flags_capacity = count;
+        changed_flags = checked_realloc(changed_flags, changed_flags_capacity);
+    }
+
+    // Levels are processed one after the other; only the cells within a
+    // level run at the same time.
+    for (size_t level = 0; level < num_levels; ++level) {
+        size_t size = starts[level + 1] - starts[level];
+        LevelJob job = {order + starts[level], changed_flags + starts[level]};
+        if (size >= PARALLEL_MIN_LEVEL)
+            pool_run(size, PARALLEL_GRAIN, evaluate_level, &job);
+        else
+            evaluate_level(0, size, 0, &job);
     }
 
-    return numForm;
+    // Queue the displays on this thread once all values are known.
+    for (size_t i = 0; i < count; ++i) {
+        bool edited = bsearch(&order[i], changed, num_changed, sizeof(CellKey), compare_keys) != NULL;
+        if (changed_flags[i] || edited)
+            cell_changed(order[i], key_block(order[i]));
+    }
 }
 
-// Function to perform dependency check and update cells in the spreadsheet.
-void perform_dependency_check() {
-    int numForm = count_function_cells();
+#endif
 
-    for (int q = 0; q < numForm; q++) {
-        for (int i = 0; i < NUM_ROWS; i++) {
-            for (int j = 0; j < NUM_COLS; j++) {
-                if (!(i == row && j == col)) {
-                    dependencyCheck(i, j);
-                }
-            }
-        }
+// Whether linear formulas may be updated by the changes of their precedents,
+// see 'model_set_delta_updates'; otherwise they are always evaluated.
+static bool delta_updates_enabled = false;
+
+// Largest number of times the value of a formula is updated incrementally
+// before it is evaluated in full again, which bounds the rounding errors the
+// updates accumulate.
+#define DELTA_MAX_UPDATES 64
+
+// Largest number of changed precedents whose changes are added up for one
+// formula in a recalculation; beyond that, evaluating it is cheaper.
+#define DELTA_MAX_TERMS 8
+
+// What happened to a cell during a recalculation.
+typedef struct {
+    CellKey key;
+    // Recalculation the entry belongs to; entries of other ones are unused
+    uint32_t pass;
+    // Number of changed precedents whose changes were added to 'delta'
+    uint32_t terms;
+    // Whether the cell must be evaluated in full
+    bool exact;
+    // Change of the value implied by the changes of the precedents, and the
+    // largest magnitude of the values involved, which bounds its rounding error
+    double delta;
+    double scale;
+    // Whether the cell was edited, and if so, whether it had a value before
+    // the first edit that changes can be computed from, and that value
+    bool edited;
+    bool previous_valid;
+    double previous;
+} CellDelta;
+
+// Changes of the cells of the current recalculation, in an open-addressing
+// hash table whose capacity is a power of two.
+typedef struct {
+    CellDelta *entries;
+    size_t capacity;
+    // Number of entries of the current recalculation
+    size_t count;
+    // Number of the current recalculation
+    uint32_t pass;
+} DeltaTable;
+
+// Changes of the model's recalculation.
+static DeltaTable deltas = {NULL, 0, 0, 1};
+
+// Function to find the entry of a cell in the table, or the free slot for it.
+CellDelta *delta_slot(CellKey key) {
+    size_t mask = deltas.capacity - 1;
+    size_t slot = (size_t)((key * 0x9E3779B97F4A7C15ull) >> 32) & mask;
+    while (deltas.entries[slot].pass == deltas.pass && deltas.entries[slot].key != key)
+        slot = (slot + 1) & mask;
+    return &deltas.entries[slot];
+}
+
+// Function to make room for 'count' more entries in the table.
+void reserve_deltas(size_t count) {
+    if (2 * (deltas.count + count) <= deltas.capacity)
+        return;
+
+    // Move the entries of the current recalculation over to a larger table.
+    CellDelta *old = deltas.entries;
+    size_t old_capacity = deltas.capacity;
+    while (2 * (deltas.count + count) > deltas.capacity)
+        deltas.capacity = deltas.capacity ? 2 * deltas.capacity : 64;
+    deltas.entries = checked_calloc(deltas.capacity, sizeof(CellDelta));
+    for (size_t i = 0; i < old_capacity; ++i) {
+        if (old[i].pass == deltas.pass)
+            *delta_slot(old[i].key) = old[i];
+    }
+    free(old);
+}
+
+// Function to find the entry of a cell, or NULL if it has none.
+CellDelta *find_delta(CellKey key) {
+    if (deltas.count == 0)
+        return NULL;
+    CellDelta *entry = delta_slot(key);
+    return entry->pass == deltas.pass ? entry : NULL;
+}
+
+// Function to find the entry of a cell, adding an empty one if it has none.
+CellDelta *insert_delta(CellKey key) {
+    reserve_deltas(1);
+    CellDelta *entry = delta_slot(key);
+    if (entry->pass != deltas.pass) {
+        *entry = (CellDelta){key, deltas.pass, 0, false, 0, 0, false, false, 0};
+        ++deltas.count;
+    }
+    return entry;
+}
+
+// Function to discard the entries of the current recalculation.
+void finish_deltas(void) {
+    deltas.count = 0;
+
+    // Once the numbers wrap around, old entries could look current again.
+    if (++deltas.pass == 0) {
+        memset(deltas.entries, 0, deltas.capacity * sizeof(CellDelta));
+        deltas.pass = 1;
     }
 }
 
-// Function to check dependencies, update cell value, and display in the spreadsheet.
-void dependencyCheck(ROW row, COL col) {
-    if (sheet[row][col].type == function) {
-        sheet[row][col].numVal = parser(row, col);
+// Function to read the value of a cell, returning whether changes can be
+// computed from it.
+bool delta_value(const Block *block, size_t i, double *value) {
+    if (block == NULL) {
+        *value = 0;
+        return true;
     }
-    update_cell_value(row, col);
-    update_cell_display(row, col, get_display_value(row, col));
-    free(get_display_value(row, col));
+    *value = block->num[i];
+    return !(block->type[i] == eqn && block->error[i]) && isfinite(*value);
+}
+
+// Function to record the value of a cell of the active sheet before it is edited.
+//
+// Only the value before the first edit of a recalculation is kept.
+void remember_previous_value(size_t row, size_t col) {
+    CellDelta *entry = insert_delta(cell_key(active_sheet, row, col));
+    if (entry->edited)
+        return;
+    entry->edited = true;
+    entry->previous_valid = delta_value(sheet_find(sheet, row, col), row % BLOCK_ROWS, &entry->previous);
 }
 
-*/
+// Largest evaluation stack of the formulas 'linear_coefficient' analyzes.
+#define LINEAR_MAX_STACK 16
+
+// Part of a formula, as analyzed by 'linear_coefficient'.
+typedef struct {
+    // Whether the value of the part depends on the cell, and by how much it
+    // changes with it; 0 if it does not
+    bool involved;
+    double coefficient;
+    // Value of the part if it is a constant, otherwise NULL
+    const double *constant;
+} LinearPart;
+
+// Function to find out by how much a linear formula of the cell at 'formula_row'
+// and 'formula_col' changes with the cell of a key.
+//
+// Linear formulas add and subtract constants, cells and SUM functions of them,
+// and may multiply and divide them by constants; parts not reading the cell
+// may be anything. Their value changes by the change of the cell times its
+// coefficient. Returns false for other formulas, and formulas with deep stacks.
+bool linear_coefficient(const Formula *formula, size_t formula_row, size_t formula_col, CellKey key,
+                        double *coefficient) {
+    if (formula == NULL || formula->max_stack > LINEAR_MAX_STACK)
+        return false;
+
+    size_t cell_sheet = key_sheet(key);
+    uint32_t row = (uint32_t)key_row(key), col = (uint32_t)key_col(key);
+    uint32_t row_offset = (uint32_t)formula_row, col_offset = (uint32_t)formula_col;
+
+    // Run the code on descriptions of the values instead of the values.
+    LinearPart stack[LINEAR_MAX_STACK];
+    size_t depth = 0;
+    for (size_t k = 0; k < formula->length; ++k) {
+        const Instruction *instruction = &formula->code[k];
+        LinearPart *top = &stack[depth > 0 ? depth - 1 : 0];
+        switch (instruction->op) {
+            case OP_CONST:
+                stack[depth++] = (LinearPart){false, 0, &formula->constants[instruction->operand]};
+                break;
+            case OP_REF:
+            case OP_ADD_REF: {
+                const CellRef *ref = &formula->refs[instruction->operand];
+                bool involved =
+                        ref->row + row_offset == row && ref->col + col_offset == col && ref->sheet == cell_sheet;
+                if (instruction->op == OP_REF) {
+                    stack[depth++] = (LinearPart){involved, involved, NULL};
+                } else {
+                    top->involved |= involved;
+                    top->coefficient += involved;
+                    top->constant = NULL;
+                }
+                break;
+            }
+            case OP_ADD_CONST:
+                top->constant = NULL;
+                break;
+            case OP_NEG:
+                top->coefficient = -top->coefficient;
+                top->constant = NULL;
+                break;
+            case OP_ADD:
+            case OP_SUB: {
+                LinearPart right = stack[--depth];
+                LinearPart *left = top - 1;
+                left->coefficient += instruction->op == OP_ADD ? right.coefficient : -right.coefficient;
+                left->involved |= right.involved;
+                left->constant = NULL;
+                break;
+            }
+            case OP_MUL:
+            case OP_DIV: {
+                // The cell may only be multiplied or divided by a constant.
+                LinearPart right = stack[--depth];
+                LinearPart *left = top - 1;
+                if (right.involved && (instruction->op == OP_DIV || left->involved || left->constant == NULL))
+                    return false;
+                if (left->involved && (right.constant == NULL || (instruction->op == OP_DIV && *right.constant == 0)))
+                    return false;
+                if (right.involved)
+                    *left = (LinearPart){true, right.coefficient * *left->constant, NULL};
+                else if (left->involved)
+                    left->coefficient = instruction->op == OP_MUL ? left->coefficient * *right.constant
+                                                                  : left->coefficient / *right.constant;
+                left->constant = NULL;
+                break;
+            }
+            case OP_POW:
+                --depth;
+                if (top->involved || top[-1].involved)
+                    return false;
+                top[-1].constant = NULL;
+                break;
+            case OP_AGG_BEGIN:
+                // The running sum comes first, below the other totals.
+                for (int t = 0; t < 4; ++t)
+                    stack[depth++] = (LinearPart){false, 0, NULL};
+                break;
+            case OP_AGG_VALUE: {
+                LinearPart value = stack[--depth];
+                LinearPart *sum = &stack[depth - 4];
+                sum->coefficient += value.coefficient;
+                sum->involved |= value.involved;
+                break;
+            }
+            case OP_AGG_RANGE:
+            case OP_AGG_RANGE_EXTREMA: {
+                // Strings and empty cells in ranges are skipped, but their
+                // value is 0 anyway.
+                const CellRange *range = &formula->ranges[instruction->operand];
+                LinearPart *sum = &stack[depth - 4];
+                if (range->first.sheet == cell_sheet && range->first.row + row_offset <= row &&
+                    row <= range->last.row + row_offset && range->first.col + col_offset <= col &&
+                    col <= range->last.col + col_offset) {
+                    sum->coefficient += 1;
+                    sum->involved = true;
+                }
+                break;
+            }
+            case OP_AGG_END:
+                // Only sums are linear in their arguments.
+                depth -= 3;
+                if (stack[depth - 1].involved && instruction->operand != FN_SUM)
+                    return false;
+                break;
+        }
+    }
+
+    *coefficient = stack[0].coefficient;
+    return true;
+}
+
+// Function to pass the change of a cell's value on to the cells reading it.
+void propagate_delta(CellKey key, bool previous_valid, double previous, bool valid, double value) {
+    const CellKey *dependents;
+    size_t count = graph_dependents(key, &dependents);
+
+    for (size_t d = 0; d < count; ++d) {
+        CellDelta *entry = insert_delta(dependents[d]);
+        if (entry->exact)
+            continue;
+
+        // Unless delta updates are on, and without usable values on both
+        // sides, or for formulas that are not linear in the cell, the
+        // dependent is evaluated in full.
+        size_t dependent_row = key_row(dependents[d]);
+        const Block *block = key_block(dependents[d]);
+        double times;
+        if (!delta_updates_enabled || !previous_valid || !valid || block == NULL || block->type[dependent_row % BLOCK_ROWS] != eqn ||
+            !linear_coefficient(block_formula(block, dependent_row % BLOCK_ROWS), dependent_row,
+                                key_col(dependents[d]), key, &times) ||
+            ++entry->terms > DELTA_MAX_TERMS) {
+            entry->exact = true;
+        } else {
+            entry->delta += times * (value - previous);
+            entry->scale += fabs(times) * (fabs(value) > fabs(previous) ? fabs(value) : fabs(previous));
+        }
+    }
+}
+
+// Cells of a sequential recalculation, in order, and whether each of them was
+// edited; the flags are reused by every recalculation.
+typedef struct {
+    const CellKey *cells;
+    uint8_t *edited;
+    size_t capacity;
+} RecalcOrder;
+
+static RecalcOrder recalc_order = {0};
+
+// Function to tell whether 'update_cell_delta' evaluates the formula of a cell
+// of the order in full rather than updating its value, once the precedents of
+// the cell are up to date.
+bool evaluated_in_full(const CellKey *cell, void *data) {
+    const RecalcOrder *order = data;
+    if (order->edited[cell - order->cells])
+        return true;
+    const CellDelta *entry = find_delta(*cell);
+    return entry != NULL && entry->exact;
+}
+
+// Function to update the value of a cell during a sequential recalculation,
+// passing its change on to the cells reading it.
+//
+// Formulas none of whose precedents changed keep their value. With delta
+// updates on, linear formulas add up the changes of their precedents, times
+// their coefficients, instead of being evaluated, unless they were updated that way DELTA_MAX_UPDATES
+// times in a row. The values involved must also be at most a few times larger
+// than the result, since the rounding errors of the update are relative to
+// them: updating 1e17 + 1 to 100 + 1 by adding 100 - 1e17 would give 96.
+void update_cell_delta(CellKey key, bool edited) {
+    Block *block = key_block(key);
+    size_t i = key_row(key) % BLOCK_ROWS;
+    CellDelta *entry = find_delta(key);
+    bool previous_valid;
+    double previous;
+
+    if (edited) {
+        // Edited cells are evaluated and always passed on: even when their
+        // value stays the same, their type may not, which COUNT notices.
+        previous_valid = entry != NULL && entry->edited && entry->previous_valid;
+        previous = previous_valid ? entry->previous : 0;
+        update_cell_value(key, true);
+    } else {
+        // Only formulas are recalculated without being edited.
+        if (entry == NULL || block == NULL || block->type[i] != eqn)
+            return;
+        previous_valid = delta_value(block, i, &previous);
+
+        bool changed;
+        double value = previous + entry->delta;
+        if (!entry->exact && previous_valid && block->delta_updates[i] < DELTA_MAX_UPDATES && isfinite(value) &&
+            value != 0 && fabs(previous) + entry->scale <= 4 * fabs(value)) {
+            changed = memcmp(&previous, &value, sizeof(double)) != 0;
+            block->num[i] = value;
+            ++block->delta_updates[i];
+            STAT_ADD(delta_updates, 1);
+            if (changed)
+                block->display_valid[i] = false;
+        } else {
+            changed = evaluate_cell(&eval_context, key, block, i);
+        }
+        if (!changed)
+            return;
+        cell_changed(key, block);
+    }
+
+    double value;
+    bool valid = delta_value(block, i, &value);
+    propagate_delta(key, previous_valid, previous, valid, value);
+}
+
+// Number of cells lazy evaluation goes through between interrupt checks.
+#define INTERRUPT_INTERVAL 256
+
+// State of lazy evaluation, see 'model_set_lazy'.
+typedef struct {
+    // Whether formulas are only evaluated when their values are needed
+    bool enabled;
+    // Region of the sheet shown by the interface
+    size_t row, col, num_rows, num_cols;
+    // Cells to bring up to date, reused by every recalculation
+    CellKey *cells;
+    size_t num_cells;
+    size_t capacity;
+    // Asked now and then whether to stop evaluating, see 'model_set_interrupt'
+    bool (*interrupted)(void *data);
+    void *interrupt_data;
+} LazyState;
+
+// Lazy evaluation state of the model; the viewport defaults to the cells
+// shown by the fixed-size interface.
+static LazyState lazy = {false, 0, 0, NUM_ROWS, NUM_COLS, NULL, 0, 0, NULL, NULL};
+
+// Function to remember a cell to bring up to date.
+void want_cell(CellKey key) {
+    if (lazy.num_cells == lazy.capacity) {
+        lazy.capacity = lazy.capacity ? 2 * lazy.capacity : 256;
+        lazy.cells = checked_realloc(lazy.cells, lazy.capacity * sizeof(CellKey));
+    }
+    lazy.cells[lazy.num_cells++] = key;
+}
+
+// Function to remember the dirty cells of a region of the active sheet.
+void want_dirty_region(size_t row, size_t col, size_t num_rows, size_t num_cols) {
+    for (size_t c = col; c < col + num_cols && c < sheet_num_cols(sheet); ++c) {
+        for (size_t r = row; r < row + num_rows && r < sheet_num_rows(sheet); ++r) {
+            CellKey key = cell_key(active_sheet, r, c);
+            if (graph_is_dirty(key))
+                want_cell(key);
+        }
+    }
+}
+
+// Function to evaluate dirty cells in dependency order, marking them clean.
+//
+// Cells are displayed when their value changes, or always if they are among
+// 'changed', which must be sorted. If 'interruptible', the evaluation stops
+// once the interrupt check asks it to, and the cells not reached yet are marked
+// dirty again.
+void evaluate_dirty(const CellKey *order, size_t count, const CellKey *changed, size_t num_changed,
+                    bool interruptible) {
+    eval_context_prepare(&eval_context);
+    STAT_ADD(cells_visited, count);
+    STAT_MAX(max_cells_visited, count);
+    for (size_t i = 0; i < count; ++i) {
+        if (interruptible && lazy.interrupted != NULL && i > 0 && i % INTERRUPT_INTERVAL == 0 &&
+            lazy.interrupted(lazy.interrupt_data)) {
+            // The rest of the order was marked clean along with the evaluated
+            // cells; the next evaluation gathers it again.
+            graph_mark_dirty(order + i, count - i);
+            break;
+        }
+        bool edited = num_changed > 0 &&
+                      bsearch(&order[i], changed, num_changed, sizeof(CellKey), compare_keys) != NULL;
+        set_upcoming(&eval_context, order + i, count - i);
+        update_cell_value(order[i], edited);
+    }
+    set_upcoming(&eval_context, NULL, 0);
+}
+
+// Function to bring the remembered cells up to date, along with the cells they read.
+void evaluate_wanted(const CellKey *changed, size_t num_changed) {
+    const CellKey *order;
+    size_t count = graph_clean_order(lazy.cells, lazy.num_cells, &order);
+    lazy.num_cells = 0;
+    evaluate_dirty(order, count, changed, num_changed, true);
+}
+
+// Function to bring every dirty cell up to date.
+void evaluate_all_dirty(void) {
+    const CellKey *order;
+    size_t count = graph_clean_all(&order);
+    evaluate_dirty(order, count, NULL, 0, false);
+    flush_displays();
+}
+
+// Function to handle changed cells in lazy mode.
+//
+// Their dependents are only marked dirty; the changed cells themselves and the
+// dirty cells in the viewport are brought up to date right away.
+void recalculate_lazy(const CellKey *changed, size_t num_changed) {
+    graph_mark_dirty(changed, num_changed);
+
+    // Cells outside the graph neither read nor are read by formulas, so they
+    // can be evaluated on their own.
+    for (size_t i = 0; i < num_changed; ++i) {
+        if (graph_is_dirty(changed[i]))
+            want_cell(changed[i]);
+        else
+            update_cell_value(changed[i], true);
+    }
+    want_dirty_region(lazy.row, lazy.col, lazy.num_rows, lazy.num_cols);
+    evaluate_wanted(changed, num_changed);
+
+    flush_displays();
+}
+
+// Function to recalculate changed cells and everything that depends on them.
+//
+// 'changed' must be sorted and free of duplicates.
+void recalculate(const CellKey *changed, size_t num_changed) {
+    const CellKey *order;
+
+    // Formulas of sheets linked since the last recalculation may read cells
+    // changed before, and are recalculated as if they were edited.
+    if (stale.count > 0) {
+        if (stale.count + num_changed > stale.capacity) {
+            stale.capacity = stale.count + num_changed;
+            stale.cells = checked_realloc(stale.cells, stale.capacity * sizeof(CellKey));
+        }
+        if (num_changed > 0)
+            memcpy(stale.cells + stale.count, changed, num_changed * sizeof(CellKey));
+        qsort(stale.cells, stale.count + num_changed, sizeof(CellKey), compare_keys);
+        size_t count = 0;
+        for (size_t i = 0; i < stale.count + num_changed; ++i) {
+            if (count == 0 || stale.cells[count - 1] != stale.cells[i])
+                stale.cells[count++] = stale.cells[i];
+        }
+        stale.count = 0;
+        changed = stale.cells;
+        num_changed = count;
+    }
+
+    // Make sure no evaluation below needs to allocate.
+    eval_context_prepare(&eval_context);
+
+    // Edited formulas may have closed or broken cycles.
+    const CellKey *cycle_changes;
+    size_t num_cycle_changes = graph_update_cycles(&cycle_changes);
+    STAT_ADD(recalculations, 1);
+
+    if (lazy.enabled) {
+        recalculate_lazy(changed, num_changed);
+        finish_deltas();
+        return;
+    }
+
+    // The graph orders the cells so that each formula is evaluated only after
+    // all of the cells it reads are up to date.
+    size_t count = graph_recalc_order(changed, num_changed, &order);
+    STAT_ADD(cells_visited, count);
+    STAT_MAX(max_cells_visited, count);
+
+#ifdef MODEL_THREADS
+    // Large recalculations are spread over the threads, if there are any.
+    if (pool_thread_count() > 1 && count >= PARALLEL_MIN_CELLS) {
+        recalculate_parallel(changed, num_changed, count);
+        flush_displays();
+        finish_deltas();
+        return;
+    }
+#endif
+
+    // Every cell of the order gets at most one entry in the table of changes.
+    // Cells entering or leaving a cycle depend on the edited cells, and must be
+    // evaluated even if none of the cells they read changed value.
+    reserve_deltas(count);
+    for (size_t i = 0; i < num_cycle_changes; ++i)
+        insert_delta(cycle_changes[i])->exact = true;
+
+    // Runs of cells filled with the same formula and evaluated in full, such
+    // as the cells of a region a formula was filled into, are evaluated in
+    // lanes.
+    if (count > recalc_order.capacity) {
+        while (count > recalc_order.capacity)
+            recalc_order.capacity = recalc_order.capacity ? 2 * recalc_order.capacity : 64;
+        recalc_order.edited = checked_realloc(recalc_order.edited, recalc_order.capacity);
+    }
+    recalc_order.cells = order;
+    for (size_t i = 0; i < count; ++i)
+        recalc_order.edited[i] = bsearch(&order[i], changed, num_changed, sizeof(CellKey), compare_keys) != NULL;
+    eval_context.evaluated = evaluated_in_full;
+    eval_context.evaluated_data = &recalc_order;
+    for (size_t i = 0; i < count; ++i) {
+        set_upcoming(&eval_context, order + i, count - i);
+        update_cell_delta(order[i], recalc_order.edited[i]);
+    }
+    set_upcoming(&eval_context, NULL, 0);
+    eval_context.evaluated = NULL;
+    finish_deltas();
+
+    // Hand all changed cells to the interface at once.
+    flush_displays();
+}
+
+// Function to recalculate a changed cell of the active sheet, or to remember
+// it while a batch is open.
+void recalculate_from(size_t row, size_t col) {
+    CellKey changed = cell_key(active_sheet, row, col);
+
+    if (batch.depth == 0) {
+        recalculate(&changed, 1);
+        journal_commit();
+        return;
+    }
+
+    if (batch.num_changed == batch.capacity) {
+        batch.capacity = batch.capacity ? 2 * batch.capacity : 64;
+        batch.changed = checked_realloc(batch.changed, batch.capacity * sizeof(CellKey));
+    }
+    batch.changed[batch.num_changed++] = changed;
+}
+
+// Function to check whether a position lies within the sheet.
+bool in_sheet(size_t row, size_t col) {
+    return row < sheet_num_rows(current_sheet()) && col < sheet_num_cols(sheet);
+}
+
+// Function to discard the sheets of the workbook along with the dependency
+// graph and any pending edits.
+void clear_workbook(void) {
+    for (size_t k = 0; k < num_sheets; ++k) {
+        if (sheets[k].cells != NULL)
+            sheet_free(sheets[k].cells);
+        free(sheets[k].name);
+    }
+    num_sheets = 0;
+    active_sheet = 0;
+    sheet = NULL;
+    snapshot_close(workbook_snapshot);
+    workbook_snapshot = NULL;
+    workbook_edited = false;
+    graph_reset();
+    batch.num_changed = 0;
+    stale.count = 0;
+    finish_deltas();
+    journal_clear();
+
+    // Consumers of the change feeds have to read the new workbook afresh.
+    if (subscribers.count > 0) {
+        ChangeRecord record = {0};
+        record.type = CHANGE_RESET;
+        push_change(&record, NULL, 0);
+        publish_changes();
+    }
+}
+
+// Function to add a sheet to the workbook, without loading it.
+void append_sheet(const char *name, size_t num_rows, size_t num_cols) {
+    if (num_sheets == sheets_capacity) {
+        sheets_capacity = sheets_capacity ? 2 * sheets_capacity : 8;
+        sheets = checked_realloc(sheets, sheets_capacity * sizeof(WorkbookSheet));
+    }
+    size_t length = strlen(name);
+    char *copy = checked_malloc(length + 1);
+    memcpy(copy, name, length + 1);
+    sheets[num_sheets++] = (WorkbookSheet){copy, num_rows, num_cols, NULL, false};
+}
+
+// Function to add an empty sheet to the workbook.
+void create_sheet(const char *name, size_t num_rows, size_t num_cols) {
+    append_sheet(name, num_rows, num_cols);
+    sheets[num_sheets - 1].cells = sheet_create(num_rows, num_cols);
+    sheets[num_sheets - 1].linked = true;
+}
+
+void model_init_sized(size_t num_rows, size_t num_cols) {
+    clear_workbook();
+    create_sheet(DEFAULT_SHEET_NAME, num_rows, num_cols);
+    sheet = sheets[0].cells;
+}
+
+void model_init() {
+    model_init_sized(NUM_ROWS, NUM_COLS);
+}
+
+size_t model_num_rows(void) {
+    return sheet_num_rows(current_sheet());
+}
+
+size_t model_num_cols(void) {
+    return sheet_num_cols(current_sheet());
+}
+
+// Function to record the change of a cell to a new text in the journal,
+// before the cell is changed.
+void journal_cell(size_t row, size_t col, const char *text, size_t length) {
+    if (journal_paused)
+        return;
+    const char *old_text;
+    size_t old_length;
+    get_textual_value_view_at(row, col, &old_text, &old_length);
+    journal_record(active_sheet, row, col, old_text, old_length, text, length);
+}
+
+void set_cell_value_at(size_t row, size_t col, char *text) {
+    // Check if the input text is empty or NULL, or the cell is outside the sheet.
+    if (text == NULL || *text == '\0' || !in_sheet(row, col)) {
+        free(text);
+        return;
+    }
+    STAT_EDIT_BEGIN();
+
+    // Store the value according to what the input text represents.
+    size_t length = strlen(text);
+    link_workbook();
+    journal_cell(row, col, text, length);
+    remember_previous_value(row, col);
+    Block *block = sheet_insert(sheet, row, col);
+    size_t i = row % BLOCK_ROWS;
+    double value;
+    if (read_num(text, length, &value)) {
+        set_num_value(block, i, text, value);
+    } else if (*skip_whitespace(text) == '=') {
+        set_formula_value(block, i, text);
+    } else {
+        set_string_value(block, i, text);
+    }
+
+    // Update the dependency edges and recalculate the affected cells only.
+    update_cell_precedents(row, col, block);
+    recalculate_from(row, col);
+    STAT_EDIT_END();
+}
+
+void clear_cell_at(size_t row, size_t col) {
+    // Check if the cell is already empty.
+    Block *block = in_sheet(row, col) ? sheet_find(sheet, row, col) : NULL;
+    if (block == NULL || block->type[row % BLOCK_ROWS] == none)
+        return;
+    STAT_EDIT_BEGIN();
+
+    // Free memory if the cell contains a string value or formula.
+    link_workbook();
+    journal_cell(row, col, "", 0);
+    remember_previous_value(row, col);
+    release_cell_contents(block, row % BLOCK_ROWS);
+
+    // Return the cell to the empty state; this may release its block.
+    update_cell_precedents(row, col, NULL);
+    sheet_remove(sheet, row, col);
+
+    // Update the cell display and its dependents.
+    recalculate_from(row, col);
+    STAT_EDIT_END();
+}
+
+// Text of the last number viewed with 'get_textual_value_view_at'.
+static char viewed_number[NUMBER_TEXT_MAX];
+
+void get_textual_value_view_at(size_t row, size_t col, const char **text, size_t *length) {
+    // Get the cell at the specified position.
+    const Block *block = in_sheet(row, col) ? sheet_find(sheet, row, col) : NULL;
+    size_t i = row % BLOCK_ROWS;
+
+    // Find the value based on the cell type; empty cells have no text.
+    // Strings and formulas are viewed where the sheet stores them, and only
+    // numbers need to be formatted.
+    *text = "";
+    *length = 0;
+    if (block != NULL) {
+        switch (block->type[i]) {
+            case num:
+                *length = number_format(block->num[i], viewed_number);
+                *text = viewed_number;
+                break;
+            case str:
+            case eqn:
+                *text = sheet_text(sheet, block->text[i]);
+                *length = strlen(*text);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+char *get_textual_value_at(size_t row, size_t col) {
+    const char *text;
+    size_t length;
+    get_textual_value_view_at(row, col, &text, &length);
+
+    // Allocate memory for the result string, only as long as needed.
+    if (length > MAX_LEN - 1)
+        length = MAX_LEN - 1;
+    char *result = malloc(length + 1);
+
+    // Check for memory allocation failure.
+    if (result == NULL) {
+        return NULL;
+    }
+
+    memcpy(result, text, length);
+    result[length] = '\0';
+    return result;
+}
+
+void model_set_threads(size_t count) {
+#ifdef MODEL_THREADS
+    pool_start(count);
+
+    // Every worker evaluates formulas on a stack of its own.
+    size_t workers = pool_thread_count();
+    for (size_t w = workers; w < num_worker_contexts; ++w) {
+        double_assist_delete(&worker_contexts[w].stack);
+        free(worker_contexts[w].lanes);
+    }
+    worker_contexts = checked_realloc(worker_contexts, workers * sizeof(EvalContext));
+    for (size_t w = num_worker_contexts; w < workers; ++w)
+        worker_contexts[w] = (EvalContext){0};
+    num_worker_contexts = workers;
+#else
+    // Builds without MODEL_THREADS always recalculate on the calling thread.
+    (void)count;
+#endif
+}
+
+size_t model_thread_count(void) {
+#ifdef MODEL_THREADS
+    return pool_thread_count();
+#else
+    return 1;
+#endif
+}
+
+ChangeFeed *model_subscribe(size_t capacity, size_t text_capacity) {
+    if (subscribers.count == subscribers.capacity) {
+        subscribers.capacity = subscribers.capacity ? 2 * subscribers.capacity : 4;
+        subscribers.feeds = checked_realloc(subscribers.feeds, subscribers.capacity * sizeof(ChangeFeed *));
+    }
+    ChangeFeed *feed = change_feed_create(capacity, text_capacity);
+    subscribers.feeds[subscribers.count++] = feed;
+    return feed;
+}
+
+void model_unsubscribe(ChangeFeed *feed) {
+    for (size_t k = 0; k < subscribers.count; ++k) {
+        if (subscribers.feeds[k] == feed) {
+            subscribers.feeds[k] = subscribers.feeds[--subscribers.count];
+            change_feed_free(feed);
+            return;
+        }
+    }
+}
+
+void model_begin_batch(void) {
+    ++batch.depth;
+}
+
+void model_commit_batch(void) {
+    if (batch.depth == 0 || --batch.depth > 0)
+        return;
+
+    // A cell edited several times is recalculated and displayed only once.
+    qsort(batch.changed, batch.num_changed, sizeof(CellKey), compare_keys);
+    size_t count = 0;
+    for (size_t i = 0; i < batch.num_changed; ++i) {
+        if (count == 0 || batch.changed[count - 1] != batch.changed[i])
+            batch.changed[count++] = batch.changed[i];
+    }
+
+    batch.num_changed = 0;
+    recalculate(batch.changed, count);
+
+    // All edits of the batch are undone together.
+    journal_commit();
+}
+
+void set_cell_values(const CellUpdate *updates, size_t count) {
+    model_begin_batch();
+    for (size_t i = 0; i < count; ++i) {
+        if (updates[i].text != NULL)
+            set_cell_value_at(updates[i].row, updates[i].col, updates[i].text);
+        else
+            clear_cell_at(updates[i].row, updates[i].col);
+    }
+    model_commit_batch();
+}
+
+// Cells collected while loading a CSV file.
+typedef struct {
+    // Formula cells, which are compiled once all cells are loaded
+    CellKey *formulas;
+    size_t num_formulas;
+    size_t capacity;
+} CsvLoad;
+
+// Function to store one field of a CSV file in its cell.
+void load_field(size_t row, size_t col, char *text, size_t length, void *data) {
+    CsvLoad *load = data;
+
+    // Fields outside the sheet are dropped, and empty fields leave empty cells.
+    if (!in_sheet(row, col))
+        return;
+    if (length == 0) {
+        clear_cell_at(row, col);
+        return;
+    }
+
+    Block *block = sheet_insert(sheet, row, col);
+    size_t i = row % BLOCK_ROWS;
+    CellKey key = cell_key(active_sheet, row, col);
+    bool had_formula = block->type[i] == eqn;
+    release_cell_contents(block, i);
+
+    // Classify the field in place, without going through 'set_cell_value_at'.
+    double value;
+    if (read_num(text, length, &value)) {
+        block->type[i] = num;
+        block->num[i] = value;
+    } else if (*skip_whitespace(text) == '=') {
+        block->type[i] = eqn;
+        block->num[i] = 0;
+        block->error[i] = no_error;
+        block->text[i] = sheet_intern_text(sheet, text, length);
+
+        // Formulas are compiled and linked into the graph after the load.
+        if (load->num_formulas == load->capacity) {
+            load->capacity = load->capacity ? 2 * load->capacity : 1024;
+            load->formulas = checked_realloc(load->formulas, load->capacity * sizeof(CellKey));
+        }
+        load->formulas[load->num_formulas++] = key;
+        return;
+    } else {
+        block->type[i] = str;
+        block->num[i] = 0;
+        block->text[i] = sheet_intern_text(sheet, text, length);
+    }
+
+    // A literal replacing a formula no longer reads any cells.
+    if (had_formula)
+        graph_set_precedents(key, NULL, 0, NULL, 0);
+
+    // Cells read by formulas are recalculated along with them; the others
+    // only need to be displayed.
+    if (graph_has_dependents(key))
+        recalculate_from(row, col);
+    else
+        cell_changed(key, block);
+}
+
+bool model_load_csv(const char *path, char delimiter) {
+    FILE *stream = fopen(path, "rb");
+    if (stream == NULL)
+        return false;
+
+    // Store all fields first, with recalculation deferred to the end.
+    CsvLoad load = {0};
+    current_sheet();
+    link_workbook();
+    model_begin_batch();
+    journal_paused = true;
+    bool ok = csv_read(stream, delimiter, load_field, &load);
+    fclose(stream);
+
+    // Build the dependency graph of the loaded formulas in one go, which lets
+    // the recalculation below evaluate them in dependency order.
+    for (size_t k = 0; k < load.num_formulas; ++k) {
+        size_t row = key_row(load.formulas[k]), col = key_col(load.formulas[k]);
+        Block *block = sheet_find(sheet, row, col);
+        compile_cell_formula(block, row % BLOCK_ROWS);
+        update_cell_precedents(row, col, block);
+        recalculate_from(row, col);
+    }
+    free(load.formulas);
+
+    // A load cannot be undone, and edits from before it no longer apply.
+    model_commit_batch();
+    journal_paused = false;
+    journal_clear();
+    return ok;
+}
+
+// Function to find the extent of the populated cells.
+void measure_cell(Block *block, size_t index, size_t row, size_t col, void *data) {
+    size_t *extent = data;
+    (void)block;
+    (void)index;
+    if (row + 1 > extent[0])
+        extent[0] = row + 1;
+    if (col + 1 > extent[1])
+        extent[1] = col + 1;
+}
+
+bool model_save_csv(const char *path, char delimiter) {
+    FILE *stream = fopen(path, "wb");
+    if (stream == NULL)
+        return false;
+    setvbuf(stream, NULL, _IOFBF, 1 << 20);
+
+    // The file covers the rectangle from A1 to the last populated row and column.
+    size_t extent[2] = {0, 0};
+    sheet_for_each(current_sheet(), measure_cell, extent);
+    size_t num_rows = extent[0], num_cols = extent[1];
+    Block **blocks = checked_malloc(num_cols * sizeof(Block *));
+    char formatted[NUMBER_TEXT_MAX];
+
+    // Rows are written one block at a time, looking up each column's block once.
+    for (size_t index = 0; index * BLOCK_ROWS < num_rows; ++index) {
+        for (size_t col = 0; col < num_cols; ++col)
+            blocks[col] = sheet_find_block(sheet, col, index);
+
+        for (size_t row = index * BLOCK_ROWS; row < num_rows && row < (index + 1) * BLOCK_ROWS; ++row) {
+            size_t i = row % BLOCK_ROWS;
+            for (size_t col = 0; col < num_cols; ++col) {
+                if (col > 0)
+                    fputc(delimiter, stream);
+                if (blocks[col] == NULL)
+                    continue;
+
+                // Numbers are written from their value, as when editing.
+                switch (blocks[col]->type[i]) {
+                    case num:
+                        fwrite(formatted, 1, number_format(blocks[col]->num[i], formatted), stream);
+                        break;
+                    case str:
+                    case eqn:
+                        csv_write_field(stream, sheet_text(sheet, blocks[col]->text[i]), delimiter);
+                        break;
+                    default:
+                        break;
+                }
+            }
+            fputc('\n', stream);
+        }
+    }
+
+    free(blocks);
+    bool ok = !ferror(stream);
+    return fclose(stream) == 0 && ok;
+}
+
+// Function to find out whether a formula of a snapshot reads a loaded sheet.
+void find_loaded_precedent(size_t row, size_t col, const CellRef *cells, size_t num_cells, const CellRange *ranges,
+                           size_t num_ranges, void *data) {
+    bool *found = data;
+    (void)row;
+    (void)col;
+    for (size_t r = 0; r < num_cells; ++r)
+        *found |= sheets[cells[r].sheet].cells != NULL;
+    for (size_t r = 0; r < num_ranges; ++r)
+        *found |= sheets[ranges[r].first.sheet].cells != NULL;
+}
+
+// Function to load the sheets of the opened snapshot whose values may be out
+// of date because of edits, and to recalculate their formulas.
+//
+// Only loaded sheets can have been edited, so the values of a sheet which was
+// never loaded are up to date unless it reads a loaded sheet, directly or
+// through other sheets; loading a sheet may therefore call for loading more.
+void load_edited_readers(void) {
+    if (!workbook_edited)
+        return;
+    bool loaded = true;
+    while (loaded) {
+        loaded = false;
+        for (size_t k = 0; k < num_sheets; ++k) {
+            bool reads_loaded = false;
+            if (sheets[k].cells == NULL)
+                snapshot_for_each_formula(workbook_snapshot, k, find_loaded_precedent, &reads_loaded);
+            if (reads_loaded) {
+                use_sheet(k);
+                loaded = true;
+            }
+        }
+    }
+    if (stale.count > 0 && batch.depth == 0)
+        recalculate(NULL, 0);
+}
+
+bool model_save_snapshot(const char *path) {
+    // Snapshots hold calculated values, so none may be out of date.
+    current_sheet();
+    load_edited_readers();
+    evaluate_all_dirty();
+
+    // Sheets which were never loaded are copied from the opened snapshot,
+    // values included, which are still up to date.
+    SnapshotSheet *list = checked_malloc(num_sheets * sizeof(SnapshotSheet));
+    for (size_t k = 0; k < num_sheets; ++k)
+        list[k] = (SnapshotSheet){sheets[k].name, sheets[k].cells, workbook_snapshot, k};
+    bool ok = snapshot_write(list, num_sheets, max_formula_stack, path);
+    free(list);
+    return ok;
+}
+
+// Function to check whether a text has the form of a sheet name: letters,
+// digits and underscores, not starting with a digit.
+bool is_sheet_name(const char *name) {
+    if (!isalpha((unsigned char)*name) && *name != '_')
+        return false;
+    for (const char *c = name; *c; ++c) {
+        if (!isalnum((unsigned char)*c) && *c != '_')
+            return false;
+    }
+    return true;
+}
+
+// Function to get the name of a sheet of a snapshot as the workbook knows it.
+const char *snapshot_name(const Snapshot *snapshot, size_t k) {
+    const char *name = snapshot_sheet_name(snapshot, k);
+    return snapshot_num_sheets(snapshot) == 1 && *name == '\0' ? DEFAULT_SHEET_NAME : name;
+}
+
+bool model_open_snapshot(const char *path) {
+    Snapshot *snapshot = snapshot_open(path);
+    if (snapshot == NULL)
+        return false;
+
+    // Formulas refer to sheets by name, so damaged names make the file unusable.
+    size_t count = snapshot_num_sheets(snapshot);
+    bool ok = count <= MAX_SHEETS;
+    for (size_t k = 0; k < count && ok; ++k) {
+        ok = is_sheet_name(snapshot_name(snapshot, k));
+        for (size_t other = 0; other < k && ok; ++other)
+            ok = !same_name(snapshot_name(snapshot, other), snapshot_name(snapshot, k),
+                            strlen(snapshot_name(snapshot, k)));
+    }
+    if (!ok) {
+        snapshot_close(snapshot);
+        return false;
+    }
+
+    // Only the first sheet is loaded; the others are loaded once they are
+    // used, and their formulas are linked into the graph then.
+    clear_workbook();
+    for (size_t k = 0; k < count; ++k)
+        append_sheet(snapshot_name(snapshot, k), snapshot_num_rows(snapshot, k), snapshot_num_cols(snapshot, k));
+    workbook_snapshot = snapshot;
+    sheet = load_sheet(0);
+    return true;
+}
+
+void model_redisplay(size_t row, size_t col, size_t num_rows, size_t num_cols) {
+    current_sheet();
+
+    // Out-of-date values are calculated before they are shown.
+    want_dirty_region(row, col, num_rows, num_cols);
+    evaluate_wanted(NULL, 0);
+
+    for (size_t c = col; c < col + num_cols && c < sheet_num_cols(sheet); ++c) {
+        for (size_t r = row; r < row + num_rows && r < sheet_num_rows(sheet); ++r)
+            display_cell(cell_key(active_sheet, r, c), sheet_find(sheet, r, c));
+    }
+    flush_displays();
+}
+
+void model_update_region(size_t row, size_t col, size_t num_rows, size_t num_cols) {
+    current_sheet();
+    want_dirty_region(row, col, num_rows, num_cols);
+    evaluate_wanted(NULL, 0);
+    flush_displays();
+}
+
+bool model_add_sheet(const char *name, size_t num_rows, size_t num_cols) {
+    current_sheet();
+    // Formulas refer to sheets by name, which must therefore be unique.
+    size_t index;
+    if (num_sheets == MAX_SHEETS || num_cols > SHEET_MAX_COLS || !is_sheet_name(name) ||
+        find_sheet_named(name, strlen(name), &index))
+        return false;
+    create_sheet(name, num_rows, num_cols);
+    return true;
+}
+
+size_t model_num_sheets(void) {
+    current_sheet();
+    return num_sheets;
+}
+
+const char *model_sheet_name(size_t index) {
+    return index < model_num_sheets() ? sheets[index].name : NULL;
+}
+
+bool model_find_sheet(const char *name, size_t *index) {
+    current_sheet();
+    return find_sheet_named(name, strlen(name), index);
+}
+
+// Function to make a sheet the active one.
+void activate_sheet(size_t index) {
+    active_sheet = index;
+    sheet = use_sheet(index);
+}
+
+bool model_select_sheet(size_t index) {
+    if (index >= model_num_sheets())
+        return false;
+    activate_sheet(index);
+
+    // Formulas of the sheet may read cells edited before it was loaded.
+    if (stale.count > 0 && batch.depth == 0)
+        recalculate(NULL, 0);
+    return true;
+}
+
+size_t model_active_sheet(void) {
+    current_sheet();
+    return active_sheet;
+}
+
+void model_set_lazy(bool enabled) {
+    // Leaving lazy mode brings every formula up to date.
+    if (lazy.enabled && !enabled && sheet != NULL)
+        evaluate_all_dirty();
+    lazy.enabled = enabled;
+}
+
+bool model_is_lazy(void) {
+    return lazy.enabled;
+}
+
+void model_set_delta_updates(bool enabled) {
+    delta_updates_enabled = enabled;
+}
+
+bool model_has_delta_updates(void) {
+    return delta_updates_enabled;
+}
+
+void model_set_viewport(size_t row, size_t col, size_t num_rows, size_t num_cols) {
+    lazy.row = row;
+    lazy.col = col;
+    lazy.num_rows = num_rows;
+    lazy.num_cols = num_cols;
+}
+
+void model_set_interrupt(bool (*interrupted)(void *data), void *data) {
+    lazy.interrupted = interrupted;
+    lazy.interrupt_data = data;
+}
+
+// Function to give a cell a text taken from the journal.
+//
+// Its sheet is made active meanwhile, so that its edits apply to it.
+void restore_cell(size_t index, size_t row, size_t col, const char *text, size_t length, void *data) {
+    (void)data;
+    size_t active = active_sheet;
+    activate_sheet(index);
+    if (length == 0) {
+        clear_cell_at(row, col);
+    } else {
+        char *copy = checked_malloc(length + 1);
+        memcpy(copy, text, length);
+        copy[length] = '\0';
+        set_cell_value_at(row, col, copy);
+    }
+    activate_sheet(active);
+}
+
+// Function to replay a step of the journal as a single batch of edits.
+bool replay_journal(bool (*step)(JournalVisit, void *)) {
+    // Steps cannot be replayed in the middle of a batch, whose edits are not
+    // in the journal yet.
+    if (batch.depth > 0)
+        return false;
+    journal_paused = true;
+    model_begin_batch();
+    bool replayed = step(restore_cell, NULL);
+    model_commit_batch();
+    journal_paused = false;
+    return replayed;
+}
+
+bool model_undo(void) {
+    return replay_journal(journal_undo);
+}
+
+bool model_redo(void) {
+    return replay_journal(journal_redo);
+}
+
+void model_set_undo_limit(size_t bytes) {
+    journal_set_limit(bytes);
+}
+
+// Function to set the value of a cell in a spreadsheet.
+void set_cell_value(ROW row, COL col, char *text) {
+    set_cell_value_at(row, col, text);
+}
+
+// Function to clear a cell and update its display.
+void clear_cell(ROW row, COL col) {
+    clear_cell_at(row, col);
+}
+
+// Function to retrieve the textual value of a cell.
+char *get_textual_value(ROW row, COL col) {
+    return get_textual_value_at(row, col);
+}
+
+void get_textual_value_view(ROW row, COL col, const char **text, size_t *length) {
+    get_textual_value_view_at(row, col, text, length);
+}
+
+ModelStats model_get_stats(void) {
+#ifdef MODEL_STATS
+    ModelStats result = stats;
+#else
+    ModelStats result = {0};
+#endif
+    result.allocations = allocation_count();
+    current_sheet();
+    for (size_t k = 0; k < num_sheets; ++k) {
+        if (sheets[k].cells != NULL)
+            result.text_bytes += sheet_text_bytes(sheets[k].cells);
+    }
+    return result;
+}
+
+void model_reset_stats(void) {
+#ifdef MODEL_STATS
+    stats = (ModelStats){0};
+#endif
+}
+
+size_t model_allocation_count(void) {
+    return allocation_count();
+}
+
+// Function to free the memory allocated for the textual value.
+void free_textual_value(char *textual_value) {
+    free(textual_value);
+}
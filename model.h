@@ -2,12 +2,57 @@
 #define ASSIGNMENT_MODEL_H
 
 #include "defs.h"
+#include "feed.h"
 
-// Initializes the data structure.
+#include <stdbool.h>
+#include <stddef.h>
+
+// Initializes the data structure for a sheet of NUM_ROWS by NUM_COLS cells.
 //
 // This is called once, at program start.
 void model_init();
 
+// Initializes the data structure for a workbook holding a single sheet of the
+// given size, named "Sheet1", discarding any previous contents.
+//
+// Storage grows with the number of populated cells, so large sheets are cheap
+// as long as they are mostly empty. At most 65536 columns are supported.
+void model_init_sized(size_t num_rows, size_t num_cols);
+
+// Adds an empty sheet of the given size after the other sheets of the
+// workbook.
+//
+// Names consist of letters, digits and underscores and do not start with a
+// digit. Formulas read the cells of other sheets by prefixing references with
+// the name and '!', as in "=Sheet2!A1" or "=SUM(Sheet2!A1:B5)", ignoring case;
+// names must therefore differ from each other regardless of case. Returns
+// false if the name cannot be used, or the workbook already has 65536 sheets.
+bool model_add_sheet(const char *name, size_t num_rows, size_t num_cols);
+
+// Returns the number of sheets of the workbook, and the name of one of them,
+// which stays valid until the workbook is replaced; NULL if there is no such
+// sheet.
+size_t model_num_sheets(void);
+const char *model_sheet_name(size_t sheet);
+
+// Finds the index of the sheet with a name, ignoring case. Returns false if
+// there is none.
+bool model_find_sheet(const char *name, size_t *sheet);
+
+// Makes a sheet the active one; returns false if there is no such sheet.
+//
+// All other functions address the cells of the active sheet, which is the
+// first one after the workbook is created or opened, and only its cells are
+// displayed. Selecting a sheet displays nothing; see 'model_redisplay'.
+bool model_select_sheet(size_t sheet);
+
+// Returns the index of the active sheet.
+size_t model_active_sheet(void);
+
+// Returns the dimensions of the active sheet.
+size_t model_num_rows(void);
+size_t model_num_cols(void);
+
 // Sets the value of a cell based on user input.
 //
 // The string referred to by 'text' is now owned by this function and/or the
@@ -25,4 +70,225 @@ void clear_cell(ROW row, COL col);
 // retain any reference to it after the function returns.
 char *get_textual_value(ROW row, COL col);
 
+// Gets the same text as 'get_textual_value' without copying it.
+//
+// '*text' is set to the text and '*length' to its length; the text is also
+// terminated by a NUL character. It is owned by the model and only stays
+// valid until the next call to this function or the next change of the sheet,
+// so nothing is allocated. Unlike 'get_textual_value', the text is never cut
+// short.
+void get_textual_value_view(ROW row, COL col, const char **text, size_t *length);
+
+// Variants of the functions above addressing cells by 0-based indices, for
+// sheets larger than the ROW and COL enumerations. Positions outside the sheet
+// are ignored and read as empty.
+void set_cell_value_at(size_t row, size_t col, char *text);
+void clear_cell_at(size_t row, size_t col);
+char *get_textual_value_at(size_t row, size_t col);
+void get_textual_value_view_at(size_t row, size_t col, const char **text, size_t *length);
+
+// A single edit applied by 'set_cell_values'.
+typedef struct {
+    // 0-based position of the cell
+    size_t row;
+    size_t col;
+    // New text of the cell, owned by the model from now on as with
+    // 'set_cell_value_at'; NULL clears the cell
+    char *text;
+} CellUpdate;
+
+// Opens a batch of edits.
+//
+// Until the matching 'model_commit_batch', edits are applied to the cells but
+// nothing is recalculated or displayed. Batches may be nested; only closing
+// the outermost one has an effect.
+void model_begin_batch(void);
+
+// Closes a batch of edits, recalculating every cell affected by any of them
+// in a single pass, in dependency order. Each affected cell is displayed once.
+void model_commit_batch(void);
+
+// Applies a number of edits as a single batch.
+void set_cell_values(const CellUpdate *updates, size_t count);
+
+// Undoes the last edit, or all edits of the last batch, that was not undone,
+// recalculating and displaying the affected cells. Returns false if there is
+// nothing to undo, or a batch is open.
+//
+// Edits are kept in a journal of limited size, see 'model_set_undo_limit';
+// loading a file or opening a snapshot empties it.
+bool model_undo(void);
+
+// Redoes the last edit or batch undone. Any other edit makes undone edits
+// impossible to redo. Returns false if there is nothing to redo, or a batch
+// is open.
+bool model_redo(void);
+
+// Sets the memory kept for undoing edits, in bytes, forgetting all edits made
+// so far. Once it is full, the oldest edits can no longer be undone. Defaults
+// to 16 MiB.
+void model_set_undo_limit(size_t bytes);
+
+// Loads cells from a file of delimiter-separated values, such as CSV (',') or
+// TSV ('\t'), into the active sheet, starting at A1.
+//
+// Each field is classified like the text given to 'set_cell_value'; empty
+// fields clear their cell, and fields outside the sheet are ignored. The file
+// is read in large chunks and all formulas are compiled and recalculated once,
+// at the end. Returns false if the file could not be read, in which case the
+// sheet may hold part of it.
+bool model_load_csv(const char *path, char delimiter);
+
+// Writes the active sheet to a file of delimiter-separated values, from A1 up
+// to the last populated row and column. Cells are written as they are edited,
+// so formulas keep their text. Returns false if the file could not be written.
+bool model_save_csv(const char *path, char delimiter);
+
+// Writes every sheet of the workbook to a binary snapshot file, including the
+// calculated values and compiled formulas. Returns false if the file could not
+// be written.
+bool model_save_snapshot(const char *path);
+
+// Replaces the workbook by the contents of a snapshot file.
+//
+// The file is mapped into memory and cells are only read from it once they
+// are accessed, so opening takes nearly constant time even for big sheets.
+// Sheets other than the first are only loaded once they are selected or read
+// by the formulas of the sheets in use, so that a session only pays for the
+// sheets it uses. Nothing is recalculated or displayed; see 'model_redisplay'.
+// Returns false, leaving the workbook as it was, if the file is not a
+// snapshot or was written by a newer version.
+bool model_open_snapshot(const char *path);
+
+// Displays every cell of the given region of the sheet again.
+void model_redisplay(size_t row, size_t col, size_t num_rows, size_t num_cols);
+
+// Calculates the out-of-date cells of the given region of the sheet, which
+// only lazy mode leaves, displaying the ones whose values change.
+//
+// Unlike 'model_redisplay', cells which are up to date are not displayed
+// again. The evaluation may be cut short like that of an edit, see
+// 'model_set_interrupt'.
+void model_update_region(size_t row, size_t col, size_t num_rows, size_t num_cols);
+
+// Chooses whether formulas are only evaluated when their values are needed.
+//
+// In lazy mode, an edit merely marks the formulas depending on the edited
+// cells as out of date. Their values are calculated once they are needed:
+// when they are in the viewport or read by an edited formula, when their
+// region is passed to 'model_redisplay', or when a snapshot is saved. Cells
+// outside the viewport are therefore not displayed after edits. Leaving lazy
+// mode brings every formula up to date. Off by default.
+void model_set_lazy(bool enabled);
+
+// Returns whether the model is in lazy mode.
+bool model_is_lazy(void);
+
+// Chooses whether linear formulas, such as "=A1+2*B1" or "=SUM(A1:A1000)",
+// are updated by the changes of the cells they read instead of being
+// evaluated again, when recalculating on the calling thread.
+//
+// Updating a formula reading many cells is much cheaper than evaluating it,
+// but rounds differently: values may then differ in their last digits from
+// those of a full evaluation, so that they depend on the order of the edits
+// and on the number of threads, and a difference of nearly equal values may
+// come out far off. Off by default, in which case every formula holds the
+// value of evaluating it.
+void model_set_delta_updates(bool enabled);
+
+// Returns whether delta updates are on.
+bool model_has_delta_updates(void);
+
+// Sets the region of the sheet shown by the interface, which lazy mode keeps
+// up to date. Defaults to the NUM_ROWS by NUM_COLS cells at the top left.
+void model_set_viewport(size_t row, size_t col, size_t num_rows, size_t num_cols);
+
+// Lets lazy evaluation be cut short, for instance by an interface that
+// recalculates on a background thread and has newer edits to apply.
+//
+// While evaluating the cells of the viewport and the ones they read, the model
+// calls 'interrupted' with 'data' every few hundred cells, and stops as soon as
+// it returns true. The cells it did not get to stay out of date until the next
+// edit or 'model_redisplay' calculates them; until then, they keep showing
+// their previous values. Saving a snapshot and leaving lazy mode are never
+// interrupted. Pass NULL to turn interrupts off again, which is the default.
+void model_set_interrupt(bool (*interrupted)(void *data), void *data);
+
+// Sets the number of threads recalculating large changes, including the
+// calling thread.
+//
+// Cells whose formulas do not depend on each other are then evaluated in
+// parallel, with results identical to a single-threaded recalculation unless
+// delta updates are on, see 'model_set_delta_updates'. This only has an
+// effect in builds configured with MODEL_THREADS; otherwise, and by default,
+// everything runs on the calling thread.
+void model_set_threads(size_t count);
+
+// Returns the number of threads recalculating large changes.
+size_t model_thread_count(void);
+
+// Subscribes to the changes of cell values, returning a new feed holding up
+// to 'capacity' records and 'text_capacity' bytes of strings, see feed.h.
+//
+// From now on, every recalculation pushes a record for each cell of the
+// workbook, on any sheet, whose value it may have changed, including the
+// edited cells, and publishes them together once it is done; in lazy mode,
+// that is once the cells are calculated. Replacing the workbook pushes a
+// CHANGE_RESET record. The model is the producer of the feed and only ever
+// calls it on the thread editing the model; the consumer may tail it on
+// another thread, without locks. Records that do not fit are dropped and
+// counted, so slow consumers never hold the model up.
+ChangeFeed *model_subscribe(size_t capacity, size_t text_capacity);
+
+// Ends a subscription and frees its feed, whose consumer must have stopped.
+void model_unsubscribe(ChangeFeed *feed);
+
+// Number of buckets of the histogram of edit times in 'ModelStats'.
+#define MODEL_STATS_BUCKETS 24
+
+// Counters of the work done by the model, see 'model_get_stats'.
+typedef struct {
+    // Formulas compiled from their text
+    size_t formulas_compiled;
+    // Formulas evaluated in full, and updated by the changes of their inputs
+    size_t formulas_evaluated;
+    size_t delta_updates;
+    // Recalculations run, cells they visited in total, and the most cells
+    // visited by one of them
+    size_t recalculations;
+    size_t cells_visited;
+    size_t max_cells_visited;
+    // Calls to 'update_cell_displays', and cells passed to it in total
+    size_t display_calls;
+    size_t cells_displayed;
+    // Heap allocations made so far, and bytes of heap held by strings and
+    // formula texts
+    size_t allocations;
+    size_t text_bytes;
+    // Cells set or cleared, and their total wall time in seconds
+    size_t edits;
+    double edit_seconds;
+    // Histogram of the wall time of the edits: bucket 0 counts the edits
+    // taking less than a microsecond, bucket k those taking from 2^(k-1) up to
+    // 2^k microseconds, and the last bucket also all slower ones
+    size_t edit_times[MODEL_STATS_BUCKETS];
+} ModelStats;
+
+// Returns the counters of the work the model has done since the program
+// started or the last 'model_reset_stats'.
+//
+// The counters are only maintained in builds configured with MODEL_STATS;
+// otherwise they are left out of the model entirely and read as 0, except
+// for 'allocations' and 'text_bytes', which are always available.
+ModelStats model_get_stats(void);
+
+// Sets the counters of 'model_get_stats' back to 0.
+void model_reset_stats(void);
+
+// Returns the number of heap allocations the model has made so far.
+//
+// Recalculation is meant to run without allocating, which tests and
+// benchmarks check by comparing this count before and after an edit.
+size_t model_allocation_count(void);
+
 #endif // ASSIGNMENT_MODEL_H
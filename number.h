@@ -0,0 +1,38 @@
+#ifndef ASSIGNMENT_NUMBER_H
+#define ASSIGNMENT_NUMBER_H
+
+#include <stddef.h>
+
+// Conversion of numbers to text and back.
+//
+// Digits are generated with the Grisu2 algorithm, which works on 64-bit
+// integers only and is several times faster than printf. The text is the same
+// printf would produce: the rare values whose digits Grisu2 cannot settle are
+// left to printf, as are values needing 16 or 17 digits.
+//
+// Numbers are read in a single pass that validates the text and collects its
+// digits, eight at a time where it can. Their value is then computed with the
+// Eisel-Lemire algorithm, or with one floating-point operation when that is
+// exact, giving the same double strtod does. Numbers these cannot settle,
+// which takes more than 19 significant digits, are left to strtod.
+
+// Number of characters, including the terminating NUL, that always suffices
+// for the text of a number.
+#define NUMBER_TEXT_MAX 32
+
+// Writes the shortest text that reads back as 'value', laid out like printf's
+// "%g" with at least 15 significant digits. Returns the length of the text.
+size_t number_format(double value, char *buffer);
+
+// Writes 'value' like printf's "%.*g" with 'precision' significant digits,
+// between 1 and 17. Returns the length of the text.
+size_t number_format_general(double value, int precision, char *buffer);
+
+// Reads a number of decimal digits with at most one decimal point, such as
+// "12", "0.25", ".5" or "3.", from the start of the first 'length' characters
+// of 'text', storing its value in 'value'. Returns the number of characters the
+// number takes up, or 0 if the text does not start with one. Unlike strtod,
+// signs, exponents, whitespace and the locale play no part.
+size_t number_parse(const char *text, size_t length, double *value);
+
+#endif //ASSIGNMENT_NUMBER_H
@@ -0,0 +1,194 @@
+#include "pool.h"
+#include "memory.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+// Indices a worker still has to run, from 'next' to 'end - 1'.
+typedef struct {
+    // Protects the range against concurrent stealing
+    pthread_mutex_t lock;
+    size_t next;
+    size_t end;
+} WorkRange;
+
+// Helper threads; worker 0 is the thread calling 'pool_run'.
+static pthread_t *threads = NULL;
+// One range per worker, including worker 0
+static WorkRange *ranges = NULL;
+// Number of workers, including worker 0
+static size_t num_workers = 1;
+
+// Protects the fields below, which hand loops to the helpers.
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+// Signalled when a new loop starts or the pool stops
+static pthread_cond_t start_cond = PTHREAD_COND_INITIALIZER;
+// Signalled when a helper finishes its part of a loop
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+// Incremented for every loop, so helpers can tell a new one has started
+static size_t generation = 0;
+// Number of helpers that have not finished the current loop yet
+static size_t busy_helpers = 0;
+// Set to make the helpers exit
+static bool stopping = false;
+
+// The current loop.
+static PoolTask current_task = NULL;
+static void *current_data = NULL;
+static size_t current_grain = 1;
+
+// Function to take the next chunk of a worker's own range.
+static bool take_chunk(WorkRange *range, size_t *begin, size_t *end) {
+    pthread_mutex_lock(&range->lock);
+    bool found = range->next < range->end;
+    if (found) {
+        *begin = range->next;
+        *end = range->end - range->next > current_grain ? range->next + current_grain : range->end;
+        range->next = *end;
+    }
+    pthread_mutex_unlock(&range->lock);
+    return found;
+}
+
+// Function to move the back half of another worker's range to 'worker'.
+static bool steal_range(size_t worker) {
+    for (size_t k = 1; k < num_workers; ++k) {
+        WorkRange *victim = &ranges[(worker + k) % num_workers];
+        size_t begin, end = 0;
+
+        pthread_mutex_lock(&victim->lock);
+        if (victim->next < victim->end) {
+            // Leave the victim the front half; a single index is taken whole.
+            begin = victim->next + (victim->end - victim->next) / 2;
+            end = victim->end;
+            victim->end = begin;
+        }
+        pthread_mutex_unlock(&victim->lock);
+
+        if (end != 0) {
+            WorkRange *own = &ranges[worker];
+            pthread_mutex_lock(&own->lock);
+            own->next = begin;
+            own->end = end;
+            pthread_mutex_unlock(&own->lock);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Function to run a worker's share of the current loop.
+static void run_worker(size_t worker) {
+    size_t begin, end;
+    do {
+        while (take_chunk(&ranges[worker], &begin, &end))
+            current_task(begin, end, worker, current_data);
+    } while (steal_range(worker));
+}
+
+// Function run by each helper thread.
+static void *helper_main(void *arg) {
+    size_t worker = (size_t)arg;
+    size_t seen = 0;
+
+    pthread_mutex_lock(&pool_lock);
+    while (true) {
+        while (!stopping && generation == seen)
+            pthread_cond_wait(&start_cond, &pool_lock);
+        if (stopping)
+            break;
+        seen = generation;
+        pthread_mutex_unlock(&pool_lock);
+
+        run_worker(worker);
+
+        pthread_mutex_lock(&pool_lock);
+        if (--busy_helpers == 0)
+            pthread_cond_signal(&done_cond);
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return NULL;
+}
+
+void pool_start(size_t num_threads) {
+    pool_stop();
+
+    if (num_threads < 2)
+        return;
+
+    ranges = checked_calloc(num_threads, sizeof(WorkRange));
+    threads = checked_calloc(num_threads - 1, sizeof(pthread_t));
+    for (size_t i = 0; i < num_threads; ++i)
+        pthread_mutex_init(&ranges[i].lock, NULL);
+
+    // Helpers wait for the next generation, so they must start from the current one.
+    stopping = false;
+    pthread_mutex_lock(&pool_lock);
+    generation = 0;
+    pthread_mutex_unlock(&pool_lock);
+
+    // Run with fewer threads if the system refuses to create more.
+    num_workers = 1;
+    while (num_workers < num_threads &&
+           pthread_create(&threads[num_workers - 1], NULL, helper_main, (void *)num_workers) == 0)
+        ++num_workers;
+}
+
+void pool_stop(void) {
+    if (threads != NULL) {
+        pthread_mutex_lock(&pool_lock);
+        stopping = true;
+        pthread_cond_broadcast(&start_cond);
+        pthread_mutex_unlock(&pool_lock);
+
+        for (size_t i = 0; i + 1 < num_workers; ++i)
+            pthread_join(threads[i], NULL);
+        for (size_t i = 0; i < num_workers; ++i)
+            pthread_mutex_destroy(&ranges[i].lock);
+    }
+
+    free(threads);
+    free(ranges);
+    threads = NULL;
+    ranges = NULL;
+    num_workers = 1;
+}
+
+size_t pool_thread_count(void) {
+    return num_workers;
+}
+
+void pool_run(size_t count, size_t grain, PoolTask task, void *data) {
+    if (count == 0)
+        return;
+
+    // Small loops are not worth waking the helpers for.
+    if (num_workers == 1 || count <= grain) {
+        task(0, count, 0, data);
+        return;
+    }
+
+    // Give every worker an equal share to start with.
+    for (size_t i = 0; i < num_workers; ++i) {
+        ranges[i].next = count * i / num_workers;
+        ranges[i].end = count * (i + 1) / num_workers;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    current_task = task;
+    current_data = data;
+    current_grain = grain ? grain : 1;
+    busy_helpers = num_workers - 1;
+    ++generation;
+    pthread_cond_broadcast(&start_cond);
+    pthread_mutex_unlock(&pool_lock);
+
+    run_worker(0);
+
+    // Returning only once every helper is done also publishes their writes.
+    pthread_mutex_lock(&pool_lock);
+    while (busy_helpers > 0)
+        pthread_cond_wait(&done_cond, &pool_lock);
+    pthread_mutex_unlock(&pool_lock);
+}
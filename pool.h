@@ -0,0 +1,34 @@
+#ifndef ASSIGNMENT_POOL_H
+#define ASSIGNMENT_POOL_H
+
+#include <stddef.h>
+
+// A pool of worker threads running loops in parallel.
+//
+// Only available in builds configured with MODEL_THREADS. Each call to
+// 'pool_run' splits the loop into one contiguous range per thread. A thread
+// runs its own range a chunk at a time and, once it is done, steals the back
+// half of the range of another thread that still has work left. The calling
+// thread takes part as worker 0.
+
+// Body of a parallel loop, called for the indices 'begin' to 'end - 1' on
+// behalf of 'worker', which is below the pool's thread count.
+typedef void (*PoolTask)(size_t begin, size_t end, size_t worker, void *data);
+
+// Starts the pool with 'num_threads' threads in total, including the caller,
+// stopping a previously started pool first. A count of 0 or 1 runs loops on
+// the calling thread only.
+void pool_start(size_t num_threads);
+
+// Stops and joins the worker threads.
+void pool_stop(void);
+
+// Returns the number of threads running loops, including the caller.
+size_t pool_thread_count(void);
+
+// Runs 'task' for the indices 0 to 'count - 1' in chunks of at most 'grain'
+// indices, and returns once all of them are done. Must not be called from
+// within a task.
+void pool_run(size_t count, size_t grain, PoolTask task, void *data);
+
+#endif //ASSIGNMENT_POOL_H
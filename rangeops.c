@@ -0,0 +1,263 @@
+#include "rangeops.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#define RANGEOPS_X86 1
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define RANGEOPS_NEON 1
+#include <arm_neon.h>
+#endif
+
+// Number of cells handled per iteration by the vector kernels.
+#define CHUNK 16
+
+// Function to tell whether a cell holds a formula that failed.
+static bool is_failed(uint8_t type, uint8_t error) {
+    return type == eqn && error;
+}
+
+// Function to tell whether a cell which has not failed holds a numeric value.
+static bool is_numeric(uint8_t type) {
+    return type == num || type == eqn;
+}
+
+// Function to fold cells one at a time.
+//
+// 'lanes' holds the four partial sums; cell i is always added to lane i % 4,
+// which is the order the vector kernels use as well.
+static bool accumulate_scalar(RangeTotals *totals, const double *values, const uint8_t *types,
+                              const uint8_t *errors, size_t begin, size_t end, double lanes[4], bool extrema) {
+    for (size_t i = begin; i < end; ++i) {
+        if (is_failed(types[i], errors[i]))
+            return false;
+
+        // Cells without a numeric value hold 0, so they can be summed anyway.
+        lanes[i % 4] += values[i];
+
+        if (is_numeric(types[i])) {
+            totals->count += 1;
+            if (extrema) {
+                if (values[i] < totals->min)
+                    totals->min = values[i];
+                if (values[i] > totals->max)
+                    totals->max = values[i];
+            }
+        }
+    }
+    return true;
+}
+
+#if RANGEOPS_X86
+
+// Function to classify a chunk of cells, returning one bit per numeric cell.
+//
+// Sets '*failed' if a formula in the chunk failed.
+static int classify_chunk(const uint8_t *types, const uint8_t *errors, bool *failed) {
+    __m128i t = _mm_loadu_si128((const __m128i *)types);
+    __m128i e = _mm_loadu_si128((const __m128i *)errors);
+    __m128i is_eqn = _mm_cmpeq_epi8(t, _mm_set1_epi8(eqn));
+    __m128i is_num = _mm_cmpeq_epi8(t, _mm_set1_epi8(num));
+    __m128i has_error = _mm_xor_si128(_mm_cmpeq_epi8(e, _mm_setzero_si128()), _mm_set1_epi8(-1));
+
+    *failed = _mm_movemask_epi8(_mm_and_si128(is_eqn, has_error)) != 0;
+    return _mm_movemask_epi8(_mm_or_si128(is_eqn, is_num));
+}
+
+// Function to update the extrema with the numeric cells of a partially numeric chunk.
+static void extrema_masked(RangeTotals *totals, const double *values, int bits) {
+    for (int k = 0; k < CHUNK; ++k) {
+        if (bits & (1 << k)) {
+            if (values[k] < totals->min)
+                totals->min = values[k];
+            if (values[k] > totals->max)
+                totals->max = values[k];
+        }
+    }
+}
+
+// Function to fold cells two lanes at a time using SSE2.
+static bool accumulate_sse2(RangeTotals *totals, const double *values, const uint8_t *types,
+                            const uint8_t *errors, size_t count, bool extrema) {
+    __m128d sum01 = _mm_setzero_pd();
+    __m128d sum23 = _mm_setzero_pd();
+    __m128d low = _mm_set1_pd(totals->min);
+    __m128d high = _mm_set1_pd(totals->max);
+    size_t i = 0;
+
+    for (; i + CHUNK <= count; i += CHUNK) {
+        bool failed;
+        int bits = classify_chunk(types + i, errors + i, &failed);
+        if (failed)
+            return false;
+        totals->count += __builtin_popcount((unsigned)bits);
+
+        for (size_t k = 0; k < CHUNK; k += 4) {
+            sum01 = _mm_add_pd(sum01, _mm_loadu_pd(values + i + k));
+            sum23 = _mm_add_pd(sum23, _mm_loadu_pd(values + i + k + 2));
+        }
+
+        if (extrema && bits == 0xffff) {
+            // Every cell is numeric, so no masking is needed.
+            for (size_t k = 0; k < CHUNK; k += 2) {
+                __m128d v = _mm_loadu_pd(values + i + k);
+                low = _mm_min_pd(low, v);
+                high = _mm_max_pd(high, v);
+            }
+        } else if (extrema && bits != 0) {
+            extrema_masked(totals, values + i, bits);
+        }
+    }
+
+    // Fold the vector registers back into the totals.
+    double lanes[4], extreme[2];
+    _mm_storeu_pd(lanes, sum01);
+    _mm_storeu_pd(lanes + 2, sum23);
+    if (extrema) {
+        _mm_storeu_pd(extreme, low);
+        for (int k = 0; k < 2; ++k)
+            totals->min = extreme[k] < totals->min ? extreme[k] : totals->min;
+        _mm_storeu_pd(extreme, high);
+        for (int k = 0; k < 2; ++k)
+            totals->max = extreme[k] > totals->max ? extreme[k] : totals->max;
+    }
+
+    if (!accumulate_scalar(totals, values, types, errors, i, count, lanes, extrema))
+        return false;
+    totals->sum += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    return true;
+}
+
+// Function to fold cells four lanes at a time using AVX2.
+__attribute__((target("avx2")))
+static bool accumulate_avx2(RangeTotals *totals, const double *values, const uint8_t *types,
+                            const uint8_t *errors, size_t count, bool extrema) {
+    __m256d sum = _mm256_setzero_pd();
+    __m256d low = _mm256_set1_pd(totals->min);
+    __m256d high = _mm256_set1_pd(totals->max);
+    size_t i = 0;
+
+    for (; i + CHUNK <= count; i += CHUNK) {
+        bool failed;
+        int bits = classify_chunk(types + i, errors + i, &failed);
+        if (failed)
+            return false;
+        totals->count += __builtin_popcount((unsigned)bits);
+
+        for (size_t k = 0; k < CHUNK; k += 4)
+            sum = _mm256_add_pd(sum, _mm256_loadu_pd(values + i + k));
+
+        if (extrema && bits == 0xffff) {
+            // Every cell is numeric, so no masking is needed.
+            for (size_t k = 0; k < CHUNK; k += 4) {
+                __m256d v = _mm256_loadu_pd(values + i + k);
+                low = _mm256_min_pd(low, v);
+                high = _mm256_max_pd(high, v);
+            }
+        } else if (extrema && bits != 0) {
+            extrema_masked(totals, values + i, bits);
+        }
+    }
+
+    // Fold the vector registers back into the totals.
+    double lanes[4], extreme[4];
+    _mm256_storeu_pd(lanes, sum);
+    if (extrema) {
+        _mm256_storeu_pd(extreme, low);
+        for (int k = 0; k < 4; ++k)
+            totals->min = extreme[k] < totals->min ? extreme[k] : totals->min;
+        _mm256_storeu_pd(extreme, high);
+        for (int k = 0; k < 4; ++k)
+            totals->max = extreme[k] > totals->max ? extreme[k] : totals->max;
+    }
+
+    if (!accumulate_scalar(totals, values, types, errors, i, count, lanes, extrema))
+        return false;
+    totals->sum += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    return true;
+}
+
+#elif RANGEOPS_NEON
+
+// Function to fold cells two lanes at a time using NEON.
+static bool accumulate_neon(RangeTotals *totals, const double *values, const uint8_t *types,
+                            const uint8_t *errors, size_t count, bool extrema) {
+    float64x2_t sum01 = vdupq_n_f64(0);
+    float64x2_t sum23 = vdupq_n_f64(0);
+    float64x2_t low = vdupq_n_f64(totals->min);
+    float64x2_t high = vdupq_n_f64(totals->max);
+    size_t i = 0;
+
+    for (; i + CHUNK <= count; i += CHUNK) {
+        uint8x16_t t = vld1q_u8(types + i);
+        uint8x16_t e = vld1q_u8(errors + i);
+        uint8x16_t is_eqn = vceqq_u8(t, vdupq_n_u8(eqn));
+        uint8x16_t numeric = vorrq_u8(is_eqn, vceqq_u8(t, vdupq_n_u8(num)));
+        uint8x16_t failed = vandq_u8(is_eqn, vtstq_u8(e, e));
+        if (vmaxvq_u8(failed) != 0)
+            return false;
+
+        // Numeric cells are 0xff in the mask; count them through their low bit.
+        unsigned numeric_count = vaddvq_u8(vandq_u8(numeric, vdupq_n_u8(1)));
+        totals->count += numeric_count;
+
+        for (size_t k = 0; k < CHUNK; k += 4) {
+            sum01 = vaddq_f64(sum01, vld1q_f64(values + i + k));
+            sum23 = vaddq_f64(sum23, vld1q_f64(values + i + k + 2));
+        }
+
+        if (extrema && numeric_count == CHUNK) {
+            // Every cell is numeric, so no masking is needed.
+            for (size_t k = 0; k < CHUNK; k += 2) {
+                float64x2_t v = vld1q_f64(values + i + k);
+                low = vminq_f64(low, v);
+                high = vmaxq_f64(high, v);
+            }
+        } else if (extrema && numeric_count != 0) {
+            for (size_t k = 0; k < CHUNK; ++k) {
+                if (is_numeric(types[i + k])) {
+                    if (values[i + k] < totals->min)
+                        totals->min = values[i + k];
+                    if (values[i + k] > totals->max)
+                        totals->max = values[i + k];
+                }
+            }
+        }
+    }
+
+    // Fold the vector registers back into the totals.
+    double lanes[4] = {vgetq_lane_f64(sum01, 0), vgetq_lane_f64(sum01, 1),
+                       vgetq_lane_f64(sum23, 0), vgetq_lane_f64(sum23, 1)};
+    if (extrema) {
+        double vector_min = vminvq_f64(low);
+        double vector_max = vmaxvq_f64(high);
+        totals->min = vector_min < totals->min ? vector_min : totals->min;
+        totals->max = vector_max > totals->max ? vector_max : totals->max;
+    }
+
+    if (!accumulate_scalar(totals, values, types, errors, i, count, lanes, extrema))
+        return false;
+    totals->sum += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    return true;
+}
+
+#endif
+
+bool range_accumulate(RangeTotals *totals, const Block *block, size_t first, size_t count, bool extrema) {
+    const double *values = block->num + first;
+    const uint8_t *types = block->type + first;
+    const uint8_t *errors = block->error + first;
+
+#if RANGEOPS_X86
+    if (__builtin_cpu_supports("avx2"))
+        return accumulate_avx2(totals, values, types, errors, count, extrema);
+    return accumulate_sse2(totals, values, types, errors, count, extrema);
+#elif RANGEOPS_NEON
+    return accumulate_neon(totals, values, types, errors, count, extrema);
+#else
+    double lanes[4] = {0, 0, 0, 0};
+    if (!accumulate_scalar(totals, values, types, errors, 0, count, lanes, extrema))
+        return false;
+    totals->sum += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    return true;
+#endif
+}
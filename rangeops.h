@@ -0,0 +1,32 @@
+#ifndef ASSIGNMENT_RANGEOPS_H
+#define ASSIGNMENT_RANGEOPS_H
+
+#include "sheet.h"
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// Running totals of the arguments of a range function such as SUM or MIN.
+typedef struct {
+    // Sum of the numeric values
+    double sum;
+    // Number of numeric values
+    double count;
+    // Smallest and largest numeric value; +/-infinity while 'count' is 0
+    double min;
+    double max;
+} RangeTotals;
+
+// Adds the cells 'first' to 'first + count - 1' of a block to the totals.
+//
+// Cells without a numeric value (empty cells and strings) are skipped. The
+// smallest and largest values are only tracked if 'extrema' is set. Returns
+// false, leaving the totals unspecified, if one of the cells holds a formula
+// that failed.
+//
+// The kernel uses SSE2 or AVX2 on x86 and NEON on 64-bit ARM, with a scalar
+// fallback elsewhere. Sums are accumulated in four interleaved lanes by every
+// variant, so all of them produce bit-identical results.
+bool range_accumulate(RangeTotals *totals, const Block *block, size_t first, size_t count, bool extrema);
+
+#endif //ASSIGNMENT_RANGEOPS_H
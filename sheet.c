@@ -0,0 +1,505 @@
+#include "sheet.h"
+#include "memory.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// An entry of a sheet's string table.
+typedef struct {
+    // The string, or NULL if it is read from the sheet's source
+    char *text;
+    // Number of cells referring to the string; 0 marks a free entry
+    uint32_t refs;
+    // Hash of the string, kept for lookups and for growing the index
+    uint32_t hash;
+} TextEntry;
+
+struct Sheet {
+    // Dimensions of the sheet
+    size_t num_rows;
+    size_t num_cols;
+    // Open-addressing hash table of allocated blocks; NULL marks a free slot
+    Block **slots;
+    // Number of slots, always a power of two
+    size_t capacity;
+    // Number of allocated blocks
+    size_t count;
+    // String table, indexed by TextId; entry 0 is never used
+    TextEntry *texts;
+    // Number of entries in 'texts' and its allocated capacity
+    size_t num_texts;
+    size_t texts_capacity;
+    // Ids of removed strings, available for reuse
+    TextId *free_texts;
+    size_t num_free_texts;
+    size_t free_texts_capacity;
+    // Open-addressing hash index of the strings by content; 0 marks a free
+    // slot. Equal strings are stored once and shared by all cells holding them.
+    TextId *text_slots;
+    // Number of slots, always a power of two, and number of strings indexed
+    size_t text_slots_capacity;
+    size_t num_indexed_texts;
+    // Ids up to this one belong to the source; they are never reused, as
+    // blocks not loaded yet may still refer to them
+    size_t num_source_texts;
+    // Source of blocks and strings, if attached
+    BlockSource source;
+    bool has_source;
+    // Whether each block of the source was loaded already
+    uint8_t *loaded;
+    // Number of source blocks not loaded yet
+    size_t num_unloaded;
+};
+
+// Function to combine the column and block index into one hash key.
+static uint64_t block_key(size_t col, size_t index) {
+    return ((uint64_t)col << 32) | (uint64_t)index;
+}
+
+// Function to scramble a block key so that neighbouring blocks spread over the table.
+static size_t hash_block(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return (size_t)key;
+}
+
+// Function to find the slot holding a block, or the free slot where it belongs.
+static size_t find_slot(const Sheet *sheet, size_t col, size_t index) {
+    size_t mask = sheet->capacity - 1;
+    size_t slot = hash_block(block_key(col, index)) & mask;
+    while (sheet->slots[slot] != NULL &&
+           (sheet->slots[slot]->col != col || sheet->slots[slot]->index != index))
+        slot = (slot + 1) & mask;
+    return slot;
+}
+
+// Function to double the hash table and reinsert all blocks.
+static void grow_slots(Sheet *sheet) {
+    Block **old = sheet->slots;
+    size_t old_capacity = sheet->capacity;
+
+    sheet->capacity *= 2;
+    sheet->slots = checked_calloc(sheet->capacity, sizeof(Block *));
+    for (size_t i = 0; i < old_capacity; ++i) {
+        if (old[i] != NULL)
+            sheet->slots[find_slot(sheet, old[i]->col, old[i]->index)] = old[i];
+    }
+    free(old);
+}
+
+// Function to release a block and the formulas it holds. Accepts NULL.
+static void free_block(Block *block) {
+    if (block == NULL)
+        return;
+    if (block->formulas != NULL) {
+        for (size_t i = 0; i < BLOCK_ROWS; ++i)
+            formula_free(block->formulas[i]);
+        free(block->formulas);
+    }
+    free(block->display);
+    free(block);
+}
+
+Sheet *sheet_create(size_t num_rows, size_t num_cols) {
+    Sheet *sheet = checked_malloc(sizeof(Sheet));
+    sheet->num_rows = num_rows;
+    sheet->num_cols = num_cols < SHEET_MAX_COLS ? num_cols : SHEET_MAX_COLS;
+    sheet->capacity = 16;
+    sheet->slots = checked_calloc(sheet->capacity, sizeof(Block *));
+    sheet->count = 0;
+    sheet->texts = NULL;
+    sheet->num_texts = 1;
+    sheet->texts_capacity = 0;
+    sheet->free_texts = NULL;
+    sheet->num_free_texts = 0;
+    sheet->free_texts_capacity = 0;
+    sheet->text_slots_capacity = 16;
+    sheet->text_slots = checked_calloc(sheet->text_slots_capacity, sizeof(TextId));
+    sheet->num_indexed_texts = 0;
+    sheet->num_source_texts = 0;
+    sheet->has_source = false;
+    sheet->loaded = NULL;
+    sheet->num_unloaded = 0;
+    return sheet;
+}
+
+void sheet_attach(Sheet *sheet, const BlockSource *source) {
+    sheet->source = *source;
+    sheet->has_source = true;
+
+    // Zeroed memory is cheap to allocate, so this stays fast for big sources.
+    sheet->loaded = checked_calloc(source->num_blocks, 1);
+    sheet->num_unloaded = source->num_blocks;
+
+    // Ids of the source's strings are reserved; their entries hold no string
+    // of their own, and are indexed once a block referring to them is loaded.
+    free(sheet->texts);
+    sheet->texts_capacity = source->num_texts + 1;
+    sheet->texts = checked_calloc(sheet->texts_capacity, sizeof(TextEntry));
+    sheet->num_texts = source->num_texts + 1;
+    sheet->num_source_texts = source->num_texts;
+}
+
+// Function to hash the characters of a string (FNV-1a).
+static uint32_t hash_text(const char *text, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; ++i) {
+        hash ^= (uint8_t)text[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Function to find the slot of the index holding a string, or the free slot where it belongs.
+static size_t find_text_slot(const Sheet *sheet, const char *text, size_t length, uint32_t hash) {
+    size_t mask = sheet->text_slots_capacity - 1;
+    size_t slot = hash & mask;
+    for (TextId id; (id = sheet->text_slots[slot]) != 0; slot = (slot + 1) & mask) {
+        if (sheet->texts[id].hash == hash) {
+            const char *other = sheet_text(sheet, id);
+            if (memcmp(other, text, length) == 0 && other[length] == '\0')
+                return slot;
+        }
+    }
+    return slot;
+}
+
+// Function to double the index of strings and reinsert all of them.
+static void grow_text_slots(Sheet *sheet) {
+    TextId *old = sheet->text_slots;
+    size_t old_capacity = sheet->text_slots_capacity;
+
+    sheet->text_slots_capacity *= 2;
+    sheet->text_slots = checked_calloc(sheet->text_slots_capacity, sizeof(TextId));
+    size_t mask = sheet->text_slots_capacity - 1;
+    for (size_t i = 0; i < old_capacity; ++i) {
+        if (old[i] == 0)
+            continue;
+        size_t slot = sheet->texts[old[i]].hash & mask;
+        while (sheet->text_slots[slot] != 0)
+            slot = (slot + 1) & mask;
+        sheet->text_slots[slot] = old[i];
+    }
+    free(old);
+}
+
+// Function to make room in the index for one more string, keeping the load factor below one half.
+static void reserve_text_slot(Sheet *sheet) {
+    if (2 * (sheet->num_indexed_texts + 1) > sheet->text_slots_capacity)
+        grow_text_slots(sheet);
+}
+
+// Function to take a string out of the index.
+static void unindex_text(Sheet *sheet, TextId id) {
+    size_t mask = sheet->text_slots_capacity - 1;
+    size_t slot = sheet->texts[id].hash & mask;
+    while (sheet->text_slots[slot] != id)
+        slot = (slot + 1) & mask;
+    sheet->text_slots[slot] = 0;
+    --sheet->num_indexed_texts;
+
+    // Shift later strings of the same probe sequence back into the hole, as
+    // for blocks in sheet_remove.
+    size_t hole = slot;
+    for (size_t next = (hole + 1) & mask; sheet->text_slots[next] != 0; next = (next + 1) & mask) {
+        TextId moved = sheet->text_slots[next];
+        size_t home = sheet->texts[moved].hash & mask;
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            sheet->text_slots[hole] = moved;
+            sheet->text_slots[next] = 0;
+            hole = next;
+        }
+    }
+}
+
+// Function to index the strings of the source that a freshly loaded block refers to.
+static void index_source_texts(Sheet *sheet, const Block *block) {
+    for (size_t i = 0; i < BLOCK_ROWS; ++i) {
+        TextId id = block->text[i];
+        if (id == 0 || id > sheet->num_source_texts || sheet->texts[id].refs != 0)
+            continue;
+
+        // Source strings are pinned, so their count only records that they
+        // were seen. A string the index holds already keeps its own id.
+        sheet->texts[id].refs = 1;
+        const char *text = sheet_text(sheet, id);
+        size_t length = strlen(text);
+        uint32_t hash = hash_text(text, length);
+        reserve_text_slot(sheet);
+        size_t slot = find_text_slot(sheet, text, length, hash);
+        if (sheet->text_slots[slot] == 0) {
+            sheet->texts[id].hash = hash;
+            sheet->text_slots[slot] = id;
+            ++sheet->num_indexed_texts;
+        }
+    }
+}
+
+// Function to insert a new, empty block into the hash table.
+static Block *add_block(Sheet *sheet, size_t col, size_t index) {
+    // Keep the load factor below one half.
+    if (2 * (sheet->count + 1) > sheet->capacity)
+        grow_slots(sheet);
+
+    Block *block = checked_calloc(1, sizeof(Block));
+    block->col = (uint32_t)col;
+    block->index = (uint32_t)index;
+    sheet->slots[find_slot(sheet, col, index)] = block;
+    ++sheet->count;
+    return block;
+}
+
+// Function to copy a block from the source, returning NULL if it has none.
+static Block *load_block(Sheet *sheet, size_t col, size_t index) {
+    size_t n;
+    if (sheet->num_unloaded == 0 || !sheet->source.find(sheet->source.data, col, index, &n) || sheet->loaded[n])
+        return NULL;
+
+    // Once loaded, the block belongs to the sheet, even after it is released.
+    sheet->loaded[n] = true;
+    --sheet->num_unloaded;
+    Block *block = add_block(sheet, col, index);
+    sheet->source.load(sheet->source.data, n, block);
+    index_source_texts(sheet, block);
+    return block;
+}
+
+void sheet_load_all(Sheet *sheet) {
+    for (size_t n = 0; sheet->num_unloaded > 0 && n < sheet->source.num_blocks; ++n) {
+        size_t col, index;
+        if (sheet->loaded[n])
+            continue;
+        sheet->source.position(sheet->source.data, n, &col, &index);
+        sheet_find_block(sheet, col, index);
+    }
+}
+
+void sheet_free(Sheet *sheet) {
+    if (sheet == NULL)
+        return;
+    for (size_t i = 0; i < sheet->capacity; ++i)
+        free_block(sheet->slots[i]);
+    free(sheet->slots);
+    for (size_t i = 1; i < sheet->num_texts; ++i)
+        free(sheet->texts[i].text);
+    free(sheet->texts);
+    free(sheet->free_texts);
+    free(sheet->text_slots);
+    free(sheet->loaded);
+    if (sheet->has_source)
+        sheet->source.release(sheet->source.data);
+    free(sheet);
+}
+
+size_t sheet_num_rows(const Sheet *sheet) {
+    return sheet->num_rows;
+}
+
+size_t sheet_num_cols(const Sheet *sheet) {
+    return sheet->num_cols;
+}
+
+Block *sheet_find(Sheet *sheet, size_t row, size_t col) {
+    return sheet_find_block(sheet, col, row / BLOCK_ROWS);
+}
+
+Block *sheet_find_block(Sheet *sheet, size_t col, size_t index) {
+    Block *block = sheet->slots[find_slot(sheet, col, index)];
+    return block != NULL ? block : load_block(sheet, col, index);
+}
+
+Block *sheet_insert(Sheet *sheet, size_t row, size_t col) {
+    size_t index = row / BLOCK_ROWS;
+    Block *block = sheet_find_block(sheet, col, index);
+
+    if (block == NULL)
+        block = add_block(sheet, col, index);
+
+    if (block->type[row % BLOCK_ROWS] == none)
+        ++block->population;
+    return block;
+}
+
+void sheet_remove(Sheet *sheet, size_t row, size_t col) {
+    // Looking the block up first may load it, which can grow the table.
+    Block *block = sheet_find(sheet, row, col);
+    size_t mask = sheet->capacity - 1;
+    size_t slot = find_slot(sheet, col, row / BLOCK_ROWS);
+    size_t i = row % BLOCK_ROWS;
+
+    if (block == NULL || block->type[i] == none)
+        return;
+
+    block->type[i] = none;
+    block->error[i] = 0;
+    block->num[i] = 0;
+    block->text[i] = 0;
+    block->display_valid[i] = false;
+    if (--block->population > 0)
+        return;
+
+    // The block is empty now, so release it.
+    free_block(block);
+    sheet->slots[slot] = NULL;
+    --sheet->count;
+
+    // Shift later blocks of the same probe sequence back into the hole, so
+    // that lookups never stop early at the freed slot.
+    size_t hole = slot;
+    for (size_t next = (hole + 1) & mask; sheet->slots[next] != NULL; next = (next + 1) & mask) {
+        Block *moved = sheet->slots[next];
+        size_t home = hash_block(block_key(moved->col, moved->index)) & mask;
+
+        // The block may move into the hole only if the hole lies on the way
+        // from its home slot to its current slot.
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            sheet->slots[hole] = moved;
+            sheet->slots[next] = NULL;
+            hole = next;
+        }
+    }
+}
+
+void block_set_formula(Block *block, size_t index, Formula *formula) {
+    // Blocks holding only literals never allocate the formula array.
+    if (block->formulas == NULL) {
+        if (formula == NULL)
+            return;
+        block->formulas = checked_calloc(BLOCK_ROWS, sizeof(Formula *));
+    }
+    block->formulas[index] = formula;
+}
+
+Formula *block_formula(const Block *block, size_t index) {
+    return block->formulas != NULL ? block->formulas[index] : NULL;
+}
+
+// Function to look up a string, counting one more reference to it if it is stored already.
+static TextId find_text(Sheet *sheet, const char *text, size_t length, uint32_t hash, size_t *slot) {
+    *slot = find_text_slot(sheet, text, length, hash);
+    TextId id = sheet->text_slots[*slot];
+    if (id > sheet->num_source_texts)
+        ++sheet->texts[id].refs;
+    return id;
+}
+
+// Function to store a new string in the table and the free index slot found for it.
+static TextId store_text(Sheet *sheet, char *text, size_t length, uint32_t hash, size_t slot) {
+    TextId id;
+
+    // Growing the index moves the slot the string belongs in.
+    if (2 * (sheet->num_indexed_texts + 1) > sheet->text_slots_capacity) {
+        grow_text_slots(sheet);
+        slot = find_text_slot(sheet, text, length, hash);
+    }
+
+    // Reuse the id of a removed string if there is one.
+    if (sheet->num_free_texts > 0) {
+        id = sheet->free_texts[--sheet->num_free_texts];
+    } else {
+        if (sheet->num_texts >= sheet->texts_capacity) {
+            sheet->texts_capacity = sheet->texts_capacity ? 2 * sheet->texts_capacity : 16;
+            sheet->texts = checked_realloc(sheet->texts, sheet->texts_capacity * sizeof(TextEntry));
+        }
+        id = (TextId)sheet->num_texts++;
+    }
+
+    sheet->texts[id] = (TextEntry){text, 1, hash};
+    sheet->text_slots[slot] = id;
+    ++sheet->num_indexed_texts;
+    return id;
+}
+
+TextId sheet_add_text(Sheet *sheet, char *text) {
+    size_t length = strlen(text), slot;
+    uint32_t hash = hash_text(text, length);
+    TextId id = find_text(sheet, text, length, hash, &slot);
+
+    // A string stored already is shared, and the new copy is not needed.
+    if (id != 0) {
+        free(text);
+        return id;
+    }
+    return store_text(sheet, text, length, hash, slot);
+}
+
+TextId sheet_intern_text(Sheet *sheet, const char *text, size_t length) {
+    size_t slot;
+    uint32_t hash = hash_text(text, length);
+    TextId id = find_text(sheet, text, length, hash, &slot);
+    if (id != 0)
+        return id;
+
+    // Only strings not stored yet are copied.
+    char *copy = checked_malloc(length + 1);
+    memcpy(copy, text, length);
+    copy[length] = '\0';
+    return store_text(sheet, copy, length, hash, slot);
+}
+
+const char *sheet_text(const Sheet *sheet, TextId id) {
+    // Ids of the source without a string of their own refer to the source's.
+    if (sheet->texts[id].text == NULL && sheet->has_source)
+        return sheet->source.text(sheet->source.data, id);
+    return sheet->texts[id].text;
+}
+
+size_t sheet_text_bound(const Sheet *sheet) {
+    return sheet->num_texts;
+}
+
+size_t sheet_text_bytes(const Sheet *sheet) {
+    size_t bytes = 0;
+    for (size_t id = 1; id < sheet->num_texts; ++id) {
+        if (sheet->texts[id].text != NULL)
+            bytes += strlen(sheet->texts[id].text) + 1;
+    }
+    return bytes;
+}
+
+void sheet_remove_text(Sheet *sheet, TextId id) {
+    // Strings of the source stay, as do strings other cells still refer to.
+    if (id <= sheet->num_source_texts || --sheet->texts[id].refs > 0)
+        return;
+
+    unindex_text(sheet, id);
+    free(sheet->texts[id].text);
+    sheet->texts[id].text = NULL;
+
+    if (sheet->num_free_texts == sheet->free_texts_capacity) {
+        sheet->free_texts_capacity = sheet->free_texts_capacity ? 2 * sheet->free_texts_capacity : 16;
+        sheet->free_texts = checked_realloc(sheet->free_texts, sheet->free_texts_capacity * sizeof(TextId));
+    }
+    sheet->free_texts[sheet->num_free_texts++] = id;
+}
+
+void sheet_for_each(Sheet *sheet, void (*visit)(Block *block, size_t index, size_t row, size_t col, void *data),
+                    void *data) {
+    if (sheet->has_source)
+        sheet_load_all(sheet);
+    for (size_t i = 0; i < sheet->capacity; ++i) {
+        Block *block = sheet->slots[i];
+        if (block == NULL)
+            continue;
+        for (size_t j = 0; j < BLOCK_ROWS; ++j) {
+            if (block->type[j] != none)
+                visit(block, j, (size_t)block->index * BLOCK_ROWS + j, block->col, data);
+        }
+    }
+}
+
+void sheet_for_each_block(Sheet *sheet, void (*visit)(Block *block, void *data), void *data) {
+    if (sheet->has_source)
+        sheet_load_all(sheet);
+    for (size_t i = 0; i < sheet->capacity; ++i) {
+        if (sheet->slots[i] != NULL)
+            visit(sheet->slots[i], data);
+    }
+}
+
+size_t sheet_block_count(Sheet *sheet) {
+    if (sheet->has_source)
+        sheet_load_all(sheet);
+    return sheet->count;
+}
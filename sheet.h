@@ -0,0 +1,199 @@
+#ifndef ASSIGNMENT_SHEET_H
+#define ASSIGNMENT_SHEET_H
+
+#include "formula.h"
+#include "interface.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Number of consecutive rows of one column stored together in a block.
+#define BLOCK_ROWS 256
+
+// Largest number of columns a sheet may have.
+#define SHEET_MAX_COLS 65536
+
+// Identifier of a string in a sheet's string table; 0 means no string.
+typedef uint32_t TextId;
+
+// Enumeration to represent different types of cells.
+typedef enum {
+    // Represents an empty or uninitialized cell
+    none,
+    // Represents a cell containing a string value
+    str,
+    // Represents a cell containing a numeric value
+    num,
+    // Represents a cell containing an equation or formula
+    eqn,
+} CELL_TYPE;
+
+// Enumeration of the reasons a formula cell may have no value.
+typedef enum {
+    // The formula was evaluated successfully
+    no_error,
+    // The formula is malformed, or reads a formula which failed
+    eval_error,
+    // The formula lies on a cycle of formulas reading each other
+    cycle_error,
+} CELL_ERROR;
+
+// A run of BLOCK_ROWS cells of one column.
+//
+// Cells are stored as a structure of arrays: each property of the cells lives
+// in its own contiguous array, indexed by row within the block. Scans over a
+// column's values therefore walk dense arrays of doubles without pulling
+// strings, pointers or padding through the cache.
+typedef struct {
+    // Column the block belongs to
+    uint32_t col;
+    // Index of the block within its column (first row / BLOCK_ROWS)
+    uint32_t index;
+    // Number of cells in the block whose type is not 'none'
+    size_t population;
+    // Type of each cell (a CELL_TYPE)
+    uint8_t type[BLOCK_ROWS];
+    // Why each formula could not be evaluated (a CELL_ERROR, valid if type is
+    // eqn); non-zero values all mean failure
+    uint8_t error[BLOCK_ROWS];
+    // Numeric value of each cell: the number itself, or the result of a
+    // formula. Always 0 for cells without a numeric value, so that sums can
+    // include them unconditionally.
+    double num[BLOCK_ROWS];
+    // Text of each string or formula cell, in the sheet's string table
+    TextId text[BLOCK_ROWS];
+    // Number of times the value of each formula was updated incrementally since
+    // it was last evaluated in full
+    uint8_t delta_updates[BLOCK_ROWS];
+    // Compiled formula of each formula cell; only allocated once the block
+    // holds a formula. A NULL entry on a formula cell marks a malformed formula.
+    Formula **formulas;
+    // Whether the cached display text of each cell is up to date
+    uint8_t display_valid[BLOCK_ROWS];
+    // Display text of each cell, cut to CELL_DISPLAY_WIDTH characters; only
+    // allocated once a cell of the block is displayed
+    char (*display)[CELL_DISPLAY_WIDTH + 1];
+} Block;
+
+// A sheet of cells whose size is chosen at runtime.
+//
+// Storage is sparse: each column is split into blocks of BLOCK_ROWS cells, and
+// only blocks containing at least one non-empty cell are allocated. Blocks are
+// found through a hash table, so memory grows with the number of populated
+// regions rather than with the area of the sheet, while cells of the same
+// column stay next to each other in memory. Strings are kept apart from the
+// blocks, in a table owned by the sheet, where equal strings are stored once
+// and counted by the number of cells referring to them.
+typedef struct Sheet Sheet;
+
+// Provider of blocks and strings that are loaded into a sheet on demand, such
+// as an open snapshot file.
+typedef struct {
+    // Passed to the functions below
+    void *data;
+    // Number of blocks the source provides
+    size_t num_blocks;
+    // Finds the block of column 'col' with index 'index', storing its number
+    // (below 'num_blocks') in '*n' and returning true if the source has it
+    bool (*find)(void *data, size_t col, size_t index, size_t *n);
+    // Returns the position of the block numbered 'n'
+    void (*position)(void *data, size_t n, size_t *col, size_t *index);
+    // Fills a zeroed block with the contents of the block numbered 'n',
+    // including its formulas, which become owned by the block
+    void (*load)(void *data, size_t n, Block *block);
+    // Number of strings the source provides; their ids are 1 to 'num_texts'
+    size_t num_texts;
+    // Returns a string of the source, which stays valid until 'release'
+    const char *(*text)(void *data, TextId id);
+    // Releases the source when the sheet is freed
+    void (*release)(void *data);
+} BlockSource;
+
+// Creates an empty sheet. The number of columns must not exceed SHEET_MAX_COLS.
+Sheet *sheet_create(size_t num_rows, size_t num_cols);
+
+// Releases a sheet along with all strings and formulas stored in it.
+void sheet_free(Sheet *sheet);
+
+// Makes an empty sheet read its blocks and strings from a source.
+//
+// Each block is copied into the sheet the first time it is looked up, after
+// which the sheet no longer consults the source for it. Strings are read from
+// the source until they are removed.
+void sheet_attach(Sheet *sheet, const BlockSource *source);
+
+// Loads all blocks of the source not loaded yet, after which lookups no longer
+// modify the sheet. Does nothing for sheets without a source.
+void sheet_load_all(Sheet *sheet);
+
+// Returns the dimensions of a sheet.
+size_t sheet_num_rows(const Sheet *sheet);
+size_t sheet_num_cols(const Sheet *sheet);
+
+// Returns the block holding a cell, or NULL if it is not allocated, in which
+// case the cell is empty. The cell's index within the block is
+// row % BLOCK_ROWS. This may load the block from the sheet's source.
+Block *sheet_find(Sheet *sheet, size_t row, size_t col);
+
+// Returns the block of the column 'col' starting at row index * BLOCK_ROWS, or
+// NULL if it is not allocated. This may load the block from the sheet's source.
+Block *sheet_find_block(Sheet *sheet, size_t col, size_t index);
+
+// Returns the block holding a cell, allocating it if necessary.
+//
+// If the cell is empty, the caller is expected to give it a type other than
+// 'none'; the sheet counts it as populated from now on.
+Block *sheet_insert(Sheet *sheet, size_t row, size_t col);
+
+// Marks a cell as empty again, releasing its block once the block holds no
+// more populated cells. The caller must release the cell's text and formula
+// first. Pointers to a released block become invalid.
+void sheet_remove(Sheet *sheet, size_t row, size_t col);
+
+// Stores the formula of the cell at 'index' of a block. Any previous formula
+// of the cell must have been freed.
+void block_set_formula(Block *block, size_t index, Formula *formula);
+
+// Returns the formula of the cell at 'index' of a block, or NULL.
+Formula *block_formula(const Block *block, size_t index);
+
+// Adds a reference to a string to the sheet's string table, taking ownership
+// of the string. If an equal string is stored already, its id is returned and
+// the given one freed.
+TextId sheet_add_text(Sheet *sheet, char *text);
+
+// Adds a reference to the 'length' characters at 'text', which are copied only
+// if no equal string is stored yet.
+TextId sheet_intern_text(Sheet *sheet, const char *text, size_t length);
+
+// Returns a string of the sheet's string table; the id must not be 0. Strings
+// may be shared between cells and must not be modified.
+const char *sheet_text(const Sheet *sheet, TextId id);
+
+// Returns a bound on the ids of the sheet's string table: all ids in use are
+// below it.
+size_t sheet_text_bound(const Sheet *sheet);
+
+// Returns the number of bytes of heap the strings of a sheet take up, not
+// counting strings still read from its source. Takes time linear in the
+// number of strings.
+size_t sheet_text_bytes(const Sheet *sheet);
+
+// Drops a reference to a string of the sheet's string table, removing the
+// string with its last reference. Accepts 0.
+void sheet_remove_text(Sheet *sheet, TextId id);
+
+// Calls 'visit' for every populated cell, in no particular order. The
+// callback must not insert or remove cells. Loads all blocks of the source.
+void sheet_for_each(Sheet *sheet, void (*visit)(Block *block, size_t index, size_t row, size_t col, void *data),
+                    void *data);
+
+// Calls 'visit' for every allocated block, in no particular order. The
+// callback must not insert or remove cells. Loads all blocks of the source.
+void sheet_for_each_block(Sheet *sheet, void (*visit)(Block *block, void *data), void *data);
+
+// Returns the number of allocated blocks, loading all blocks of the source.
+size_t sheet_block_count(Sheet *sheet);
+
+#endif //ASSIGNMENT_SHEET_H
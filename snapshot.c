@@ -0,0 +1,913 @@
+#include "snapshot.h"
+#include "memory.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define SNAPSHOT_MMAP 0
+#else
+#define SNAPSHOT_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Identifies snapshot files.
+static const char SNAPSHOT_MAGIC[8] = {'S', 'H', 'E', 'E', 'T', 'S', 'N', 'P'};
+
+// Written in native byte order, to recognize files from other machines.
+#define BYTE_ORDER_MARK 0x01020304u
+
+// Start of a snapshot file of version 2 or later, holding a workbook.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    // Total size of the file
+    uint64_t file_size;
+    // Sheet directory: a SheetEntry for each sheet, followed by their names
+    uint64_t num_sheets;
+    uint64_t sheets_offset;
+} WorkbookHeader;
+
+// Entry of the sheet directory. The offsets are from the start of the file;
+// names are NUL-terminated and sections start at a multiple of 8 bytes.
+typedef struct {
+    uint64_t offset;
+    uint64_t size;
+    uint64_t name_offset;
+    uint64_t name_length;
+} SheetEntry;
+
+// Start of the section of a sheet, which makes up the whole file in version 1.
+// All offsets are from the start of the section, and every part of it starts
+// at a multiple of 8 bytes.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    // Total size of the section
+    uint64_t file_size;
+    // Dimensions of the sheet, and the deepest stack any formula needs
+    uint64_t num_rows;
+    uint64_t num_cols;
+    uint64_t max_stack;
+    // Block directory: the position of every block, sorted by column and then
+    // block index, followed by the blocks themselves in the same order
+    uint64_t num_blocks;
+    uint64_t directory_offset;
+    uint64_t blocks_offset;
+    // String pool: 'num_texts + 1' offsets into the pool's bytes, string 'id'
+    // being the NUL-terminated bytes from offsets[id - 1] to offsets[id] - 1
+    uint64_t num_texts;
+    uint64_t texts_offset;
+    uint64_t text_bytes_offset;
+    // Compiled formulas, referred to by the blocks
+    uint64_t formulas_offset;
+    uint64_t formulas_size;
+    // Precedents of every formula, as a sequence of EdgeRecords
+    uint64_t num_edges;
+    uint64_t edges_offset;
+    uint64_t edges_size;
+} SnapshotHeader;
+
+// Entry of the block directory.
+typedef struct {
+    uint32_t col;
+    uint32_t index;
+} DirectoryEntry;
+
+// A block as stored in a snapshot; cells without a formula have offset 0.
+typedef struct {
+    uint8_t type[BLOCK_ROWS];
+    uint8_t error[BLOCK_ROWS];
+    double num[BLOCK_ROWS];
+    TextId text[BLOCK_ROWS];
+    // Offset of each cell's formula within the formula section, plus one
+    uint64_t formula[BLOCK_ROWS];
+} BlockRecord;
+
+// A compiled formula, followed by its instructions as (opcode, operand)
+// pairs, its constants, its references as CellRefs and its ranges as (first,
+// last) pairs of references, padded to a multiple of 8 bytes. References of
+// version 1 are only (row, col) pairs, as it has a single sheet.
+typedef struct {
+    uint32_t length;
+    uint32_t num_constants;
+    uint32_t num_refs;
+    uint32_t num_ranges;
+    uint64_t max_stack;
+} FormulaRecord;
+
+// The precedents of a formula, followed by its references and ranges laid
+// out as in a FormulaRecord.
+typedef struct {
+    uint32_t row;
+    uint32_t col;
+    uint32_t num_refs;
+    uint32_t num_ranges;
+} EdgeRecord;
+
+// Size of a reference in version 1.
+#define V1_REF_SIZE (2 * sizeof(uint32_t))
+
+// A sheet of an open snapshot.
+typedef struct {
+    // Snapshot holding the sheet, and the sheet's name
+    Snapshot *snapshot;
+    const char *name;
+    // Contents of the sheet's section
+    const uint8_t *base;
+    size_t size;
+    // Size of the references stored in the section
+    size_t ref_size;
+    // Parts of the section
+    const SnapshotHeader *header;
+    const DirectoryEntry *directory;
+    const BlockRecord *blocks;
+    const uint64_t *text_offsets;
+    const char *text_bytes;
+} SheetSection;
+
+struct Snapshot {
+    // Contents of the file
+    const uint8_t *base;
+    size_t size;
+    // Whether 'base' is a mapping rather than an allocation
+    bool mapped;
+    // Sheets of the file
+    SheetSection *sheets;
+    size_t num_sheets;
+    // Holders of the snapshot: the one who opened it, until it is closed,
+    // and every sheet attached to it
+    size_t holders;
+};
+
+// Function to round a size up to a multiple of 8.
+static uint64_t align8(uint64_t size) {
+    return (size + 7) & ~(uint64_t)7;
+}
+
+// Function to compute the size of a formula's record.
+static uint64_t formula_record_size(const Formula *formula) {
+    return align8(sizeof(FormulaRecord) + formula->length * 2 * sizeof(uint32_t) +
+                  formula->num_constants * sizeof(double) + formula->num_refs * sizeof(CellRef) +
+                  formula->num_ranges * sizeof(CellRange));
+}
+
+// Function to compute the size of a formula's edge record.
+static uint64_t edge_record_size(const Formula *formula) {
+    return align8(sizeof(EdgeRecord) + formula->num_refs * sizeof(CellRef) + formula->num_ranges * sizeof(CellRange));
+}
+
+/* WRITING */
+
+// Blocks of the sheet being written.
+typedef struct {
+    Block **blocks;
+    size_t count;
+    size_t capacity;
+} BlockList;
+
+// Function to collect the blocks of a sheet.
+static void collect_block(Block *block, void *data) {
+    BlockList *list = data;
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? 2 * list->capacity : 64;
+        list->blocks = checked_realloc(list->blocks, list->capacity * sizeof(Block *));
+    }
+    list->blocks[list->count++] = block;
+}
+
+// Function to order blocks by column, then by index.
+static int compare_blocks(const void *a, const void *b) {
+    const Block *x = *(Block *const *)a;
+    const Block *y = *(Block *const *)b;
+    if (x->col != y->col)
+        return (x->col > y->col) - (x->col < y->col);
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+// Function to write zero bytes up to a multiple of 8.
+static void write_padding(FILE *stream, uint64_t size) {
+    static const uint8_t zeros[8] = {0};
+    fwrite(zeros, 1, (size_t)(align8(size) - size), stream);
+}
+
+// Function to write an array, which may be NULL if it is empty.
+static void write_array(FILE *stream, const void *array, size_t size, size_t count) {
+    if (count > 0)
+        fwrite(array, size, count, stream);
+}
+
+// Function to move a position relative to the cell at 'row' and 'col' by that
+// cell, or back.
+static CellRef move_ref(CellRef ref, uint32_t row, uint32_t col) {
+    return (CellRef){ref.row + row, ref.col + col, ref.sheet};
+}
+
+// Function to write the references and ranges of the formula of the cell at
+// 'row' and 'col'. Snapshots store the positions of the cells read, so that
+// the precedents of a sheet are read in place.
+static void write_refs(FILE *stream, const Formula *formula, size_t row, size_t col) {
+    for (size_t k = 0; k < formula->num_refs; ++k) {
+        CellRef ref = move_ref(formula->refs[k], (uint32_t)row, (uint32_t)col);
+        fwrite(&ref, sizeof(ref), 1, stream);
+    }
+    for (size_t k = 0; k < formula->num_ranges; ++k) {
+        CellRange range = {move_ref(formula->ranges[k].first, (uint32_t)row, (uint32_t)col),
+                           move_ref(formula->ranges[k].last, (uint32_t)row, (uint32_t)col)};
+        fwrite(&range, sizeof(range), 1, stream);
+    }
+}
+
+// Function to write the section of a sheet to a stream, setting its size.
+static bool write_section(Sheet *sheet, size_t max_stack, FILE *stream, uint64_t *size) {
+    BlockList list = {0};
+    sheet_for_each_block(sheet, collect_block, &list);
+    if (list.count > 0)
+        qsort(list.blocks, list.count, sizeof(Block *), compare_blocks);
+
+    // Measure the sections. Strings get new ids in the order of the cells
+    // first holding them; strings shared by several cells are written once.
+    SnapshotHeader header = {0};
+    uint64_t text_bytes = 0;
+    TextId *renumbered = checked_calloc(sheet_text_bound(sheet), sizeof(TextId));
+    TextId *texts = checked_malloc(sheet_text_bound(sheet) * sizeof(TextId));
+    for (size_t b = 0; b < list.count; ++b) {
+        const Block *block = list.blocks[b];
+        for (size_t i = 0; i < BLOCK_ROWS; ++i) {
+            TextId text = block->text[i];
+            if (text != 0 && renumbered[text] == 0) {
+                texts[header.num_texts++] = text;
+                renumbered[text] = (TextId)header.num_texts;
+                text_bytes += strlen(sheet_text(sheet, text)) + 1;
+            }
+            const Formula *formula = block_formula(block, i);
+            if (formula != NULL) {
+                header.formulas_size += formula_record_size(formula);
+                header.edges_size += edge_record_size(formula);
+                ++header.num_edges;
+            }
+        }
+    }
+
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.version = SNAPSHOT_VERSION;
+    header.byte_order = BYTE_ORDER_MARK;
+    header.num_rows = sheet_num_rows(sheet);
+    header.num_cols = sheet_num_cols(sheet);
+    header.max_stack = max_stack;
+    header.num_blocks = list.count;
+    header.directory_offset = align8(sizeof(SnapshotHeader));
+    header.blocks_offset = align8(header.directory_offset + list.count * sizeof(DirectoryEntry));
+    header.texts_offset = header.blocks_offset + list.count * sizeof(BlockRecord);
+    header.text_bytes_offset = header.texts_offset + (header.num_texts + 1) * sizeof(uint64_t);
+    header.formulas_offset = align8(header.text_bytes_offset + text_bytes);
+    header.edges_offset = header.formulas_offset + header.formulas_size;
+    header.file_size = header.edges_offset + header.edges_size;
+    fwrite(&header, sizeof(header), 1, stream);
+    write_padding(stream, sizeof(header));
+
+    // Block directory.
+    for (size_t b = 0; b < list.count; ++b) {
+        DirectoryEntry entry = {list.blocks[b]->col, list.blocks[b]->index};
+        fwrite(&entry, sizeof(entry), 1, stream);
+    }
+    write_padding(stream, list.count * sizeof(DirectoryEntry));
+
+    // Blocks, with their strings and formulas renumbered.
+    BlockRecord *record = checked_malloc(sizeof(BlockRecord));
+    uint64_t formula_offset = 0;
+    for (size_t b = 0; b < list.count; ++b) {
+        const Block *block = list.blocks[b];
+        memcpy(record->type, block->type, sizeof(record->type));
+        memcpy(record->error, block->error, sizeof(record->error));
+        memcpy(record->num, block->num, sizeof(record->num));
+        for (size_t i = 0; i < BLOCK_ROWS; ++i) {
+            record->text[i] = renumbered[block->text[i]];
+            const Formula *formula = block_formula(block, i);
+            record->formula[i] = formula != NULL ? formula_offset + 1 : 0;
+            if (formula != NULL)
+                formula_offset += formula_record_size(formula);
+        }
+        fwrite(record, sizeof(BlockRecord), 1, stream);
+    }
+    free(record);
+
+    // String pool.
+    uint64_t offset = 0;
+    fwrite(&offset, sizeof(offset), 1, stream);
+    for (size_t k = 0; k < header.num_texts; ++k) {
+        offset += strlen(sheet_text(sheet, texts[k])) + 1;
+        fwrite(&offset, sizeof(offset), 1, stream);
+    }
+    for (size_t k = 0; k < header.num_texts; ++k) {
+        const char *text = sheet_text(sheet, texts[k]);
+        fwrite(text, 1, strlen(text) + 1, stream);
+    }
+    write_padding(stream, text_bytes);
+    free(renumbered);
+    free(texts);
+
+    // Compiled formulas.
+    for (size_t b = 0; b < list.count; ++b) {
+        const Block *block = list.blocks[b];
+        for (size_t i = 0; i < BLOCK_ROWS; ++i) {
+            const Formula *formula = block_formula(block, i);
+            if (formula == NULL)
+                continue;
+            FormulaRecord head = {(uint32_t)formula->length, (uint32_t)formula->num_constants,
+                                  (uint32_t)formula->num_refs, (uint32_t)formula->num_ranges, formula->max_stack};
+            fwrite(&head, sizeof(head), 1, stream);
+            for (size_t k = 0; k < formula->length; ++k) {
+                uint32_t instruction[2] = {(uint32_t)formula->code[k].op, formula->code[k].operand};
+                fwrite(instruction, sizeof(instruction), 1, stream);
+            }
+            write_array(stream, formula->constants, sizeof(double), formula->num_constants);
+            write_refs(stream, formula, (size_t)block->index * BLOCK_ROWS + i, block->col);
+            write_padding(stream, formula->num_refs * sizeof(CellRef) + formula->num_ranges * sizeof(CellRange));
+        }
+    }
+
+    // Precedents.
+    for (size_t b = 0; b < list.count; ++b) {
+        const Block *block = list.blocks[b];
+        for (size_t i = 0; i < BLOCK_ROWS; ++i) {
+            const Formula *formula = block_formula(block, i);
+            if (formula == NULL)
+                continue;
+            EdgeRecord edge = {(uint32_t)((size_t)block->index * BLOCK_ROWS + i), block->col,
+                               (uint32_t)formula->num_refs, (uint32_t)formula->num_ranges};
+            fwrite(&edge, sizeof(edge), 1, stream);
+            write_refs(stream, formula, edge.row, edge.col);
+            write_padding(stream, sizeof(EdgeRecord) + formula->num_refs * sizeof(CellRef) +
+                                  formula->num_ranges * sizeof(CellRange));
+        }
+    }
+
+    free(list.blocks);
+    *size = header.file_size;
+    return !ferror(stream);
+}
+
+// Function to write a workbook to a stream in the snapshot format.
+static bool write_snapshot(const SnapshotSheet *sheets, size_t num_sheets, size_t max_stack, FILE *stream) {
+    setvbuf(stream, NULL, _IOFBF, 1 << 20);
+
+    // The directory is written once the sizes of the sections are known.
+    WorkbookHeader header = {{0}, SNAPSHOT_VERSION, BYTE_ORDER_MARK, 0, num_sheets, align8(sizeof(WorkbookHeader))};
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    SheetEntry *entries = checked_calloc(num_sheets + 1, sizeof(SheetEntry));
+    uint64_t offset = header.sheets_offset + num_sheets * sizeof(SheetEntry);
+    for (size_t k = 0; k < num_sheets; ++k) {
+        entries[k].name_offset = offset;
+        entries[k].name_length = strlen(sheets[k].name);
+        offset += entries[k].name_length + 1;
+    }
+    offset = align8(offset);
+    fwrite(&header, sizeof(header), 1, stream);
+    write_padding(stream, sizeof(header));
+    write_array(stream, entries, sizeof(SheetEntry), num_sheets);
+    for (size_t k = 0; k < num_sheets; ++k)
+        fwrite(sheets[k].name, 1, entries[k].name_length + 1, stream);
+    write_padding(stream, entries[num_sheets - 1].name_offset + entries[num_sheets - 1].name_length + 1);
+
+    bool ok = true;
+    for (size_t k = 0; k < num_sheets && ok; ++k) {
+        entries[k].offset = offset;
+        if (sheets[k].cells != NULL) {
+            ok = write_section(sheets[k].cells, max_stack, stream, &entries[k].size);
+        } else {
+            // Sections are copied as they are; their offsets are their own.
+            // Version 1 files store references without sheets, and hold a
+            // single sheet, which cannot be copied.
+            const SheetSection *section = &sheets[k].source->sheets[sheets[k].index];
+            ok = section->ref_size == sizeof(CellRef);
+            if (ok)
+                fwrite(section->base, 1, section->size, stream);
+            entries[k].size = section->size;
+        }
+        offset += entries[k].size;
+    }
+
+    header.file_size = offset;
+    ok = ok && fseek(stream, 0, SEEK_SET) == 0;
+    if (ok) {
+        fwrite(&header, sizeof(header), 1, stream);
+        write_padding(stream, sizeof(header));
+        write_array(stream, entries, sizeof(SheetEntry), num_sheets);
+    }
+    free(entries);
+    return ok && !ferror(stream);
+}
+
+bool snapshot_write(const SnapshotSheet *sheets, size_t num_sheets, size_t max_stack, const char *path) {
+    // The snapshot is written next to the file and then moved over it, as the
+    // file may be the one the sheet is mapped from: truncating it would pull
+    // the strings and blocks still read from it out from under the sheet.
+    size_t length = strlen(path);
+    char *temporary = checked_malloc(length + sizeof(".tmp"));
+    memcpy(temporary, path, length);
+    memcpy(temporary + length, ".tmp", sizeof(".tmp"));
+
+    FILE *stream = fopen(temporary, "wb");
+    bool ok = stream != NULL && write_snapshot(sheets, num_sheets, max_stack, stream);
+    ok = stream != NULL && fclose(stream) == 0 && ok;
+#if !SNAPSHOT_MMAP
+    // Unmapped snapshots are read into memory, so the old file can be removed
+    // first where renaming does not replace files.
+    if (ok)
+        remove(path);
+#endif
+    ok = ok && rename(temporary, path) == 0;
+    if (!ok)
+        remove(temporary);
+    free(temporary);
+    return ok;
+}
+
+/* READING */
+
+// Function to read a whole file into memory, mapping it where possible.
+static bool read_file(const char *path, Snapshot *snapshot) {
+#if SNAPSHOT_MMAP
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(SnapshotHeader)) {
+        close(fd);
+        return false;
+    }
+
+    // The mapping stays valid after the descriptor is closed.
+    void *base = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return false;
+    snapshot->base = base;
+    snapshot->size = (size_t)info.st_size;
+    snapshot->mapped = true;
+    return true;
+#else
+    FILE *stream = fopen(path, "rb");
+    if (stream == NULL)
+        return false;
+    fseek(stream, 0, SEEK_END);
+    long size = ftell(stream);
+    fseek(stream, 0, SEEK_SET);
+    if (size < (long)sizeof(SnapshotHeader)) {
+        fclose(stream);
+        return false;
+    }
+
+    uint8_t *base = checked_malloc((size_t)size);
+    bool ok = fread(base, 1, (size_t)size, stream) == (size_t)size;
+    fclose(stream);
+    if (!ok) {
+        free(base);
+        return false;
+    }
+    snapshot->base = base;
+    snapshot->size = (size_t)size;
+    snapshot->mapped = false;
+    return true;
+#endif
+}
+
+// Function to release the contents of a file.
+static void release_file(Snapshot *snapshot) {
+#if SNAPSHOT_MMAP
+    if (snapshot->mapped) {
+        munmap((void *)snapshot->base, snapshot->size);
+        return;
+    }
+#endif
+    free((void *)snapshot->base);
+}
+
+// Function to check that 'count' elements of 'size' bytes at 'offset' lie
+// within 'available' bytes, starting at a multiple of 8.
+static bool part_fits(uint64_t available, uint64_t offset, uint64_t count, uint64_t size) {
+    return offset % 8 == 0 && offset <= available && count <= (available - offset) / size;
+}
+
+// Function to check the header of a sheet's section and locate its parts.
+static bool check_section(SheetSection *section, uint32_t version) {
+    const SnapshotHeader *header = (const SnapshotHeader *)section->base;
+    uint64_t size = section->size;
+
+    // Sections from other versions or byte orders cannot be read.
+    if (size < sizeof(SnapshotHeader) || memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 ||
+        header->version != version || header->byte_order != BYTE_ORDER_MARK || header->file_size != size ||
+        header->num_cols > SHEET_MAX_COLS || header->num_rows > UINT32_MAX)
+        return false;
+
+    if (!part_fits(size, header->directory_offset, header->num_blocks, sizeof(DirectoryEntry)) ||
+        !part_fits(size, header->blocks_offset, header->num_blocks, sizeof(BlockRecord)) ||
+        !part_fits(size, header->texts_offset, header->num_texts + 1, sizeof(uint64_t)) ||
+        header->num_texts >= UINT32_MAX || header->text_bytes_offset > size ||
+        !part_fits(size, header->formulas_offset, header->formulas_size, 1) ||
+        !part_fits(size, header->edges_offset, header->edges_size, 1))
+        return false;
+
+    section->ref_size = version == 1 ? V1_REF_SIZE : sizeof(CellRef);
+    section->header = header;
+    section->directory = (const DirectoryEntry *)(section->base + header->directory_offset);
+    section->blocks = (const BlockRecord *)(section->base + header->blocks_offset);
+    section->text_offsets = (const uint64_t *)(section->base + header->texts_offset);
+    section->text_bytes = (const char *)(section->base + header->text_bytes_offset);
+    return true;
+}
+
+// Function to check the headers of a file and locate its sheets.
+static bool check_header(Snapshot *snapshot) {
+    const WorkbookHeader *header = (const WorkbookHeader *)snapshot->base;
+
+    // Files from newer versions or other byte orders cannot be read.
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 || header->version == 0 ||
+        header->version > SNAPSHOT_VERSION || header->byte_order != BYTE_ORDER_MARK ||
+        header->file_size != snapshot->size)
+        return false;
+
+    // Version 1 files hold a single sheet, without a name.
+    if (header->version == 1) {
+        snapshot->num_sheets = 1;
+        snapshot->sheets = checked_calloc(1, sizeof(SheetSection));
+        snapshot->sheets[0] = (SheetSection){.snapshot = snapshot, .name = "", .base = snapshot->base,
+                                             .size = snapshot->size};
+        return check_section(&snapshot->sheets[0], 1);
+    }
+
+    // Sheet indices must fit in the references of the formulas.
+    if (header->num_sheets == 0 || header->num_sheets > UINT32_MAX ||
+        !part_fits(snapshot->size, header->sheets_offset, header->num_sheets, sizeof(SheetEntry)))
+        return false;
+    const SheetEntry *entries = (const SheetEntry *)(snapshot->base + header->sheets_offset);
+    snapshot->sheets = checked_calloc(header->num_sheets, sizeof(SheetSection));
+    for (size_t k = 0; k < header->num_sheets; ++k) {
+        const SheetEntry *entry = &entries[k];
+        if (!part_fits(snapshot->size, entry->offset, entry->size, 1) || entry->name_offset > snapshot->size ||
+            entry->name_length >= snapshot->size - entry->name_offset ||
+            snapshot->base[entry->name_offset + entry->name_length] != '\0')
+            return false;
+        SheetSection *section = &snapshot->sheets[snapshot->num_sheets++];
+        *section = (SheetSection){.snapshot = snapshot,
+                                  .name = (const char *)snapshot->base + entry->name_offset,
+                                  .base = snapshot->base + entry->offset,
+                                  .size = entry->size};
+        if (!check_section(section, header->version))
+            return false;
+    }
+    return true;
+}
+
+// Function to release the contents of a file once nothing holds it anymore.
+static void release_snapshot(Snapshot *snapshot) {
+    if (--snapshot->holders > 0)
+        return;
+    release_file(snapshot);
+    free(snapshot->sheets);
+    free(snapshot);
+}
+
+Snapshot *snapshot_open(const char *path) {
+    Snapshot *snapshot = checked_calloc(1, sizeof(Snapshot));
+    if (!read_file(path, snapshot)) {
+        free(snapshot);
+        return NULL;
+    }
+    snapshot->holders = 1;
+    if (!check_header(snapshot)) {
+        release_snapshot(snapshot);
+        return NULL;
+    }
+    return snapshot;
+}
+
+void snapshot_close(Snapshot *snapshot) {
+    if (snapshot != NULL)
+        release_snapshot(snapshot);
+}
+
+size_t snapshot_num_sheets(const Snapshot *snapshot) {
+    return snapshot->num_sheets;
+}
+
+const char *snapshot_sheet_name(const Snapshot *snapshot, size_t sheet) {
+    return snapshot->sheets[sheet].name;
+}
+
+size_t snapshot_num_rows(const Snapshot *snapshot, size_t sheet) {
+    return snapshot->sheets[sheet].header->num_rows;
+}
+
+size_t snapshot_num_cols(const Snapshot *snapshot, size_t sheet) {
+    return snapshot->sheets[sheet].header->num_cols;
+}
+
+size_t snapshot_max_stack(const Snapshot *snapshot, size_t sheet) {
+    return snapshot->sheets[sheet].header->max_stack;
+}
+
+// Function to read references stored in a section.
+static void read_refs(const SheetSection *section, const uint8_t *p, CellRef *refs, size_t count) {
+    if (section->ref_size == sizeof(CellRef)) {
+        memcpy(refs, p, count * sizeof(CellRef));
+        return;
+    }
+
+    // References of version 1 lie on the only sheet.
+    for (size_t k = 0; k < count; ++k, p += V1_REF_SIZE) {
+        uint32_t position[2];
+        memcpy(position, p, sizeof(position));
+        refs[k] = (CellRef){position[0], position[1], 0};
+    }
+}
+
+// Function to check that a cell lies within a sheet of the snapshot.
+static bool ref_fits(const SheetSection *section, CellRef ref) {
+    if (ref.sheet >= section->snapshot->num_sheets)
+        return false;
+    const SnapshotHeader *header = section->snapshot->sheets[ref.sheet].header;
+    return ref.row < header->num_rows && ref.col < header->num_cols;
+}
+
+// Function to check the references and ranges following a record.
+static bool refs_fit(const SheetSection *section, const CellRef *refs, size_t num_refs, const CellRange *ranges,
+                     size_t num_ranges) {
+    for (size_t k = 0; k < num_refs; ++k) {
+        if (!ref_fits(section, refs[k]))
+            return false;
+    }
+    for (size_t k = 0; k < num_ranges; ++k) {
+        if (!ref_fits(section, ranges[k].first) || !ref_fits(section, ranges[k].last) ||
+            ranges[k].first.sheet != ranges[k].last.sheet || ranges[k].first.row > ranges[k].last.row ||
+            ranges[k].first.col > ranges[k].last.col)
+            return false;
+    }
+    return true;
+}
+
+// Function to check that code keeps the evaluation stack within its bounds.
+//
+// The evaluator trusts compiled code, so code from a file must pop only values
+// it pushed and never grow the stack beyond the depth the snapshot promises.
+static bool code_is_safe(const SheetSection *section, const Formula *formula) {
+    size_t depth = 0, max_depth = 0;
+
+    for (size_t k = 0; k < formula->length; ++k) {
+        const Instruction *instruction = &formula->code[k];
+        switch (instruction->op) {
+            case OP_CONST:
+                if (instruction->operand >= formula->num_constants)
+                    return false;
+                ++depth;
+                break;
+            case OP_REF:
+                if (instruction->operand >= formula->num_refs)
+                    return false;
+                ++depth;
+                break;
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_DIV:
+            case OP_POW:
+                if (depth < 2)
+                    return false;
+                --depth;
+                break;
+            case OP_NEG:
+                if (depth < 1)
+                    return false;
+                break;
+            case OP_ADD_REF:
+                if (depth < 1 || instruction->operand >= formula->num_refs)
+                    return false;
+                break;
+            case OP_ADD_CONST:
+                if (depth < 1 || instruction->operand >= formula->num_constants)
+                    return false;
+                break;
+            case OP_AGG_BEGIN:
+                depth += 4;
+                break;
+            case OP_AGG_VALUE:
+                if (depth < 5)
+                    return false;
+                --depth;
+                break;
+            case OP_AGG_RANGE:
+            case OP_AGG_RANGE_EXTREMA:
+                if (depth < 4 || instruction->operand >= formula->num_ranges)
+                    return false;
+                break;
+            case OP_AGG_END:
+                if (depth < 4 || instruction->operand > FN_COUNT)
+                    return false;
+                depth -= 3;
+                break;
+            default:
+                return false;
+        }
+        if (depth > max_depth)
+            max_depth = depth;
+    }
+    return depth == 1 && max_depth <= formula->max_stack && formula->max_stack <= section->header->max_stack;
+}
+
+// Function to decode the compiled formula of the cell at 'row' and 'col',
+// returning NULL if it is damaged. Identical formulas are shared.
+static Formula *decode_formula(const SheetSection *section, uint64_t offset, size_t row, size_t col) {
+    const SnapshotHeader *header = section->header;
+    if (offset % 8 != 0 || offset > header->formulas_size || header->formulas_size - offset < sizeof(FormulaRecord))
+        return NULL;
+
+    const uint8_t *start = section->base + header->formulas_offset + offset;
+    const FormulaRecord *record = (const FormulaRecord *)start;
+    uint64_t size = sizeof(FormulaRecord) + (uint64_t)record->length * 2 * sizeof(uint32_t) +
+                    (uint64_t)record->num_constants * sizeof(double) +
+                    ((uint64_t)record->num_refs + 2 * (uint64_t)record->num_ranges) * section->ref_size;
+    if (header->formulas_size - offset < size)
+        return NULL;
+
+    Formula *formula = checked_calloc(1, sizeof(Formula));
+    formula->length = record->length;
+    formula->num_constants = record->num_constants;
+    formula->num_refs = record->num_refs;
+    formula->num_ranges = record->num_ranges;
+    formula->max_stack = record->max_stack;
+    formula->code = checked_malloc(formula->length * sizeof(Instruction));
+    formula->constants = checked_malloc(formula->num_constants * sizeof(double));
+    formula->refs = checked_malloc(formula->num_refs * sizeof(CellRef));
+    formula->ranges = checked_malloc(formula->num_ranges * sizeof(CellRange));
+
+    const uint8_t *p = start + sizeof(FormulaRecord);
+    for (size_t k = 0; k < formula->length; ++k, p += 2 * sizeof(uint32_t)) {
+        uint32_t instruction[2];
+        memcpy(instruction, p, sizeof(instruction));
+        formula->code[k].op = (OPCODE)instruction[0];
+        formula->code[k].operand = instruction[1];
+    }
+    memcpy(formula->constants, p, formula->num_constants * sizeof(double));
+    p += formula->num_constants * sizeof(double);
+    read_refs(section, p, formula->refs, formula->num_refs);
+    p += formula->num_refs * section->ref_size;
+    read_refs(section, p, (CellRef *)formula->ranges, 2 * formula->num_ranges);
+
+    if (!code_is_safe(section, formula) ||
+        !refs_fit(section, formula->refs, formula->num_refs, formula->ranges, formula->num_ranges)) {
+        formula_free(formula);
+        return NULL;
+    }
+
+    // Compiled formulas read cells relative to their own.
+    for (size_t k = 0; k < formula->num_refs; ++k)
+        formula->refs[k] = move_ref(formula->refs[k], -(uint32_t)row, -(uint32_t)col);
+    for (size_t k = 0; k < formula->num_ranges; ++k) {
+        formula->ranges[k].first = move_ref(formula->ranges[k].first, -(uint32_t)row, -(uint32_t)col);
+        formula->ranges[k].last = move_ref(formula->ranges[k].last, -(uint32_t)row, -(uint32_t)col);
+    }
+    return formula_share(formula);
+}
+
+// Function to find a block through a binary search of the directory.
+static bool find_block(void *data, size_t col, size_t index, size_t *n) {
+    const SheetSection *section = data;
+    size_t low = 0, high = section->header->num_blocks;
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        const DirectoryEntry *entry = &section->directory[mid];
+        if (entry->col < col || (entry->col == col && entry->index < index))
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    if (low == section->header->num_blocks || section->directory[low].col != col ||
+        section->directory[low].index != index)
+        return false;
+    *n = low;
+    return true;
+}
+
+// Function to return the position of a block of the directory.
+static void block_position(void *data, size_t n, size_t *col, size_t *index) {
+    const SheetSection *section = data;
+    *col = section->directory[n].col;
+    *index = section->directory[n].index;
+}
+
+// Function to copy a block out of the file.
+static void load_block(void *data, size_t n, Block *block) {
+    const SheetSection *section = data;
+    const BlockRecord *record = &section->blocks[n];
+
+    memcpy(block->num, record->num, sizeof(block->num));
+    for (size_t i = 0; i < BLOCK_ROWS; ++i) {
+        // Damaged cells are read as empty, and damaged formulas as malformed.
+        uint8_t type = record->type[i] <= eqn ? record->type[i] : none;
+        TextId text = record->text[i] <= section->header->num_texts ? record->text[i] : 0;
+        if (type == none || type == num || text == 0) {
+            text = 0;
+            type = type == num ? num : none;
+        }
+
+        block->type[i] = type;
+        block->error[i] = record->error[i] <= cycle_error ? record->error[i] : eval_error;
+        block->text[i] = text;
+        if (type == none)
+            block->num[i] = 0;
+        else
+            ++block->population;
+
+        if (type == eqn && record->formula[i] != 0) {
+            size_t row = (size_t)block->index * BLOCK_ROWS + i;
+            block_set_formula(block, i, decode_formula(section, record->formula[i] - 1, row, block->col));
+        }
+    }
+}
+
+// Function to return a string of the pool.
+static const char *pool_text(void *data, TextId id) {
+    const SheetSection *section = data;
+    const uint64_t *offsets = section->text_offsets;
+    uint64_t available = section->size - section->header->text_bytes_offset;
+
+    // Damaged strings are read as empty.
+    if (id == 0 || id > section->header->num_texts || offsets[id - 1] >= offsets[id] || offsets[id] > available ||
+        section->text_bytes[offsets[id] - 1] != '\0')
+        return "";
+    return section->text_bytes + offsets[id - 1];
+}
+
+// Function to release a snapshot once a sheet attached to it is freed.
+static void release_sheet(void *data) {
+    SheetSection *section = data;
+    release_snapshot(section->snapshot);
+}
+
+void snapshot_attach(Snapshot *snapshot, size_t sheet, Sheet *cells) {
+    SheetSection *section = &snapshot->sheets[sheet];
+    BlockSource source = {
+        .data = section,
+        .num_blocks = section->header->num_blocks,
+        .find = find_block,
+        .position = block_position,
+        .load = load_block,
+        .num_texts = section->header->num_texts,
+        .text = pool_text,
+        .release = release_sheet,
+    };
+    ++snapshot->holders;
+    sheet_attach(cells, &source);
+}
+
+void snapshot_for_each_formula(const Snapshot *snapshot, size_t sheet,
+                               void (*visit)(size_t row, size_t col, const CellRef *refs, size_t num_refs,
+                                             const CellRange *ranges, size_t num_ranges, void *data),
+                               void *data) {
+    const SheetSection *section = &snapshot->sheets[sheet];
+    const uint8_t *p = section->base + section->header->edges_offset;
+    uint64_t left = section->header->edges_size;
+
+    // References of version 1 are converted, and those of later versions are
+    // read from the file in place.
+    CellRef *converted = NULL;
+    size_t converted_capacity = 0;
+
+    for (uint64_t k = 0; k < section->header->num_edges && left >= sizeof(EdgeRecord); ++k) {
+        const EdgeRecord *edge = (const EdgeRecord *)p;
+        uint64_t count = (uint64_t)edge->num_refs + 2 * (uint64_t)edge->num_ranges;
+        uint64_t size = align8(sizeof(EdgeRecord) + count * section->ref_size);
+        if (size > left)
+            break;
+
+        const CellRef *refs = (const CellRef *)(p + sizeof(EdgeRecord));
+        if (section->ref_size != sizeof(CellRef)) {
+            if (count > converted_capacity) {
+                converted_capacity = (size_t)count;
+                converted = checked_realloc(converted, converted_capacity * sizeof(CellRef));
+            }
+            read_refs(section, p + sizeof(EdgeRecord), converted, (size_t)count);
+            refs = converted;
+        }
+
+        // Damaged records are skipped.
+        const CellRange *ranges = (const CellRange *)(refs + edge->num_refs);
+        CellRef cell = {edge->row, edge->col, (uint32_t)sheet};
+        if (ref_fits(section, cell) && refs_fit(section, refs, edge->num_refs, ranges, edge->num_ranges))
+            visit(edge->row, edge->col, refs, edge->num_refs, ranges, edge->num_ranges, data);
+
+        p += size;
+        left -= size;
+    }
+    free(converted);
+}
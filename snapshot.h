@@ -0,0 +1,75 @@
+#ifndef ASSIGNMENT_SNAPSHOT_H
+#define ASSIGNMENT_SNAPSHOT_H
+
+#include "formula.h"
+#include "sheet.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Binary snapshots of a workbook.
+//
+// A snapshot holds a versioned header and a directory of the sheets of the
+// workbook, followed by a section for each sheet. A section has a header of
+// its own followed by four parts: the blocks of the sheet with their values
+// already calculated, a pool of the strings and formula texts, the compiled
+// formulas, and the precedents of every formula. Opening a snapshot maps the
+// file into memory and only checks the headers; sheets are attached one by
+// one, blocks are copied into a sheet when they are first accessed, and
+// strings are read straight from the mapping. Opening is therefore nearly
+// independent of the size of the file, and only the touched regions of the
+// sheets in use are ever read from disk.
+
+// Current version of the format. Snapshots of older versions remain readable;
+// those of version 1 hold a single sheet, named "".
+#define SNAPSHOT_VERSION 2
+
+// An open snapshot.
+typedef struct Snapshot Snapshot;
+
+// A sheet to write to a snapshot.
+typedef struct {
+    // Name of the sheet
+    const char *name;
+    // Cells of the sheet, or NULL to copy sheet 'index' of the open snapshot
+    // 'source' as it is stored; sheets of version 1 cannot be copied
+    Sheet *cells;
+    const Snapshot *source;
+    size_t index;
+} SnapshotSheet;
+
+// Writes the sheets of a workbook, of which there must be at least one, to a
+// snapshot file; 'max_stack' is the deepest evaluation stack any of their
+// formulas needs. Returns false if the file could not be written.
+bool snapshot_write(const SnapshotSheet *sheets, size_t num_sheets, size_t max_stack, const char *path);
+
+// Opens a snapshot file. Returns NULL if it cannot be read, is not a
+// snapshot, or was written by a newer version.
+Snapshot *snapshot_open(const char *path);
+
+// Closes a snapshot. Its memory is released once the sheets attached to it
+// are freed as well.
+void snapshot_close(Snapshot *snapshot);
+
+// Returns the number of sheets of the snapshot, and the name of one of them.
+size_t snapshot_num_sheets(const Snapshot *snapshot);
+const char *snapshot_sheet_name(const Snapshot *snapshot, size_t sheet);
+
+// Returns the dimensions of a sheet of the snapshot and the deepest
+// evaluation stack its formulas need.
+size_t snapshot_num_rows(const Snapshot *snapshot, size_t sheet);
+size_t snapshot_num_cols(const Snapshot *snapshot, size_t sheet);
+size_t snapshot_max_stack(const Snapshot *snapshot, size_t sheet);
+
+// Attaches a sheet of a snapshot to an empty sheet of its dimensions, which
+// keeps the snapshot open until it is freed.
+void snapshot_attach(Snapshot *snapshot, size_t sheet, Sheet *cells);
+
+// Calls 'visit' with the position and precedents of every formula of a sheet
+// of the snapshot, as compiled when it was written.
+void snapshot_for_each_formula(const Snapshot *snapshot, size_t sheet,
+                               void (*visit)(size_t row, size_t col, const CellRef *refs, size_t num_refs,
+                                             const CellRange *ranges, size_t num_ranges, void *data),
+                               void *data);
+
+#endif //ASSIGNMENT_SNAPSHOT_H
@@ -12,14 +12,34 @@
 
 static char display[NUM_ROWS][NUM_COLS][CELL_DISPLAY_WIDTH + 1];
 
+// Number of display callbacks, and of cells they listed
+static size_t display_calls = 0;
+static size_t displayed_cells = 0;
+
 int main() {
     memset(display, 0, sizeof(display));
+    model_init();
     run_tests();
     return 0;
 }
 
-void update_cell_display(ROW row, COL col, const char *text) {
-    snprintf(display[row][col], CELL_DISPLAY_WIDTH + 1, "%s", text);
+void update_cell_displays(const CellDisplayUpdate *updates, size_t count) {
+    ++display_calls;
+    displayed_cells += count;
+    for (size_t i = 0; i < count; ++i) {
+        // Only the default-sized part of larger sheets is recorded.
+        if (updates[i].row >= NUM_ROWS || updates[i].col >= NUM_COLS)
+            continue;
+        snprintf(display[updates[i].row][updates[i].col], CELL_DISPLAY_WIDTH + 1, "%s", updates[i].text);
+    }
+}
+
+size_t display_call_count(void) {
+    return display_calls;
+}
+
+size_t displayed_cell_count(void) {
+    return displayed_cells;
 }
 
 void assert_display_text(ROW row, COL col, const char *text) {
@@ -27,7 +47,8 @@ void assert_display_text(ROW row, COL col, const char *text) {
 }
 
 void assert_edit_text(ROW row, COL col, const char *text) {
-    char *value = get_textual_value(row, col);
-    assert(value != NULL && strcmp(text, value) == 0);
-    free(value);
+    const char *value;
+    size_t length;
+    get_textual_value_view(row, col, &value, &length);
+    assert(length == strlen(text) && memcmp(text, value, length) == 0 && value[length] == '\0');
 }
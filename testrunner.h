@@ -3,7 +3,14 @@
 
 #include "defs.h"
 
+#include <stddef.h>
+
 void assert_display_text(ROW row, COL col, const char *text);
 void assert_edit_text(ROW row, COL col, const char *text);
 
+// Return how often the model updated the display, and the total number of
+// cells it redrew.
+size_t display_call_count(void);
+size_t displayed_cell_count(void);
+
 #endif //ASSIGNMENT_TESTRUNNER_H
@@ -1,17 +1,731 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "formula.h"
+#include "graph.h"
 #include "model.h"
 #include "testrunner.h"
 #include "tests.h"
 
+// Function to interrupt every evaluation, counting how often it was asked.
+static bool interrupt_always(void *data) {
+    ++*(size_t *)data;
+    return true;
+}
+
 void run_tests() {
     set_cell_value(ROW_2, COL_A, strdup("1.4"));
-    assert_display_text(ROW_2, COL_A, strdup("1.4"));
+    assert_display_text(ROW_2, COL_A, "1.4");
     set_cell_value(ROW_2, COL_B, strdup("2.9"));
-    assert_display_text(ROW_2, COL_B, strdup("2.9"));
+    assert_display_text(ROW_2, COL_B, "2.9");
     set_cell_value(ROW_2, COL_C, strdup("=A2+B2+0.4"));
-    assert_edit_text(ROW_2, COL_C, strdup("=A2+B2+0.4"));
-    assert_display_text(ROW_2, COL_C, strdup("4.7"));
+    assert_edit_text(ROW_2, COL_C, "=A2+B2+0.4");
+    assert_display_text(ROW_2, COL_C, "4.7");
     set_cell_value(ROW_2, COL_B, strdup("3.1"));
-    assert_display_text(ROW_2, COL_C, strdup("4.9"));
+    assert_display_text(ROW_2, COL_C, "4.9");
+
+    // Chains are evaluated in dependency order, not in sheet order.
+    set_cell_value(ROW_6, COL_A, strdup("=B6"));
+    set_cell_value(ROW_6, COL_B, strdup("=C6+1"));
+    set_cell_value(ROW_6, COL_C, strdup("5"));
+    assert_display_text(ROW_6, COL_B, "6");
+    assert_display_text(ROW_6, COL_A, "6");
+    clear_cell(ROW_6, COL_C);
+    assert_display_text(ROW_6, COL_C, "");
+    assert_display_text(ROW_6, COL_A, "1");
+
+    // Malformed formulas, and formulas reading them, display an error.
+    set_cell_value(ROW_7, COL_A, strdup("=A6+"));
+    assert_display_text(ROW_7, COL_A, "ERROR");
+    assert_edit_text(ROW_7, COL_A, "=A6+");
+    set_cell_value(ROW_7, COL_B, strdup("= A7 + 1"));
+    assert_display_text(ROW_7, COL_B, "ERROR");
+    set_cell_value(ROW_7, COL_A, strdup("=A6 + 2.5"));
+    assert_display_text(ROW_7, COL_B, "4.5");
+
+    // Recalculating the dependents of an edited value does not allocate.
+    size_t allocations = model_allocation_count();
+    set_cell_value(ROW_2, COL_A, strdup("2"));
+    assert_display_text(ROW_2, COL_C, "5.5");
+    set_cell_value(ROW_6, COL_C, strdup("7"));
+    assert_display_text(ROW_6, COL_A, "8");
+    assert(model_allocation_count() == allocations);
+
+    // Numbers are stored as values, and their text is generated from the value.
+    set_cell_value(ROW_8, COL_A, strdup("0010.250"));
+    assert_display_text(ROW_8, COL_A, "10.25");
+    assert_edit_text(ROW_8, COL_A, "10.25");
+    set_cell_value(ROW_8, COL_B, strdup("  42"));
+    assert_edit_text(ROW_8, COL_B, "42");
+    set_cell_value(ROW_8, COL_B, strdup(".5"));
+    assert_edit_text(ROW_8, COL_B, "0.5");
+    set_cell_value(ROW_8, COL_B, strdup("5."));
+    assert_edit_text(ROW_8, COL_B, "5");
+
+    // Numbers round like strtod however many digits they have; exponents and
+    // trailing characters make text.
+    set_cell_value(ROW_8, COL_B, strdup("0.1000000000000000055511151231257827021181583404541015625"));
+    assert_edit_text(ROW_8, COL_B, "0.1");
+    set_cell_value(ROW_8, COL_B, strdup("9007199254740993"));
+    assert_edit_text(ROW_8, COL_B, "9007199254740992");
+    set_cell_value(ROW_8, COL_B, strdup("1e5"));
+    assert_edit_text(ROW_8, COL_B, "1e5");
+    set_cell_value(ROW_8, COL_B, strdup("5 "));
+    assert_edit_text(ROW_8, COL_B, "5 ");
+    set_cell_value(ROW_8, COL_B, strdup("=0.1000000000000000055511151231257827021181583404541015625*3"));
+    assert_display_text(ROW_8, COL_B, "0.3");
+    set_cell_value(ROW_8, COL_B, strdup("=1e5"));
+    assert_display_text(ROW_8, COL_B, "ERROR");
+    set_cell_value(ROW_8, COL_B, strdup("0.1"));
+    assert_edit_text(ROW_8, COL_B, "0.1");
+
+    // Results display with six significant digits, and displays are cut to the cell width.
+    set_cell_value(ROW_8, COL_C, strdup("=AVERAGE(A8, B8, B8)"));
+    assert_display_text(ROW_8, COL_C, "3.48333");
+    set_cell_value(ROW_8, COL_D, strdup("=D9+123456789"));
+    assert_display_text(ROW_8, COL_D, "1.23457e+08");
+    set_cell_value(ROW_9, COL_D, strdup("0.000012"));
+    assert_display_text(ROW_8, COL_D, "1.23457e+08");
+    set_cell_value(ROW_9, COL_D, strdup("123456789012.5"));
+    assert_display_text(ROW_9, COL_D, "12345678901");
+    assert_edit_text(ROW_9, COL_D, "123456789012.5");
+    assert_display_text(ROW_8, COL_D, "1.2358e+11");
+    model_redisplay(0, 0, NUM_ROWS, NUM_COLS);
+    assert_display_text(ROW_8, COL_D, "1.2358e+11");
+    clear_cell(ROW_9, COL_D);
+    assert_display_text(ROW_9, COL_D, "");
+    set_cell_value(ROW_8, COL_D, strdup("=D9+0.1+0.2"));
+    assert_display_text(ROW_8, COL_D, "0.3");
+
+    // Repeated texts share one string, so entering them again does not allocate.
+    set_cell_value(ROW_9, COL_A, strdup("label"));
+    allocations = model_allocation_count();
+    set_cell_value(ROW_9, COL_B, strdup("label"));
+    set_cell_value(ROW_9, COL_A, strdup("label"));
+    assert(model_allocation_count() == allocations);
+    clear_cell(ROW_9, COL_A);
+    assert_edit_text(ROW_9, COL_B, "label");
+    set_cell_value(ROW_9, COL_A, strdup("other"));
+    assert_edit_text(ROW_9, COL_A, "other");
+    assert_edit_text(ROW_9, COL_B, "label");
+
+    // Sheets can be sized at runtime and address cells beyond the enumerations.
+    model_init_sized(200000, 100);
+    set_cell_value_at(199999, 99, strdup("3"));
+    set_cell_value(ROW_1, COL_A, strdup("=CV200000+A1000+1"));
+    assert_display_text(ROW_1, COL_A, "4");
+    char *value = get_textual_value_at(199999, 99);
+    assert(strcmp(value, "3") == 0);
+    free(value);
+
+    // Views of the text of cells are not copied, nor cut short.
+    char *long_text = malloc(301);
+    memset(long_text, 'x', 300);
+    long_text[300] = '\0';
+    set_cell_value(ROW_2, COL_A, long_text);
+    size_t allocations_before_views = model_allocation_count();
+    const char *view;
+    size_t view_length;
+    get_textual_value_view_at(199999, 99, &view, &view_length);
+    assert(view_length == 1 && strcmp(view, "3") == 0);
+    get_textual_value_view(ROW_2, COL_A, &view, &view_length);
+    assert(view_length == 300 && view[0] == 'x' && view[300] == '\0');
+    get_textual_value_view(ROW_3, COL_A, &view, &view_length);
+    assert(view_length == 0 && view[0] == '\0');
+    assert(model_allocation_count() == allocations_before_views);
+    value = get_textual_value(ROW_2, COL_A);
+    assert(strlen(value) == 255);
+    free(value);
+    clear_cell_at(199999, 99);
+    assert_display_text(ROW_1, COL_A, "1");
+    set_cell_value(ROW_1, COL_B, strdup("=CW1"));
+    assert_display_text(ROW_1, COL_B, "ERROR");
+
+    // Formulas reading long ranges follow edits anywhere in them.
+    set_cell_value(ROW_1, COL_C, strdup("=SUM(CU1:CV200000)"));
+    set_cell_value_at(150000, 98, strdup("2"));
+    assert_display_text(ROW_1, COL_C, "2");
+    set_cell_value_at(123456, 99, strdup("=C1"));
+    assert_display_text(ROW_1, COL_C, "#CYCLE");
+    clear_cell_at(123456, 99);
+    assert_display_text(ROW_1, COL_C, "2");
+    set_cell_value(ROW_1, COL_C, strdup("=SUM(CU1:CU2)"));
+    set_cell_value_at(150000, 98, strdup("5"));
+    assert_display_text(ROW_1, COL_C, "0");
+
+    // Range functions skip empty cells and strings, across blocks of the sheet.
+    for (size_t row = 0; row < 300; ++row) {
+        char text[16];
+        snprintf(text, sizeof(text), "%zu", row + 1);
+        set_cell_value_at(row + 20, COL_G, strdup(text));
+    }
+    set_cell_value(ROW_2, COL_A, strdup("=SUM(G21:G320)"));
+    set_cell_value(ROW_2, COL_B, strdup("=MIN(G21:G320, 7)"));
+    set_cell_value(ROW_2, COL_C, strdup("=MAX(G21:G320)"));
+    set_cell_value(ROW_2, COL_D, strdup("=AVERAGE(G21:G320)"));
+    set_cell_value(ROW_2, COL_E, strdup("=COUNT(G1:G400, A1, 1+1)"));
+    assert_display_text(ROW_2, COL_A, "45150");
+    assert_display_text(ROW_2, COL_B, "1");
+    assert_display_text(ROW_2, COL_C, "300");
+    assert_display_text(ROW_2, COL_D, "150.5");
+    assert_display_text(ROW_2, COL_E, "302");
+    set_cell_value_at(20, COL_G, strdup("text"));
+    set_cell_value_at(300, COL_G, strdup("0.5"));
+    assert_display_text(ROW_2, COL_A, "44868.5");
+    assert_display_text(ROW_2, COL_B, "0.5");
+    assert_display_text(ROW_2, COL_E, "301");
+    set_cell_value(ROW_3, COL_A, strdup("=AVERAGE(F1:F10)"));
+    assert_display_text(ROW_3, COL_A, "ERROR");
+    set_cell_value_at(100, COL_G, strdup("=CW1"));
+    assert_display_text(ROW_2, COL_C, "ERROR");
+
+    // Batched edits are recalculated and displayed only once committed.
+    model_begin_batch();
+    set_cell_value(ROW_4, COL_A, strdup("=B4+C4"));
+    set_cell_value(ROW_4, COL_B, strdup("2"));
+    assert_display_text(ROW_4, COL_A, "");
+    set_cell_value(ROW_4, COL_C, strdup("3"));
+    model_commit_batch();
+    assert_display_text(ROW_4, COL_A, "5");
+    assert_display_text(ROW_4, COL_B, "2");
+    CellUpdate updates[] = {
+        {ROW_4, COL_B, strdup("10")},
+        {ROW_4, COL_C, NULL},
+        {ROW_4, COL_B, strdup("20")},
+    };
+    set_cell_values(updates, sizeof(updates) / sizeof(updates[0]));
+    assert_display_text(ROW_4, COL_A, "20");
+    assert_display_text(ROW_4, COL_C, "");
+
+    // Each recalculation redraws only the cells whose text changed, at once.
+    set_cell_value(ROW_5, COL_A, strdup("=MIN(B5, 1)"));
+    set_cell_value(ROW_5, COL_C, strdup("=B5+A5"));
+    set_cell_value(ROW_5, COL_B, strdup("5"));
+    size_t calls = display_call_count();
+    size_t cells = displayed_cell_count();
+    set_cell_value(ROW_5, COL_B, strdup("7"));
+    assert_display_text(ROW_5, COL_C, "8");
+    assert(display_call_count() == calls + 1);
+    assert(displayed_cell_count() == cells + 2);
+
+    // Multi-threaded recalculation gives the same results as a single thread.
+    model_set_threads(4);
+    model_begin_batch();
+    set_cell_value_at(0, 8, strdup("1"));
+    for (size_t row = 10; row < 2010; ++row)
+        set_cell_value_at(row, 8, strdup("=I1+1"));
+    set_cell_value(ROW_9, COL_A, strdup("=SUM(I11:I2010)"));
+    model_commit_batch();
+    assert_display_text(ROW_9, COL_A, "4000");
+    set_cell_value_at(0, 8, strdup("2"));
+    assert_display_text(ROW_9, COL_A, "6000");
+    model_set_threads(1);
+    assert(model_thread_count() == 1);
+    set_cell_value_at(0, 8, strdup("3"));
+    assert_display_text(ROW_9, COL_A, "8000");
+
+    // Sums are updated by the changes of their inputs, with the same results.
+    model_init();
+    set_cell_value(ROW_1, COL_A, strdup("1"));
+    set_cell_value(ROW_2, COL_A, strdup("x"));
+    set_cell_value(ROW_3, COL_A, strdup("3"));
+    set_cell_value(ROW_1, COL_B, strdup("=SUM(A1:A3)+A1+A1"));
+    set_cell_value(ROW_2, COL_B, strdup("=B1+0.5"));
+    set_cell_value(ROW_3, COL_B, strdup("=COUNT(A1:A3)"));
+    set_cell_value(ROW_1, COL_A, strdup("2"));
+    assert_display_text(ROW_1, COL_B, "9");
+    assert_display_text(ROW_2, COL_B, "9.5");
+    set_cell_value(ROW_2, COL_A, strdup("0"));
+    assert_display_text(ROW_1, COL_B, "9");
+    assert_display_text(ROW_3, COL_B, "3");
+    set_cell_value(ROW_3, COL_A, strdup("=A9+"));
+    assert_display_text(ROW_2, COL_B, "ERROR");
+    set_cell_value(ROW_3, COL_A, strdup("100000000000000000"));
+    assert_display_text(ROW_1, COL_B, "1e+17");
+    set_cell_value(ROW_3, COL_A, strdup("100"));
+    assert_display_text(ROW_1, COL_B, "106");
+    for (int k = 0; k < 200; ++k)
+        set_cell_value(ROW_1, COL_A, strdup(k % 2 ? "0.1" : "0.7"));
+    assert_display_text(ROW_2, COL_B, "100.8");
+
+    // Arithmetic follows the usual precedence, and failing operations display an error.
+    model_init();
+    set_cell_value(ROW_1, COL_A, strdup("10"));
+    set_cell_value(ROW_1, COL_B, strdup("3"));
+    set_cell_value(ROW_2, COL_A, strdup("=1+2*3-(1+2)*3"));
+    assert_display_text(ROW_2, COL_A, "-2");
+    set_cell_value(ROW_2, COL_B, strdup("=2^3^2/-2^2"));
+    assert_display_text(ROW_2, COL_B, "-128");
+    set_cell_value(ROW_2, COL_C, strdup("= A1 - B1*2 + SUM(A1:B1) / -(B1 - 1)"));
+    assert_display_text(ROW_2, COL_C, "-2.5");
+    set_cell_value(ROW_2, COL_D, strdup("=A1/(B1-3)"));
+    assert_display_text(ROW_2, COL_D, "ERROR");
+    set_cell_value(ROW_2, COL_E, strdup("=(0-8)^(1/3)"));
+    assert_display_text(ROW_2, COL_E, "ERROR");
+    set_cell_value(ROW_2, COL_F, strdup("=(A1*2"));
+    assert_display_text(ROW_2, COL_F, "ERROR");
+
+    // Constant parts are calculated when compiling, and sums of cells take one instruction per cell.
+    Formula *folded = formula_compile("=2*3+A1-4*-1", &(FormulaScope){0, 0, 0, 10, 10, NULL, NULL});
+    assert(folded->length == 3 && folded->code[0].op == OP_CONST && folded->constants[0] == 6);
+    assert(folded->code[1].op == OP_ADD_REF && folded->code[2].op == OP_ADD_CONST);
+    formula_free(folded);
+
+    // Linear formulas are updated by the changes of their inputs too, with
+    // delta updates on.
+    model_set_delta_updates(true);
+    set_cell_value(ROW_3, COL_A, strdup("=2*A1-B1/4+SUM(A1, -B1)*3"));
+    assert_display_text(ROW_3, COL_A, "40.25");
+    set_cell_value(ROW_1, COL_A, strdup("11"));
+    assert_display_text(ROW_3, COL_A, "45.25");
+    set_cell_value(ROW_1, COL_B, strdup("5"));
+    assert_display_text(ROW_3, COL_A, "38.75");
+    assert_display_text(ROW_2, COL_C, "-3");
+    model_set_delta_updates(false);
+
+    // Otherwise, values do not depend on the edits leading to them, even for
+    // inputs without an exact binary form: 0.7 + 0.2 is 0.8999999999999999.
+    set_cell_value(ROW_4, COL_A, strdup("0.1"));
+    set_cell_value(ROW_4, COL_B, strdup("=A4+0.2"));
+    set_cell_value(ROW_4, COL_C, strdup("=(B4-0.9)*1000000000000000000"));
+    assert_display_text(ROW_4, COL_C, "-6e+17");
+    set_cell_value(ROW_4, COL_A, strdup("0.7"));
+    assert_display_text(ROW_4, COL_C, "-111.022");
+
+    // The counters of the model describe the work done by edits.
+    model_init();
+    model_reset_stats();
+    set_cell_value(ROW_1, COL_A, strdup("text"));
+    set_cell_value(ROW_2, COL_A, strdup("3"));
+    set_cell_value(ROW_2, COL_B, strdup("=A2+A1"));
+    ModelStats stats = model_get_stats();
+    assert(stats.text_bytes == strlen("text") + strlen("=A2+A1") + 2);
+    assert(stats.allocations == model_allocation_count());
+#ifdef MODEL_STATS
+    set_cell_value(ROW_2, COL_A, strdup("4"));
+    stats = model_get_stats();
+    assert(stats.edits == 4);
+    assert(stats.formulas_compiled == 1);
+    assert(stats.formulas_evaluated + stats.delta_updates == 2);
+    assert(stats.recalculations == 4 && stats.max_cells_visited == 2);
+    assert(stats.display_calls == 4 && stats.cells_displayed == 5);
+    size_t timed = 0;
+    for (size_t k = 0; k < MODEL_STATS_BUCKETS; ++k)
+        timed += stats.edit_times[k];
+    assert(timed == stats.edits && stats.edit_seconds > 0);
+    model_reset_stats();
+    assert(model_get_stats().edits == 0);
+#else
+    assert(stats.edits == 0 && stats.formulas_compiled == 0);
+#endif
+
+    // Formulas reading themselves, directly or not, are marked as cycles.
+    model_init();
+    set_cell_value(ROW_1, COL_A, strdup("=B1"));
+    set_cell_value(ROW_1, COL_C, strdup("=A1+1"));
+    assert_display_text(ROW_1, COL_C, "1");
+    set_cell_value(ROW_1, COL_B, strdup("=A1+2"));
+    assert_display_text(ROW_1, COL_A, "#CYCLE");
+    assert_display_text(ROW_1, COL_B, "#CYCLE");
+    assert_display_text(ROW_1, COL_C, "ERROR");
+    set_cell_value(ROW_2, COL_A, strdup("=A2+1"));
+    assert_display_text(ROW_2, COL_A, "#CYCLE");
+    set_cell_value(ROW_3, COL_A, strdup("=SUM(A4:A5)"));
+    set_cell_value(ROW_5, COL_A, strdup("=A3"));
+    assert_display_text(ROW_3, COL_A, "#CYCLE");
+    assert_display_text(ROW_5, COL_A, "#CYCLE");
+
+    // Breaking a cycle brings its formulas back.
+    set_cell_value(ROW_1, COL_B, strdup("5"));
+    assert_display_text(ROW_1, COL_A, "5");
+    assert_display_text(ROW_1, COL_C, "6");
+    set_cell_value(ROW_5, COL_A, strdup("=A4+3"));
+    assert_display_text(ROW_3, COL_A, "3");
+    assert_display_text(ROW_5, COL_A, "3");
+
+    // Cells join a cycle closing through them even if no value they read changed.
+    set_cell_value(ROW_7, COL_A, strdup("=B7"));
+    set_cell_value(ROW_7, COL_B, strdup("=B7+C7"));
+    assert_display_text(ROW_7, COL_A, "ERROR");
+    set_cell_value(ROW_7, COL_C, strdup("=A7"));
+    assert_display_text(ROW_7, COL_A, "#CYCLE");
+    assert_display_text(ROW_7, COL_C, "#CYCLE");
+
+    // Edits are undone and redone along with the formulas reading them.
+    model_init();
+    set_cell_value(ROW_1, COL_A, strdup("2"));
+    set_cell_value(ROW_1, COL_B, strdup("=A1+A1+A1"));
+    set_cell_value(ROW_1, COL_A, strdup("4"));
+    clear_cell(ROW_1, COL_A);
+    assert_display_text(ROW_1, COL_B, "0");
+    assert(model_undo());
+    assert_edit_text(ROW_1, COL_A, "4");
+    assert_display_text(ROW_1, COL_B, "12");
+    assert(model_undo() && model_undo());
+    assert_display_text(ROW_1, COL_B, "");
+    assert_display_text(ROW_1, COL_A, "2");
+    assert(model_redo());
+    assert_display_text(ROW_1, COL_B, "6");
+
+    // A batch is undone as a whole, and other edits drop what was undone.
+    CellUpdate swaps[] = {
+        {ROW_1, COL_A, strdup("5")},
+        {ROW_1, COL_B, strdup("=A1+1")},
+        {ROW_1, COL_A, strdup("7")},
+    };
+    set_cell_values(swaps, sizeof(swaps) / sizeof(swaps[0]));
+    assert_display_text(ROW_1, COL_B, "8");
+    assert(model_undo());
+    assert_edit_text(ROW_1, COL_A, "2");
+    assert_edit_text(ROW_1, COL_B, "=A1+A1+A1");
+    set_cell_value(ROW_2, COL_A, strdup("x"));
+    assert(!model_redo());
+    assert(model_undo() && model_undo() && model_undo());
+    assert(!model_undo());
+    assert_display_text(ROW_1, COL_A, "");
+
+    // A full journal forgets the oldest edits first.
+    model_set_undo_limit(256);
+    for (int k = 0; k < 10; ++k)
+        set_cell_value(ROW_3, COL_A, strdup(k % 2 ? "=1+2+3" : "=4+5+6"));
+    size_t undone = 0;
+    while (model_undo())
+        ++undone;
+    assert(undone > 0 && undone < 10);
+    assert_display_text(ROW_3, COL_A, undone % 2 ? "15" : "6");
+    model_set_undo_limit(16u << 20);
+
+    // CSV files are loaded in one go, with formulas reading later cells.
+    model_init();
+    FILE *file = fopen("model_test.csv", "wb");
+    assert(file != NULL);
+    fputs("=B1+C2,1.5,\"a, \"\"quoted\"\" text\"\r\n,,2\n\"=SUM(A1:C2)\"\n", file);
+    fclose(file);
+    assert(model_load_csv("model_test.csv", ','));
+    assert_display_text(ROW_1, COL_A, "3.5");
+    assert_display_text(ROW_1, COL_C, "a, \"quoted\"");
+    assert_edit_text(ROW_2, COL_A, "");
+    assert_display_text(ROW_3, COL_A, "7");
+    set_cell_value(ROW_2, COL_C, strdup("4"));
+    assert_display_text(ROW_3, COL_A, "11");
+
+    // Saving writes the cells as they are edited.
+    assert(model_save_csv("model_test.csv", ','));
+    file = fopen("model_test.csv", "rb");
+    char contents[128] = {0};
+    size_t length = fread(contents, 1, sizeof(contents) - 1, file);
+    assert(length > 0);
+    fclose(file);
+    remove("model_test.csv");
+    assert(strcmp(contents, "=B1+C2,1.5,\"a, \"\"quoted\"\" text\"\n,,4\n=SUM(A1:C2),,\n") == 0);
+
+    // Snapshots restore values and formulas without recalculating.
+    set_cell_value(ROW_4, COL_B, strdup("=A1+A1"));
+    set_cell_value(ROW_5, COL_A, strdup("=A4+"));
+    set_cell_value(ROW_5, COL_B, strdup("=B5"));
+    set_cell_value(ROW_6, COL_A, strdup("label"));
+    set_cell_value(ROW_6, COL_B, strdup("label"));
+    assert(model_save_snapshot("model_test.snapshot"));
+    model_init();
+    assert(model_open_snapshot("model_test.snapshot"));
+    assert(model_num_rows() == NUM_ROWS);
+    model_redisplay(0, 0, NUM_ROWS, NUM_COLS);
+    assert_display_text(ROW_1, COL_A, "5.5");
+    assert_display_text(ROW_3, COL_A, "11");
+    assert_display_text(ROW_4, COL_B, "11");
+    assert_display_text(ROW_5, COL_A, "ERROR");
+    assert_display_text(ROW_5, COL_B, "#CYCLE");
+    assert_edit_text(ROW_1, COL_C, "a, \"quoted\" text");
+    assert_edit_text(ROW_3, COL_A, "=SUM(A1:C2)");
+
+    // Edits of an opened snapshot update the formulas stored in it.
+    set_cell_value(ROW_1, COL_B, strdup("2.5"));
+    assert_display_text(ROW_1, COL_A, "6.5");
+    assert_display_text(ROW_3, COL_A, "13");
+    assert_display_text(ROW_4, COL_B, "13");
+    clear_cell(ROW_1, COL_C);
+    assert_edit_text(ROW_1, COL_C, "");
+    set_cell_value(ROW_6, COL_A, strdup("other"));
+    set_cell_value(ROW_6, COL_C, strdup("label"));
+    assert_edit_text(ROW_6, COL_A, "other");
+    assert_edit_text(ROW_6, COL_B, "label");
+    assert_edit_text(ROW_6, COL_C, "label");
+
+    // An opened snapshot can be saved over, and its cells leave cycles too.
+    set_cell_value(ROW_7, COL_A, strdup("=B7"));
+    set_cell_value(ROW_7, COL_B, strdup("=B7+C7"));
+    set_cell_value(ROW_7, COL_C, strdup("=A7"));
+    assert(model_save_snapshot("model_test.snapshot"));
+    assert(model_open_snapshot("model_test.snapshot"));
+    assert(model_save_snapshot("model_test.snapshot"));
+    model_redisplay(0, 0, NUM_ROWS, NUM_COLS);
+    assert_display_text(ROW_4, COL_B, "13");
+    assert_display_text(ROW_7, COL_A, "#CYCLE");
+    set_cell_value(ROW_7, COL_C, strdup("1"));
+    assert_display_text(ROW_7, COL_A, "ERROR");
+    assert_display_text(ROW_7, COL_B, "#CYCLE");
+    remove("model_test.snapshot");
+
+    // Other files are rejected.
+    file = fopen("model_test.snapshot", "wb");
+    fputs("not a snapshot, but long enough to hold a header of one: 0123456789012345678901234567890123456789", file);
+    fclose(file);
+    assert(!model_open_snapshot("model_test.snapshot"));
+    assert(!model_open_snapshot("missing.snapshot"));
+    remove("model_test.snapshot");
+    assert_edit_text(ROW_1, COL_B, "2.5");
+
+    // Workbooks hold several sheets, whose formulas read each other's cells.
+    model_init();
+    assert(model_num_sheets() == 1 && strcmp(model_sheet_name(0), "Sheet1") == 0);
+    assert(model_add_sheet("Data", NUM_ROWS, NUM_COLS));
+    assert(model_add_sheet("Calc", 100, 3));
+    assert(!model_add_sheet("data", 10, 10));
+    assert(!model_add_sheet("2nd", 10, 10));
+    size_t index;
+    assert(model_find_sheet("DATA", &index) && index == 1);
+    assert(!model_find_sheet("Other", &index));
+    set_cell_value(ROW_1, COL_A, strdup("=Data!A1*2"));
+    set_cell_value(ROW_2, COL_A, strdup("=SUM(data!A1:B2)+Calc!C100"));
+    set_cell_value(ROW_3, COL_A, strdup("=Data!A11"));
+    set_cell_value(ROW_4, COL_A, strdup("=Other!A1"));
+    assert_display_text(ROW_1, COL_A, "0");
+    assert_display_text(ROW_3, COL_A, "ERROR");
+    assert_display_text(ROW_4, COL_A, "ERROR");
+
+    // Only the cells of the active sheet are displayed.
+    assert(model_select_sheet(1) && model_active_sheet() == 1);
+    assert(!model_select_sheet(3));
+    set_cell_value(ROW_1, COL_A, strdup("3"));
+    set_cell_value(ROW_2, COL_B, strdup("4"));
+    set_cell_value(ROW_3, COL_A, strdup("=Sheet1!A2"));
+    assert_display_text(ROW_1, COL_A, "3");
+    assert_display_text(ROW_3, COL_A, "7");
+    assert(model_select_sheet(0));
+    model_redisplay(0, 0, NUM_ROWS, NUM_COLS);
+    assert_display_text(ROW_1, COL_A, "6");
+    assert_display_text(ROW_2, COL_A, "7");
+
+    // Edits are undone on their own sheets.
+    assert(model_undo() && model_undo());
+    assert_display_text(ROW_2, COL_A, "3");
+    assert(model_redo());
+    assert_display_text(ROW_2, COL_A, "7");
+    assert(model_select_sheet(2));
+    set_cell_value_at(99, 2, strdup("1"));
+    set_cell_value(ROW_1, COL_A, strdup("=Sheet1!A5*10"));
+    assert(model_add_sheet("Report", NUM_ROWS, NUM_COLS) && model_select_sheet(3));
+    set_cell_value(ROW_1, COL_A, strdup("=Calc!A1+1"));
+    assert(model_select_sheet(0));
+    model_redisplay(0, 0, NUM_ROWS, NUM_COLS);
+    assert_display_text(ROW_2, COL_A, "8");
+
+    // Sheets of a snapshot are loaded once they are used; the ones never used
+    // are saved as they were read.
+    assert(model_save_snapshot("model_test.snapshot"));
+    assert(model_open_snapshot("model_test.snapshot"));
+    assert(model_num_sheets() == 4 && model_active_sheet() == 0 && strcmp(model_sheet_name(3), "Report") == 0);
+    assert(model_save_snapshot("model_test.snapshot"));
+    assert(model_open_snapshot("model_test.snapshot"));
+    model_redisplay(0, 0, NUM_ROWS, NUM_COLS);
+    assert_display_text(ROW_2, COL_A, "8");
+
+    // Sheets loaded after an edit catch up with it, along with the sheets
+    // they read.
+    set_cell_value(ROW_5, COL_A, strdup("4"));
+    assert(model_select_sheet(3));
+    model_redisplay(0, 0, NUM_ROWS, NUM_COLS);
+    assert_display_text(ROW_1, COL_A, "41");
+    assert(model_select_sheet(0));
+    set_cell_value(ROW_5, COL_A, strdup("5"));
+    assert(model_select_sheet(3));
+    model_redisplay(0, 0, NUM_ROWS, NUM_COLS);
+    assert_display_text(ROW_1, COL_A, "51");
+
+    // Saving after an edit first brings the sheets never loaded which read
+    // the edited cells, through other sheets too, up to date.
+    assert(model_save_snapshot("model_test.snapshot"));
+    assert(model_open_snapshot("model_test.snapshot"));
+    set_cell_value(ROW_5, COL_A, strdup("6"));
+    assert(model_save_snapshot("model_test.snapshot"));
+    assert(model_open_snapshot("model_test.snapshot"));
+    assert(model_select_sheet(3));
+    model_redisplay(0, 0, NUM_ROWS, NUM_COLS);
+    assert_display_text(ROW_1, COL_A, "61");
+    remove("model_test.snapshot");
+    model_init();
+    assert(model_num_sheets() == 1);
+
+    // Lazy mode only calculates the viewport and the edited cells.
+    model_init();
+    model_set_lazy(true);
+    assert(model_is_lazy());
+    model_set_viewport(0, 0, 1, NUM_COLS);
+    set_cell_value(ROW_1, COL_A, strdup("1"));
+    set_cell_value(ROW_1, COL_B, strdup("=A1+1"));
+    set_cell_value(ROW_5, COL_A, strdup("=A1+1"));
+    set_cell_value(ROW_6, COL_A, strdup("=A5+1"));
+    assert_display_text(ROW_6, COL_A, "3");
+    size_t displayed = displayed_cell_count();
+    set_cell_value(ROW_1, COL_A, strdup("5"));
+    assert(displayed_cell_count() == displayed + 2);
+    assert_display_text(ROW_1, COL_B, "6");
+    assert_display_text(ROW_5, COL_A, "2");
+    model_redisplay(4, 0, 1, 1);
+    assert_display_text(ROW_5, COL_A, "6");
+    assert_display_text(ROW_6, COL_A, "3");
+
+    // Edited formulas are calculated along with the stale cells they read.
+    set_cell_value(ROW_1, COL_A, strdup("10"));
+    set_cell_value(ROW_7, COL_A, strdup("=A6+A5"));
+    assert_display_text(ROW_5, COL_A, "11");
+    assert_display_text(ROW_6, COL_A, "12");
+    assert_display_text(ROW_7, COL_A, "23");
+
+    // Moving the viewport calculates what it shows; leaving lazy mode the rest.
+    set_cell_value(ROW_1, COL_A, strdup("20"));
+    model_set_viewport(5, 0, 1, NUM_COLS);
+    model_redisplay(5, 0, 1, NUM_COLS);
+    assert_display_text(ROW_5, COL_A, "21");
+    assert_display_text(ROW_6, COL_A, "22");
+    assert_display_text(ROW_7, COL_A, "23");
+    model_set_lazy(false);
+    assert_display_text(ROW_7, COL_A, "43");
+    model_set_viewport(0, 0, NUM_ROWS, NUM_COLS);
+
+    // Interrupted evaluations leave the cells they did not reach to the next one.
+    model_init_sized(1000, 2);
+    model_set_lazy(true);
+    model_set_viewport(0, 0, 1, 2);
+    set_cell_value_at(999, 1, strdup("1"));
+    for (size_t row = 999; row-- > 0;) {
+        char text[16];
+        snprintf(text, sizeof(text), "=B%zu+1", row + 2);
+        set_cell_value_at(row, 1, strdup(text));
+    }
+    set_cell_value(ROW_1, COL_A, strdup("=B1"));
+    assert_display_text(ROW_1, COL_A, "1000");
+    size_t interrupts = 0;
+    model_set_interrupt(interrupt_always, &interrupts);
+    set_cell_value_at(999, 1, strdup("5"));
+    assert(interrupts == 1);
+    assert_display_text(ROW_1, COL_A, "1000");
+    model_set_interrupt(NULL, NULL);
+    model_redisplay(0, 0, 1, 2);
+    assert_display_text(ROW_1, COL_A, "1004");
+
+    // Updating the region only displays the cells whose values change, so
+    // nothing once they are all up to date.
+    model_set_interrupt(interrupt_always, &interrupts);
+    set_cell_value_at(999, 1, strdup("9"));
+    assert(interrupts == 2);
+    model_set_interrupt(NULL, NULL);
+    model_update_region(0, 0, 1, 2);
+    assert_display_text(ROW_1, COL_A, "1008");
+    displayed = displayed_cell_count();
+    model_update_region(0, 0, 1, 2);
+    assert(displayed_cell_count() == displayed);
+    model_set_lazy(false);
+    model_set_viewport(0, 0, NUM_ROWS, NUM_COLS);
+
+    // Formulas filled down a column share one compiled copy, which is found
+    // again by its shape, and recalculating them all gives the same results
+    // on any number of threads.
+    model_init_sized(3000, 3);
+    for (size_t row = 0; row < 3000; ++row) {
+        char text[32];
+        snprintf(text, sizeof(text), "%zu", row + 1);
+        set_cell_value_at(row, 0, strdup(text));
+    }
+    model_begin_batch();
+    for (size_t row = 0; row < 3000; ++row) {
+        char text[32];
+        snprintf(text, sizeof(text), "=A%zu*A%zu/4", row + 1, row + 1);
+        set_cell_value_at(row, 1, strdup(text));
+    }
+    set_cell_value(ROW_1, COL_C, strdup("=SUM(B1:B3000)"));
+    model_commit_batch();
+    assert(formula_count() == 2);
+    assert_display_text(ROW_2, COL_B, "1");
+    assert_display_text(ROW_1, COL_C, "2.25113e+09");
+    set_cell_value(ROW_2, COL_A, strdup("0"));
+    assert_display_text(ROW_2, COL_B, "0");
+    model_set_threads(4);
+    model_begin_batch();
+    for (size_t row = 0; row < 3000; ++row) {
+        char text[32];
+        snprintf(text, sizeof(text), "%zu", row + 1);
+        set_cell_value_at(row, 0, strdup(text));
+    }
+    model_commit_batch();
+    assert_display_text(ROW_2, COL_B, "1");
+    assert_display_text(ROW_1, COL_C, "2.25113e+09");
+    model_set_threads(1);
+
+    // A shared shape still checks that its references lie on the sheet.
+    model_init();
+    set_cell_value(ROW_1, COL_B, strdup("=A2+1"));
+    set_cell_value(ROW_10, COL_B, strdup("=A11+1"));
+    assert_display_text(ROW_10, COL_B, "ERROR");
+    assert(formula_count() == 1);
+
+    // Change feeds get a record for every changed cell of any sheet, published
+    // once per recalculation, and count the records they have no room for.
+    ChangeFeed *feed = model_subscribe(16, 64);
+    const ChangeRecord *records;
+    assert(model_add_sheet("Data", 10, 10));
+    set_cell_value(ROW_1, COL_B, strdup("=Data!A1*3"));
+    assert(change_feed_peek(feed, &records) == 1 && records[0].number == 0);
+    change_feed_release(feed, 1);
+    model_select_sheet(1);
+    set_cell_value(ROW_1, COL_A, strdup("2"));
+    model_select_sheet(0);
+    assert(change_feed_peek(feed, &records) == 2);
+    assert(records[0].sheet == 1 && records[0].type == CHANGE_NUMBER && records[0].number == 2);
+    assert(records[1].sheet == 0 && records[1].row == 0 && records[1].col == 1 && records[1].number == 6);
+    assert(records[0].epoch == records[1].epoch);
+    change_feed_release(feed, 2);
+    set_cell_value(ROW_2, COL_A, strdup("hello"));
+    assert(change_feed_peek(feed, &records) == 1 && records[0].type == CHANGE_TEXT);
+    assert(strcmp(change_feed_text(feed, &records[0]), "hello") == 0);
+    change_feed_release(feed, 1);
+    model_begin_batch();
+    for (size_t row = 0; row < 10; ++row) {
+        set_cell_value_at(row, 3, strdup("1"));
+        set_cell_value_at(row, 4, strdup("some text"));
+    }
+    model_commit_batch();
+    assert(change_feed_peek(feed, &records) == 12);
+    change_feed_release(feed, 12);
+    assert(change_feed_peek(feed, &records) == 3 && change_feed_dropped(feed) == 5);
+    change_feed_release(feed, 3);
+    model_init();
+    assert(change_feed_peek(feed, &records) == 1 && records[0].type == CHANGE_RESET);
+    change_feed_release(feed, 1);
+    model_unsubscribe(feed);
+
+    // Cleared cells give back the nodes of the graph, including the cells
+    // they read and the cells only read through ranges.
+    model_init();
+    set_cell_value(ROW_1, COL_A, strdup("=B1+C1"));
+    set_cell_value(ROW_1, COL_D, strdup("=SUM(E1:E5)"));
+    assert(graph_num_nodes() == 4);
+    for (size_t row = 0; row < 5; ++row)
+        set_cell_value_at(row, 4, strdup("2"));
+    assert_display_text(ROW_1, COL_D, "10");
+    assert(graph_num_nodes() == 4);
+    clear_cell(ROW_1, COL_A);
+    assert(graph_num_nodes() == 1);
+    set_cell_value(ROW_1, COL_B, strdup("=A1"));
+    set_cell_value(ROW_1, COL_A, strdup("=B1"));
+    assert_display_text(ROW_1, COL_A, "#CYCLE");
+    clear_cell(ROW_1, COL_A);
+    clear_cell(ROW_1, COL_B);
+    clear_cell(ROW_1, COL_D);
+    assert(graph_num_nodes() == 0);
+    set_cell_value(ROW_1, COL_A, strdup("=SUM(E1:E5)+C1"));
+    assert_display_text(ROW_1, COL_A, "10");
+    assert(graph_num_nodes() == 2);
 }